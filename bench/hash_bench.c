@@ -0,0 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+#define HASH_ITERATIONS 20000000
+// Distinct names hashed in turn, which stay in the L1 cache
+#define HASH_NAMES 256
+
+/*
+ * The djb2 hash names used to be hashed with, for comparison
+ */
+uint64_t hash_bench_djb2(const char *value) {
+  uint32_t hash = 5381;
+  for (const char *c = value; *c; c++) {
+    hash = hash * 33 + (uint8_t) *c;
+  }
+  return hash;
+}
+
+double hash_bench_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the nanoseconds a hash function takes per name, hashing distinct names made from
+ * the given one, so that no hash can be reused
+ */
+double hash_bench_run(uint64_t (*function)(const char *), const char *name) {
+  const size_t length = strlen(name);
+  char *names = malloc(HASH_NAMES * (length + 1));
+  CHECK_ALLOC(names);
+  for (uint32_t i = 0; i < HASH_NAMES; i++) {
+    char *copy = names + i * (length + 1);
+    memcpy(copy, name, length + 1);
+    copy[0] = 'a' + i % 26;
+    copy[length / 2] = 'a' + i / 26 % 26;
+  }
+
+  volatile uint64_t sink = 0;
+  const double start = hash_bench_seconds();
+  for (uint32_t i = 0; i < HASH_ITERATIONS; i++) {
+    sink ^= function(names + i % HASH_NAMES * (length + 1));
+  }
+  (void) sink;
+  const double elapsed = hash_bench_seconds() - start;
+  free(names);
+  return elapsed * 1e9 / HASH_ITERATIONS;
+}
+
+int main(void) {
+  hash_init();
+  const char *names[] = {
+    "x.io",
+    "ads.example.com",
+    "tracker.eu-west.example.net",
+    "a-very-long-subdomain-label.of-a-content-delivery-network.example.com"
+  };
+  printf("hash_bench: ns per hash by name length\n");
+  printf("%-8s %8s %8s\n", "length", "djb2", "hash");
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const double djb2 = hash_bench_run(hash_bench_djb2, names[i]);
+    const double seeded = hash_bench_run(hash, names[i]);
+    printf("%-8zu %8.1f %8.1f\n", strlen(names[i]), djb2, seeded);
+  }
+  return 0;
+}
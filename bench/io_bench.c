@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "utils.h"
+
+// Port the servers under test listen on, on the loopback address
+#define IO_BENCH_PORT "5391"
+// Names of the block list the queries are for, which are answered without an upstream
+#define IO_BENCH_NAMES 1000
+// Seconds each number of queries in flight is measured for
+#define IO_BENCH_SECONDS 2
+// Milliseconds after which the queries in flight are taken as lost and sent again
+#define IO_BENCH_TIMEOUT_MS 100
+
+const char *io_bench_backends[] = { "blocking", "uring" };
+const uint32_t io_bench_windows[] = { 1, 8, 32, 128 };
+
+double io_bench_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Writes the query number id for a name of the block list into buffer, returning its length
+ */
+size_t io_bench_query(uint8_t *buffer, uint32_t id) {
+  const uint8_t header[QUESTION_START_BYTE] = { id >> 8, id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+  memcpy(buffer, header, sizeof(header));
+  char label[16];
+  const int length = snprintf(label, sizeof(label), "bench%u", id % IO_BENCH_NAMES);
+  uint8_t *out = buffer + sizeof(header);
+  *out++ = (uint8_t) length;
+  memcpy(out, label, length);
+  out += length;
+  memcpy(out, "\4test\0\0\1\0\1", 10);
+  return out + 10 - buffer;
+}
+
+/*
+ * Starts the server with a backend, its output discarded, returning its process id
+ */
+pid_t io_bench_start(const char *server, const char *backend, const char *blocklist) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execl(server, server, "--disable-defaults", "--blocklist", blocklist, "--startup", "wait",
+        "-a", "127.0.0.1", "-p", IO_BENCH_PORT, "--io", backend, (char *) NULL);
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+/*
+ * - Keeps window queries in flight against the server for the given seconds, sending a new
+ *   query for every response
+ * - Returns the number of responses per second
+ */
+double io_bench_run(int s, uint32_t window, double seconds) {
+  uint8_t buffer[MAX_MESSAGE_LENGTH];
+  uint32_t id = 0;
+  uint64_t responses = 0;
+  const double start = io_bench_seconds();
+  double now = start;
+  while (now - start < seconds) {
+    // Lost queries are replaced by refilling the window after a timeout
+    for (uint32_t i = 0; i < window; i++) {
+      send(s, buffer, io_bench_query(buffer, id++), 0);
+    }
+    while (recv(s, buffer, sizeof(buffer), 0) > 0) {
+      responses++;
+      send(s, buffer, io_bench_query(buffer, id++), 0);
+      if ((responses & 1023) == 0 && io_bench_seconds() - start >= seconds) {
+        break;
+      }
+    }
+    now = io_bench_seconds();
+  }
+  return responses / (now - start);
+}
+
+/*
+ * - Compares the I/O backends of the server at a path (./dnsblocker by default), measuring
+ *   the queries per second it answers with each backend for several numbers of queries in
+ *   flight
+ * - Client and server share the host, so the numbers are only comparable with each other
+ */
+int main(int argc, char **argv) {
+  const char *server = argc > 1 ? argv[1] : "./dnsblocker";
+  char blocklist[] = "/tmp/io_bench_XXXXXX";
+  const int fd = mkstemp(blocklist);
+  if (fd == -1) {
+    fatal_error("Failed to create the block list: %d", errno);
+  }
+  FILE *file = fdopen(fd, "w");
+  for (uint32_t i = 0; i < IO_BENCH_NAMES; i++) {
+    fprintf(file, "bench%u.test\n", i);
+  }
+  fclose(file);
+
+  const int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(IO_BENCH_PORT)) };
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  const int buffer_size = 1 << 22;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  const struct timeval timeout = { .tv_usec = IO_BENCH_TIMEOUT_MS * 1000 };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    fatal_error("Failed to create the client socket: %d", errno);
+  }
+
+  const size_t backend_count = sizeof(io_bench_backends) / sizeof(io_bench_backends[0]);
+  const size_t window_count = sizeof(io_bench_windows) / sizeof(io_bench_windows[0]);
+  double qps[sizeof(io_bench_backends) / sizeof(io_bench_backends[0])]
+      [sizeof(io_bench_windows) / sizeof(io_bench_windows[0])];
+  for (size_t b = 0; b < backend_count; b++) {
+    const pid_t pid = io_bench_start(server, io_bench_backends[b], blocklist);
+    // Wait for the server to answer, the lists load before it binds its socket
+    if (io_bench_run(s, 1, 0.5) == 0 && io_bench_run(s, 1, 2) == 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      unlink(blocklist);
+      fatal_error("%s doesn't answer on port %s", server, IO_BENCH_PORT);
+    }
+    for (size_t w = 0; w < window_count; w++) {
+      qps[b][w] = io_bench_run(s, io_bench_windows[w], IO_BENCH_SECONDS);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    // Drain the responses still in flight, so that the next backend starts clean
+    uint8_t buffer[MAX_MESSAGE_LENGTH];
+    while (recv(s, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0) {
+    }
+  }
+  unlink(blocklist);
+
+  printf("io_bench: queries per second by queries in flight\n");
+  printf("%-8s", "window");
+  for (size_t b = 0; b < backend_count; b++) {
+    printf(" %10s", io_bench_backends[b]);
+  }
+  printf("\n");
+  for (size_t w = 0; w < window_count; w++) {
+    printf("%-8u", io_bench_windows[w]);
+    for (size_t b = 0; b < backend_count; b++) {
+      printf(" %10.0f", qps[b][w]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "perfect_set.h"
+#include "set.h"
+#include "utils.h"
+
+// Names in the sets by default, far more than fit in the caches
+#define LOOKUP_BENCH_NAMES 4000000
+// Largest batch measured, the batches are powers of two up to it
+#define LOOKUP_BENCH_MAX_BATCH 64
+
+double lookup_bench_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Makes the name number index, prefixed so that present and missing names differ
+ */
+char *lookup_bench_name(const char *prefix, uint32_t index) {
+  char buffer[64];
+  const uint32_t scrambled = index * 2654435761u;
+  snprintf(buffer, sizeof(buffer), "%s%08x.n%u.example.com", prefix, scrambled, index % 977);
+  const size_t size = strlen(buffer) + 1;
+  char *name = malloc(size);
+  CHECK_ALLOC(name);
+  memcpy(name, buffer, size);
+  return name;
+}
+
+/*
+ * Returns the nanoseconds per lookup of the names in batches of the given size, a batch of 1
+ * using the single lookup, checking that the expected number of names is found
+ */
+double lookup_bench_run(const Set *set, const PerfectSet *perfect, const char *const *names,
+    size_t count, size_t batch, size_t expected) {
+  ListMask results[LOOKUP_BENCH_MAX_BATCH];
+  size_t found = 0;
+  const double start = lookup_bench_seconds();
+  for (size_t first = 0; first + batch <= count; first += batch) {
+    if (batch == 1) {
+      results[0] = perfect ? perfect_set_lookup(perfect, names[first], NULL)
+          : set_lookup(set, names[first], NULL);
+    } else if (perfect) {
+      perfect_set_lookup_batch(perfect, names + first, batch, results, NULL);
+    } else {
+      set_lookup_batch(set, names + first, batch, results, NULL);
+    }
+    for (size_t i = 0; i < batch; i++) {
+      found += results[i] != 0;
+    }
+  }
+  const double elapsed = lookup_bench_seconds() - start;
+  if (found != expected) {
+    fatal_error("Found %zu names instead of %zu", found, expected);
+  }
+  return elapsed * 1e9 / count;
+}
+
+/*
+ * - Measures the lookups in a set of millions of names (the number given as the first
+ *   argument, if any) and in its perfect hash index, in batches of growing size
+ * - Half of the names looked up are in the set, in an order unrelated to their buckets
+ */
+int main(int argc, char **argv) {
+  const size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : LOOKUP_BENCH_NAMES;
+  hash_init();
+
+  Set *set = set_new();
+  for (uint32_t i = 0; i < count; i++) {
+    set_add(set, lookup_bench_name("", i), LIST_BIT(0));
+  }
+  PerfectSet *perfect = perfect_set_build(set);
+  if (!perfect) {
+    fatal_error("No perfect hash function was found for %zu names", count);
+  }
+
+  // Every other name is missing, the present ones are taken in a scrambled order
+  const char **names = malloc(count * sizeof(char *));
+  CHECK_ALLOC(names);
+  char **missing = malloc(count / 2 * sizeof(char *));
+  CHECK_ALLOC(missing);
+  for (uint32_t i = 0; i < count; i++) {
+    if (i % 2) {
+      missing[i / 2] = lookup_bench_name("x", i);
+      names[i] = missing[i / 2];
+    } else {
+      names[i] = lookup_bench_name("", (uint32_t) ((i * 40503ull) % count));
+    }
+  }
+  // Every batch size looks up the same names, the ones a whole number of batches covers
+  const size_t lookups = count / LOOKUP_BENCH_MAX_BATCH * LOOKUP_BENCH_MAX_BATCH;
+  size_t expected = 0;
+  for (size_t i = 0; i < lookups; i++) {
+    expected += set_lookup(set, names[i], NULL) != 0;
+  }
+
+  printf("lookup_bench: ns per lookup by batch size, %zu names\n", count);
+  printf("%-8s %8s %8s\n", "batch", "set", "perfect");
+  for (size_t batch = 1; batch <= LOOKUP_BENCH_MAX_BATCH; batch *= 2) {
+    const double chained = lookup_bench_run(set, NULL, names, lookups, batch, expected);
+    const double indexed = lookup_bench_run(set, perfect, names, lookups, batch, expected);
+    printf("%-8zu %8.1f %8.1f\n", batch, chained, indexed);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (i % 2 == 0) {
+      free((char *) names[i]);
+    }
+  }
+  for (size_t i = 0; i < count / 2; i++) {
+    free(missing[i]);
+  }
+  free(missing);
+  free(names);
+  perfect_set_free(perfect);
+  set_free_vals(set);
+  return 0;
+}
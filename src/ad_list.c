@@ -1,6 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <curl/curl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -8,274 +12,1037 @@
 #include "utils.h"
 #include "string.h"
 
+// Longest line of a list, longer lines can't hold a valid domain and are skipped
+#define MAX_LINE_LENGTH 1024
+// Size of the chunks list files are read in
+#define READ_CHUNK_SIZE 65536
+#define SNAPSHOT_MAGIC "DNSBLST1"
+#define SNAPSHOT_MAGIC_LENGTH 8
+
+// Lists supported by default, in the catalog file syntax
+const char *default_catalog[] = {
+  "name=custom_blocklist format=plain path=./lists/blocklist.txt",
+  "name=easylist_adservers format=adblock refresh=86400 path=./lists/easylist_adservers.txt "
+      "url=https://raw.githubusercontent.com/easylist/easylist/master/easylist/easylist_adservers.txt",
+  "name=yoyo_adservers_hosts format=hosts refresh=86400 path=./lists/yoyo_adservers_hosts.txt "
+      "url=https://pgl.yoyo.org/adservers/serverlist.php?hostformat=hosts&showintro=0&mimetype=plaintext",
+  "name=easylist_thirdparty format=adblock refresh=86400 active=no path=./lists/easylist_thirdparty.txt "
+      "url=https://raw.githubusercontent.com/easylist/easylist/master/easylist/easylist_thirdparty.txt",
+  "name=stevenblack format=hosts refresh=86400 path=./lists/stevenblack.txt "
+      "url=https://raw.githubusercontent.com/StevenBlack/hosts/master/hosts",
+  "name=custom_whitelist format=plain action=allow priority=100 path=./lists/whitelist.txt"
+};
+
+char *copy_string(const char *string) {
+  char *copy = malloc(strlen(string) + 1);
+  CHECK_ALLOC(copy);
+  strcpy(copy, string);
+  return copy;
+}
+
+/*
+ * Returns the next space separated token of a line, advancing the cursor past it, or NULL
+ * at the end of the line
+ */
+char *next_token(char **cursor) {
+  char *start = *cursor + strspn(*cursor, " \t\r\n");
+  if (!*start) {
+    return NULL;
+  }
+  char *end = start + strcspn(start, " \t\r\n");
+  if (*end) {
+    *end++ = '\0';
+  }
+  *cursor = end;
+  return start;
+}
+
+void free_list_info(AdListInfo *ad_list_info) {
+  free(ad_list_info->name);
+  free(ad_list_info->url);
+  free(ad_list_info->path);
+  free(ad_list_info);
+}
+
 /*
- * Downloads file from a given address and saves it to dest
- * Returns true on success, false on failure
+ * - Parses a catalog line describing a list
+ * - Returns NULL if the line is invalid
  */
-bool download_file(const char *url, const char *dest) {
+AdListInfo *parse_catalog_line(char *line) {
+  AdListInfo *ad_list_info = (AdListInfo *) calloc(1, sizeof(AdListInfo));
+  CHECK_ALLOC(ad_list_info);
+  ad_list_info->format = LIST_FORMAT_PLAIN;
+  ad_list_info->active = true;
+
+  bool valid = true;
+  char *cursor = line;
+  for (char *token = next_token(&cursor); token && valid; token = next_token(&cursor)) {
+    char *value = strchr(token, '=');
+    if (!value) {
+      fprintf(stderr, "[AdList] Catalog entry %s is not a key=value pair!\n", token);
+      valid = false;
+      break;
+    }
+    *value++ = '\0';
+
+    char *end;
+    if (!strcmp(token, "name")) {
+      free(ad_list_info->name);
+      ad_list_info->name = copy_string(value);
+    } else if (!strcmp(token, "path")) {
+      free(ad_list_info->path);
+      ad_list_info->path = copy_string(value);
+    } else if (!strcmp(token, "url")) {
+      free(ad_list_info->url);
+      ad_list_info->url = copy_string(value);
+      ad_list_info->online = true;
+    } else if (!strcmp(token, "format")) {
+      if (!strcmp(value, "plain")) {
+        ad_list_info->format = LIST_FORMAT_PLAIN;
+      } else if (!strcmp(value, "hosts")) {
+        ad_list_info->format = LIST_FORMAT_HOSTS;
+      } else if (!strcmp(value, "adblock")) {
+        ad_list_info->format = LIST_FORMAT_ADBLOCK;
+      } else {
+        valid = false;
+      }
+    } else if (!strcmp(token, "action")) {
+      valid = !strcmp(value, "allow") || !strcmp(value, "deny");
+      ad_list_info->allow = !strcmp(value, "allow");
+    } else if (!strcmp(token, "priority")) {
+      const long priority = strtol(value, &end, 10);
+      valid = *value && !*end && priority >= INT32_MIN && priority <= INT32_MAX;
+      ad_list_info->priority = (int32_t) priority;
+    } else if (!strcmp(token, "refresh")) {
+      const unsigned long interval = strtoul(value, &end, 10);
+      valid = *value && !*end && interval <= UINT32_MAX;
+      ad_list_info->refresh_interval = (uint32_t) interval;
+    } else if (!strcmp(token, "active")) {
+      valid = !strcmp(value, "yes") || !strcmp(value, "no");
+      ad_list_info->active = !strcmp(value, "yes");
+    } else {
+      fprintf(stderr, "[AdList] Unknown catalog key %s!\n", token);
+      valid = false;
+      break;
+    }
+
+    if (!valid) {
+      fprintf(stderr, "[AdList] Invalid value %s of catalog key %s!\n", value, token);
+    }
+  }
+
+  if (valid && (!ad_list_info->name || !ad_list_info->path)) {
+    fprintf(stderr, "[AdList] Catalog entries need a name and a path!\n");
+    valid = false;
+  }
+  if (!valid) {
+    free_list_info(ad_list_info);
+    return NULL;
+  }
+  return ad_list_info;
+}
+
+/*
+ * Adds a list parsed from the catalog to the lists, before they are numbered
+ */
+bool add_catalog_list(AdListsInfo *ad_lists, AdListInfo *ad_list_info) {
+  uint32_t id;
+  if (map_get(ad_lists->lists_map, ad_list_info->name, &id)) {
+    fprintf(stderr, "[AdList] Duplicate list %s in the catalog!\n", ad_list_info->name);
+    return false;
+  }
+  if (ad_lists->num_lists == MAX_LISTS) {
+    fprintf(stderr, "[AdList] The catalog has more than %d lists!\n", MAX_LISTS);
+    return false;
+  }
+
+  map_put(ad_lists->lists_map, ad_list_info->name, ad_lists->num_lists);
+  ad_lists->lists[ad_lists->num_lists++] = ad_list_info;
+  return true;
+}
+
+/*
+ * Numbers the lists in the order of their priorities, keeping the catalog order of lists
+ * with equal priorities
+ */
+void number_lists(AdListsInfo *ad_lists) {
+  AdListInfo **lists = ad_lists->lists;
+  for (uint32_t i = 1; i < ad_lists->num_lists; i++) {
+    AdListInfo *ad_list_info = lists[i];
+    uint32_t j = i;
+    while (j > 0 && lists[j - 1]->priority > ad_list_info->priority) {
+      lists[j] = lists[j - 1];
+      j--;
+    }
+    lists[j] = ad_list_info;
+  }
+
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    lists[id]->id = id;
+    map_put(ad_lists->lists_map, lists[id]->name, id);
+  }
+}
+
+AdListsInfo *create_adlists_info(const char *path, bool disable_defaults, const char *blocklist,
+    const char *whitelist) {
+  AdListsInfo *ad_lists = (AdListsInfo *) malloc(sizeof(AdListsInfo));
+  CHECK_ALLOC(ad_lists);
+  ad_lists->lists_map = map_new();
+  ad_lists->num_lists = 0;
+  ad_lists->lists = (AdListInfo **) calloc(MAX_LISTS, sizeof(AdListInfo *));
+  CHECK_ALLOC(ad_lists->lists);
+  pthread_mutex_init(&ad_lists->lock, NULL);
+
+  FILE *file = NULL;
+  if (path) {
+    file = fopen(path, "r");
+    if (!file) {
+      fprintf(stderr, "[AdList] Failed to open list catalog %s!\n", path);
+      free_adlists(ad_lists);
+      return NULL;
+    }
+  }
+
+  char buffer[4096];
+  uint32_t line = 0;
+  bool success = true;
+  const size_t default_count = sizeof(default_catalog) / sizeof(default_catalog[0]);
+  while (success && (file ? fgets(buffer, sizeof(buffer), file) != NULL : line < default_count)) {
+    if (!file) {
+      strcpy(buffer, default_catalog[line]);
+    }
+    line++;
+
+    const char *first = buffer + strspn(buffer, " \t\r\n");
+    if (!*first || *first == '#') {
+      // Skip comments and blank lines
+      continue;
+    }
 
-  // Backup original file contents prior to download
-  FILE *file = fopen(dest, "rb");
-  uint8_t *contents = NULL;
-  size_t file_size;
-  bool file_exists = false;
+    AdListInfo *ad_list_info = parse_catalog_line(buffer);
+    if (!ad_list_info) {
+      fprintf(stderr, "[AdList] Invalid list on line %" PRIu32 " of the catalog!\n", line);
+      success = false;
+    } else if (disable_defaults && ad_list_info->online) {
+      free_list_info(ad_list_info);
+    } else if (!add_catalog_list(ad_lists, ad_list_info)) {
+      free_list_info(ad_list_info);
+      success = false;
+    }
+  }
   if (file) {
-    file_exists = true;
-    if (fseek(file, 0, SEEK_END)) {
-      fprintf(stderr, "[AdList] Failed to seek end of file %s", dest);
-      fclose(file);
+    fclose(file);
+  }
+  if (!success) {
+    free_adlists(ad_lists);
+    return NULL;
+  }
+
+  number_lists(ad_lists);
+
+  // Custom lists given on the command line replace the paths from the catalog
+  uint32_t id;
+  if (blocklist && map_get(ad_lists->lists_map, "custom_blocklist", &id)) {
+    free(ad_lists->lists[id]->path);
+    ad_lists->lists[id]->path = copy_string(blocklist);
+  }
+  if (whitelist && map_get(ad_lists->lists_map, "custom_whitelist", &id)) {
+    free(ad_lists->lists[id]->path);
+    ad_lists->lists[id]->path = copy_string(whitelist);
+  }
+
+  return ad_lists;
+}
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+} StringArray;
+
+/*
+ * Appends a string to an array without copying it
+ */
+void strings_append(StringArray *array, char *string) {
+  if (array->count == array->capacity) {
+    array->capacity = array->capacity ? array->capacity * 2 : 256;
+    array->items = realloc(array->items, array->capacity * sizeof(char *));
+    CHECK_ALLOC(array->items);
+  }
+  array->items[array->count++] = string;
+}
+
+void strings_push(StringArray *array, const char *string) {
+  strings_append(array, copy_string(string));
+}
+
+int compare_strings(const void *first, const void *second) {
+  return strcmp(*(char * const *) first, *(char * const *) second);
+}
+
+/*
+ * Sorts the strings of an array and frees the duplicates
+ */
+void strings_sort_unique(StringArray *array) {
+  if (array->count == 0) {
+    return;
+  }
+  qsort(array->items, array->count, sizeof(char *), compare_strings);
+  size_t unique = 0;
+  for (size_t i = 0; i < array->count; i++) {
+    if (unique > 0 && !strcmp(array->items[unique - 1], array->items[i])) {
+      free(array->items[i]);
+    } else {
+      array->items[unique++] = array->items[i];
+    }
+  }
+  array->count = unique;
+}
+
+void free_strings(char **strings, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(strings[i]);
+  }
+  free(strings);
+}
+
+bool same_strings(char **first, size_t first_count, char **second, size_t second_count) {
+  if (first_count != second_count) {
+    return false;
+  }
+  for (size_t i = 0; i < first_count; i++) {
+    if (strcmp(first[i], second[i])) {
       return false;
     }
+  }
+  return true;
+}
+
+/*
+ * Returns true iff a line of a list is a wildcard or a /regex/ rule rather than a plain domain
+ */
+bool is_rule(const char *line) {
+  const size_t length = strlen(line);
+  return (length > 2 && line[0] == '/' && line[length - 1] == '/') || strchr(line, '*');
+}
+
+/*
+ * Adds a rule loaded from a list to the rule set
+ */
+void add_rule(RuleSet *rules, const AdListInfo *ad_list_info, char *line) {
+  const size_t length = strlen(line);
+  const ListMask list = LIST_BIT(ad_list_info->id);
+  bool added;
+  if (line[0] == '/' && line[length - 1] == '/') {
+    line[length - 1] = '\0';
+    added = rules_add_regex(rules, line + 1, list);
+    line[length - 1] = '/';
+  } else {
+    // Adblock style "||" rules also match all subdomains of the hosts they match
+    const bool match_subdomains = ad_list_info->format == LIST_FORMAT_ADBLOCK;
+    added = rules_add_wildcard(rules, line, match_subdomains, list);
+  }
+
+  if (!added) {
+    fprintf(stderr, "[AdList] Unsupported rule %s in %s, skipping!\n", line, ad_list_info->name);
+  }
+}
+
+/*
+ * Recompiles the filter rules from the rules of all lists, as compiled rules can't be removed
+ * one by one. Unlike the domains, lists only hold a handful of rules.
+ */
+bool rebuild_rules(const AdListsInfo *ad_lists, Filter *filter) {
+  RuleSet *rules = rules_new();
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    const AdListInfo *ad_list_info = ad_lists->lists[id];
+    for (size_t i = 0; ad_list_info && i < ad_list_info->rule_count; i++) {
+      add_rule(rules, ad_list_info, ad_list_info->rules[i]);
+    }
+  }
+  const bool compiled = rules_compile(rules);
+  filter_swap_rules(filter, rules);
+  return compiled;
+}
+
+/*
+ * Applies the difference between the sorted domains last loaded from a list and its new sorted
+ * domains to the filter, dropping the references of the list to the removed domains and taking
+ * them for the added ones. Takes ownership of the new domains.
+ */
+void apply_list_diff(AdListInfo *ad_list_info, Filter *filter, char **domains, size_t count) {
+  const ListMask list = LIST_BIT(ad_list_info->id);
+  char **old_domains = ad_list_info->domains;
+  const size_t old_count = ad_list_info->domain_count;
+  char **merged = malloc((count + 1) * sizeof(char *));
+  CHECK_ALLOC(merged);
+
+  size_t merged_count = 0;
+  size_t added = 0;
+  size_t removed = 0;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < old_count || j < count) {
+    const int result = i == old_count ? 1 : j == count ? -1 : strcmp(old_domains[i], domains[j]);
+    if (result < 0) {
+      // Domain was removed from the list
+      set_release(filter->domains, old_domains[i++], list);
+      removed++;
+    } else if (result > 0) {
+      // Domain was added to the list, it might already be stored for another list
+      char *value = set_acquire(filter->domains, domains[j], list);
+      if (value != domains[j]) {
+        free(domains[j]);
+      }
+      merged[merged_count++] = value;
+      j++;
+      added++;
+    } else {
+      merged[merged_count++] = old_domains[i++];
+      free(domains[j++]);
+    }
+  }
+
+  set_reclaim(filter->domains);
+  free(old_domains);
+  ad_list_info->domains = merged;
+  ad_list_info->domain_count = merged_count;
+  if (old_count && (added || removed)) {
+    printf("[AdList] Updated %s, %zu domains added and %zu removed\n",
+        ad_list_info->name, added, removed);
+  }
+}
+
+struct ParsedList {
+  StringArray domains;
+  StringArray rules;
+};
+
+typedef void (*LineParser)(char *line, ParsedList *parsed);
+
+void parsed_push(ParsedList *parsed, const char *entry) {
+  strings_push(is_rule(entry) ? &parsed->rules : &parsed->domains, entry);
+}
+
+/*
+ * Parses a line holding a single domain or rule, ignoring comments
+ */
+void parse_plain_line(char *line, ParsedList *parsed) {
+  char *entry = next_token(&line);
+  if (entry && entry[0] != '#') {
+    parsed_push(parsed, entry);
+  }
+}
+
+// Names of the local host mapped by the headers of hosts files
+const char *local_hostnames[] = {
+  "localhost", "localhost.localdomain", "local", "broadcasthost", "0.0.0.0"
+};
+
+bool is_local_hostname(const char *name) {
+  if (!strncmp(name, "ip6-", 4)) {
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(local_hostnames) / sizeof(local_hostnames[0]); i++) {
+    if (!strcmp(name, local_hostnames[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Parses a hosts file line, which maps an address to any number of domains, ignoring the
+ * names of the local host
+ */
+void parse_hosts_line(char *line, ParsedList *parsed) {
+  const char *address = next_token(&line);
+  if (!address || address[0] == '#') {
+    return;
+  }
+
+  for (char *name = next_token(&line); name && name[0] != '#'; name = next_token(&line)) {
+    if (!is_local_hostname(name)) {
+      parsed_push(parsed, name);
+    }
+  }
+}
 
-    file_size = ftell(file);
-    rewind(file);
-    contents = malloc(file_size);
-    CHECK_ALLOC(contents);
-    fread(contents, 1, file_size, file);
+/*
+ * Parses an adblock "||domain^" rule, ignoring exceptions, comments and element hiding rules
+ */
+void parse_adblock_line(char *line, ParsedList *parsed) {
+  if (line[0] != '|' || line[1] != '|') {
+    return;
+  }
+
+  char *name = line + 2;
+  char *end = name + strcspn(name, "^/|$\r\n");
+  if (*end != '^' || end == name) {
+    return;
+  }
+  *end = '\0';
+  parsed_push(parsed, name);
+}
+
+LineParser list_parsers[] = {
+  [LIST_FORMAT_PLAIN]   = parse_plain_line,
+  [LIST_FORMAT_HOSTS]   = parse_hosts_line,
+  [LIST_FORMAT_ADBLOCK] = parse_adblock_line
+};
+
+void free_parsed_list(ParsedList *parsed) {
+  if (parsed) {
+    free_strings(parsed->domains.items, parsed->domains.count);
+    free_strings(parsed->rules.items, parsed->rules.count);
+    free(parsed);
+  }
+}
+
+/*
+ * Splits the bytes of a list into lines as they are read or downloaded, passing every complete
+ * line to the parser of the list's format. Lines may span any number of chunks.
+ */
+typedef struct {
+  LineParser parser;
+  ParsedList *parsed;
+  char line[MAX_LINE_LENGTH];
+  size_t length;
+  // Whether the current line is longer than the buffer, which can't hold a valid domain
+  bool truncated;
+} LineReader;
+
+void line_reader_init(LineReader *reader, ListFormat format, ParsedList *parsed) {
+  reader->parser = list_parsers[format];
+  reader->parsed = parsed;
+  reader->length = 0;
+  reader->truncated = false;
+}
+
+void line_reader_feed(LineReader *reader, const char *data, size_t size) {
+  while (size) {
+    const char *newline = memchr(data, '\n', size);
+    const size_t chunk = newline ? (size_t) (newline - data) : size;
+    if (!reader->truncated && reader->length + chunk < MAX_LINE_LENGTH - 1) {
+      memcpy(reader->line + reader->length, data, chunk);
+      reader->length += chunk;
+    } else {
+      reader->truncated = true;
+    }
+    if (!newline) {
+      return;
+    }
+
+    if (!reader->truncated) {
+      reader->line[reader->length] = '\0';
+      reader->parser(reader->line, reader->parsed);
+    }
+    reader->length = 0;
+    reader->truncated = false;
+    data += chunk + 1;
+    size -= chunk + 1;
+  }
+}
+
+/*
+ * Parses the last line of a list if it doesn't end with a newline
+ */
+void line_reader_finish(LineReader *reader) {
+  if (reader->length && !reader->truncated) {
+    reader->line[reader->length] = '\0';
+    reader->parser(reader->line, reader->parsed);
+  }
+  reader->length = 0;
+  reader->truncated = false;
+}
+
+/*
+ * - Loads all domains and rules of a list from its file with the parser of its format
+ * - Returns NULL on failure
+ */
+ParsedList *read_list_file(const AdListInfo *ad_list_info) {
+  const char *path = ad_list_info->path;
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "[AdList] Failed to open file with blocking rules %s!\n", path);
+    return NULL;
+  }
+
+  ParsedList *parsed = calloc(1, sizeof(ParsedList));
+  CHECK_ALLOC(parsed);
+  LineReader reader;
+  line_reader_init(&reader, ad_list_info->format, parsed);
+  char buffer[READ_CHUNK_SIZE];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    line_reader_feed(&reader, buffer, size);
+  }
+
+  // Check that whole file has been read
+  if (ferror(file)) {
+    fprintf(stderr, "[AdList] Failed to read the whole blocking rules file %s!\n", path);
+    free_parsed_list(parsed);
     fclose(file);
+    return NULL;
   }
+  fclose(file);
+  line_reader_finish(&reader);
+  return parsed;
+}
 
-  // Overwrite the file with downloaded contents
-  file = fopen(dest, "wb");
+typedef struct {
+  FILE *file;
+  LineReader *reader;
+} DownloadSink;
+
+/*
+ * Writes a chunk received by curl to the downloaded file and parses it, returning a short
+ * count to abort the transfer if the file can't be written
+ */
+size_t download_write(char *data, size_t size, size_t count, void *context) {
+  DownloadSink *sink = context;
+  const size_t length = size * count;
+  if (fwrite(data, 1, length, sink->file) != length) {
+    return 0;
+  }
+  line_reader_feed(sink->reader, data, length);
+  return length;
+}
 
+/*
+ * - Downloads file from a given address, passing its contents to a line reader while saving
+ *   them to dest
+ * - The file is downloaded to a unique file next to dest and only replaces it once complete,
+ *   so that dest is kept unchanged on failure and concurrent downloads don't collide
+ * - Returns true on success, false on failure
+ */
+bool download_file(const char *url, const char *dest, LineReader *reader) {
+  const char suffix[] = ".XXXXXX";
+  char *temporary = malloc(strlen(dest) + sizeof(suffix));
+  CHECK_ALLOC(temporary);
+  strcpy(temporary, dest);
+  strcat(temporary, suffix);
+
+  const int fd = mkstemp(temporary);
+  FILE *file = fd == -1 ? NULL : fdopen(fd, "wb");
   if (!file) {
-    fprintf(stderr, "[AdList] Failed to open file %s!\n", dest);
-    free(contents);
+    fprintf(stderr, "[AdList] Failed to create file %s with error: %d\n", temporary, errno);
+    if (fd != -1) {
+      close(fd);
+      remove(temporary);
+    }
+    free(temporary);
     return false;
   }
+  // mkstemp creates the file readable by its owner only, lists are readable like before
+  fchmod(fd, 0644);
 
   // Set up curl and set its options
   CURL *curl = curl_easy_init();
   if (!curl) {
     perror("[AdList] Failed to initialize curl easy handle!\n");
-    free(contents);
     fclose(file);
+    remove(temporary);
+    free(temporary);
     return false;
   }
-  char error_buffer[CURL_ERROR_SIZE];
+  char error_buffer[CURL_ERROR_SIZE] = "";
+  DownloadSink sink = { file, reader };
   curl_easy_setopt(curl, CURLOPT_URL, url);
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1l);
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2l);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1l);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, download_write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
   curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5l);
-  if (curl_easy_perform(curl)) {
+  bool success = curl_easy_perform(curl) == CURLE_OK;
+  curl_easy_cleanup(curl);
+  if (!success) {
     fprintf(stderr, "[AdList] An error occurred while downloading remote file from %s!\n", url);
     fprintf(stderr, "[AdList] curl perform operation failed with an error: %s\n", error_buffer);
-    // Restore original contents of the file if the download failed
-    if (file_exists) {
-      fwrite(contents, 1, file_size, file);
-    }
-    fclose(file);
-    curl_easy_cleanup(curl);
-    free(contents);
-    return false;
   }
 
-  fclose(file);
-  curl_easy_cleanup(curl);
-  free(contents);
-  return true;
+  if (fclose(file) && success) {
+    fprintf(stderr, "[AdList] Failed to write file %s!\n", temporary);
+    success = false;
+  }
+  if (success && rename(temporary, dest)) {
+    fprintf(stderr, "[AdList] Failed to replace file %s!\n", dest);
+    success = false;
+  }
+  if (!success) {
+    remove(temporary);
+  }
+  free(temporary);
+  return success;
 }
 
-AdListsInfo *create_default_adlists_info(bool disable_defaults, char *blocklist, char *whitelist) {
-  AdListsInfo *ad_lists = (AdListsInfo *) malloc(sizeof(AdListsInfo));
-  CHECK_ALLOC(ad_lists);
-  Map *lists_map = map_new();
-  AdListInfo **lists = (AdListInfo **) calloc(MAX_LISTS, sizeof(AdListInfo *));
-  ad_lists->lists_map = lists_map;
-  ad_lists->num_lists = 6;
-  ad_lists->whitelists_lower_id = 5;
-  ad_lists->lists = lists;
-
-  uint32_t list_id = 0;
-  map_put(lists_map, "custom_blocklist", list_id);
-  AdListInfo *custom_blocklist = (AdListInfo *) malloc(sizeof(AdListInfo));
-  CHECK_ALLOC(custom_blocklist);
-  custom_blocklist->id = list_id;
-  custom_blocklist->name = "custom_blocklist";
-  custom_blocklist->pattern = "%[^\n\r]%c";
-  custom_blocklist->delimiters = "\n\r";
-  custom_blocklist->active = true;
-  custom_blocklist->online = false;
-  custom_blocklist->domain = NULL;
-  if (blocklist) {
-    custom_blocklist->path = blocklist;
-  } else {
-    custom_blocklist->path = "./lists/blocklist.txt";
-  }
-  lists[list_id] = custom_blocklist;
-
-  if (!disable_defaults) {
-    list_id = 1;
-    map_put(lists_map, "easylist_adservers", list_id);
-    AdListInfo *easylist_adservers = (AdListInfo *) malloc(sizeof(AdListInfo));
-    CHECK_ALLOC(easylist_adservers);
-    easylist_adservers->id = list_id;
-    easylist_adservers->name = "easylist_adservers";
-    easylist_adservers->pattern = "||%[^^\n\r/|]%c";
-    easylist_adservers->delimiters = "^";
-    easylist_adservers->active = true;
-    easylist_adservers->online = true;
-    easylist_adservers->domain = "https://raw.githubusercontent.com/easylist/easylist/master/easylist/easylist_adservers.txt";
-    easylist_adservers->path = "./lists/easylist_adservers.txt";
-    lists[list_id] = easylist_adservers;
-
-    list_id = 2;
-    map_put(lists_map, "yoyo_adservers_hosts", list_id);
-    AdListInfo *yoyo_adservers_hosts = (AdListInfo *) malloc(sizeof(AdListInfo));
-    CHECK_ALLOC(yoyo_adservers_hosts);
-    yoyo_adservers_hosts->id = list_id;
-    yoyo_adservers_hosts->name = "yoyo_adservers_hosts";
-    yoyo_adservers_hosts->pattern = "127.0.0.1 %[^\n\r/]%c";
-    yoyo_adservers_hosts->delimiters = "\n";
-    yoyo_adservers_hosts->active = true;
-    yoyo_adservers_hosts->online = true;
-    yoyo_adservers_hosts->domain = "https://pgl.yoyo.org/adservers/serverlist.php?hostformat=hosts&showintro=0&mimetype=plaintext";
-    yoyo_adservers_hosts->path = "./lists/yoyo_adservers_hosts.txt";
-    lists[list_id] = yoyo_adservers_hosts;
-
-    list_id = 3;
-    map_put(lists_map, "easylist_thirdparty", list_id);
-    AdListInfo *easylist_thirdparty = (AdListInfo *) malloc(sizeof(AdListInfo));
-    CHECK_ALLOC(easylist_adservers);
-    easylist_thirdparty->id = list_id;
-    easylist_thirdparty->name = "easylist_thirdparty";
-    easylist_thirdparty->pattern = "||%[^^\n\r/|]%c";
-    easylist_thirdparty->delimiters = "^";
-    easylist_thirdparty->active = false;
-    easylist_thirdparty->online = true;
-    easylist_thirdparty->domain = "https://raw.githubusercontent.com/easylist/easylist/master/easylist/easylist_thirdparty.txt";
-    easylist_thirdparty->path = "./lists/easylist_thirdparty.txt";
-    lists[list_id] = easylist_thirdparty;
-
-    list_id = 4;
-    map_put(lists_map, "stevenblack", list_id);
-    AdListInfo *stevenblack_hosts = (AdListInfo *) malloc(sizeof(AdListInfo));
-    CHECK_ALLOC(stevenblack_hosts);
-    stevenblack_hosts->id = list_id;
-    stevenblack_hosts->name = "stevenblack";
-    stevenblack_hosts->pattern = "0.0.0.0 %[^\n\r/]%c";
-    stevenblack_hosts->delimiters = "\n";
-    stevenblack_hosts->active = true;
-    stevenblack_hosts->online = true;
-    stevenblack_hosts->domain = "https://raw.githubusercontent.com/StevenBlack/hosts/master/hosts";
-    stevenblack_hosts->path = "./lists/stevenblack.txt";
-    lists[list_id] = stevenblack_hosts;
-  }
-
-  list_id = 5;
-  map_put(lists_map, "custom_whitelist", list_id);
-  AdListInfo *custom_whitelist = (AdListInfo *) malloc(sizeof(AdListInfo));
-  CHECK_ALLOC(custom_whitelist);
-  custom_whitelist->id = list_id;
-  custom_whitelist->name = "custom_whitelist";
-  custom_whitelist->pattern = "%[^\n\r]%c";
-  custom_whitelist->delimiters = "\n\r";
-  custom_whitelist->active = true;
-  custom_whitelist->online = false;
-  custom_whitelist->domain = NULL;
-  if (whitelist) {
-    custom_whitelist->path = whitelist;
-  } else {
-    custom_whitelist->path = "./lists/whitelist.txt";
+bool download_list(AdListInfo *ad_list_info, ParsedList **parsed) {
+  *parsed = NULL;
+  if (!ad_list_info->online) {
+    return true;
   }
-  lists[list_id] = custom_whitelist;
 
-  return ad_lists;
-}
+  struct stat s = {0};
+  if (stat("./lists", &s) == -1) {
+    mkdir("./lists", 0755);
+    fprintf(stderr, "[AdList] The lists directory did not exist and was automatically created!\n");
+  }
 
-void free_adlists(AdListsInfo *ad_lists) {
-  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
-    free(ad_lists->lists[id]);
+  // Loaded list has online version - attempt to update, parsing it as it arrives into domains
+  // of its own, which only reach the filter once the whole list is applied
+  ParsedList *downloaded = calloc(1, sizeof(ParsedList));
+  CHECK_ALLOC(downloaded);
+  LineReader reader;
+  line_reader_init(&reader, ad_list_info->format, downloaded);
+  if (!download_file(ad_list_info->url, ad_list_info->path, &reader)) {
+    fprintf(stderr, "[AdList] Could not update ad list %s, blocking rules might be obsolete!\n",
+        ad_list_info->name);
+    free_parsed_list(downloaded);
+    return false;
   }
-  free(ad_lists->lists);
-  map_free(ad_lists->lists_map);
-  free(ad_lists);
+  line_reader_finish(&reader);
+  *parsed = downloaded;
+  return true;
 }
 
-bool load_list_by_id(uint32_t id, AdListsInfo *ad_lists, Set *domain_set) {
+bool load_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter) {
   if (id >= ad_lists->num_lists) {
     fprintf(stderr, "[AdList] No filter with id %" SCNu32, id);
     return false;
   }
+  ParsedList *parsed;
+  download_list(ad_lists->lists[id], &parsed);
+  return apply_list_by_id(id, ad_lists, filter, parsed);
+}
 
-  struct stat s = {0};
-  if (stat("./lists", &s) == -1) {
-    mkdir("./lists", 0755);
-    fprintf(stderr, "[AdList] The lists directory did not exist and was automatically created!\n");
+bool apply_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter, ParsedList *parsed) {
+  if (id >= ad_lists->num_lists) {
+    fprintf(stderr, "[AdList] No filter with id %" SCNu32, id);
+    free_parsed_list(parsed);
+    return false;
+  }
+  if (!filter->domains) {
+    fprintf(stderr, "[AdList] Lists can't be reloaded once the filter is read-only!\n");
+    free_parsed_list(parsed);
+    return false;
   }
 
   AdListInfo *ad_list_info = ad_lists->lists[id];
-  char *path = ad_list_info->path;
-  char *ad_list_name = ad_list_info->name;
-  if (ad_list_info->online) {
-    // Loaded list has online version - attempt to update
-    char *domain = ad_list_info->domain;
-    if (!download_file(domain, path)) {
-      fprintf(stderr, "[AdList] Could not update ad list %s, blocking rules might be obsolete!\n",
-          ad_list_name);
+  if (!parsed) {
+    parsed = read_list_file(ad_list_info);
+    if (!parsed) {
+      return false;
     }
   }
 
-  FILE *file = fopen(path, "r");
+  // Only apply the domains that changed since the last load of the list
+  StringArray *domains = &parsed->domains;
+  strings_sort_unique(domains);
+  apply_list_diff(ad_list_info, filter, domains->items, domains->count);
+  free(domains->items);
+  if (ad_list_info->allow) {
+    filter->allow_lists |= LIST_BIT(id);
+  }
 
-  if (!file) {
-    fprintf(stderr, "[AdList] Failed to open file with blocking rules %s!\n", path);
-    return false;
+  StringArray rules = parsed->rules;
+  free(parsed);
+  strings_sort_unique(&rules);
+  if (same_strings(ad_list_info->rules, ad_list_info->rule_count, rules.items, rules.count)) {
+    free_strings(rules.items, rules.count);
+    return true;
   }
+  free_strings(ad_list_info->rules, ad_list_info->rule_count);
+  ad_list_info->rules = rules.items;
+  ad_list_info->rule_count = rules.count;
+  return rebuild_rules(ad_lists, filter);
+}
 
-  // Load all domains matching the pattern to the set
-  char buffer[500];
-  char curr_domain[270];
-  char *pattern = ad_list_info->pattern;
-  char *delimiters = ad_list_info->delimiters;
-  char next_char;
-  uint32_t whitelist_lower_id = ad_lists->whitelists_lower_id;
-  while (fgets(buffer, sizeof(buffer), file)) {
-    if (sscanf(buffer, pattern, curr_domain, &next_char) && strchr(delimiters, next_char)) {
-      char *domain_string = calloc(strlen(curr_domain) + 1, sizeof(char));
-      strcpy(domain_string, curr_domain);
-      if (id < whitelist_lower_id) {
-        if (set_contains(domain_set, domain_string)) {
-          free(domain_string);
-          continue;
-        }
-        set_add(domain_set, domain_string);
-      } else {
-        set_remove(domain_set, domain_string, true);
-        free(domain_string);
-      }
+void unload_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter) {
+  if (id >= ad_lists->num_lists || !ad_lists->lists[id] || !filter->domains) {
+    return;
+  }
+
+  AdListInfo *ad_list_info = ad_lists->lists[id];
+  apply_list_diff(ad_list_info, filter, NULL, 0);
+  filter->allow_lists &= ~LIST_BIT(id);
+  if (ad_list_info->rule_count) {
+    free_strings(ad_list_info->rules, ad_list_info->rule_count);
+    ad_list_info->rules = NULL;
+    ad_list_info->rule_count = 0;
+    rebuild_rules(ad_lists, filter);
+  }
+}
+
+/*
+ * Returns the index of the domain in the sorted domains of a list, or the index it would be
+ * inserted at if the list doesn't contain it
+ */
+size_t find_list_domain(const AdListInfo *ad_list_info, const char *domain, bool *found) {
+  size_t low = 0;
+  size_t high = ad_list_info->domain_count;
+  *found = false;
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    const int result = strcmp(ad_list_info->domains[middle], domain);
+    if (result == 0) {
+      *found = true;
+      return middle;
+    } else if (result < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
   }
+  return low;
+}
 
-  // Check that whole file has been read
-  if (!feof(file)) {
-    fprintf(stderr, "[AdList] Failed to read the whole blocking rules file %s!\n", path);
-    fclose(file);
+bool add_list_domain(AdListInfo *ad_list_info, const char *domain, Filter *filter) {
+  bool found;
+  const size_t index = find_list_domain(ad_list_info, domain, &found);
+  if (found) {
     return false;
   }
 
-  fclose(file);
+  char *copy = malloc(strlen(domain) + 1);
+  CHECK_ALLOC(copy);
+  strcpy(copy, domain);
+  char *value = set_acquire(filter->domains, copy, LIST_BIT(ad_list_info->id));
+  if (value != copy) {
+    free(copy);
+  }
+
+  char **domains = realloc(ad_list_info->domains, (ad_list_info->domain_count + 1) * sizeof(char *));
+  CHECK_ALLOC(domains);
+  memmove(domains + index + 1, domains + index, (ad_list_info->domain_count - index) * sizeof(char *));
+  domains[index] = value;
+  ad_list_info->domains = domains;
+  ad_list_info->domain_count++;
   return true;
 }
 
-bool load_list_by_name(char *name, AdListsInfo *ad_lists, Set *domain_set) {
+bool remove_list_domain(AdListInfo *ad_list_info, const char *domain, Filter *filter) {
+  bool found;
+  const size_t index = find_list_domain(ad_list_info, domain, &found);
+  if (!found) {
+    return false;
+  }
+
+  char **domains = ad_list_info->domains;
+  set_release(filter->domains, domains[index], LIST_BIT(ad_list_info->id));
+  memmove(domains + index, domains + index + 1, (ad_list_info->domain_count - index - 1) * sizeof(char *));
+  ad_list_info->domain_count--;
+  set_reclaim(filter->domains);
+  return true;
+}
+
+void forget_list_domains(AdListsInfo *ad_lists) {
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    AdListInfo *ad_list_info = ad_lists->lists[id];
+    if (ad_list_info) {
+      free(ad_list_info->domains);
+      ad_list_info->domains = NULL;
+      ad_list_info->domain_count = 0;
+    }
+  }
+}
+
+bool load_list_by_name(char *name, AdListsInfo *ad_lists, Filter *filter) {
   uint32_t id;
   if (!map_get(ad_lists->lists_map, name, &id)) {
     fprintf(stderr, "[AdList] Unknown filter name %s!\n", name);
     return false;
   }
-  return load_list_by_id(id, ad_lists, domain_set);
+  return load_list_by_id(id, ad_lists, filter);
 }
 
-bool load_active_lists(AdListsInfo *ad_lists, Set *domain_set) {
+ListMask adlists_block_mask(const AdListsInfo *ad_lists) {
+  ListMask mask = 0;
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    if (ad_lists->lists[id] && !ad_lists->lists[id]->allow) {
+      mask |= LIST_BIT(id);
+    }
+  }
+  return mask;
+}
+
+bool load_active_lists(AdListsInfo *ad_lists, Filter *filter) {
   bool success = true;
   for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
-    if (ad_lists->lists[id]->active) {
-      success = load_list_by_id(id, ad_lists, domain_set) && success;
+    if (ad_lists->lists[id] && ad_lists->lists[id]->active) {
+      success = load_list_by_id(id, ad_lists, filter) && success;
     }
   }
   return success;
 }
+
+/*
+ * Writes a string of a lists snapshot, preceded by its length
+ */
+void write_snapshot_string(FILE *file, const char *string) {
+  const uint16_t length = (uint16_t) strlen(string);
+  fwrite(&length, sizeof(length), 1, file);
+  fwrite(string, 1, length, file);
+}
+
+/*
+ * Reads a string of a lists snapshot into a buffer of size bytes, returning false if it's
+ * truncated or doesn't fit
+ */
+bool read_snapshot_string(FILE *file, char *buffer, size_t size) {
+  uint16_t length;
+  if (fread(&length, sizeof(length), 1, file) != 1 || length >= size
+      || fread(buffer, 1, length, file) != length) {
+    return false;
+  }
+  buffer[length] = '\0';
+  return true;
+}
+
+void write_snapshot_name(const char *value, ListMask lists, const HitCounter *hits,
+    void *context) {
+  FILE *file = context;
+  fwrite(&lists, sizeof(lists), 1, file);
+  write_snapshot_string(file, value);
+}
+
+bool save_lists_snapshot(const AdListsInfo *ad_lists, const Filter *filter, const char *path) {
+  char *temporary_path = malloc(strlen(path) + 5);
+  CHECK_ALLOC(temporary_path);
+  sprintf(temporary_path, "%s.tmp", path);
+
+  FILE *file = fopen(temporary_path, "wb");
+  if (!file) {
+    fprintf(stderr, "[AdList] Failed to open %s with error: %d\n", temporary_path, errno);
+    free(temporary_path);
+    return false;
+  }
+
+  // The snapshot is a magic string followed by the name and rules of every list, in the order
+  // of their ids, and records of the mask and name of every domain, in host byte order
+  fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LENGTH, file);
+  fwrite(&ad_lists->num_lists, sizeof(ad_lists->num_lists), 1, file);
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    const AdListInfo *ad_list_info = ad_lists->lists[id];
+    const uint32_t rule_count = ad_list_info ? (uint32_t) ad_list_info->rule_count : 0;
+    write_snapshot_string(file, ad_list_info ? ad_list_info->name : "");
+    fwrite(&rule_count, sizeof(rule_count), 1, file);
+    for (uint32_t i = 0; i < rule_count; i++) {
+      write_snapshot_string(file, ad_list_info->rules[i]);
+    }
+  }
+  filter_foreach(filter, write_snapshot_name, file);
+
+  bool success = fflush(file) == 0 && !ferror(file);
+  success = fclose(file) == 0 && success;
+  if (success && rename(temporary_path, path) == -1) {
+    success = false;
+  }
+  if (success) {
+    printf("[AdList] Saved %zu domains to snapshot %s\n", filter_size(filter), path);
+  } else {
+    fprintf(stderr, "[AdList] Failed to write snapshot %s with error: %d\n", path, errno);
+    remove(temporary_path);
+  }
+  free(temporary_path);
+  return success;
+}
+
+bool load_lists_snapshot(const AdListsInfo *ad_lists, Filter *filter, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    if (errno == ENOENT) {
+      printf("[AdList] No snapshot at %s\n", path);
+    } else {
+      fprintf(stderr, "[AdList] Failed to open snapshot %s with error: %d\n", path, errno);
+    }
+    return false;
+  }
+
+  char magic[SNAPSHOT_MAGIC_LENGTH];
+  uint32_t list_count;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+      || memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH)
+      || fread(&list_count, sizeof(list_count), 1, file) != 1 || list_count > MAX_LISTS) {
+    fprintf(stderr, "[AdList] %s is not a lists snapshot!\n", path);
+    fclose(file);
+    return false;
+  }
+
+  // Lists are matched by name, as their ids change with the catalog, and only the ones that
+  // are still active are loaded
+  bool success = true;
+  char buffer[MAX_LINE_LENGTH + 1];
+  uint32_t ids[MAX_LISTS];
+  RuleSet *rules = rules_new();
+  for (uint32_t snapshot_id = 0; success && snapshot_id < list_count; snapshot_id++) {
+    uint32_t id;
+    uint32_t rule_count;
+    success = read_snapshot_string(file, buffer, sizeof(buffer))
+        && fread(&rule_count, sizeof(rule_count), 1, file) == 1;
+    if (!success) {
+      break;
+    }
+    const bool known = map_get(ad_lists->lists_map, buffer, &id) && ad_lists->lists[id]->active;
+    ids[snapshot_id] = known ? id : UINT32_MAX;
+    if (known && ad_lists->lists[id]->allow) {
+      filter->allow_lists |= LIST_BIT(id);
+    }
+    for (uint32_t i = 0; success && i < rule_count; i++) {
+      success = read_snapshot_string(file, buffer, sizeof(buffer));
+      if (success && known) {
+        add_rule(rules, ad_lists->lists[id], buffer);
+      }
+    }
+  }
+
+  size_t loaded = 0;
+  ListMask snapshot_lists;
+  while (success && fread(&snapshot_lists, sizeof(snapshot_lists), 1, file) == 1) {
+    success = read_snapshot_string(file, buffer, sizeof(buffer));
+    if (!success) {
+      break;
+    }
+    ListMask lists = 0;
+    for (uint32_t snapshot_id = 0; snapshot_id < list_count; snapshot_id++) {
+      if (snapshot_lists & LIST_BIT(snapshot_id) && ids[snapshot_id] != UINT32_MAX) {
+        lists |= LIST_BIT(ids[snapshot_id]);
+      }
+    }
+    if (lists) {
+      char *domain = copy_string(buffer);
+      if (!set_add(filter->domains, domain, lists)) {
+        free(domain);
+      }
+      loaded++;
+    }
+  }
+  fclose(file);
+  rules_compile(rules);
+  filter_swap_rules(filter, rules);
+
+  if (success) {
+    printf("[AdList] Loaded %zu domains and %zu rules from snapshot %s\n", loaded,
+        rules_count(rules), path);
+  } else {
+    fprintf(stderr, "[AdList] Snapshot %s is truncated or corrupt!\n", path);
+  }
+  return success;
+}
+
+void free_adlists(AdListsInfo *ad_lists) {
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    AdListInfo *ad_list_info = ad_lists->lists[id];
+    if (ad_list_info) {
+      // The domains are owned by the filter
+      free(ad_list_info->domains);
+      free_strings(ad_list_info->rules, ad_list_info->rule_count);
+      free_list_info(ad_list_info);
+    }
+  }
+  pthread_mutex_destroy(&ad_lists->lock);
+  free(ad_lists->lists);
+  map_free(ad_lists->lists_map);
+  free(ad_lists);
+}
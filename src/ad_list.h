@@ -1,55 +1,163 @@
+#pragma once
+
+#include <pthread.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
-#include "set.h"
+#include "filter.h"
 #include "map.h"
 
-#define MAX_LISTS 100
+typedef enum {
+  // One domain or rule per line
+  LIST_FORMAT_PLAIN,
+  // An address followed by one or more domains per line
+  LIST_FORMAT_HOSTS,
+  // Adblock "||domain^" network rules
+  LIST_FORMAT_ADBLOCK
+} ListFormat;
 
 /*
- * Auxiliary data structures describing a domain block list
+ * Auxiliary data structures describing a domain list. Lists are numbered in the order of
+ * their priorities, so that a list's id is greater than the ids of the lists it overrides.
  */
 typedef struct {
   uint32_t id;
-  char* name;
-  char* pattern;
-  char* delimiters;
+  char *name;
+  ListFormat format;
+  // Allowing lists exempt the domains they contain from blocking by lower priority lists
+  bool allow;
+  int32_t priority;
+  // Seconds between background refreshes of the list, 0 never refreshes it
+  uint32_t refresh_interval;
   bool active;
   bool online;
-  char* domain;
-  char* path;
+  char *url;
+  char *path;
+  // Sorted distinct domains last loaded from the list, pointing to the values stored in the filter
+  char **domains;
+  size_t domain_count;
+  // Wildcard and regex rules last loaded from the list
+  char **rules;
+  size_t rule_count;
 } AdListInfo;
 
+/*
+ * Domains and rules parsed from a list, before they are applied to the filter
+ */
+typedef struct ParsedList ParsedList;
+
 typedef struct {
   Map *lists_map;
   uint32_t num_lists;
-  uint32_t whitelists_lower_id;
   AdListInfo **lists;
+  // Serializes the threads changing the lists and the filter
+  pthread_mutex_t lock;
 } AdListsInfo;
 
 /*
- * - Loads domains from a block list identified by name and stores them in domain_set
+ * - Loads domains from a list identified by name and stores them in filter
+ * - Reloading a list only adds and removes the domains that changed since its last load,
+ *   and recompiles the filter rules if its rules changed
+ * - Returns true on success, false on failure
+ */
+bool load_list_by_name(char *name, AdListsInfo *ad_lists, Filter *filter);
+
+/*
+ * - Loads domains from a list identified by id and stores them in filter, see load_list_by_name
+ * - Returns true on success, false on failure
+ */
+bool load_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter);
+
+/*
+ * - Downloads the online version of a list to its path, keeping the previous file on failure
+ * - The list is parsed as it's downloaded, parsed being set to its domains and rules, or to
+ *   NULL if the list has no online version. The filter isn't changed, so the lock of the lists
+ *   doesn't need to be held, and apply_list_by_id applies the list afterwards.
+ * - Returns true on success or if the list has no online version, false on failure
+ */
+bool download_list(AdListInfo *ad_list_info, ParsedList **parsed);
+
+/*
+ * - Applies the domains and rules of a list identified by id, taking ownership of them, or
+ *   loads them from the file of the list if parsed is NULL
  * - Returns true on success, false on failure
  */
-bool load_list_by_name(char *name, AdListsInfo *ad_lists, Set *domain_set);
+bool apply_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter, ParsedList *parsed);
+
+/*
+ * Frees the domains and rules parsed from a list
+ */
+void free_parsed_list(ParsedList *parsed);
 
 /*
- * - Loads domains from a block list identified by id and stores them in domain_set
+ * Removes all domains and rules of a list identified by id from filter
+ */
+void unload_list_by_id(uint32_t id, AdListsInfo *ad_lists, Filter *filter);
+
+/*
+ * - Adds a domain to a loaded list until the list is next reloaded
+ * - Returns false if the list already contains the domain
+ */
+bool add_list_domain(AdListInfo *ad_list_info, const char *domain, Filter *filter);
+
+/*
+ * - Removes a domain from a loaded list until the list is next reloaded
+ * - Returns false if the list doesn't contain the domain
+ */
+bool remove_list_domain(AdListInfo *ad_list_info, const char *domain, Filter *filter);
+
+/*
+ * - Loads domains from lists that are marked as active in AdListsInfo and stores them in filter
  * - Returns true on success, false on failure
  */
-bool load_list_by_id(uint32_t id, AdListsInfo *ad_lists, Set *domain_set);
+bool load_active_lists(AdListsInfo *ad_lists, Filter *filter);
+
+/*
+ * Returns the mask of lists that block the domains they contain, whether they are active or
+ * not, as inactive lists contain no domains
+ */
+ListMask adlists_block_mask(const AdListsInfo *ad_lists);
+
+/*
+ * Drops the per-list domain indexes once the filter has been compacted and no longer stores
+ * the domains they point to, after which the lists can't be reloaded
+ */
+void forget_list_domains(AdListsInfo *ad_lists);
+
+/*
+ * - Creates the AdListsInfo structure from a catalog file, or from the built-in catalog of
+ *   lists supported by default if path is NULL
+ * - Each line of a catalog describes a list as space separated key=value pairs:
+ *     name=<name>                       required, unique name of the list
+ *     path=<path>                       required, local file of the list
+ *     url=<url>                         online version downloaded over the file
+ *     format=plain|hosts|adblock        syntax of the list, plain by default
+ *     action=deny|allow                 whether the list blocks or allows its domains
+ *     priority=<number>                 higher priority lists override lower ones, 0 by default
+ *     refresh=<seconds>                 interval of background refreshes, 0 by default
+ *     active=yes|no                     whether the list is loaded on startup
+ * - disable_defaults skips the online lists, blocklist and whitelist replace the paths of
+ *   the custom_blocklist and custom_whitelist lists
+ * - Returns NULL on failure
+ */
+AdListsInfo *create_adlists_info(const char *path, bool disable_defaults, const char *blocklist,
+    const char *whitelist);
 
 /*
- * - Loads domains from lists that are marked as active in AdListsInfo and stores them in domain_set
+ * - Writes the domains of the filter with the lists they belong to, and the rules of the
+ *   lists, to a snapshot file, replacing it atomically
+ * - Must not run concurrently with changes to the lists
  * - Returns true on success, false on failure
  */
-bool load_active_lists(AdListsInfo *ad_lists, Set *domain_set);
+bool save_lists_snapshot(const AdListsInfo *ad_lists, const Filter *filter, const char *path);
 
 /*
- * Generates default AdListsInfo structure storing information about block lists
- * supported by default
+ * - Loads the domains and rules of a snapshot written by save_lists_snapshot into an empty
+ *   filter, without reading the lists themselves or changing ad_lists. Lists are matched by
+ *   name, the ones that are no longer in the catalog or inactive are skipped.
+ * - Returns false if there is no snapshot or it can't be read completely
  */
-AdListsInfo *create_default_adlists_info(bool disable_defaults, char *blocklist, char *whitelist);
+bool load_lists_snapshot(const AdListsInfo *ad_lists, Filter *filter, const char *path);
 
 /*
  * Frees memory allocated for ad lists
@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "utils.h"
+
+#define CACHE_WAYS 4
+// Longest time a response is cached, whatever its TTL
+#define MAX_CACHE_TTL 86400
+#define SNAPSHOT_MAGIC "DNSBCAC1"
+#define SNAPSHOT_MAGIC_LENGTH 8
+// Sets of a shared cache guarded by each lock, at most
+#define SETS_PER_LOCK 16
+
+typedef struct {
+  uint64_t hash;
+  // Unix times at which the response was stored and expires, 0 for free entries
+  uint64_t stored_at;
+  uint64_t expires_at;
+  uint64_t last_used;
+  uint16_t key_length;
+  uint16_t response_length;
+  // Key followed by the response, a fixed slot of the mapping of a shared cache
+  uint8_t *data;
+} CacheEntry;
+
+typedef struct {
+  // Shards are only written by their own thread, so they don't share cache lines
+  alignas(64) CacheEntry *entries;
+  // Processes using a shared cache update the clock without atomic increments, so that
+  // entries used at the same time may get the same stamp
+  _Atomic uint64_t clock;
+} CacheShard;
+
+struct ResponseCache {
+  CacheShard *shards;
+  uint32_t shard_count;
+  // Entries are grouped in sets of CACHE_WAYS entries, the hash of a key picking its set
+  uint32_t set_count;
+  // Shared caches map their only shard, entries, data and locks into a single mapping, the
+  // set at index i being guarded by the lock at index i modulo lock_count
+  void *mapping;
+  size_t mapping_size;
+  pthread_mutex_t *locks;
+  uint32_t lock_count;
+};
+
+ResponseCache *cache_new(uint32_t shard_count, uint32_t capacity) {
+  if (capacity == 0) {
+    return NULL;
+  }
+
+  ResponseCache *cache = malloc(sizeof(ResponseCache));
+  CHECK_ALLOC(cache);
+  cache->shard_count = shard_count;
+  cache->set_count = (capacity + CACHE_WAYS - 1) / CACHE_WAYS;
+  cache->shards = aligned_alloc(alignof(CacheShard), shard_count * sizeof(CacheShard));
+  CHECK_ALLOC(cache->shards);
+  for (uint32_t i = 0; i < shard_count; i++) {
+    cache->shards[i].entries = calloc((size_t) cache->set_count * CACHE_WAYS, sizeof(CacheEntry));
+    CHECK_ALLOC(cache->shards[i].entries);
+    atomic_init(&cache->shards[i].clock, 0);
+  }
+  cache->mapping = NULL;
+  cache->mapping_size = 0;
+  cache->locks = NULL;
+  cache->lock_count = 0;
+  return cache;
+}
+
+ResponseCache *cache_new_shared(uint32_t capacity) {
+  if (capacity == 0) {
+    return NULL;
+  }
+
+  ResponseCache *cache = malloc(sizeof(ResponseCache));
+  CHECK_ALLOC(cache);
+  cache->shard_count = 1;
+  cache->set_count = (capacity + CACHE_WAYS - 1) / CACHE_WAYS;
+  cache->lock_count = (cache->set_count + SETS_PER_LOCK - 1) / SETS_PER_LOCK;
+  const size_t entry_count = (size_t) cache->set_count * CACHE_WAYS;
+  const size_t slot_size = MAX_CACHE_KEY + MAX_MESSAGE_LENGTH;
+  cache->mapping_size = sizeof(CacheShard) + cache->lock_count * sizeof(pthread_mutex_t)
+      + entry_count * (sizeof(CacheEntry) + slot_size);
+  cache->mapping = memory_alloc_shared(cache->mapping_size);
+
+  // The mapping is laid out as the shard, the locks, the entries and their data
+  cache->shards = cache->mapping;
+  cache->locks = (pthread_mutex_t *) (cache->shards + 1);
+  cache->shards->entries = (CacheEntry *) (cache->locks + cache->lock_count);
+  atomic_init(&cache->shards->clock, 0);
+  uint8_t *data = (uint8_t *) (cache->shards->entries + entry_count);
+  for (size_t i = 0; i < entry_count; i++) {
+    cache->shards->entries[i].data = data + i * slot_size;
+  }
+
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  for (uint32_t i = 0; i < cache->lock_count; i++) {
+    pthread_mutex_init(&cache->locks[i], &attributes);
+  }
+  pthread_mutexattr_destroy(&attributes);
+  return cache;
+}
+
+uint8_t cache_fold(uint8_t c) {
+  return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+bool cache_key(const Message *query, CacheKey *key) {
+  const uint8_t *data = query->data;
+  // Only standard queries with a single question
+  if (query->length < QUESTION_START_BYTE || (data[2] & 0xf8) || data[4] || data[5] != 1) {
+    return false;
+  }
+
+  size_t offset = QUESTION_START_BYTE;
+  while (offset < query->length && data[offset]) {
+    if (data[offset] > 63) {
+      return false;
+    }
+    offset += data[offset] + 1;
+  }
+  offset += 5;
+  const size_t question_length = offset - QUESTION_START_BYTE;
+  if (offset > query->length || question_length + 1 > MAX_CACHE_KEY) {
+    return false;
+  }
+
+  // Label lengths are below 'A', so the whole name can be folded
+  const size_t name_length = question_length - 4;
+  for (size_t i = 0; i < name_length; i++) {
+    key->data[i] = cache_fold(data[QUESTION_START_BYTE + i]);
+  }
+  memcpy(key->data + name_length, data + QUESTION_START_BYTE + name_length, 4);
+  // Responses to EDNS queries may carry records that other clients didn't ask for
+  key->data[question_length] = data[10] || data[11];
+  key->length = question_length + 1;
+  key->question_length = question_length;
+  key->hash = hash_bytes(key->data, key->length);
+  return true;
+}
+
+CacheShard *cache_shard(const ResponseCache *cache, uint32_t shard) {
+  return cache->shards + (cache->mapping ? 0 : shard);
+}
+
+CacheEntry *cache_set(const ResponseCache *cache, uint32_t shard, uint64_t hash) {
+  return cache_shard(cache, shard)->entries + (hash % cache->set_count) * CACHE_WAYS;
+}
+
+/*
+ * Returns a new stamp of the clock of a shard, later than the stamps of the entries
+ */
+uint64_t cache_tick(const ResponseCache *cache, uint32_t shard) {
+  _Atomic uint64_t *clock = &cache_shard(cache, shard)->clock;
+  const uint64_t stamp = atomic_load_explicit(clock, memory_order_relaxed) + 1;
+  atomic_store_explicit(clock, stamp, memory_order_relaxed);
+  return stamp;
+}
+
+bool cache_entry_matches(const CacheEntry *entry, uint64_t hash, const uint8_t *key,
+    size_t key_length) {
+  return entry->expires_at && entry->hash == hash && entry->key_length == key_length
+      && !memcmp(entry->data, key, key_length);
+}
+
+void cache_entry_clear(const ResponseCache *cache, CacheEntry *entry) {
+  if (cache->mapping) {
+    // The data slots of shared caches are never freed
+    *entry = (CacheEntry) { .data = entry->data };
+  } else {
+    free(entry->data);
+    *entry = (CacheEntry) {0};
+  }
+}
+
+/*
+ * Locks the stripe of a set in a shared cache, clearing the sets of the stripe if a process
+ * died while it held the lock, as it might have left an entry half written
+ */
+void cache_lock(const ResponseCache *cache, size_t set) {
+  if (!cache->locks) {
+    return;
+  }
+  const uint32_t stripe = set % cache->lock_count;
+  if (pthread_mutex_lock(&cache->locks[stripe]) == EOWNERDEAD) {
+    CacheEntry *entries = cache->shards->entries;
+    for (size_t i = stripe; i < cache->set_count; i += cache->lock_count) {
+      for (int way = 0; way < CACHE_WAYS; way++) {
+        cache_entry_clear(cache, &entries[i * CACHE_WAYS + way]);
+      }
+    }
+    pthread_mutex_consistent(&cache->locks[stripe]);
+  }
+}
+
+void cache_unlock(const ResponseCache *cache, size_t set) {
+  if (cache->locks) {
+    pthread_mutex_unlock(&cache->locks[set % cache->lock_count]);
+  }
+}
+
+/*
+ * Stores a response, replacing the entry of the same key, else a free or expired entry,
+ * else the least recently used entry of its set
+ */
+void cache_insert(ResponseCache *cache, uint32_t shard, uint64_t hash, const uint8_t *key,
+    size_t key_length, const uint8_t *response, size_t response_length, uint64_t stored_at,
+    uint64_t expires_at, uint64_t now) {
+  cache_lock(cache, hash % cache->set_count);
+  CacheEntry *set = cache_set(cache, shard, hash);
+  CacheEntry *entry = NULL;
+  CacheEntry *victim = set;
+  for (int way = 0; way < CACHE_WAYS; way++) {
+    if (cache_entry_matches(set + way, hash, key, key_length)) {
+      entry = set + way;
+      break;
+    }
+    if (victim->expires_at > now && (set[way].expires_at <= now
+        || set[way].last_used < victim->last_used)) {
+      victim = set + way;
+    }
+  }
+  if (entry == NULL) {
+    entry = victim;
+  }
+
+  cache_entry_clear(cache, entry);
+  if (!cache->mapping) {
+    entry->data = malloc(key_length + response_length);
+    CHECK_ALLOC(entry->data);
+  }
+  memcpy(entry->data, key, key_length);
+  memcpy(entry->data + key_length, response, response_length);
+  entry->hash = hash;
+  entry->stored_at = stored_at;
+  entry->expires_at = expires_at;
+  entry->key_length = (uint16_t) key_length;
+  entry->response_length = (uint16_t) response_length;
+  entry->last_used = cache_tick(cache, shard);
+  cache_unlock(cache, hash % cache->set_count);
+}
+
+bool cache_lookup(ResponseCache *cache, uint32_t shard, const CacheKey *key, Message *message) {
+  cache_lock(cache, key->hash % cache->set_count);
+  CacheEntry *set = cache_set(cache, shard, key->hash);
+  CacheEntry *entry = NULL;
+  for (int way = 0; way < CACHE_WAYS && !entry; way++) {
+    if (cache_entry_matches(set + way, key->hash, key->data, key->length)) {
+      entry = set + way;
+    }
+  }
+  if (!entry) {
+    cache_unlock(cache, key->hash % cache->set_count);
+    return false;
+  }
+
+  const uint64_t now = time(NULL);
+  if (now >= entry->expires_at) {
+    cache_entry_clear(cache, entry);
+    cache_unlock(cache, key->hash % cache->set_count);
+    return false;
+  }
+
+  // Keep the ID, RD flag and question of the query, whose name may differ in case
+  const uint8_t *response = entry->data + entry->key_length;
+  const size_t answer_offset = QUESTION_START_BYTE + key->question_length;
+  const uint8_t recursion_desired = message->data[2] & 0x01;
+  memcpy(message->data + 2, response + 2, QUESTION_START_BYTE - 2);
+  message->data[2] = (message->data[2] & ~0x01) | recursion_desired;
+  memcpy(message->data + answer_offset, response + answer_offset,
+      entry->response_length - answer_offset);
+  message->length = entry->response_length;
+  message_adjust_ttls(message, (uint32_t) (now - entry->stored_at));
+
+  entry->last_used = cache_tick(cache, shard);
+  cache_unlock(cache, key->hash % cache->set_count);
+  return true;
+}
+
+void cache_store(ResponseCache *cache, uint32_t shard, const CacheKey *key, const Message *response) {
+  const uint8_t *data = response->data;
+  const size_t answer_offset = QUESTION_START_BYTE + key->question_length;
+  // Only successful and NXDOMAIN responses that aren't truncated
+  const uint8_t rcode = data[3] & 0x0f;
+  if (response->length < answer_offset || (rcode != 0 && rcode != 3) || (data[2] & 0x02)) {
+    return;
+  }
+
+  // The response has to answer the question of the key
+  if (data[4] || data[5] != 1) {
+    return;
+  }
+  const size_t name_length = key->question_length - 4;
+  for (size_t i = 0; i < name_length; i++) {
+    if (cache_fold(data[QUESTION_START_BYTE + i]) != key->data[i]) {
+      return;
+    }
+  }
+  if (memcmp(data + QUESTION_START_BYTE + name_length, key->data + name_length, 4)) {
+    return;
+  }
+
+  uint32_t ttl;
+  if (!message_min_ttl(response, &ttl) || ttl == 0 || ttl == UINT32_MAX) {
+    return;
+  }
+  if (ttl > MAX_CACHE_TTL) {
+    ttl = MAX_CACHE_TTL;
+  }
+
+  const uint64_t now = time(NULL);
+  cache_insert(cache, shard, key->hash, key->data, key->length, data, response->length, now,
+      now + ttl, now);
+}
+
+bool cache_save_file(const ResponseCache *cache, FILE *file, size_t *count) {
+  // The snapshot is a magic string followed by records of the stored and expiry times, the
+  // key and response lengths, the key and the response, in host byte order
+  const uint64_t now = time(NULL);
+  *count = 0;
+  fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LENGTH, file);
+  for (uint32_t shard = 0; shard < cache->shard_count; shard++) {
+    const CacheEntry *entries = cache->shards[shard].entries;
+    for (size_t i = 0; i < (size_t) cache->set_count * CACHE_WAYS; i++) {
+      const CacheEntry *entry = &entries[i];
+      if (i % CACHE_WAYS == 0) {
+        cache_lock(cache, i / CACHE_WAYS);
+      }
+      if (entry->expires_at > now) {
+        fwrite(&entry->stored_at, sizeof(entry->stored_at), 1, file);
+        fwrite(&entry->expires_at, sizeof(entry->expires_at), 1, file);
+        fwrite(&entry->key_length, sizeof(entry->key_length), 1, file);
+        fwrite(&entry->response_length, sizeof(entry->response_length), 1, file);
+        fwrite(entry->data, 1, entry->key_length + entry->response_length, file);
+        (*count)++;
+      }
+      if (i % CACHE_WAYS == CACHE_WAYS - 1) {
+        cache_unlock(cache, i / CACHE_WAYS);
+      }
+    }
+  }
+  return fflush(file) == 0 && !ferror(file);
+}
+
+bool cache_save(const ResponseCache *cache, const char *path) {
+  char *temporary_path = malloc(strlen(path) + 5);
+  CHECK_ALLOC(temporary_path);
+  sprintf(temporary_path, "%s.tmp", path);
+
+  FILE *file = fopen(temporary_path, "wb");
+  if (!file) {
+    fprintf(stderr, "[Cache] Failed to open %s with error: %d\n", temporary_path, errno);
+    free(temporary_path);
+    return false;
+  }
+
+  size_t count;
+  bool success = cache_save_file(cache, file, &count);
+  success = fclose(file) == 0 && success;
+  if (success && rename(temporary_path, path) == -1) {
+    success = false;
+  }
+  if (success) {
+    printf("[Cache] Saved %zu responses to %s\n", count, path);
+  } else {
+    fprintf(stderr, "[Cache] Failed to write snapshot %s with error: %d\n", path, errno);
+    remove(temporary_path);
+  }
+  free(temporary_path);
+  return success;
+}
+
+bool cache_load_file(ResponseCache *cache, FILE *file, const char *name) {
+  char magic[SNAPSHOT_MAGIC_LENGTH];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+      || memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH)) {
+    fprintf(stderr, "[Cache] %s is not a cache snapshot!\n", name);
+    return false;
+  }
+
+  const uint64_t now = time(NULL);
+  size_t loaded = 0;
+  size_t expired = 0;
+  bool success = true;
+  uint64_t stored_at, expires_at;
+  uint16_t key_length, response_length;
+  uint8_t data[MAX_CACHE_KEY + MAX_MESSAGE_LENGTH];
+  while (fread(&stored_at, sizeof(stored_at), 1, file) == 1) {
+    if (fread(&expires_at, sizeof(expires_at), 1, file) != 1
+        || fread(&key_length, sizeof(key_length), 1, file) != 1
+        || fread(&response_length, sizeof(response_length), 1, file) != 1
+        || key_length == 0 || key_length > MAX_CACHE_KEY || response_length > MAX_MESSAGE_LENGTH
+        || response_length < QUESTION_START_BYTE + key_length - 1
+        || fread(data, 1, key_length + response_length, file) != key_length + response_length) {
+      fprintf(stderr, "[Cache] Snapshot %s is truncated or corrupt!\n", name);
+      success = false;
+      break;
+    }
+
+    if (expires_at <= now) {
+      expired++;
+      continue;
+    }
+    // Hashes are seeded differently in every process
+    const uint64_t hash = hash_bytes(data, key_length);
+    for (uint32_t shard = 0; shard < cache->shard_count; shard++) {
+      cache_insert(cache, shard, hash, data, key_length, data + key_length, response_length,
+          stored_at, expires_at, now);
+    }
+    loaded++;
+  }
+
+  printf("[Cache] Loaded %zu responses from %s, %zu had expired\n", loaded, name, expired);
+  return success;
+}
+
+bool cache_load(ResponseCache *cache, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file && errno == ENOENT) {
+    printf("[Cache] No snapshot at %s, starting with an empty cache\n", path);
+    return true;
+  }
+  if (!file) {
+    fprintf(stderr, "[Cache] Failed to open snapshot %s with error: %d\n", path, errno);
+    return false;
+  }
+
+  const bool success = cache_load_file(cache, file, path);
+  fclose(file);
+  return success;
+}
+
+void cache_free(ResponseCache *cache) {
+  if (!cache) {
+    return;
+  }
+  if (cache->mapping) {
+    for (uint32_t i = 0; i < cache->lock_count; i++) {
+      pthread_mutex_destroy(&cache->locks[i]);
+    }
+    memory_free_shared(cache->mapping, cache->mapping_size);
+    free(cache);
+    return;
+  }
+  for (uint32_t shard = 0; shard < cache->shard_count; shard++) {
+    for (size_t i = 0; i < (size_t) cache->set_count * CACHE_WAYS; i++) {
+      free(cache->shards[shard].entries[i].data);
+    }
+    free(cache->shards[shard].entries);
+  }
+  free(cache->shards);
+  free(cache);
+}
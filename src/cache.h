@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "message.h"
+
+// Longest question name, followed by its type and class and the key flags
+#define MAX_CACHE_KEY 264
+
+typedef struct ResponseCache ResponseCache;
+
+/*
+ * Identifies the responses that can answer a query
+ */
+typedef struct {
+  // Case folded question, followed by a byte telling whether the query has EDNS records
+  uint8_t data[MAX_CACHE_KEY];
+  size_t length;
+  // Length of the question in the query
+  size_t question_length;
+  uint64_t hash;
+} CacheKey;
+
+/*
+ * - Creates a cache of upstream responses split in shards, each holding up to capacity
+ *   responses and used by a single thread without any locking
+ * - Returns NULL if capacity is 0
+ */
+ResponseCache *cache_new(uint32_t shard_count, uint32_t capacity);
+
+/*
+ * - Creates a cache of upstream responses holding up to capacity responses in memory shared
+ *   with the processes forked afterwards, so that a response stored by one of them answers
+ *   the queries of all the others
+ * - Lookups and stores lock a stripe of the table with robust mutexes, a process dying while
+ *   holding one only losing the responses of its stripe
+ * - The shard arguments of the other functions are ignored
+ * - Returns NULL if capacity is 0
+ */
+ResponseCache *cache_new_shared(uint32_t capacity);
+
+/*
+ * - Computes the cache key of a query
+ * - Returns false if the query can't be cached
+ */
+bool cache_key(const Message *query, CacheKey *key);
+
+/*
+ * - Looks up the response to a query in a shard, which replaces the query in place, with the
+ *   ID and question of the query and TTLs decreased by the time spent in the cache
+ * - Returns false if no response is cached or it has expired
+ */
+bool cache_lookup(ResponseCache *cache, uint32_t shard, const CacheKey *key, Message *message);
+
+/*
+ * Stores the response to a query in a shard until its smallest TTL expires, unless it's an
+ * error, truncated or has no records
+ */
+void cache_store(ResponseCache *cache, uint32_t shard, const CacheKey *key, const Message *response);
+
+/*
+ * - Writes the unexpired responses of all shards to a snapshot file, replacing it atomically
+ * - Returns true on success, false on failure
+ */
+bool cache_save(const ResponseCache *cache, const char *path);
+
+/*
+ * - Writes the unexpired responses of all shards to an open file in the snapshot format,
+ *   setting count to the number of responses written
+ * - Returns true on success, false on failure
+ */
+bool cache_save_file(const ResponseCache *cache, FILE *file, size_t *count);
+
+/*
+ * - Loads the unexpired responses of a snapshot file into every shard, so that each worker
+ *   starts warm
+ * - Returns true on success, false on failure
+ */
+bool cache_load(ResponseCache *cache, const char *path);
+
+/*
+ * - Loads the responses of a snapshot read from an open file into every shard, naming the
+ *   snapshot as name in messages
+ * - Returns true on success, false on failure
+ */
+bool cache_load_file(ResponseCache *cache, FILE *file, const char *name);
+
+/*
+ * Frees memory allocated for the cache
+ */
+void cache_free(ResponseCache *cache);
@@ -0,0 +1,383 @@
+#include "compact_set.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "utils.h"
+
+// Number of items front coded against the first item of their block
+#define BLOCK_SIZE 16
+#define MAX_NAME_LENGTH 512
+
+/*
+ * The set is stored in a single allocation laid out as the arrays below:
+ * - block_keys: first 8 bytes of the first name of every block packed into big endian
+ *   integers, so that the binary search only compares the names of blocks with equal keys
+ * - masks: distinct list masks of the items, referenced by index from data
+ * - block_offsets: offset of every block in data
+ * - data: blocks of items, the first item of a block encoded as its length, name and mask
+ *   index, the following ones as the length of the prefix shared with the previous name,
+ *   the length and bytes of the rest of the name and the mask index, all lengths and
+ *   indices being LEB128 varints
+ * The hit counters of the items are allocated separately, indexed by the position of the
+ * items in the sorted order, and shared by the replicas of the set.
+ */
+struct CompactSet {
+  uint8_t *blob;
+  size_t blob_size;
+  size_t item_count;
+  size_t block_count;
+  size_t mask_count;
+  uint64_t *block_keys;
+  uint32_t *block_offsets;
+  ListMask *masks;
+  uint8_t *data;
+  HitCounter *hits;
+  // Whether the hit counters are freed with the set rather than by one of its replicas
+  bool owns_hits;
+};
+
+typedef struct {
+  char *reversed;
+  size_t length;
+  ListMask lists;
+} CompactItem;
+
+typedef struct {
+  CompactItem *items;
+  size_t count;
+} CompactItems;
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} ByteBuffer;
+
+void buffer_reserve(ByteBuffer *buffer, size_t size) {
+  if (buffer->size + size > buffer->capacity) {
+    while (buffer->size + size > buffer->capacity) {
+      buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    }
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    CHECK_ALLOC(buffer->data);
+  }
+}
+
+void buffer_write_varint(ByteBuffer *buffer, size_t value) {
+  buffer_reserve(buffer, 10);
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    buffer->data[buffer->size++] = byte | (value ? 0x80 : 0);
+  } while (value);
+}
+
+void buffer_write(ByteBuffer *buffer, const char *bytes, size_t size) {
+  buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->size, bytes, size);
+  buffer->size += size;
+}
+
+const uint8_t *read_varint(const uint8_t *data, size_t *value) {
+  *value = 0;
+  for (unsigned int shift = 0; ; shift += 7) {
+    const uint8_t byte = *data++;
+    *value |= (size_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return data;
+    }
+  }
+}
+
+uint64_t pack_key(const char *name, size_t length) {
+  uint64_t key = 0;
+  for (size_t i = 0; i < 8; i++) {
+    key = (key << 8) | (i < length ? (uint8_t) name[i] : 0);
+  }
+  return key;
+}
+
+int compare_names(const char *first, size_t first_length, const char *second, size_t second_length) {
+  const size_t length = first_length < second_length ? first_length : second_length;
+  const int result = memcmp(first, second, length);
+  if (result) {
+    return result;
+  }
+  return (first_length > second_length) - (first_length < second_length);
+}
+
+int compare_items(const void *first, const void *second) {
+  const CompactItem *a = first;
+  const CompactItem *b = second;
+  return compare_names(a->reversed, a->length, b->reversed, b->length);
+}
+
+int compare_masks(const void *first, const void *second) {
+  const ListMask a = *(const ListMask *) first;
+  const ListMask b = *(const ListMask *) second;
+  return (a > b) - (a < b);
+}
+
+void collect_item(const char *value, ListMask lists, const HitCounter *hits, void *context) {
+  CompactItems *items = context;
+  const size_t length = strlen(value);
+  if (length >= MAX_NAME_LENGTH) {
+    return;
+  }
+
+  CompactItem *item = items->items + items->count++;
+  item->reversed = malloc(length);
+  CHECK_ALLOC(item->reversed);
+  for (size_t i = 0; i < length; i++) {
+    item->reversed[i] = value[length - 1 - i];
+  }
+  item->length = length;
+  item->lists = lists;
+}
+
+size_t find_mask(const ListMask *masks, size_t mask_count, ListMask lists) {
+  size_t low = 0;
+  size_t high = mask_count;
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (masks[middle] < lists) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/*
+ * Points the arrays of a compact set into its blob
+ */
+void compact_set_attach(CompactSet *set, uint8_t *blob) {
+  set->blob = blob;
+  set->block_keys = (uint64_t *) blob;
+  set->masks = (ListMask *) (set->block_keys + set->block_count);
+  set->block_offsets = (uint32_t *) (set->masks + set->mask_count);
+  set->data = (uint8_t *) (set->block_offsets + set->block_count);
+}
+
+CompactSet *compact_set_build(const Set *set) {
+  CompactItems items = { malloc((set_size(set) + 1) * sizeof(CompactItem)), 0 };
+  CHECK_ALLOC(items.items);
+  set_foreach(set, collect_item, &items);
+  qsort(items.items, items.count, sizeof(CompactItem), compare_items);
+
+  // Collect the distinct masks, most sets only having a handful of them
+  ListMask *masks = malloc((items.count + 1) * sizeof(ListMask));
+  CHECK_ALLOC(masks);
+  for (size_t i = 0; i < items.count; i++) {
+    masks[i] = items.items[i].lists;
+  }
+  qsort(masks, items.count, sizeof(ListMask), compare_masks);
+  size_t mask_count = 0;
+  for (size_t i = 0; i < items.count; i++) {
+    if (mask_count == 0 || masks[mask_count - 1] != masks[i]) {
+      masks[mask_count++] = masks[i];
+    }
+  }
+
+  const size_t block_count = (items.count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint64_t *block_keys = malloc((block_count + 1) * sizeof(uint64_t));
+  uint32_t *block_offsets = malloc((block_count + 1) * sizeof(uint32_t));
+  CHECK_ALLOC(block_keys);
+  CHECK_ALLOC(block_offsets);
+
+  ByteBuffer data = {0};
+  for (size_t i = 0; i < items.count; i++) {
+    const CompactItem *item = items.items + i;
+    size_t shared = 0;
+    if (i % BLOCK_SIZE == 0) {
+      block_keys[i / BLOCK_SIZE] = pack_key(item->reversed, item->length);
+      block_offsets[i / BLOCK_SIZE] = (uint32_t) data.size;
+    } else {
+      const CompactItem *previous = item - 1;
+      while (shared < item->length && shared < previous->length
+          && item->reversed[shared] == previous->reversed[shared]) {
+        shared++;
+      }
+      buffer_write_varint(&data, shared);
+    }
+    buffer_write_varint(&data, item->length - shared);
+    buffer_write(&data, item->reversed + shared, item->length - shared);
+    buffer_write_varint(&data, find_mask(masks, mask_count, item->lists));
+  }
+
+  // Lay all arrays out in one allocation, keeping the 8 byte arrays aligned
+  CompactSet *compact = malloc(sizeof(CompactSet));
+  CHECK_ALLOC(compact);
+  compact->item_count = items.count;
+  compact->block_count = block_count;
+  compact->mask_count = mask_count;
+  compact->blob_size = block_count * sizeof(uint64_t) + mask_count * sizeof(ListMask)
+      + block_count * sizeof(uint32_t) + data.size;
+  compact_set_attach(compact, memory_alloc(compact->blob_size, -1));
+  memcpy(compact->block_keys, block_keys, block_count * sizeof(uint64_t));
+  memcpy(compact->masks, masks, mask_count * sizeof(ListMask));
+  memcpy(compact->block_offsets, block_offsets, block_count * sizeof(uint32_t));
+  memcpy(compact->data, data.data, data.size);
+  compact->hits = calloc(items.count + 1, sizeof(HitCounter));
+  CHECK_ALLOC(compact->hits);
+  compact->owns_hits = true;
+
+  for (size_t i = 0; i < items.count; i++) {
+    free(items.items[i].reversed);
+  }
+  free(items.items);
+  free(masks);
+  free(block_keys);
+  free(block_offsets);
+  free(data.data);
+  return compact;
+}
+
+/*
+ * Returns the number of keys lower than key in a sorted array, without branching on the
+ * comparisons so that the search is not slowed down by mispredictions
+ */
+size_t count_lower_keys(const uint64_t *keys, size_t count, uint64_t key) {
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t *base = keys;
+  while (count > 1) {
+    const size_t half = count / 2;
+    base = base[half] < key ? base + half : base;
+    count -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+/*
+ * Compares the first name of a block, whose key is equal to key, with the reversed name that
+ * is searched for
+ */
+int compare_block(const CompactSet *set, size_t block, uint64_t key, const char *name, size_t length) {
+  size_t block_length;
+  const uint8_t *data = read_varint(set->data + set->block_offsets[block], &block_length);
+  return compare_names((const char *) data, block_length, name, length);
+}
+
+ListMask compact_set_lookup(const CompactSet *set, const char *value, HitCounter **hits) {
+  char name[MAX_NAME_LENGTH];
+  const size_t length = strlen(value);
+  if (length >= MAX_NAME_LENGTH) {
+    return 0;
+  }
+  for (size_t i = 0; i < length; i++) {
+    name[i] = value[length - 1 - i];
+  }
+  const uint64_t key = pack_key(name, length);
+
+  // Blocks whose keys are lower than the searched key start with lower names and blocks with
+  // greater keys with greater names, only blocks with equal keys need their names compared
+  size_t low = count_lower_keys(set->block_keys, set->block_count, key);
+  size_t high = key == UINT64_MAX
+      ? set->block_count
+      : count_lower_keys(set->block_keys, set->block_count, key + 1);
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (compare_block(set, middle, key, name, length) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return 0;
+  }
+  const size_t block = low - 1;
+
+  // Decode the block until reaching the searched name or a greater one
+  char current[MAX_NAME_LENGTH];
+  size_t current_length = 0;
+  const uint8_t *data = set->data + set->block_offsets[block];
+  size_t items = set->item_count - block * BLOCK_SIZE;
+  if (items > BLOCK_SIZE) {
+    items = BLOCK_SIZE;
+  }
+  for (size_t i = 0; i < items; i++) {
+    size_t shared = 0;
+    size_t suffix;
+    size_t mask_index;
+    if (i > 0) {
+      data = read_varint(data, &shared);
+    }
+    data = read_varint(data, &suffix);
+    memcpy(current + shared, data, suffix);
+    current_length = shared + suffix;
+    data = read_varint(data + suffix, &mask_index);
+
+    const int result = compare_names(current, current_length, name, length);
+    if (result == 0) {
+      if (hits) {
+        *hits = set->hits + block * BLOCK_SIZE + i;
+      }
+      return set->masks[mask_index];
+    } else if (result > 0) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+void compact_set_foreach(const CompactSet *set, SetItemCallback callback, void *context) {
+  char current[MAX_NAME_LENGTH];
+  char value[MAX_NAME_LENGTH];
+  size_t current_length = 0;
+  const uint8_t *data = set->data;
+  for (size_t i = 0; i < set->item_count; i++) {
+    // Blocks are stored back to back, so only the first item of a block restarts the coding
+    size_t shared = 0;
+    size_t suffix;
+    size_t mask_index;
+    if (i % BLOCK_SIZE) {
+      data = read_varint(data, &shared);
+    }
+    data = read_varint(data, &suffix);
+    memcpy(current + shared, data, suffix);
+    current_length = shared + suffix;
+    data = read_varint(data + suffix, &mask_index);
+
+    for (size_t j = 0; j < current_length; j++) {
+      value[j] = current[current_length - 1 - j];
+    }
+    value[current_length] = '\0';
+    callback(value, set->masks[mask_index], set->hits + i, context);
+  }
+}
+
+size_t compact_set_size(const CompactSet *set) {
+  return set->item_count;
+}
+
+size_t compact_set_memory(const CompactSet *set) {
+  return sizeof(CompactSet) + set->blob_size + set->item_count * sizeof(HitCounter);
+}
+
+CompactSet *compact_set_replicate(CompactSet *set, int node) {
+  CompactSet *replica = malloc(sizeof(CompactSet));
+  CHECK_ALLOC(replica);
+  *replica = *set;
+  compact_set_attach(replica, memory_alloc(set->blob_size, node));
+  memcpy(replica->blob, set->blob, set->blob_size);
+  set->owns_hits = false;
+  return replica;
+}
+
+void compact_set_report_memory(const CompactSet *set, const char *name) {
+  memory_report(name, set->blob, set->blob_size);
+}
+
+void compact_set_free(CompactSet *set) {
+  if (set->owns_hits) {
+    free(set->hits);
+  }
+  memory_free(set->blob, set->blob_size);
+  free(set);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "set.h"
+
+typedef struct CompactSet CompactSet;
+
+/*
+ * - Builds a read-only copy of a set optimised for size
+ * - Items are sorted by their reversed names, so that names sharing a domain suffix are
+ *   adjacent, and front coded in blocks indexed by their first item
+ */
+CompactSet *compact_set_build(const Set *set);
+
+/*
+ * - Searches for an item in a compact set and returns the mask of lists it belongs to, or 0
+ *   if it's not in the set
+ * - If hits is not NULL, it's set to the hit counter of the item when it's found
+ */
+ListMask compact_set_lookup(const CompactSet *set, const char *value, HitCounter **hits);
+
+/*
+ * Calls callback with every item in the compact set, in the order of their reversed names
+ */
+void compact_set_foreach(const CompactSet *set, SetItemCallback callback, void *context);
+
+/*
+ * Returns the number of items in the compact set
+ */
+size_t compact_set_size(const CompactSet *set);
+
+/*
+ * Returns the number of bytes used by the compact set
+ */
+size_t compact_set_memory(const CompactSet *set);
+
+/*
+ * - Copies a compact set into memory bound to the given NUMA node
+ * - The hit counters are shared with the set rather than copied, the first replica taking
+ *   them over so that they are kept once the set is freed
+ */
+CompactSet *compact_set_replicate(CompactSet *set, int node);
+
+/*
+ * Prints the page sizes and NUMA node of the memory holding the compact set
+ */
+void compact_set_report_memory(const CompactSet *set, const char *name);
+
+/*
+ * Frees memory allocated for the compact set
+ */
+void compact_set_free(CompactSet *set);
@@ -0,0 +1,453 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "control.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "hits.h"
+#include "stages.h"
+#include "stats.h"
+#include "top.h"
+#include "utils.h"
+
+#define MAX_COMMAND_LENGTH 1024
+// Keys printed by the top command when no count is given
+#define DEFAULT_TOP_COUNT 10
+
+/*
+ * Names of every list and how many of them were never found by a lookup
+ */
+typedef struct {
+  size_t names[MAX_LISTS];
+  size_t unused[MAX_LISTS];
+} NameCounts;
+
+/*
+ * Names of a list not found by a lookup since a time, printed by the unused command
+ */
+typedef struct {
+  ListMask list;
+  // Seconds since the epoch, 0 for the names never found
+  uint32_t since;
+  FILE *out;
+  size_t count;
+} UnusedNames;
+
+struct Control {
+  int socket;
+  char *path;
+  // Inode of the socket file, which a process taking over from this one replaces
+  ino_t inode;
+  pthread_t thread;
+  ControlContext *context;
+  atomic_bool stopping;
+  // Socket of the connection being served, -1 if there is none
+  atomic_int connection;
+};
+
+/*
+ * Finds a list by name, reporting unknown names to the client
+ */
+bool control_find_list(ControlContext *context, const char *name, FILE *out, AdListInfo **list) {
+  uint32_t id;
+  if (!name || !map_get(context->ad_lists->lists_map, name, &id) || !context->ad_lists->lists[id]) {
+    fprintf(out, "ERR unknown list %s\n", name ? name : "");
+    return false;
+  }
+  *list = context->ad_lists->lists[id];
+  return true;
+}
+
+/*
+ * Reports to the client that lists can't be changed if the filter has been made read-only
+ */
+bool control_check_mutable(ControlContext *context, FILE *out) {
+  if (!context->filter->domains) {
+    fprintf(out, "ERR the filter is read-only and can't be changed\n");
+    return false;
+  }
+  return true;
+}
+
+void control_lists(ControlContext *context, FILE *out) {
+  const AdListsInfo *ad_lists = context->ad_lists;
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    const AdListInfo *list = ad_lists->lists[id];
+    if (list) {
+      fprintf(out, "%s %s %s %zu domains %zu rules\n", list->name,
+          list->allow ? "allow" : "block",
+          list->active ? "active" : "inactive", list->domain_count, list->rule_count);
+    }
+  }
+  fprintf(out, "OK\n");
+}
+
+void control_enable(ControlContext *context, const char *name, bool enable, FILE *out) {
+  AdListInfo *list;
+  if (!control_find_list(context, name, out, &list) || !control_check_mutable(context, out)) {
+    return;
+  }
+  if (list->active == enable) {
+    fprintf(out, "OK %s is already %s\n", name, enable ? "enabled" : "disabled");
+    return;
+  }
+
+  if (enable) {
+    // Commands run with the lock of the lists held, which is released for the download like
+    // the refresher does, so that refreshes don't wait for curl. The list stays inactive
+    // until it's applied, so the refresher leaves it alone meanwhile.
+    AdListsInfo *ad_lists = context->ad_lists;
+    ParsedList *parsed;
+    pthread_mutex_unlock(&ad_lists->lock);
+    download_list(list, &parsed);
+    pthread_mutex_lock(&ad_lists->lock);
+    if (!apply_list_by_id(list->id, ad_lists, context->filter, parsed)) {
+      fprintf(out, "ERR failed to load %s\n", name);
+      return;
+    }
+  } else {
+    unload_list_by_id(list->id, context->ad_lists, context->filter);
+  }
+  list->active = enable;
+  fprintf(out, "OK %s %s\n", name, enable ? "enabled" : "disabled");
+}
+
+void control_change_domain(ControlContext *context, const char *domain, const char *name, bool add,
+    FILE *out) {
+  AdListInfo *list;
+  if (!domain) {
+    fprintf(out, "ERR missing domain\n");
+    return;
+  }
+  if (!control_find_list(context, name ? name : "custom_blocklist", out, &list)
+      || !control_check_mutable(context, out)) {
+    return;
+  }
+  if (!list->active) {
+    fprintf(out, "ERR %s is not active\n", list->name);
+    return;
+  }
+  if (strpbrk(domain, "*/")) {
+    fprintf(out, "ERR rules can only be loaded from list files\n");
+    return;
+  }
+
+  if (add) {
+    const bool added = add_list_domain(list, domain, context->filter);
+    fprintf(out, "OK %s %s %s\n", domain, added ? "added to" : "is already in", list->name);
+  } else {
+    const bool removed = remove_list_domain(list, domain, context->filter);
+    fprintf(out, "OK %s %s %s\n", domain, removed ? "removed from" : "is not in", list->name);
+  }
+}
+
+void control_policy(ControlContext *context, char *subnet, char *names, FILE *out) {
+  if (!subnet || !names) {
+    fprintf(out, "ERR usage: policy <subnet> <lists>\n");
+    return;
+  }
+  if (!policy_table_set(context->policies, subnet, names, context->ad_lists)) {
+    fprintf(out, "ERR invalid policy\n");
+    return;
+  }
+  fprintf(out, "OK\n");
+}
+
+void control_query(ControlContext *context, const char *domain, const char *client, FILE *out) {
+  struct in_addr addr;
+  if (!domain) {
+    fprintf(out, "ERR missing domain\n");
+    return;
+  }
+  if (inet_pton(AF_INET, client ? client : "127.0.0.1", &addr) != 1) {
+    fprintf(out, "ERR invalid client address %s\n", client);
+    return;
+  }
+
+  const ListMask policy_mask = policy_table_lookup(context->policies, ntohl(addr.s_addr));
+  const ListMask blocking = filter_lookup(context->filter, domain, policy_mask, false);
+  if (!blocking) {
+    fprintf(out, "OK %s is not blocked\n", domain);
+    return;
+  }
+
+  fprintf(out, "OK %s is blocked by", domain);
+  for (uint32_t id = 0; id < context->ad_lists->num_lists; id++) {
+    if (blocking & LIST_BIT(id)) {
+      fprintf(out, " %s", context->ad_lists->lists[id]->name);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+void control_stats(ControlContext *context, FILE *out) {
+  uint64_t totals[STAT_COUNT];
+  stats_collect(totals);
+  for (size_t stat = 0; stat < STAT_COUNT; stat++) {
+    fprintf(out, "%s %" PRIu64 "\n", stats_name(stat), totals[stat]);
+  }
+
+  const Filter *filter = context->filter;
+  fprintf(out, "domains %zu\n", filter_size(filter));
+  fprintf(out, "rules %zu\n", rules_count(atomic_load(&filter->rules)));
+  fprintf(out, "OK\n");
+}
+
+void control_stages(FILE *out) {
+  if (!stages_enabled()) {
+    fprintf(out, "ERR stage timing is disabled\n");
+    return;
+  }
+
+  StageTimes times;
+  stages_collect(&times);
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    fprintf(out, "%s %" PRIu64 " calls %" PRIu64 " avg_ns %" PRIu64 " max_ns\n", stage_name(stage),
+        times.count[stage], times.count[stage] ? times.total_ns[stage] / times.count[stage] : 0,
+        times.max_ns[stage]);
+  }
+  fprintf(out, "OK\n");
+}
+
+void control_top(const char *name, const char *count, FILE *out) {
+  if (!top_enabled()) {
+    fprintf(out, "ERR top tracking is disabled\n");
+    return;
+  }
+
+  TopStream stream;
+  if (!name || !top_find_stream(name, &stream)) {
+    fprintf(out, "ERR unknown stream %s\n", name ? name : "");
+    return;
+  }
+  char *end = NULL;
+  const unsigned long limit = count ? strtoul(count, &end, 10) : DEFAULT_TOP_COUNT;
+  if (count && (*end || end == count || limit > UINT32_MAX)) {
+    fprintf(out, "ERR invalid count %s\n", count);
+    return;
+  }
+
+  top_report(stream, (uint32_t) limit, out);
+  fprintf(out, "OK\n");
+}
+
+void control_count_names(const char *value, ListMask lists, const HitCounter *hits,
+    void *context) {
+  NameCounts *counts = context;
+  const bool unused = atomic_load_explicit(&hits->count, memory_order_relaxed) == 0;
+  while (lists) {
+    const int id = __builtin_ctzll(lists);
+    counts->names[id]++;
+    counts->unused[id] += unused;
+    lists &= lists - 1;
+  }
+}
+
+void control_hits(ControlContext *context, FILE *out) {
+  ListHits hits;
+  hits_collect(&hits);
+  NameCounts *counts = calloc(1, sizeof(NameCounts));
+  CHECK_ALLOC(counts);
+  filter_foreach(context->filter, control_count_names, counts);
+
+  const AdListsInfo *ad_lists = context->ad_lists;
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    if (ad_lists->lists[id]) {
+      fprintf(out, "%s %" PRIu64 " name_hits %" PRIu64 " rule_hits %zu names %zu unused\n",
+          ad_lists->lists[id]->name, hits.names[id], hits.rules[id], counts->names[id],
+          counts->unused[id]);
+    }
+  }
+  free(counts);
+  fprintf(out, "OK\n");
+}
+
+void control_print_unused(const char *value, ListMask lists, const HitCounter *hits,
+    void *context) {
+  UnusedNames *unused = context;
+  if (!(lists & unused->list)) {
+    return;
+  }
+  const uint32_t count = atomic_load_explicit(&hits->count, memory_order_relaxed);
+  const uint32_t last = atomic_load_explicit(&hits->last, memory_order_relaxed);
+  if (unused->since ? last < unused->since : count == 0) {
+    fprintf(unused->out, "%s %" PRIu32 " %" PRIu32 "\n", value, count, last);
+    unused->count++;
+  }
+}
+
+void control_unused(ControlContext *context, const char *name, const char *since, FILE *out) {
+  AdListInfo *list;
+  if (!control_find_list(context, name, out, &list)) {
+    return;
+  }
+  char *end = NULL;
+  const unsigned long long seconds = since ? strtoull(since, &end, 10) : 0;
+  if (since && (*end || end == since || seconds > UINT32_MAX)) {
+    fprintf(out, "ERR invalid time %s\n", since);
+    return;
+  }
+
+  UnusedNames unused = { LIST_BIT(list->id), (uint32_t) seconds, out, 0 };
+  filter_foreach(context->filter, control_print_unused, &unused);
+  fprintf(out, "OK %zu names\n", unused.count);
+}
+
+void control_execute(ControlContext *context, char *line, FILE *out) {
+  char *save;
+  char *command = strtok_r(line, " \t\r\n", &save);
+  char *first = strtok_r(NULL, " \t\r\n", &save);
+  char *second = strtok_r(NULL, " \t\r\n", &save);
+  if (!command) {
+    return;
+  }
+
+  if (!strcmp(command, "lists")) {
+    control_lists(context, out);
+  } else if (!strcmp(command, "enable") || !strcmp(command, "disable")) {
+    control_enable(context, first, !strcmp(command, "enable"), out);
+  } else if (!strcmp(command, "add") || !strcmp(command, "remove")) {
+    control_change_domain(context, first, second, !strcmp(command, "add"), out);
+  } else if (!strcmp(command, "policy")) {
+    control_policy(context, first, second, out);
+  } else if (!strcmp(command, "query")) {
+    control_query(context, first, second, out);
+  } else if (!strcmp(command, "stats")) {
+    control_stats(context, out);
+  } else if (!strcmp(command, "stages")) {
+    control_stages(out);
+  } else if (!strcmp(command, "top")) {
+    control_top(first, second, out);
+  } else if (!strcmp(command, "hits")) {
+    control_hits(context, out);
+  } else if (!strcmp(command, "unused")) {
+    control_unused(context, first, second, out);
+  } else {
+    fprintf(out, "ERR unknown command %s\n", command);
+  }
+}
+
+void control_serve(Control *control, int connection) {
+  FILE *in = fdopen(connection, "r");
+  FILE *out = fdopen(dup(connection), "w");
+  if (!in || !out) {
+    fprintf(stderr, "[Control] Failed to open connection streams with error: %d\n", errno);
+    if (in) {
+      fclose(in);
+    } else {
+      close(connection);
+    }
+    if (out) {
+      fclose(out);
+    }
+    return;
+  }
+
+  char line[MAX_COMMAND_LENGTH];
+  while (fgets(line, sizeof(line), in)) {
+    pthread_mutex_lock(&control->context->ad_lists->lock);
+    control_execute(control->context, line, out);
+    pthread_mutex_unlock(&control->context->ad_lists->lock);
+    fflush(out);
+  }
+  fclose(out);
+  fclose(in);
+}
+
+void *control_thread(void *argument) {
+  Control *control = argument;
+  while (!atomic_load(&control->stopping)) {
+    const int connection = accept(control->socket, NULL, NULL);
+    if (connection == -1) {
+      if (errno != EINTR && !atomic_load(&control->stopping)) {
+        fprintf(stderr, "[Control] Failed to accept connection with error: %d\n", errno);
+      }
+      continue;
+    }
+
+    atomic_store(&control->connection, connection);
+    control_serve(control, connection);
+    atomic_store(&control->connection, -1);
+  }
+  return NULL;
+}
+
+Control *control_start(const char *path, ControlContext *context) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[Control] Socket path %s is too long!\n", path);
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == -1) {
+    fprintf(stderr, "[Control] Failed to create socket with error: %d\n", errno);
+    return NULL;
+  }
+
+  // Replace the socket left behind by a previous run
+  unlink(path);
+  if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(s, 4) == -1) {
+    fprintf(stderr, "[Control] Failed to listen on %s with error: %d\n", path, errno);
+    close(s);
+    return NULL;
+  }
+
+  Control *control = malloc(sizeof(Control));
+  CHECK_ALLOC(control);
+  control->socket = s;
+  control->path = malloc(strlen(path) + 1);
+  CHECK_ALLOC(control->path);
+  strcpy(control->path, path);
+  struct stat status;
+  control->inode = stat(path, &status) == 0 ? status.st_ino : 0;
+  control->context = context;
+  atomic_init(&control->stopping, false);
+  atomic_init(&control->connection, -1);
+
+  // Clients closing their connection early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!start_thread(&control->thread, control_thread, control)) {
+    fprintf(stderr, "[Control] Failed to start control thread!\n");
+    close(s);
+    unlink(path);
+    free(control->path);
+    free(control);
+    return NULL;
+  }
+
+  printf("[Control] Listening for commands on %s...\n", path);
+  return control;
+}
+
+void control_stop(Control *control) {
+  atomic_store(&control->stopping, true);
+  shutdown(control->socket, SHUT_RDWR);
+  const int connection = atomic_load(&control->connection);
+  if (connection != -1) {
+    shutdown(connection, SHUT_RDWR);
+  }
+  pthread_join(control->thread, NULL);
+
+  close(control->socket);
+  struct stat status;
+  if (stat(control->path, &status) == 0 && status.st_ino == control->inode) {
+    unlink(control->path);
+  }
+  free(control->path);
+  free(control);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "ad_list.h"
+#include "filter.h"
+#include "policy.h"
+
+typedef struct Control Control;
+
+/*
+ * State changed by the control commands while the server is running
+ */
+typedef struct {
+  AdListsInfo *ad_lists;
+  Filter *filter;
+  PolicyTable *policies;
+} ControlContext;
+
+/*
+ * - Starts a thread serving control commands on a Unix domain socket bound to path
+ * - Each line sent to the socket is a command, answered by lines of output ending with a line
+ *   starting with "OK" or "ERR":
+ *     lists                      lists all filters and whether they are active
+ *     enable <list>              loads a list and starts filtering with it
+ *     disable <list>             stops filtering with a list and unloads it
+ *     add <domain> [list]        adds a domain to a list, custom_blocklist by default
+ *     remove <domain> [list]     removes a domain from a list, custom_blocklist by default
+ *     policy <subnet> <lists>    sets the lists filtering a subnet, as in the policy file
+ *     query <domain> [client]    prints the verdict for a domain queried by a client
+ *     stats                      prints the query counters and the filter sizes
+ *     stages                     prints the time spent in each stage of the requests
+ *     top <stream> [count]       prints the most frequent keys of a stream, one of clients,
+ *                                blocked, forwarded, cached or local, with their counts
+ *     hits                       prints the lookups decided by each list by name and by rule,
+ *                                and how many of its names were never found
+ *     unused <list> [time]       prints the names of a list not found since a time in seconds
+ *                                since the epoch, or never found, with their hit count and the
+ *                                time of their latest hit
+ * - Returns NULL on failure
+ */
+Control *control_start(const char *path, ControlContext *context);
+
+/*
+ * Stops the control thread, closes the socket and removes it from the file system, unless
+ * another process has replaced it
+ */
+void control_stop(Control *control);
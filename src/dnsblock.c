@@ -1,69 +1,187 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "ad_list.h"
+#include "cache.h"
+#include "control.h"
+#include "handoff.h"
+#include "loader.h"
+#include "local_zone.h"
+#include "policy.h"
+#include "refresh.h"
+#include "replay.h"
+#include "stages.h"
+#include "stats.h"
+#include "top.h"
 #include "udp_server.h"
 #include "utils.h"
 
+// Seconds for which clients may cache the answers to blocked queries
+#define BLOCKED_TTL 280
+// Seconds for which the answers of the stub upstream used by replays can be cached
+#define STUB_UPSTREAM_TTL 300
+
 typedef struct {
   ProgramOptions options;
-  Set *domain_set;
+  Filter *filter;
+  PolicyTable *policies;
+  LocalZones *local_zones;
+  BlockTemplates block_templates;
+  // Upstream responses, NULL if caching is disabled
+  ResponseCache *cache;
+  // Whether every request is logged, which replays turn off to run at full speed
+  bool log_requests;
+  // Answers standing in for the upstream provider when replaying, NULL otherwise
+  const BlockTemplates *stub_upstream;
 } HandlerContext;
 
-void generate_localhost_response(Message *message, const uint16_t transaction_id, const size_t name_size, const uint8_t *name) {
-  size_t message_length = 32 + name_size;
-  message->length = message_length;
-  
-  uint8_t *data = message->data;
-  *((uint16_t *)data) = transaction_id; // To match up the response with the request
-  data[2] = 0x81; // Response flags
-  data[3] = 0x80;
-  data[5] = 0x1; // One query contained
-  data[7] = 0x1; // One response contained
-  memcpy(data+12, name, name_size); // Domain name
-  size_t offset = 12 + name_size;
-  data[offset + 1] = 0x01; // A record type
-  data[offset + 3] = 0x01; // IN record class
-  data[offset + 4] = 0xc0; // Response start, pointer to domain name
-  data[offset + 5] = 0x0c;
-  data[offset + 7] = 0x01; // A
-  data[offset + 9] = 0x01; // IN
-  data[offset + 12] = 0x01; // TTL
-  data[offset + 13] = 0x18;
-  data[offset + 15] = 4; // IP length
-  // Using 0.0.0.0 for the IP as it's non-routable
-}
+typedef struct {
+  // Requests of the last batch, whose names were looked up ahead of handling them
+  const Message *messages;
+  size_t count;
+  // Question names of the requests, NULL if they have none or the request was handled, each
+  // freed by the handler of its request
+  char *domains[MAX_BATCH];
+  const LocalName *local[MAX_BATCH];
+  bool blocked[MAX_BATCH];
+} RequestBatch;
+
+_Thread_local RequestBatch current_batch;
 
-bool handle_server_request(UDPServer *server, const Message *request, Message *response, void *context) {
+void handle_server_batch(UDPServer *server, Message *messages, size_t count, void *context) {
   HandlerContext *hcontext = (HandlerContext *) context;
+  RequestBatch *batch = &current_batch;
+  for (size_t i = 0; i < batch->count; i++) {
+    free(batch->domains[i]);
+  }
+  batch->messages = messages;
+  batch->count = count;
 
   size_t name_length;
-  char *domain = parse_dns_domain(request, &name_length);
-
-  Set *domain_set = hcontext->domain_set;
-  bool ad_domain = set_contains(domain_set, domain);
-  if (ad_domain) {
-    printf("Blocking DNS request: %s\n", domain);
-    uint16_t transaction_id = *((uint16_t *) request->data);
-    generate_localhost_response(response, transaction_id, name_length, request->data+QUESTION_START_BYTE);
+  for (size_t i = 0; i < count; i++) {
+    batch->domains[i] = parse_dns_domain(&messages[i], &name_length);
+  }
+  stage_end(STAGE_PARSE);
+
+  // The names which aren't local are looked up in the lists together
+  const char *names[MAX_BATCH];
+  ListMask policy_masks[MAX_BATCH];
+  ListMask blocked[MAX_BATCH];
+  size_t indices[MAX_BATCH];
+  size_t lookups = 0;
+  for (size_t i = 0; i < count; i++) {
+    const char *domain = batch->domains[i];
+    batch->local[i] = domain ? local_zones_lookup(hcontext->local_zones, domain) : NULL;
+    batch->blocked[i] = false;
+    if (domain && !batch->local[i]) {
+      names[lookups] = domain;
+      policy_masks[lookups] = policy_table_lookup(hcontext->policies,
+          ntohl(messages[i].sender.address));
+      indices[lookups++] = i;
+    }
+  }
+  filter_lookup_batch(hcontext->filter, names, policy_masks, lookups, true, blocked);
+  for (size_t i = 0; i < lookups; i++) {
+    batch->blocked[indices[i]] = blocked[i];
+  }
+  stage_end(STAGE_LOOKUP);
+}
+
+bool handle_server_request(UDPServer *server, Message *message, void *context) {
+  HandlerContext *hcontext = (HandlerContext *) context;
+  RequestBatch *batch = &current_batch;
+
+  char *domain;
+  const LocalName *local;
+  bool ad_domain;
+  if (batch->messages && message >= batch->messages && message < batch->messages + batch->count) {
+    // The request was parsed and looked up with its batch
+    const size_t index = message - batch->messages;
+    domain = batch->domains[index];
+    batch->domains[index] = NULL;
+    local = batch->local[index];
+    ad_domain = batch->blocked[index];
+    stage_end(STAGE_PARSE);
+    stage_end(STAGE_LOOKUP);
   } else {
-    printf("Forwarding DNS request: %s\n", domain);
-    UDPClient *client = server_getclient(server);
+    size_t name_length;
+    domain = parse_dns_domain(message, &name_length);
+    stage_end(STAGE_PARSE);
 
-    // Create external request by copying request data and sending to external provider
-    Message forwarded_request = { .length = request->length };
-    set_message_address(&forwarded_request.recipient, DEFAULT_DNS_PORT, hcontext->options.provider_address);
-    memcpy(forwarded_request.data, request->data, forwarded_request.length);
+    // Local names are answered without consulting the lists or the upstream provider, only the
+    // lists selected by the client's policy can block other names
+    local = domain ? local_zones_lookup(hcontext->local_zones, domain) : NULL;
+    ListMask policy_mask = policy_table_lookup(hcontext->policies, ntohl(message->sender.address));
+    ad_domain = !local && domain && filter_lookup(hcontext->filter, domain, policy_mask, true);
+    stage_end(STAGE_LOOKUP);
+  }
 
-    // Send request and write response
-    client_send(client, &forwarded_request, response);
-    server_returnclient(server, client);
+  bool respond = true;
+  Stat verdict;
+  if (local) {
+    if (hcontext->log_requests) {
+      printf("Answering DNS request locally: %s\n", domain);
+      stage_end(STAGE_LOG);
+    }
+    verdict = STAT_LOCAL;
+    respond = local_zones_apply(local, message);
+    stage_end(STAGE_RESPOND);
+  } else if (ad_domain) {
+    if (hcontext->log_requests) {
+      printf("Blocking DNS request: %s\n", domain);
+      stage_end(STAGE_LOG);
+    }
+    verdict = STAT_BLOCKED;
+    respond = block_templates_apply(&hcontext->block_templates, message);
+    stage_end(STAGE_RESPOND);
+  } else {
+    CacheKey key;
+    const uint32_t shard = server_worker_id(server);
+    const bool cacheable = hcontext->cache && cache_key(message, &key);
+    const bool cached = cacheable && cache_lookup(hcontext->cache, shard, &key, message);
+    stage_end(STAGE_RESPOND);
+    if (cached) {
+      if (hcontext->log_requests) {
+        printf("Answering DNS request from cache: %s\n", domain ? domain : ".");
+        stage_end(STAGE_LOG);
+      }
+      verdict = STAT_CACHED;
+    } else {
+      if (hcontext->log_requests) {
+        printf("Forwarding DNS request: %s\n", domain ? domain : ".");
+        stage_end(STAGE_LOG);
+      }
+      verdict = STAT_FORWARDED;
+
+      if (hcontext->stub_upstream) {
+        respond = block_templates_apply(hcontext->stub_upstream, message);
+      } else {
+        UDPClient *client = server_getclient(server);
+
+        // Send the request to the external provider and receive its response in its place,
+        // leaving the client to retry if the provider failed
+        const Address sender = message->sender;
+        set_message_address(&message->recipient, DEFAULT_DNS_PORT, hcontext->options.provider_address);
+        respond = client_send(client, message, message);
+        message->recipient = sender;
+        server_returnclient(server, client);
+      }
+
+      if (respond && cacheable) {
+        cache_store(hcontext->cache, shard, &key, message);
+      }
+      stage_end(STAGE_FORWARD);
+    }
   }
 
+  stats_increment(verdict);
+  top_record(ntohl(message->sender.address), verdict, domain);
+  STAGE_PROBE3(request, domain ? domain : ".", verdict, respond);
   free(domain);
 
-  return true;
+  return respond;
 }
 
 int main(int argc, char **argv) {
@@ -72,23 +190,150 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  AdListsInfo *lists_info = create_default_adlists_info(options.disable_defaults, options.blocklist, options.whitelist);
-  Set *domain_set = set_new();
-  load_active_lists(lists_info, domain_set);
+  // Replays keep the fixed default seed, so that table layouts and cache evictions repeat
+  if (!options.replay) {
+    hash_init();
+  }
+  memory_configure(options.page_mode);
+  if (options.stage_timing || options.slow_query_us || options.replay) {
+    stages_enable((uint64_t) options.slow_query_us * 1000);
+  }
+  if (options.top_capacity) {
+    top_enable(options.top_capacity);
+  }
 
-  HandlerContext context = { options, domain_set };
+  AdListsInfo *lists_info = create_adlists_info(options.catalog, options.disable_defaults,
+      options.blocklist, options.whitelist);
+  if (!lists_info) {
+    fprintf(stderr, "Failed to load the list catalog.\n");
+    return EXIT_FAILURE;
+  }
+  // Unless the server waits for them, the lists are loaded while it serves with a stand-in
+  Filter *filter = filter_new();
+  ListLoader *loader = NULL;
+  if (options.startup == STARTUP_WAIT || options.replay) {
+    loader_run(lists_info, filter, &options);
+  } else {
+    loader = loader_start(lists_info, filter, &options);
+  }
+
+  PolicyTable *policies = policy_table_new(adlists_block_mask(lists_info));
+  if (options.policies && !policy_table_load(policies, options.policies, lists_info)) {
+    fprintf(stderr, "Failed to load client policies from %s.\n", options.policies);
+    return EXIT_FAILURE;
+  }
+
+  LocalZones *local_zones = local_zones_new();
+  if (options.local_zones && !local_zones_load(local_zones, options.local_zones)) {
+    fprintf(stderr, "Failed to load local zones from %s.\n", options.local_zones);
+    return EXIT_FAILURE;
+  }
+  if (!local_zones_finish(local_zones)) {
+    return EXIT_FAILURE;
+  }
+
+  HandlerContext context = { options, filter, policies, local_zones };
+  block_templates_init(&context.block_templates, options.block_mode, BLOCKED_TTL);
+  context.log_requests = true;
+
+  if (options.replay) {
+    // Replay the capture on this thread against a stub upstream, with a cold cache
+    BlockTemplates stub_upstream;
+    block_templates_init(&stub_upstream, BLOCK_MODE_ZERO, STUB_UPSTREAM_TTL);
+    context.log_requests = false;
+    context.stub_upstream = &stub_upstream;
+    context.cache = cache_new(1, options.cache_size);
+
+    const bool replayed = replay_run(options.replay, options.replay_passes, handle_server_request,
+        handle_server_batch, &context);
+
+    cache_free(context.cache);
+    free_adlists(lists_info);
+    filter_free(filter);
+    policy_table_free(policies);
+    local_zones_free(local_zones);
+    return replayed ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // A running process keeps serving on the sockets taken over from it until this one is ready
+  Handoff *handoff = handoff_new(options.handoff_socket);
+  int sockets[MAX_WORKERS];
+  const uint32_t socket_count = handoff_inherit(handoff, sockets);
 
   UDPServerConfig config = {
-    .port    = options.server_port,
-    .address = options.server_address
+    .port           = options.server_port,
+    .address        = options.server_address,
+    .io_backend     = options.io_backend,
+    .workers        = options.workers,
+    .processes      = options.prefork,
+    .query_limit    = options.query_limit,
+    .response_limit = options.response_limit,
+    .sockets        = socket_count ? sockets : NULL,
+    .socket_count   = socket_count,
+    .doh = {
+      .port         = options.doh_port,
+      .address      = options.server_address,
+      .certificate  = options.doh_certificate,
+      .key          = options.doh_key
+    }
   };
 
+  // Once the server is running, lists are changed by the control and refresh threads
+  ControlContext control_context = { lists_info, filter, policies };
+  Control *control = NULL;
+  if (options.control_socket) {
+    control = control_start(options.control_socket, &control_context);
+    if (!control) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  Refresher *refresher = refresher_start(lists_info, filter);
+
   UDPServer *server = server_create(&config);
-  server_run(server, handle_server_request, &context);
+  if (!server) {
+    return EXIT_FAILURE;
+  }
+
+  // Each worker caches into its own shard, the snapshot warms all of them, unless the cache of
+  // the process taken over from is more recent. Worker processes share a single cache.
+  context.cache = options.prefork
+      ? cache_new_shared(options.cache_size)
+      : cache_new(server_worker_count(server), options.cache_size);
+  // The running process keeps serving with its lists until this one has loaded its own
+  if (handoff_has_predecessor(handoff)) {
+    loader_wait(loader);
+  }
+  if (!handoff_ready(handoff, context.cache) && context.cache && options.cache_snapshot) {
+    cache_load(context.cache, options.cache_snapshot);
+  }
+  if (options.handoff_socket) {
+    handoff_listen(handoff, server);
+  }
+
+  server_run(server, handle_server_request, handle_server_batch, &context);
+  handoff_finish(handoff, context.cache);
   server_destroy(server);
+  if (context.cache && options.cache_snapshot) {
+    cache_save(context.cache, options.cache_snapshot);
+  }
+  cache_free(context.cache);
+  loader_finish(loader);
+  if (refresher) {
+    refresher_stop(refresher);
+  }
+  if (control) {
+    control_stop(control);
+  }
+  // Lists changed since they were loaded are saved for the next start
+  if (options.lists_snapshot) {
+    save_lists_snapshot(lists_info, filter, options.lists_snapshot);
+  }
 
   free_adlists(lists_info);
-  set_free_vals(domain_set);
+  filter_free(filter);
+  policy_table_free(policies);
+  local_zones_free(local_zones);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+
+#include "doh.h"
+
+#include <stdio.h>
+
+#ifdef HAVE_DOH
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nghttp2/nghttp2.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "utils.h"
+
+// Connections served at once, further ones are closed as soon as they are accepted
+#define MAX_DOH_CONNECTIONS 1024
+#define MAX_DOH_EVENTS 64
+// Streams a client may have open at once on a connection
+#define MAX_CONCURRENT_STREAMS 100
+// Bytes of TLS records read at once
+#define DOH_READ_SIZE 16384
+// Bytes of frames gathered before they are written, so that responses to the queries read
+// together leave in as few TLS records and writes as possible
+#define DOH_WRITE_SIZE 32768
+// Largest frame nghttp2 sends, with the default maximum frame size and the frame header
+#define MAX_DOH_FRAME (16384 + 9)
+// Seconds a connection may stay idle before it's closed
+#define DOH_IDLE_TIMEOUT 120
+#define DOH_PATH "/dns-query"
+// Longest path of a GET request, holding a query of MAX_MESSAGE_LENGTH bytes in base64url
+#define MAX_DOH_PATH 1024
+#define DOH_CONTENT_TYPE "application/dns-message"
+#define DOH_SESSION_CONTEXT "dnsblocker"
+
+struct DoHListener {
+  int socket;
+  SSL_CTX *tls;
+  nghttp2_session_callbacks *callbacks;
+};
+
+typedef struct DoHStream {
+  // Status of the error response, 0 while the request is valid
+  int status;
+  bool post;
+  bool has_method;
+  // Path of the request, holding the query of GET requests
+  char path[MAX_DOH_PATH];
+  size_t path_length;
+  // Query from the body of POST requests or the path of GET requests, then the response
+  Message message;
+  size_t sent;
+  char content_length[8];
+  // Open streams of the connection, which are freed with it if it closes before they do
+  struct DoHStream *previous;
+  struct DoHStream *next;
+} DoHStream;
+
+typedef struct DoHConnection {
+  int fd;
+  SSL *ssl;
+  nghttp2_session *session;
+  Address peer;
+  time_t active_at;
+  // Frames not written yet
+  uint8_t output[DOH_WRITE_SIZE];
+  size_t output_length;
+  bool writing;
+  DoHStream *streams;
+  struct DoHLoop *loop;
+  struct DoHConnection *previous;
+  struct DoHConnection *next;
+} DoHConnection;
+
+typedef struct DoHLoop {
+  DoHListener *listener;
+  int epoll;
+  DoHHandler handler;
+  void *context;
+  DoHConnection *connections;
+  size_t connection_count;
+} DoHLoop;
+
+bool doh_supported(void) {
+  return true;
+}
+
+/*
+ * Selects HTTP/2 among the protocols offered by a client, as DNS over HTTPS needs no other
+ */
+int doh_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+    const unsigned char *in, unsigned int in_length, void *argument) {
+  for (unsigned int i = 0; i < in_length; i += in[i] + 1) {
+    if (in[i] == 2 && i + 3 <= in_length && !memcmp(in + i + 1, "h2", 2)) {
+      *out = in + i + 1;
+      *out_length = 2;
+      return SSL_TLSEXT_ERR_OK;
+    }
+  }
+  return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+/*
+ * Decodes unpadded base64url into at most max bytes, returning the decoded length or -1
+ */
+int doh_decode_base64url(const char *text, size_t length, uint8_t *out, size_t max) {
+  uint32_t bits = 0;
+  int bit_count = 0;
+  size_t decoded = 0;
+  for (size_t i = 0; i < length; i++) {
+    const char c = text[i];
+    uint32_t value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '-') {
+      value = 62;
+    } else if (c == '_') {
+      value = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return -1;
+    }
+    bits = (bits << 6) | value;
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      if (decoded == max) {
+        return -1;
+      }
+      out[decoded++] = (uint8_t) (bits >> bit_count);
+    }
+  }
+  return (int) decoded;
+}
+
+/*
+ * Reads the query of a GET request from the dns parameter of its path, returning the status
+ * of the error response if it has none
+ */
+int doh_read_get_query(DoHStream *stream) {
+  const char *query = strchr(stream->path, '?');
+  const char *parameter = NULL;
+  for (const char *cursor = query; cursor; cursor = strchr(cursor + 1, '&')) {
+    if (!strncmp(cursor + 1, "dns=", 4)) {
+      parameter = cursor + 5;
+      break;
+    }
+  }
+  if (!parameter) {
+    return 400;
+  }
+  const size_t text_length = strcspn(parameter, "&");
+  if (text_length > (MAX_MESSAGE_LENGTH * 4 + 2) / 3) {
+    return 414;
+  }
+  const int length = doh_decode_base64url(parameter, text_length, stream->message.data,
+      MAX_MESSAGE_LENGTH);
+  if (length < QUESTION_START_BYTE) {
+    return 400;
+  }
+  stream->message.length = (size_t) length;
+  return 0;
+}
+
+int doh_begin_headers(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+  // Headers following the request headers of a stream are trailers, which carry nothing used
+  if (frame->hd.type != NGHTTP2_HEADERS
+      || nghttp2_session_get_stream_user_data(session, frame->hd.stream_id)) {
+    return 0;
+  }
+  DoHConnection *connection = user_data;
+  DoHStream *stream = calloc(1, sizeof(DoHStream));
+  CHECK_ALLOC(stream);
+  stream->next = connection->streams;
+  if (connection->streams) {
+    connection->streams->previous = stream;
+  }
+  connection->streams = stream;
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+  return 0;
+}
+
+/*
+ * Compares a header name or value to a null terminated string
+ */
+bool doh_header_is(const uint8_t *text, size_t length, const char *expected) {
+  return length == strlen(expected) && !memcmp(text, expected, length);
+}
+
+int doh_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+    size_t name_length, const uint8_t *value, size_t value_length, uint8_t flags,
+    void *user_data) {
+  DoHStream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!stream || stream->status) {
+    return 0;
+  }
+
+  if (doh_header_is(name, name_length, ":method")) {
+    stream->has_method = true;
+    if (doh_header_is(value, value_length, "POST")) {
+      stream->post = true;
+    } else if (!doh_header_is(value, value_length, "GET")) {
+      stream->status = 405;
+    }
+  } else if (doh_header_is(name, name_length, ":path")) {
+    if (value_length >= MAX_DOH_PATH) {
+      stream->status = 414;
+      return 0;
+    }
+    memcpy(stream->path, value, value_length);
+    stream->path[value_length] = '\0';
+    stream->path_length = value_length;
+  } else if (doh_header_is(name, name_length, "content-type")
+      && !doh_header_is(value, value_length, DOH_CONTENT_TYPE)) {
+    stream->status = 415;
+  }
+  return 0;
+}
+
+int doh_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+    const uint8_t *data, size_t length, void *user_data) {
+  DoHStream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (!stream || stream->status) {
+    return 0;
+  }
+  if (stream->message.length + length > MAX_MESSAGE_LENGTH) {
+    stream->status = 413;
+    return 0;
+  }
+  memcpy(stream->message.data + stream->message.length, data, length);
+  stream->message.length += length;
+  return 0;
+}
+
+ssize_t doh_read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buffer,
+    size_t length, uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
+  DoHStream *stream = source->ptr;
+  size_t remaining = stream->message.length - stream->sent;
+  if (remaining > length) {
+    remaining = length;
+  }
+  memcpy(buffer, stream->message.data + stream->sent, remaining);
+  stream->sent += remaining;
+  if (stream->sent == stream->message.length) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return (ssize_t) remaining;
+}
+
+#define DOH_HEADER(name, value) \
+  { (uint8_t *) (name), (uint8_t *) (value), sizeof(name) - 1, strlen(value), \
+    NGHTTP2_NV_FLAG_NONE }
+
+/*
+ * Answers a complete request, passing its query to the handler
+ */
+void doh_answer(DoHConnection *connection, int32_t stream_id, DoHStream *stream) {
+  nghttp2_session *session = connection->session;
+  const bool valid_path = stream->path_length >= sizeof(DOH_PATH) - 1
+      && !memcmp(stream->path, DOH_PATH, sizeof(DOH_PATH) - 1)
+      && (stream->path[sizeof(DOH_PATH) - 1] == '\0' || stream->path[sizeof(DOH_PATH) - 1] == '?');
+  if (!stream->status && !valid_path) {
+    stream->status = 404;
+  }
+  if (!stream->status && !stream->has_method) {
+    stream->status = 400;
+  }
+  if (!stream->status && !stream->post) {
+    stream->status = doh_read_get_query(stream);
+  }
+  if (!stream->status && stream->message.length < QUESTION_START_BYTE) {
+    stream->status = 400;
+  }
+
+  if (stream->status) {
+    char status[4];
+    snprintf(status, sizeof(status), "%d", stream->status);
+    const nghttp2_nv headers[] = { DOH_HEADER(":status", status) };
+    nghttp2_submit_response(session, stream_id, headers, 1, NULL);
+    return;
+  }
+
+  stream->message.sender = connection->peer;
+  if (!connection->loop->handler(&stream->message, connection->loop->context)) {
+    nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_REFUSED_STREAM);
+    return;
+  }
+
+  snprintf(stream->content_length, sizeof(stream->content_length), "%zu",
+      stream->message.length);
+  const nghttp2_nv headers[] = {
+    DOH_HEADER(":status", "200"),
+    DOH_HEADER("content-type", DOH_CONTENT_TYPE),
+    DOH_HEADER("content-length", stream->content_length)
+  };
+  nghttp2_data_provider body = { .source.ptr = stream, .read_callback = doh_read_body };
+  nghttp2_submit_response(session, stream_id, headers, sizeof(headers) / sizeof(headers[0]),
+      &body);
+}
+
+int doh_frame_received(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+      || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  DoHStream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (stream) {
+    doh_answer(user_data, frame->hd.stream_id, stream);
+  }
+  return 0;
+}
+
+int doh_stream_closed(nghttp2_session *session, int32_t stream_id, uint32_t error_code,
+    void *user_data) {
+  DoHConnection *connection = user_data;
+  DoHStream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (!stream) {
+    return 0;
+  }
+  if (stream->previous) {
+    stream->previous->next = stream->next;
+  } else {
+    connection->streams = stream->next;
+  }
+  if (stream->next) {
+    stream->next->previous = stream->previous;
+  }
+  free(stream);
+  nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+  return 0;
+}
+
+DoHListener *doh_listen(const DoHConfig *config) {
+  // Writes to connections closed by their clients have to fail instead of killing the process
+  signal(SIGPIPE, SIG_IGN);
+
+  SSL_CTX *tls = SSL_CTX_new(TLS_server_method());
+  if (!tls) {
+    fprintf(stderr, "[DoH] Failed to create the TLS context!\n");
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(tls, TLS1_2_VERSION);
+  SSL_CTX_set_options(tls, SSL_OP_NO_COMPRESSION | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_mode(tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_read_ahead(tls, 1);
+  if (SSL_CTX_use_certificate_chain_file(tls, config->certificate) != 1
+      || SSL_CTX_use_PrivateKey_file(tls, config->key, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(tls) != 1) {
+    fprintf(stderr, "[DoH] Failed to load the certificate %s and key %s: %s\n",
+        config->certificate, config->key, ERR_error_string(ERR_get_error(), NULL));
+    SSL_CTX_free(tls);
+    return NULL;
+  }
+  SSL_CTX_set_alpn_select_cb(tls, doh_select_protocol, NULL);
+  // Returning clients resume their sessions with a ticket, or by id from the session cache,
+  // skipping the key exchange and certificate of a full handshake
+  SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(tls, (const unsigned char *) DOH_SESSION_CONTEXT,
+      sizeof(DOH_SESSION_CONTEXT) - 1);
+
+  const int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (s == -1) {
+    fprintf(stderr, "[DoH] Failed to create socket with error: %d\n", errno);
+    SSL_CTX_free(tls);
+    return NULL;
+  }
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(config->port),
+    .sin_addr.s_addr = config->address ? inet_addr(config->address) : htonl(INADDR_ANY)
+  };
+  const int enable = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+  if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(s, SOMAXCONN) == -1) {
+    fprintf(stderr, "[DoH] Failed to listen on port %d with error: %d\n", config->port, errno);
+    close(s);
+    SSL_CTX_free(tls);
+    return NULL;
+  }
+
+  DoHListener *listener = malloc(sizeof(DoHListener));
+  CHECK_ALLOC(listener);
+  listener->socket = s;
+  listener->tls = tls;
+  nghttp2_session_callbacks_new(&listener->callbacks);
+  CHECK_ALLOC(listener->callbacks);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(listener->callbacks, doh_begin_headers);
+  nghttp2_session_callbacks_set_on_header_callback(listener->callbacks, doh_header);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(listener->callbacks, doh_data_chunk);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(listener->callbacks, doh_frame_received);
+  nghttp2_session_callbacks_set_on_stream_close_callback(listener->callbacks, doh_stream_closed);
+  printf("[DoH] Serving DNS over HTTPS on port %d...\n", config->port);
+  return listener;
+}
+
+void doh_close(DoHLoop *loop, DoHConnection *connection) {
+  if (connection->previous) {
+    connection->previous->next = connection->next;
+  } else {
+    loop->connections = connection->next;
+  }
+  if (connection->next) {
+    connection->next->previous = connection->previous;
+  }
+  loop->connection_count--;
+
+  // Deleting a session doesn't close its streams
+  if (connection->session) {
+    nghttp2_session_del(connection->session);
+  }
+  while (connection->streams) {
+    DoHStream *next = connection->streams->next;
+    free(connection->streams);
+    connection->streams = next;
+  }
+  SSL_free(connection->ssl);
+  close(connection->fd);
+  free(connection);
+}
+
+void doh_accept(DoHLoop *loop) {
+  for (;;) {
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    const int fd = accept4(loop->listener->socket, (struct sockaddr *) &addr, &addr_length,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    if (loop->connection_count == MAX_DOH_CONNECTIONS) {
+      close(fd);
+      continue;
+    }
+    const int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    DoHConnection *connection = calloc(1, sizeof(DoHConnection));
+    CHECK_ALLOC(connection);
+    connection->fd = fd;
+    connection->ssl = SSL_new(loop->listener->tls);
+    CHECK_ALLOC(connection->ssl);
+    SSL_set_fd(connection->ssl, fd);
+    SSL_set_accept_state(connection->ssl);
+    connection->peer = (Address) { .port = addr.sin_port, .address = addr.sin_addr.s_addr };
+    connection->active_at = time(NULL);
+    connection->loop = loop;
+    connection->next = loop->connections;
+    if (loop->connections) {
+      loop->connections->previous = connection;
+    }
+    loop->connections = connection;
+    loop->connection_count++;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+/*
+ * - Writes the frames of a connection, gathering them into as few TLS records as possible,
+ *   and waits for the socket to be writable if it's full
+ * - Returns false if the connection failed
+ */
+bool doh_flush(DoHConnection *connection) {
+  for (;;) {
+    // Gather frames while the largest one still fits, as nghttp2 can't take a frame back
+    while (DOH_WRITE_SIZE - connection->output_length >= MAX_DOH_FRAME) {
+      const uint8_t *data;
+      const ssize_t length = nghttp2_session_mem_send(connection->session, &data);
+      if (length < 0) {
+        return false;
+      }
+      if (length == 0) {
+        break;
+      }
+      memcpy(connection->output + connection->output_length, data, length);
+      connection->output_length += length;
+    }
+    if (connection->output_length == 0) {
+      break;
+    }
+
+    const int written = SSL_write(connection->ssl, connection->output,
+        (int) connection->output_length);
+    if (written <= 0) {
+      const int error = SSL_get_error(connection->ssl, written);
+      if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ) {
+        return false;
+      }
+      break;
+    }
+    memmove(connection->output, connection->output + written,
+        connection->output_length - written);
+    connection->output_length -= written;
+  }
+
+  // Waiting for the socket to be writable only while there is output left
+  const bool writing = connection->output_length > 0;
+  if (writing != connection->writing) {
+    struct epoll_event event = {
+      .events = EPOLLIN | (writing ? EPOLLOUT : 0),
+      .data.ptr = connection
+    };
+    epoll_ctl(connection->loop->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->writing = writing;
+  }
+  return true;
+}
+
+/*
+ * - Completes the TLS handshake of a connection and starts its HTTP/2 session
+ * - Returns false if the handshake failed or the client doesn't speak HTTP/2
+ */
+bool doh_handshake(DoHConnection *connection) {
+  const int result = SSL_do_handshake(connection->ssl);
+  if (result != 1) {
+    const int error = SSL_get_error(connection->ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      return true;
+    }
+    return false;
+  }
+
+  const unsigned char *protocol = NULL;
+  unsigned int protocol_length = 0;
+  SSL_get0_alpn_selected(connection->ssl, &protocol, &protocol_length);
+  if (protocol_length != 2 || memcmp(protocol, "h2", 2)) {
+    return false;
+  }
+  if (nghttp2_session_server_new(&connection->session, connection->loop->listener->callbacks,
+      connection)) {
+    return false;
+  }
+  const nghttp2_settings_entry settings[] = {
+    { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS }
+  };
+  return nghttp2_submit_settings(connection->session, NGHTTP2_FLAG_NONE, settings, 1) == 0;
+}
+
+/*
+ * - Reads the records available on a connection and passes them to its session, which
+ *   answers the complete requests, then writes the responses
+ * - Returns false once the connection is closed or failed
+ */
+bool doh_serve_connection(DoHConnection *connection) {
+  connection->active_at = time(NULL);
+  if (!connection->session) {
+    if (!doh_handshake(connection)) {
+      return false;
+    }
+    if (!connection->session) {
+      return true;
+    }
+  }
+
+  // Records are read ahead as far as the socket has them, so reading stops once none is left
+  // buffered, rather than with a read that would block, and the loop comes back for the rest
+  uint8_t buffer[DOH_READ_SIZE];
+  do {
+    const int length = SSL_read(connection->ssl, buffer, sizeof(buffer));
+    if (length <= 0) {
+      const int error = SSL_get_error(connection->ssl, length);
+      if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        break;
+      }
+      return false;
+    }
+    if (nghttp2_session_mem_recv(connection->session, buffer, length) < 0) {
+      return false;
+    }
+  } while (SSL_has_pending(connection->ssl));
+
+  if (!doh_flush(connection)) {
+    return false;
+  }
+  return nghttp2_session_want_read(connection->session)
+      || nghttp2_session_want_write(connection->session) || connection->output_length;
+}
+
+void doh_serve(DoHListener *listener, const atomic_bool *stopping, DoHHandler handler,
+    void *context) {
+  DoHLoop loop = {
+    .listener = listener,
+    .epoll = epoll_create1(EPOLL_CLOEXEC),
+    .handler = handler,
+    .context = context
+  };
+  if (loop.epoll == -1) {
+    fprintf(stderr, "[DoH] Failed to create the event loop with error: %d\n", errno);
+    return;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(loop.epoll, EPOLL_CTL_ADD, listener->socket, &event);
+
+  struct epoll_event events[MAX_DOH_EVENTS];
+  time_t swept_at = time(NULL);
+  while (!atomic_load_explicit(stopping, memory_order_relaxed)) {
+    const int count = epoll_wait(loop.epoll, events, MAX_DOH_EVENTS, 1000);
+    for (int i = 0; i < count; i++) {
+      DoHConnection *connection = events[i].data.ptr;
+      if (!connection) {
+        doh_accept(&loop);
+      } else if (!doh_serve_connection(connection)) {
+        doh_close(&loop, connection);
+      }
+    }
+
+    // Idle connections are closed, clients reconnect and resume their sessions when needed
+    const time_t now = time(NULL);
+    if (now != swept_at) {
+      swept_at = now;
+      DoHConnection *connection = loop.connections;
+      while (connection) {
+        DoHConnection *next = connection->next;
+        if (now - connection->active_at > DOH_IDLE_TIMEOUT) {
+          doh_close(&loop, connection);
+        }
+        connection = next;
+      }
+    }
+  }
+
+  while (loop.connections) {
+    doh_close(&loop, loop.connections);
+  }
+  close(loop.epoll);
+}
+
+void doh_free(DoHListener *listener) {
+  nghttp2_session_callbacks_del(listener->callbacks);
+  SSL_CTX_free(listener->tls);
+  close(listener->socket);
+  free(listener);
+}
+
+#else
+
+bool doh_supported(void) {
+  return false;
+}
+
+DoHListener *doh_listen(const DoHConfig *config) {
+  fprintf(stderr, "[DoH] DNS over HTTPS isn't supported by this build, build with DOH=1!\n");
+  return NULL;
+}
+
+void doh_serve(DoHListener *listener, const atomic_bool *stopping, DoHHandler handler,
+    void *context) {
+}
+
+void doh_free(DoHListener *listener) {
+}
+
+#endif
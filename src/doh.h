@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "message.h"
+
+typedef struct {
+  // TCP port of the listener, 0 if DNS over HTTPS isn't served
+  uint16_t port;
+  // Address the listener is bound to, NULL for all addresses
+  const char *address;
+  // PEM files of the certificate chain presented to clients and of its private key
+  const char *certificate;
+  const char *key;
+} DoHConfig;
+
+typedef struct DoHListener DoHListener;
+
+/*
+ * Function invoked by a listener with every DNS query it receives, which works like a
+ * RequestHandler: the response is written over the query, and returning false sends none
+ */
+typedef bool (*DoHHandler)(Message *message, void *context);
+
+/*
+ * Returns whether the program was built with DNS over HTTPS support, with DOH=1
+ */
+bool doh_supported(void);
+
+/*
+ * - Creates a DNS over HTTPS listener, loading the certificate and key into a TLS context and
+ *   binding its TCP socket with SO_REUSEPORT, so that an upgraded process can bind it too
+ * - A self-signed certificate for local tests is made with:
+ *     openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 30
+ *       -subj /CN=localhost -keyout key.pem -out cert.pem
+ * - Returns NULL on failure
+ */
+DoHListener *doh_listen(const DoHConfig *config);
+
+/*
+ * - Serves RFC 8484 GET and POST requests to /dns-query over HTTP/2 and TLS on the calling
+ *   thread, until stopping is set and the thread is interrupted by a signal
+ * - Connections are served by a single event loop, each multiplexing up to 100 streams.
+ *   TLS sessions are resumed with tickets or from the session cache.
+ * - Queries are passed to the handler with the client's address as the sender. Queries
+ *   without a response reset their stream, which the client may retry.
+ * - The handler runs on the event loop as soon as a query has arrived, so a handler that
+ *   blocks, such as one forwarding the query and waiting for the upstream answer, holds up
+ *   every connection of the listener until it returns
+ */
+void doh_serve(DoHListener *listener, const atomic_bool *stopping, DoHHandler handler,
+    void *context);
+
+/*
+ * Closes the socket of a listener and frees it, once doh_serve has returned
+ */
+void doh_free(DoHListener *listener);
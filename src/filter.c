@@ -0,0 +1,264 @@
+#include "filter.h"
+
+#include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "hits.h"
+#include "memory.h"
+#include "rcu.h"
+#include "utils.h"
+
+// Largest number of NUMA nodes the compact set is replicated to
+#define MAX_REPLICAS 64
+
+Filter *filter_new(void) {
+  Filter *filter = malloc(sizeof(Filter));
+  CHECK_ALLOC(filter);
+  filter->domains = set_new();
+  filter->compact = NULL;
+  filter->perfect = NULL;
+  filter->replicas = NULL;
+  filter->replica_count = 0;
+  atomic_init(&filter->rules, rules_new());
+  atomic_init(&filter->allow_lists, 0);
+  atomic_init(&filter->standin, NULL);
+  return filter;
+}
+
+/*
+ * Returns the compact set lookups of the calling thread use, its node's replica if there is one
+ */
+const CompactSet *filter_compact_set(const Filter *filter) {
+  if (filter->replicas) {
+    const size_t node = (size_t) memory_current_node();
+    if (node < filter->replica_count && filter->replicas[node]) {
+      return filter->replicas[node];
+    }
+  }
+  return filter->compact;
+}
+
+/*
+ * - Decides whether the given lists block a domain, given the lists matching its name and the
+ *   counter of the name. The rules are matched too, unless the lists matching the name
+ *   outrank every list with rules, so that names and rules compete by the same priority.
+ * - Has to be called in a read-side section
+ */
+ListMask filter_decide(const Filter *filter, const char *domain, ListMask lists,
+    ListMask matched, HitCounter *hits, bool record_hits) {
+  const ListMask allow_lists = atomic_load_explicit(&filter->allow_lists, memory_order_relaxed);
+  const ListMask relevant = allow_lists | lists;
+  const ListMask by_name = matched & relevant;
+
+  // Lists are numbered by priority, the matching list with the highest id decides
+  const RuleSet *rules = atomic_load_explicit(&filter->rules, memory_order_acquire);
+  ListMask outranking = rules_lists(rules) & relevant;
+  if (by_name) {
+    const ListMask top = LIST_BIT(63 - __builtin_clzll(by_name));
+    outranking &= ~(top | (top - 1));
+  }
+  const ListMask by_rule = outranking ? rules_match(rules, domain) & relevant & ~by_name : 0;
+
+  if (record_hits) {
+    // The counter of a removed name stays valid until the end of the read-side section
+    if (by_name) {
+      hits_record(by_name, hits);
+    }
+    if (by_rule) {
+      hits_record(by_rule, NULL);
+    }
+  }
+
+  const ListMask deciding = by_name | by_rule;
+  if (!deciding || (LIST_BIT(63 - __builtin_clzll(deciding)) & allow_lists)) {
+    return 0;
+  }
+  return deciding & lists;
+}
+
+/*
+ * Returns the filter answering lookups in place of filter, which has to be called in a
+ * read-side section
+ */
+const Filter *filter_serving(const Filter *filter) {
+  const Filter *standin = atomic_load_explicit(&filter->standin, memory_order_acquire);
+  return standin ? standin : filter;
+}
+
+ListMask filter_lookup(const Filter *filter, const char *domain, ListMask lists,
+    bool record_hits) {
+  rcu_read_lock();
+  filter = filter_serving(filter);
+  const CompactSet *compact = filter_compact_set(filter);
+  HitCounter *hits = NULL;
+  HitCounter **name_hits = record_hits ? &hits : NULL;
+  const ListMask matched = filter->perfect
+      ? perfect_set_lookup(filter->perfect, domain, name_hits)
+      : compact
+      ? compact_set_lookup(compact, domain, name_hits)
+      : set_lookup(filter->domains, domain, name_hits);
+  const ListMask blocked = filter_decide(filter, domain, lists, matched, hits, record_hits);
+  rcu_read_unlock();
+  return blocked;
+}
+
+void filter_lookup_batch(const Filter *filter, const char *const *domains,
+    const ListMask *lists, size_t count, bool record_hits, ListMask *results) {
+  HitCounter *hits[MAX_LOOKUP_BATCH] = { NULL };
+  ListMask matched[MAX_LOOKUP_BATCH];
+
+  rcu_read_lock();
+  filter = filter_serving(filter);
+  const CompactSet *compact = filter_compact_set(filter);
+  for (size_t first = 0; first < count; first += MAX_LOOKUP_BATCH) {
+    const size_t batch = count - first < MAX_LOOKUP_BATCH ? count - first : MAX_LOOKUP_BATCH;
+    HitCounter **name_hits = record_hits ? hits : NULL;
+    if (filter->perfect) {
+      perfect_set_lookup_batch(filter->perfect, domains + first, batch, matched, name_hits);
+    } else if (compact) {
+      // Binary searches depend on the previous comparison, leaving nothing to prefetch ahead
+      for (size_t i = 0; i < batch; i++) {
+        matched[i] = compact_set_lookup(compact, domains[first + i],
+            name_hits ? name_hits + i : NULL);
+      }
+    } else {
+      set_lookup_batch(filter->domains, domains + first, batch, matched, name_hits);
+    }
+
+    for (size_t i = 0; i < batch; i++) {
+      results[first + i] = filter_decide(filter, domains[first + i], lists[first + i],
+          matched[i], hits[i], record_hits);
+      hits[i] = NULL;
+    }
+  }
+  rcu_read_unlock();
+}
+
+void filter_stand_in(Filter *filter, Filter *standin) {
+  atomic_store_explicit(&filter->standin, standin, memory_order_release);
+}
+
+void filter_publish(Filter *filter) {
+  // The filter was filled before the release, so lookups that see no stand-in see all of it
+  Filter *standin = atomic_exchange_explicit(&filter->standin, NULL, memory_order_release);
+  if (standin) {
+    rcu_synchronize();
+    filter_free(standin);
+  }
+}
+
+void filter_swap_rules(Filter *filter, RuleSet *rules) {
+  RuleSet *old_rules = atomic_exchange(&filter->rules, rules);
+  rcu_synchronize();
+  rules_free(old_rules);
+}
+
+void filter_compact(Filter *filter) {
+  if (!filter->domains) {
+    return;
+  }
+
+  filter->compact = compact_set_build(filter->domains);
+  set_free_vals(filter->domains);
+  filter->domains = NULL;
+#ifdef __GLIBC__
+  // The names were allocated one by one, give the freed memory back to the system
+  malloc_trim(0);
+#endif
+}
+
+bool filter_perfect_hash(Filter *filter) {
+  if (!filter->domains) {
+    return false;
+  }
+
+  filter->perfect = perfect_set_build(filter->domains);
+  if (filter->perfect == NULL) {
+    return false;
+  }
+  set_free_vals(filter->domains);
+  filter->domains = NULL;
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  return true;
+}
+
+void filter_foreach(const Filter *filter, SetItemCallback callback, void *context) {
+  if (filter->domains) {
+    set_foreach(filter->domains, callback, context);
+  } else if (filter->perfect) {
+    perfect_set_foreach(filter->perfect, callback, context);
+  } else {
+    compact_set_foreach(filter->compact, callback, context);
+  }
+}
+
+size_t filter_size(const Filter *filter) {
+  if (filter->domains) {
+    return set_size(filter->domains);
+  }
+  return filter->perfect ? perfect_set_size(filter->perfect) : compact_set_size(filter->compact);
+}
+
+void filter_replicate(Filter *filter) {
+  if (filter->compact == NULL || filter->replicas) {
+    return;
+  }
+
+  int nodes[MAX_REPLICAS];
+  const size_t node_count = memory_nodes(nodes, MAX_REPLICAS);
+  filter->replica_count = nodes[node_count - 1] + 1;
+  filter->replicas = calloc(filter->replica_count, sizeof(CompactSet *));
+  CHECK_ALLOC(filter->replicas);
+  for (size_t i = 0; i < node_count; i++) {
+    filter->replicas[nodes[i]] = compact_set_replicate(filter->compact, nodes[i]);
+  }
+
+  // The unbound original is only kept as the fallback for threads on unknown nodes
+  compact_set_free(filter->compact);
+  filter->compact = filter->replicas[nodes[0]];
+}
+
+void filter_report_memory(const Filter *filter) {
+  if (filter->domains) {
+    set_report_memory(filter->domains, "Domain set");
+  } else if (filter->perfect) {
+    perfect_set_report_memory(filter->perfect, "Perfect set");
+  } else if (filter->replicas) {
+    for (size_t node = 0; node < filter->replica_count; node++) {
+      if (filter->replicas[node]) {
+        compact_set_report_memory(filter->replicas[node], "Compact set replica");
+      }
+    }
+  } else {
+    compact_set_report_memory(filter->compact, "Compact set");
+  }
+}
+
+void filter_free(Filter *filter) {
+  if (filter->domains) {
+    set_free_vals(filter->domains);
+  }
+  if (filter->perfect) {
+    perfect_set_free(filter->perfect);
+  }
+  if (filter->replicas) {
+    for (size_t node = 0; node < filter->replica_count; node++) {
+      if (filter->replicas[node]) {
+        compact_set_free(filter->replicas[node]);
+      }
+    }
+    free(filter->replicas);
+  } else if (filter->compact) {
+    compact_set_free(filter->compact);
+  }
+  rules_free(atomic_load(&filter->rules));
+  Filter *standin = atomic_load(&filter->standin);
+  if (standin) {
+    filter_free(standin);
+  }
+  free(filter);
+}
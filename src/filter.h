@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "compact_set.h"
+#include "perfect_set.h"
+#include "rules.h"
+#include "set.h"
+
+// Most domains looked up at once by filter_lookup_batch, longer batches being split
+#define MAX_LOOKUP_BATCH 64
+
+/*
+ * Domains blocked or allowed by the loaded lists, as exact names and as wildcard or regex rules.
+ * Once the filter is compacted, the names are only stored in the compact set, which can
+ * be replicated to every NUMA node, with lookups using the replica of the caller's node, or in
+ * the perfect set, which answers lookups with a single probe.
+ * Lookups don't take locks and may run while one thread at a time changes the domains and
+ * replaces the rules with filter_swap_rules. A filter that is still being filled can have
+ * another one answer its lookups until it's published.
+ */
+typedef struct Filter {
+  Set *domains;
+  CompactSet *compact;
+  PerfectSet *perfect;
+  CompactSet **replicas;
+  size_t replica_count;
+  _Atomic(RuleSet *) rules;
+  // Lists allowing the domains they contain, overriding the blocking lists with lower ids
+  _Atomic ListMask allow_lists;
+  // Filter answering the lookups in place of this one until it's published, NULL after
+  _Atomic(struct Filter *) standin;
+} Filter;
+
+/*
+ * Creates a new, empty filter on a heap
+ */
+Filter *filter_new(void);
+
+/*
+ * - Returns the mask of the given lists which block the domain, or 0 if none of them do or the
+ *   domain is allowed by a list with a higher id than the blocking ones. Lists match by name
+ *   or by rule alike, the rules are only skipped if no list with rules could outrank the lists
+ *   matching the name.
+ * - If record_hits is true, the lookup is counted for the given and allowing lists matching
+ *   the domain and, if it matched by name, for the name
+ */
+ListMask filter_lookup(const Filter *filter, const char *domain, ListMask lists,
+    bool record_hits);
+
+/*
+ * - Looks up count domains like filter_lookup, each against its own lists, writing the masks
+ *   of the lists blocking them to results
+ * - The names of the whole batch are looked up before any of them is decided, so that the
+ *   memory accesses of the lookups overlap instead of waiting on each other
+ */
+void filter_lookup_batch(const Filter *filter, const char *const *domains,
+    const ListMask *lists, size_t count, bool record_hits, ListMask *results);
+
+/*
+ * - Makes the lookups in the filter use the stand-in filter instead, until filter_publish
+ *   is called, so that the filter can be loaded and compacted while the stand-in serves
+ * - Has to be called before any lookup, the filter takes ownership of the stand-in
+ */
+void filter_stand_in(Filter *filter, Filter *standin);
+
+/*
+ * Makes the lookups use the filter itself from then on, switching all of them at once, and
+ * frees its stand-in, if any, once no lookup can be using it
+ */
+void filter_publish(Filter *filter);
+
+/*
+ * Replaces the rules of the filter, freeing the old ones once no lookup can be using them
+ */
+void filter_swap_rules(Filter *filter, RuleSet *rules);
+
+/*
+ * Replaces the set of blocked names with a read-only compact set, after which no more
+ * names can be added to or removed from the filter
+ */
+void filter_compact(Filter *filter);
+
+/*
+ * - Replaces the set of blocked names with a read-only set indexed by a minimal perfect hash
+ *   function, after which no more names can be added to or removed from the filter
+ * - Returns false, keeping the set of names, if no perfect hash function was found
+ */
+bool filter_perfect_hash(Filter *filter);
+
+/*
+ * - Calls callback with every name of the filter, the mask of lists it belongs to, its hit
+ *   counter and the context
+ * - Must not run concurrently with changes to the names
+ */
+void filter_foreach(const Filter *filter, SetItemCallback callback, void *context);
+
+/*
+ * Returns the number of blocked names of the filter
+ */
+size_t filter_size(const Filter *filter);
+
+/*
+ * Replicates the compact set of a compacted filter to every online NUMA node
+ */
+void filter_replicate(Filter *filter);
+
+/*
+ * Prints the page sizes and NUMA nodes of the memory holding the filter lookup tables
+ */
+void filter_report_memory(const Filter *filter);
+
+/*
+ * Deletes the filter and all the domains stored in it
+ */
+void filter_free(Filter *filter);
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "utils.h"
+
+#define HANDOFF_MAGIC "DNSHAND1"
+#define HANDOFF_MAGIC_LENGTH 8
+// Byte sent by the new process once it is ready to serve
+#define HANDOFF_READY 'R'
+// Seconds the new process waits for the previous one to drain its workers
+#define HANDOFF_DRAIN_TIMEOUT 10
+// First file descriptor passed by systemd socket activation
+#define SYSTEMD_FIRST_FD 3
+
+/*
+ * Header of the messages passing file descriptors, which are attached to it
+ */
+typedef struct {
+  char magic[HANDOFF_MAGIC_LENGTH];
+  uint32_t count;
+} HandoffHeader;
+
+struct Handoff {
+  char *path;
+  // Connection to the process the sockets were taken over from, -1 if there is none
+  int predecessor;
+  // Socket listening for the next upgrade, -1 if there is none
+  int socket;
+  // Inode of the socket file, which the process taking over from this one replaces
+  ino_t inode;
+  pthread_t thread;
+  UDPServer *server;
+  atomic_bool stopping;
+  // Connection to the process taking over from this one, -1 if there is none. Whoever
+  // exchanges it for -1 owns it and closes it.
+  atomic_int connection;
+  // Whether the process taking over is ready and the server was stopped for it
+  atomic_bool upgrading;
+};
+
+/*
+ * Sends a header with count file descriptors attached, returning true on success
+ */
+bool handoff_send(int connection, const int *fds, uint32_t count) {
+  HandoffHeader header = { .count = count };
+  memcpy(header.magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH);
+  struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+  } control;
+  struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  if (count) {
+    memset(&control, 0, sizeof(control));
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  return sent == sizeof(header);
+}
+
+/*
+ * - Receives a header and the file descriptors attached to it, up to max of them
+ * - Returns true on success, false if the connection was closed or the message is invalid
+ */
+bool handoff_receive(int connection, int *fds, uint32_t max, uint32_t *count) {
+  HandoffHeader header;
+  struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+  } control;
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+    .msg_controllen = sizeof(control.buffer)
+  };
+
+  ssize_t received;
+  do {
+    received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+  } while (received == -1 && errno == EINTR);
+  if (received == -1) {
+    fprintf(stderr, "[Handoff] Failed to receive from the other process with error: %d\n", errno);
+    return false;
+  }
+
+  *count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      const uint32_t attached = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (uint32_t i = 0; i < attached; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        if (*count < max) {
+          fds[(*count)++] = fd;
+        } else {
+          close(fd);
+        }
+      }
+    }
+  }
+
+  if (received != sizeof(header) || memcmp(header.magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH)
+      || (message.msg_flags & MSG_CTRUNC) || header.count != *count) {
+    if (received) {
+      fprintf(stderr, "[Handoff] Received an invalid message from the other process!\n");
+    }
+    for (uint32_t i = 0; i < *count; i++) {
+      close(fds[i]);
+    }
+    *count = 0;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Fills an address for the path, returning false if it's too long
+ */
+bool handoff_address(const char *path, struct sockaddr_un *addr) {
+  *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "[Handoff] Socket path %s is too long!\n", path);
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+Handoff *handoff_new(const char *path) {
+  Handoff *handoff = malloc(sizeof(Handoff));
+  CHECK_ALLOC(handoff);
+  *handoff = (Handoff) { .predecessor = -1, .socket = -1 };
+  if (path) {
+    handoff->path = malloc(strlen(path) + 1);
+    CHECK_ALLOC(handoff->path);
+    strcpy(handoff->path, path);
+  }
+  atomic_init(&handoff->stopping, false);
+  atomic_init(&handoff->connection, -1);
+  atomic_init(&handoff->upgrading, false);
+  return handoff;
+}
+
+/*
+ * - Connects to the process serving handoffs at the path and receives its sockets
+ * - Returns the number of sockets, 0 if no process is serving handoffs
+ */
+uint32_t handoff_connect(Handoff *handoff, int *sockets) {
+  struct sockaddr_un addr;
+  if (!handoff_address(handoff->path, &addr)) {
+    return 0;
+  }
+
+  int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1) {
+    fprintf(stderr, "[Handoff] Failed to create socket with error: %d\n", errno);
+    return 0;
+  }
+  if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    if (errno != ENOENT && errno != ECONNREFUSED) {
+      fprintf(stderr, "[Handoff] Failed to connect to %s with error: %d\n", handoff->path, errno);
+    }
+    close(s);
+    return 0;
+  }
+
+  uint32_t count;
+  if (!handoff_receive(s, sockets, MAX_WORKERS, &count) || count == 0) {
+    fprintf(stderr, "[Handoff] Failed to take the sockets over from %s!\n", handoff->path);
+    close(s);
+    return 0;
+  }
+
+  // The previous process only takes time to drain its workers once this one is ready
+  const struct timeval timeout = { .tv_sec = HANDOFF_DRAIN_TIMEOUT };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  handoff->predecessor = s;
+  printf("[Handoff] Took %" PRIu32 " sockets over from the process serving %s\n", count,
+      handoff->path);
+  return count;
+}
+
+/*
+ * - Takes the UDP sockets passed by systemd socket activation, closing the others
+ * - Returns the number of sockets, 0 if the process wasn't activated by systemd
+ */
+uint32_t handoff_systemd_sockets(int *sockets) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  if (!pid || !fds || strtol(pid, NULL, 10) != getpid()) {
+    return 0;
+  }
+  const long fd_count = strtol(fds, NULL, 10);
+  // Keep the sockets from being passed on to the processes started by this one
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  uint32_t count = 0;
+  for (int fd = SYSTEMD_FIRST_FD; fd < SYSTEMD_FIRST_FD + fd_count; fd++) {
+    int type;
+    socklen_t length = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == -1 || type != SOCK_DGRAM
+        || count == MAX_WORKERS) {
+      fprintf(stderr, "[Handoff] Ignoring socket %d passed by systemd, only up to %d UDP "
+          "sockets are served\n", fd, MAX_WORKERS);
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    sockets[count++] = fd;
+  }
+  if (count) {
+    printf("[Handoff] Serving on %" PRIu32 " sockets passed by systemd\n", count);
+  }
+  return count;
+}
+
+uint32_t handoff_inherit(Handoff *handoff, int *sockets) {
+  if (handoff->path) {
+    const uint32_t count = handoff_connect(handoff, sockets);
+    if (count) {
+      return count;
+    }
+  }
+  return handoff_systemd_sockets(sockets);
+}
+
+bool handoff_has_predecessor(const Handoff *handoff) {
+  return handoff->predecessor != -1;
+}
+
+bool handoff_ready(Handoff *handoff, ResponseCache *cache) {
+  if (handoff->predecessor == -1) {
+    return false;
+  }
+
+  const char ready = HANDOFF_READY;
+  int fd = -1;
+  uint32_t count = 0;
+  bool success = send(handoff->predecessor, &ready, 1, MSG_NOSIGNAL) == 1
+      && handoff_receive(handoff->predecessor, &fd, 1, &count);
+  close(handoff->predecessor);
+  handoff->predecessor = -1;
+  if (!success) {
+    fprintf(stderr, "[Handoff] The previous process failed to hand its cache over!\n");
+    return false;
+  }
+  printf("[Handoff] The previous process has stopped serving\n");
+  if (count == 0) {
+    return false;
+  }
+
+  // The snapshot was written to a memory file whose offset is shared with the sender
+  FILE *file = fdopen(fd, "rb");
+  if (!file) {
+    close(fd);
+    return false;
+  }
+  rewind(file);
+  success = cache && cache_load_file(cache, file, "the previous process");
+  fclose(file);
+  return success;
+}
+
+/*
+ * - Hands the sockets of the server over to a new process connected to the handoff socket
+ *   and waits for it to be ready
+ * - Returns true if the new process is ready, false if the upgrade was aborted
+ */
+bool handoff_serve(Handoff *handoff, int connection) {
+  // The DNS over HTTPS listener stays, the new process binds its own to the same port
+  int sockets[MAX_WORKERS];
+  const uint32_t count = server_socket_count(handoff->server);
+  for (uint32_t i = 0; i < count; i++) {
+    sockets[i] = server_worker_socket(handoff->server, i);
+  }
+  if (!handoff_send(connection, sockets, count)) {
+    fprintf(stderr, "[Handoff] Failed to hand the sockets over with error: %d\n", errno);
+    return false;
+  }
+  printf("[Handoff] Handed %" PRIu32 " sockets over, serving until the new process is ready\n",
+      count);
+
+  char ready = 0;
+  ssize_t received;
+  do {
+    received = recv(connection, &ready, 1, 0);
+  } while (received == -1 && errno == EINTR);
+  if (received != 1 || ready != HANDOFF_READY) {
+    if (!atomic_load(&handoff->stopping)) {
+      fprintf(stderr, "[Handoff] The new process exited before it was ready, upgrade aborted\n");
+    }
+    return false;
+  }
+  printf("[Handoff] The new process is ready, draining the workers\n");
+  return true;
+}
+
+void *handoff_thread(void *argument) {
+  Handoff *handoff = argument;
+  while (!atomic_load(&handoff->stopping)) {
+    const int connection = accept4(handoff->socket, NULL, NULL, SOCK_CLOEXEC);
+    if (connection == -1) {
+      if (errno != EINTR && !atomic_load(&handoff->stopping)) {
+        fprintf(stderr, "[Handoff] Failed to accept connection with error: %d\n", errno);
+      }
+      continue;
+    }
+
+    atomic_store(&handoff->connection, connection);
+    // A stop that started before the connection was stored can't shut it down, so don't serve it
+    if (!atomic_load(&handoff->stopping) && handoff_serve(handoff, connection)) {
+      // The connection is kept to send the cache once the workers have drained
+      atomic_store(&handoff->upgrading, true);
+      server_stop(handoff->server);
+      return NULL;
+    }
+    // Stopping takes the connection to shut it down, and closes it once this thread has exited
+    if (atomic_exchange(&handoff->connection, -1) == connection) {
+      close(connection);
+    }
+  }
+  return NULL;
+}
+
+bool handoff_listen(Handoff *handoff, UDPServer *server) {
+  struct sockaddr_un addr;
+  if (!handoff_address(handoff->path, &addr)) {
+    return false;
+  }
+
+  int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1) {
+    fprintf(stderr, "[Handoff] Failed to create socket with error: %d\n", errno);
+    return false;
+  }
+
+  // Replace the socket of the process this one took over from, or left behind by a previous run
+  unlink(handoff->path);
+  if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(s, 1) == -1) {
+    fprintf(stderr, "[Handoff] Failed to listen on %s with error: %d\n", handoff->path, errno);
+    close(s);
+    return false;
+  }
+
+  struct stat status;
+  handoff->inode = stat(handoff->path, &status) == 0 ? status.st_ino : 0;
+  handoff->socket = s;
+  handoff->server = server;
+
+  // New processes exiting while the sockets are handed over must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!start_thread(&handoff->thread, handoff_thread, handoff)) {
+    fprintf(stderr, "[Handoff] Failed to start handoff thread!\n");
+    close(s);
+    unlink(handoff->path);
+    handoff->socket = -1;
+    return false;
+  }
+
+  printf("[Handoff] Listening for upgrades on %s...\n", handoff->path);
+  return true;
+}
+
+/*
+ * Sends the unexpired responses of the cache to the new process in a memory file
+ */
+void handoff_send_cache(int connection, const ResponseCache *cache) {
+  FILE *file = NULL;
+  size_t count = 0;
+  if (cache) {
+    const int fd = memfd_create("dnsblocker-cache", MFD_CLOEXEC);
+    file = fd == -1 ? NULL : fdopen(fd, "w+b");
+    if (!file || !cache_save_file(cache, file, &count)) {
+      fprintf(stderr, "[Handoff] Failed to write the cache with error: %d\n", errno);
+      if (file) {
+        fclose(file);
+      } else if (fd != -1) {
+        close(fd);
+      }
+      file = NULL;
+    }
+  }
+
+  const int fd = file ? fileno(file) : -1;
+  if (!handoff_send(connection, &fd, file ? 1 : 0)) {
+    fprintf(stderr, "[Handoff] Failed to hand the cache over with error: %d\n", errno);
+  } else if (file) {
+    printf("[Handoff] Handed %zu cached responses over to the new process\n", count);
+  }
+  if (file) {
+    fclose(file);
+  }
+}
+
+void handoff_finish(Handoff *handoff, const ResponseCache *cache) {
+  if (handoff->predecessor != -1) {
+    close(handoff->predecessor);
+  }
+
+  if (handoff->socket != -1) {
+    atomic_store(&handoff->stopping, true);
+    shutdown(handoff->socket, SHUT_RDWR);
+    const int connection = atomic_exchange(&handoff->connection, -1);
+    // A new process that isn't ready yet keeps the sockets it has taken over
+    if (connection != -1 && !atomic_load(&handoff->upgrading)) {
+      shutdown(connection, SHUT_RDWR);
+    }
+    pthread_join(handoff->thread, NULL);
+
+    if (connection != -1 && atomic_load(&handoff->upgrading)) {
+      handoff_send_cache(connection, cache);
+    }
+    if (connection != -1) {
+      close(connection);
+    }
+    close(handoff->socket);
+
+    struct stat status;
+    if (stat(handoff->path, &status) == 0 && status.st_ino == handoff->inode) {
+      unlink(handoff->path);
+    }
+  }
+
+  free(handoff->path);
+  free(handoff);
+}
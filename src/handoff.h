@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "udp_server.h"
+
+typedef struct Handoff Handoff;
+
+/*
+ * - Creates the state of upgrades through the Unix domain socket bound to path, on which a
+ *   running process hands its sockets over to the process replacing it
+ * - path may be NULL, leaving only the sockets passed by systemd to be inherited
+ */
+Handoff *handoff_new(const char *path);
+
+/*
+ * - Takes over the sockets of the process serving handoffs at the path, or else the UDP
+ *   sockets passed by systemd socket activation through LISTEN_FDS
+ * - The previous process keeps serving on the sockets until handoff_ready is called
+ * - Writes up to MAX_WORKERS sockets and returns their number, 0 if there were none to
+ *   inherit and the server has to bind its own
+ */
+uint32_t handoff_inherit(Handoff *handoff, int *sockets);
+
+/*
+ * Returns whether the sockets were taken over from a running process, which keeps serving on
+ * them until handoff_ready is called
+ */
+bool handoff_has_predecessor(const Handoff *handoff);
+
+/*
+ * - Tells the process the sockets were taken over from that this one is ready to serve, and
+ *   waits for it to stop its workers, loading the responses it had cached into cache
+ * - Returns true if the cache was handed over, false if there was no previous process, no
+ *   cache on either side or the previous process failed
+ */
+bool handoff_ready(Handoff *handoff, ResponseCache *cache);
+
+/*
+ * - Starts a thread serving the next upgrade on the path, handing the sockets of the server
+ *   over to the process connecting to it and stopping the server once it is ready
+ * - A process closing its connection before it is ready aborts the upgrade
+ * - Returns true on success, false on failure
+ */
+bool handoff_listen(Handoff *handoff, UDPServer *server);
+
+/*
+ * Sends the cache to the process replacing this one, if any, stops the handoff thread and
+ * frees the handoff, removing its socket unless the new process has replaced it
+ */
+void handoff_finish(Handoff *handoff, const ResponseCache *cache);
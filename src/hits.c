@@ -0,0 +1,61 @@
+#include "hits.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "thread_slots.h"
+
+typedef struct {
+  alignas(64) _Atomic uint64_t names[MAX_LISTS];
+  _Atomic uint64_t rules[MAX_LISTS];
+} ThreadHits;
+
+ThreadHits thread_hits[MAX_THREAD_SLOTS];
+ThreadSlots hits_slots = THREAD_SLOTS_INIT("count list hits");
+_Thread_local ThreadHits *current_hits = NULL;
+
+void hits_record(ListMask lists, HitCounter *counter) {
+  if (current_hits == NULL) {
+    current_hits = thread_hits + thread_slots_acquire(&hits_slots);
+  }
+
+  _Atomic uint64_t *list_counters = counter ? current_hits->names : current_hits->rules;
+  while (lists) {
+    _Atomic uint64_t *list_counter = list_counters + __builtin_ctzll(lists);
+    atomic_store_explicit(list_counter,
+        atomic_load_explicit(list_counter, memory_order_relaxed) + 1, memory_order_relaxed);
+    lists &= lists - 1;
+  }
+
+  if (counter) {
+    // Counters of names are shared by all threads, but a locked increment would cost more than
+    // the lookup. Concurrent hits of a name may lose increments, whether it was hit at all is
+    // exact. The count saturates instead of wrapping around and the time is written at most
+    // once a second.
+    const uint32_t count = atomic_load_explicit(&counter->count, memory_order_relaxed);
+    if (count != UINT32_MAX) {
+      atomic_store_explicit(&counter->count, count + 1, memory_order_relaxed);
+    }
+    const uint32_t now = (uint32_t) time(NULL);
+    if (atomic_load_explicit(&counter->last, memory_order_relaxed) != now) {
+      atomic_store_explicit(&counter->last, now, memory_order_relaxed);
+    }
+  }
+}
+
+void hits_collect(ListHits *totals) {
+  for (size_t id = 0; id < MAX_LISTS; id++) {
+    totals->names[id] = 0;
+    totals->rules[id] = 0;
+  }
+
+  const size_t count = thread_slots_count(&hits_slots);
+  for (size_t i = 0; i < count; i++) {
+    for (size_t id = 0; id < MAX_LISTS; id++) {
+      totals->names[id] += atomic_load_explicit(&thread_hits[i].names[id], memory_order_relaxed);
+      totals->rules[id] += atomic_load_explicit(&thread_hits[i].rules[id], memory_order_relaxed);
+    }
+  }
+}
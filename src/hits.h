@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "set.h"
+
+/*
+ * Numbers of lookups decided by each list, by an exact name or by a rule
+ */
+typedef struct {
+  uint64_t names[MAX_LISTS];
+  uint64_t rules[MAX_LISTS];
+} ListHits;
+
+/*
+ * - Counts a lookup decided by the lists in mask into the counters of the calling thread,
+ *   which no other thread writes
+ * - counter is the hit counter of the matching name, NULL if a rule matched
+ */
+void hits_record(ListMask lists, HitCounter *counter);
+
+/*
+ * Sums the counters of all threads into totals
+ */
+void hits_collect(ListHits *totals);
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "loader.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct ListLoader {
+  AdListsInfo *ad_lists;
+  Filter *filter;
+  const ProgramOptions *options;
+  pthread_t thread;
+  // Posted once the thread holds the lock of the lists
+  sem_t locked;
+  bool joined;
+};
+
+void loader_run(AdListsInfo *ad_lists, Filter *filter, const ProgramOptions *options) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  load_active_lists(ad_lists, filter);
+  if (options->perfect_hash) {
+    if (filter_perfect_hash(filter)) {
+      forget_list_domains(ad_lists);
+      printf("[Filter] Indexed %zu domains with a perfect hash in %zu bytes, %zu of them for "
+          "the hash function\n", perfect_set_size(filter->perfect),
+          perfect_set_memory(filter->perfect), perfect_set_index_memory(filter->perfect));
+    } else {
+      fprintf(stderr, "[Filter] Failed to build a perfect hash of the domains, keeping the "
+          "%s!\n", options->compact ? "compacted domains" : "domain set");
+    }
+  }
+  // Compacting consumes the domain set, so it only runs once no perfect hash was built from it
+  if (options->compact && !filter->perfect) {
+    filter_compact(filter);
+    forget_list_domains(ad_lists);
+    printf("[Filter] Compacted %zu domains into %zu bytes\n", compact_set_size(filter->compact),
+        compact_set_memory(filter->compact));
+    if (options->numa_replicas) {
+      filter_replicate(filter);
+    }
+  }
+  filter_report_memory(filter);
+
+  const bool stood_in = atomic_load(&filter->standin) != NULL;
+  filter_publish(filter);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (stood_in) {
+    printf("[Loader] Loaded %zu domains in %.1f s, filtering with them from now on\n",
+        filter_size(filter), (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+  fflush(stdout);
+
+  if (options->lists_snapshot) {
+    save_lists_snapshot(ad_lists, filter, options->lists_snapshot);
+  }
+}
+
+void *loader_thread(void *argument) {
+  ListLoader *loader = argument;
+  pthread_mutex_lock(&loader->ad_lists->lock);
+  sem_post(&loader->locked);
+  loader_run(loader->ad_lists, loader->filter, loader->options);
+  pthread_mutex_unlock(&loader->ad_lists->lock);
+  return NULL;
+}
+
+ListLoader *loader_start(AdListsInfo *ad_lists, Filter *filter, const ProgramOptions *options) {
+  // Until the lists are loaded, an empty stand-in forwards every query
+  Filter *standin = filter_new();
+  if (options->startup == STARTUP_SNAPSHOT
+      && !load_lists_snapshot(ad_lists, standin, options->lists_snapshot)) {
+    fprintf(stderr, "[Loader] Forwarding every query until the lists are loaded\n");
+    filter_free(standin);
+    standin = filter_new();
+  }
+  filter_stand_in(filter, standin);
+
+  ListLoader *loader = calloc(1, sizeof(ListLoader));
+  CHECK_ALLOC(loader);
+  loader->ad_lists = ad_lists;
+  loader->filter = filter;
+  loader->options = options;
+  sem_init(&loader->locked, 0, 0);
+  if (!start_thread(&loader->thread, loader_thread, loader)) {
+    fprintf(stderr, "[Loader] Failed to start loader thread, loading the lists first!\n");
+    sem_destroy(&loader->locked);
+    free(loader);
+    loader_run(ad_lists, filter, options);
+    return NULL;
+  }
+
+  // Threads changing the lists have to wait for the loader from the start
+  while (sem_wait(&loader->locked) == -1) {
+  }
+  return loader;
+}
+
+void loader_wait(ListLoader *loader) {
+  if (loader && !loader->joined) {
+    pthread_join(loader->thread, NULL);
+    loader->joined = true;
+  }
+}
+
+void loader_finish(ListLoader *loader) {
+  if (!loader) {
+    return;
+  }
+  loader_wait(loader);
+  sem_destroy(&loader->locked);
+  free(loader);
+}
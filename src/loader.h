@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ad_list.h"
+#include "filter.h"
+#include "utils.h"
+
+typedef struct ListLoader ListLoader;
+
+/*
+ * - Loads the active lists into the filter and compacts, indexes or replicates it as the
+ *   options say, publishing it once it's ready and then saving the lists snapshot, if any
+ * - Runs on the calling thread, which has to be the only one using the lists
+ */
+void loader_run(AdListsInfo *ad_lists, Filter *filter, const ProgramOptions *options);
+
+/*
+ * - Starts a thread running loader_run while the filter is served by a stand-in, empty or
+ *   loaded from the lists snapshot depending on the startup policy
+ * - The thread holds the lock of the lists until the filter is published, so that threads
+ *   changing the lists wait for it
+ * - Returns NULL if the thread can't be started, after loading the lists on the calling thread
+ */
+ListLoader *loader_start(AdListsInfo *ad_lists, Filter *filter, const ProgramOptions *options);
+
+/*
+ * Waits for the lists to be loaded and the filter to be published
+ */
+void loader_wait(ListLoader *loader);
+
+/*
+ * Waits for the lists to be loaded and frees the loader
+ */
+void loader_finish(ListLoader *loader);
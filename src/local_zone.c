@@ -0,0 +1,504 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "local_zone.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#include "map.h"
+#include "utils.h"
+
+// Seconds for which clients may cache local answers
+#define LOCAL_TTL 300
+#define MAX_NAME_LENGTH 253
+#define MAX_WIRE_NAME 255
+// Owner name pointer, type, class, TTL and data length of a record
+#define RECORD_HEADER_LENGTH 12
+#define QTYPE_A 1
+#define QTYPE_CNAME 5
+#define QTYPE_PTR 12
+#define QTYPE_AAAA 28
+#define RCODE_NXDOMAIN 3
+
+typedef struct {
+  uint16_t type;
+  uint16_t data_length;
+  uint8_t data[MAX_WIRE_NAME];
+  // Name the record points to, only kept for CNAME records
+  char *target;
+} LocalRecord;
+
+typedef struct {
+  // Query type answered, 0 for any other type
+  uint16_t qtype;
+  uint8_t header[RESPONSE_HEADER_LENGTH];
+  uint8_t *answer;
+  size_t answer_length;
+} LocalAnswer;
+
+struct LocalName {
+  char *name;
+  LocalRecord *records;
+  size_t record_count;
+  // Answers by query type, ending with the answer to any other type
+  LocalAnswer *answers;
+  size_t answer_count;
+};
+
+struct LocalZones {
+  // Names with records, mapped to their index in names
+  Map *name_map;
+  LocalName **names;
+  size_t name_count;
+  size_t name_capacity;
+  // Zones whose names are never forwarded
+  Map *zones;
+  size_t zone_count;
+  // Last labels of all names and zones, so that other domains are ruled out by scanning the
+  // few of them instead of looking up every suffix
+  char **top_labels;
+  size_t *top_label_lengths;
+  size_t top_label_count;
+  // Answer to names in a zone which have no records
+  LocalName nxdomain;
+};
+
+/*
+ * - Lowercases a name into output, dropping a trailing dot
+ * - Returns false if the name isn't a valid domain name
+ */
+bool local_zone_normalize(const char *input, char *output) {
+  size_t length = strlen(input);
+  if (length && input[length - 1] == '.') {
+    length--;
+  }
+  if (length == 0 || length > MAX_NAME_LENGTH) {
+    return false;
+  }
+
+  size_t label_length = 0;
+  for (size_t i = 0; i < length; i++) {
+    const char c = input[i];
+    if (c == '.') {
+      if (label_length == 0) {
+        return false;
+      }
+      label_length = 0;
+    } else if (++label_length > 63 || c <= ' ' || c > '~') {
+      return false;
+    }
+    output[i] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+  }
+  output[length] = '\0';
+  return label_length > 0;
+}
+
+/*
+ * Writes a normalized name in wire format, returning its length
+ */
+size_t local_zone_encode(const char *name, uint8_t *wire) {
+  size_t length = 0;
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    const size_t label_length = dot ? (size_t) (dot - name) : strlen(name);
+    wire[length++] = (uint8_t) label_length;
+    memcpy(wire + length, name, label_length);
+    length += label_length;
+    name += label_length + (dot ? 1 : 0);
+  }
+  wire[length++] = 0;
+  return length;
+}
+
+/*
+ * Returns the last label of a normalized name
+ */
+const char *local_zone_top_label(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot ? dot + 1 : name;
+}
+
+/*
+ * Returns true if the last label of a domain is the last label of a local name or zone
+ */
+bool local_zone_has_top_label(const LocalZones *zones, const char *domain) {
+  const char *top_label = local_zone_top_label(domain);
+  const size_t length = strlen(top_label);
+  for (size_t i = 0; i < zones->top_label_count; i++) {
+    if (zones->top_label_lengths[i] == length && !strcasecmp(zones->top_labels[i], top_label)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void local_zone_add_top_label(LocalZones *zones, const char *name) {
+  if (local_zone_has_top_label(zones, name)) {
+    return;
+  }
+  const size_t count = zones->top_label_count + 1;
+  zones->top_labels = realloc(zones->top_labels, count * sizeof(char *));
+  zones->top_label_lengths = realloc(zones->top_label_lengths, count * sizeof(size_t));
+  CHECK_ALLOC(zones->top_labels);
+  CHECK_ALLOC(zones->top_label_lengths);
+  zones->top_labels[zones->top_label_count] = strdup(local_zone_top_label(name));
+  CHECK_ALLOC(zones->top_labels[zones->top_label_count]);
+  zones->top_label_lengths[zones->top_label_count] = strlen(zones->top_labels[zones->top_label_count]);
+  zones->top_label_count = count;
+}
+
+void local_zone_add_zone(LocalZones *zones, const char *name) {
+  uint32_t unused;
+  if (map_get(zones->zones, name, &unused)) {
+    return;
+  }
+  char *key = strdup(name);
+  CHECK_ALLOC(key);
+  map_put(zones->zones, key, 0);
+  zones->zone_count++;
+  local_zone_add_top_label(zones, name);
+}
+
+LocalName *local_zone_get_name(LocalZones *zones, const char *name) {
+  uint32_t index;
+  if (map_get(zones->name_map, name, &index)) {
+    return zones->names[index];
+  }
+
+  if (zones->name_count == zones->name_capacity) {
+    zones->name_capacity = zones->name_capacity ? zones->name_capacity * 2 : 16;
+    zones->names = realloc(zones->names, zones->name_capacity * sizeof(LocalName *));
+    CHECK_ALLOC(zones->names);
+  }
+  LocalName *entry = calloc(1, sizeof(LocalName));
+  CHECK_ALLOC(entry);
+  entry->name = strdup(name);
+  CHECK_ALLOC(entry->name);
+  zones->names[zones->name_count] = entry;
+  map_put(zones->name_map, entry->name, (uint32_t) zones->name_count++);
+  local_zone_add_top_label(zones, name);
+  return entry;
+}
+
+LocalAnswer *local_zone_new_answer(LocalName *entry, uint16_t qtype, size_t max_length) {
+  entry->answers = realloc(entry->answers, (entry->answer_count + 1) * sizeof(LocalAnswer));
+  CHECK_ALLOC(entry->answers);
+  LocalAnswer *answer = &entry->answers[entry->answer_count++];
+  *answer = (LocalAnswer) { .qtype = qtype };
+  answer->answer = malloc(max_length);
+  CHECK_ALLOC(answer->answer);
+  answer->header[0] = 0x84; // Authoritative response, the RD flag is copied from the query
+  answer->header[1] = 0x80; // Recursion available
+  answer->header[3] = 0x01; // One question
+  return answer;
+}
+
+LocalZones *local_zones_new(void) {
+  LocalZones *zones = calloc(1, sizeof(LocalZones));
+  CHECK_ALLOC(zones);
+  zones->name_map = map_new();
+  zones->zones = map_new();
+
+  // Names that public resolvers can only answer with NXDOMAIN, after a round trip
+  const char *defaults[] = {
+    "lan", "local", "internal", "home.arpa", "10.in-addr.arpa", "168.192.in-addr.arpa",
+    "254.169.in-addr.arpa"
+  };
+  for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+    local_zone_add_zone(zones, defaults[i]);
+  }
+  for (int octet = 16; octet < 32; octet++) {
+    char zone[32];
+    snprintf(zone, sizeof(zone), "%d.172.in-addr.arpa", octet);
+    local_zone_add_zone(zones, zone);
+  }
+
+  LocalAnswer *nxdomain = local_zone_new_answer(&zones->nxdomain, 0, 1);
+  nxdomain->header[1] |= RCODE_NXDOMAIN;
+  return zones;
+}
+
+/*
+ * - Adds a record to a name, as on a line of a local zone file
+ * - Returns true on success, false on failure
+ */
+bool local_zone_add_record(LocalZones *zones, const char *name, const char *type,
+    const char *value) {
+  LocalRecord record = {0};
+  char target[MAX_NAME_LENGTH + 1];
+  if (!strcasecmp(type, "A") && inet_pton(AF_INET, value, record.data) == 1) {
+    record.type = QTYPE_A;
+    record.data_length = 4;
+  } else if (!strcasecmp(type, "AAAA") && inet_pton(AF_INET6, value, record.data) == 1) {
+    record.type = QTYPE_AAAA;
+    record.data_length = 16;
+  } else if ((!strcasecmp(type, "CNAME") || !strcasecmp(type, "PTR"))
+      && local_zone_normalize(value, target)) {
+    record.type = !strcasecmp(type, "CNAME") ? QTYPE_CNAME : QTYPE_PTR;
+    record.data_length = (uint16_t) local_zone_encode(target, record.data);
+    if (record.type == QTYPE_CNAME) {
+      record.target = strdup(target);
+      CHECK_ALLOC(record.target);
+    }
+  } else {
+    fprintf(stderr, "[LocalZone] Invalid %s record %s for %s!\n", type, value, name);
+    return false;
+  }
+
+  LocalName *entry = local_zone_get_name(zones, name);
+  entry->records = realloc(entry->records, (entry->record_count + 1) * sizeof(LocalRecord));
+  CHECK_ALLOC(entry->records);
+  entry->records[entry->record_count++] = record;
+  return true;
+}
+
+bool local_zones_load(LocalZones *zones, const char *path) {
+  FILE *file = fopen(path, "r");
+
+  if (!file) {
+    fprintf(stderr, "[LocalZone] Failed to open local zone file %s!\n", path);
+    return false;
+  }
+
+  char buffer[1024];
+  char raw_name[256];
+  char type[16];
+  char value[256];
+  char name[MAX_NAME_LENGTH + 1];
+  uint32_t line = 0;
+  bool success = true;
+  while (fgets(buffer, sizeof(buffer), file)) {
+    line++;
+    const int fields = sscanf(buffer, "%255s %15s %255s", raw_name, type, value);
+    if (buffer[0] == '#' || fields < 1) {
+      // Skip comments and blank lines
+      continue;
+    }
+
+    bool valid = fields >= 2 && local_zone_normalize(raw_name, name);
+    if (valid && fields == 2 && !strcasecmp(type, "local")) {
+      local_zone_add_zone(zones, name);
+    } else if (valid && fields == 3) {
+      valid = local_zone_add_record(zones, name, type, value);
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      fprintf(stderr, "[LocalZone] Skipping invalid entry on line %" PRIu32 " of %s!\n", line, path);
+      success = false;
+    }
+  }
+
+  fclose(file);
+  return success;
+}
+
+/*
+ * Appends a record with an owner name pointer to an answer, returning false if it's too long
+ */
+bool local_zone_append(LocalAnswer *answer, size_t max_length, uint16_t owner,
+    const LocalRecord *record) {
+  const size_t length = RECORD_HEADER_LENGTH + record->data_length;
+  if (answer->answer_length + length > max_length) {
+    return false;
+  }
+
+  uint8_t *data = answer->answer + answer->answer_length;
+  data[0] = 0xc0 | (owner >> 8);
+  data[1] = (uint8_t) owner;
+  data[2] = record->type >> 8;
+  data[3] = (uint8_t) record->type;
+  data[4] = 0;
+  data[5] = 0x01; // IN class
+  data[6] = LOCAL_TTL >> 24;
+  data[7] = (LOCAL_TTL >> 16) & 0xff;
+  data[8] = (LOCAL_TTL >> 8) & 0xff;
+  data[9] = LOCAL_TTL & 0xff;
+  data[10] = record->data_length >> 8;
+  data[11] = (uint8_t) record->data_length;
+  memcpy(data + RECORD_HEADER_LENGTH, record->data, record->data_length);
+  answer->answer_length += length;
+
+  const uint16_t count = ((answer->header[4] << 8) | answer->header[5]) + 1;
+  answer->header[4] = count >> 8;
+  answer->header[5] = (uint8_t) count;
+  return true;
+}
+
+/*
+ * Appends the records of a given type to an answer, returning false if they don't fit
+ */
+bool local_zone_append_type(LocalAnswer *answer, size_t max_length, uint16_t owner,
+    const LocalName *entry, uint16_t type) {
+  for (size_t i = 0; i < entry->record_count; i++) {
+    if (entry->records[i].type == type
+        && !local_zone_append(answer, max_length, owner, &entry->records[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * - Builds the answers of a name for every type of its records
+ * - Names with a CNAME record answer every other type with the records of that type of the
+ *   target, if it's local, following the CNAME record
+ */
+bool local_zone_build(const LocalZones *zones, LocalName *entry) {
+  uint8_t wire[MAX_WIRE_NAME];
+  const size_t question_length = local_zone_encode(entry->name, wire) + 4;
+  const size_t max_length = MAX_MESSAGE_LENGTH - QUESTION_START_BYTE - question_length;
+
+  const LocalRecord *cname = NULL;
+  for (size_t i = 0; i < entry->record_count; i++) {
+    if (entry->records[i].type == QTYPE_CNAME) {
+      cname = &entry->records[i];
+    }
+  }
+  if (cname && entry->record_count > 1) {
+    fprintf(stderr, "[LocalZone] %s can't have other records next to its CNAME record!\n", entry->name);
+    return false;
+  }
+
+  const uint16_t types[] = { QTYPE_A, QTYPE_AAAA, QTYPE_PTR, QTYPE_CNAME };
+  bool fits = true;
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]) && fits; t++) {
+    const uint16_t type = types[t];
+    if (cname) {
+      // The target's records are owned by the name in the CNAME record's data
+      uint32_t index;
+      const LocalName *target = type != QTYPE_CNAME && map_get(zones->name_map, cname->target, &index)
+          ? zones->names[index]
+          : NULL;
+      bool has_type = type == QTYPE_CNAME;
+      for (size_t i = 0; target && i < target->record_count; i++) {
+        has_type |= target->records[i].type == type;
+      }
+      if (has_type) {
+        const uint16_t target_owner = QUESTION_START_BYTE + question_length + RECORD_HEADER_LENGTH;
+        LocalAnswer *answer = local_zone_new_answer(entry, type, max_length);
+        fits = local_zone_append(answer, max_length, QUESTION_START_BYTE, cname)
+            && (!target || local_zone_append_type(answer, max_length, target_owner, target, type));
+      }
+    } else {
+      bool has_type = false;
+      for (size_t i = 0; i < entry->record_count; i++) {
+        has_type |= entry->records[i].type == type;
+      }
+      if (has_type) {
+        fits = local_zone_append_type(local_zone_new_answer(entry, type, max_length), max_length,
+            QUESTION_START_BYTE, entry, type);
+      }
+    }
+  }
+  if (!fits) {
+    fprintf(stderr, "[LocalZone] %s has too many records to answer!\n", entry->name);
+    return false;
+  }
+
+  // Other types are answered with the CNAME record alone, or with no records
+  LocalAnswer *other = local_zone_new_answer(entry, 0, max_length);
+  if (cname) {
+    local_zone_append(other, max_length, QUESTION_START_BYTE, cname);
+  }
+  return true;
+}
+
+bool local_zones_finish(LocalZones *zones) {
+  bool success = true;
+  for (size_t i = 0; i < zones->name_count; i++) {
+    success &= local_zone_build(zones, zones->names[i]);
+  }
+  printf("[LocalZone] Answering %zu names and %zu zones locally\n", zones->name_count,
+      zones->zone_count);
+  return success;
+}
+
+/*
+ * Lowercases a name of up to max_length characters into output, returning false if it's longer
+ */
+bool local_zone_fold(const char *input, char *output, size_t max_length) {
+  for (size_t i = 0; i <= max_length; i++) {
+    const char c = input[i];
+    output[i] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+    if (c == '\0') {
+      return true;
+    }
+  }
+  return false;
+}
+
+const LocalName *local_zones_lookup(const LocalZones *zones, const char *domain) {
+  // Most domains are ruled out by their last label, without folding and looking up the name
+  if (!local_zone_has_top_label(zones, domain)) {
+    return NULL;
+  }
+
+  uint32_t index;
+  char name[MAX_NAME_LENGTH + 1];
+  if (!local_zone_fold(domain, name, MAX_NAME_LENGTH)) {
+    return NULL;
+  }
+  if (map_get(zones->name_map, name, &index)) {
+    return zones->names[index];
+  }
+  for (const char *suffix = name; suffix; suffix = strchr(suffix, '.')) {
+    if (*suffix == '.') {
+      suffix++;
+    }
+    if (map_get(zones->zones, suffix, &index)) {
+      return &zones->nxdomain;
+    }
+  }
+  return NULL;
+}
+
+bool local_zones_apply(const LocalName *name, Message *message) {
+  const size_t offset = message_question_end(message);
+  if (!offset) {
+    return false;
+  }
+
+  const uint16_t qtype = (message->data[offset - 4] << 8) | message->data[offset - 3];
+  const LocalAnswer *answer = &name->answers[name->answer_count - 1];
+  for (size_t i = 0; i + 1 < name->answer_count; i++) {
+    if (name->answers[i].qtype == qtype) {
+      answer = &name->answers[i];
+      break;
+    }
+  }
+  return message_respond(message, offset, answer->header, answer->answer, answer->answer_length);
+}
+
+void local_zone_free_name(LocalName *entry) {
+  for (size_t i = 0; i < entry->record_count; i++) {
+    free(entry->records[i].target);
+  }
+  for (size_t i = 0; i < entry->answer_count; i++) {
+    free(entry->answers[i].answer);
+  }
+  free(entry->records);
+  free(entry->answers);
+  free(entry->name);
+}
+
+void local_zones_free(LocalZones *zones) {
+  for (size_t i = 0; i < zones->name_count; i++) {
+    local_zone_free_name(zones->names[i]);
+    free(zones->names[i]);
+  }
+  local_zone_free_name(&zones->nxdomain);
+  free(zones->names);
+  map_free(zones->name_map);
+  map_free_opts(zones->zones, true);
+  for (size_t i = 0; i < zones->top_label_count; i++) {
+    free(zones->top_labels[i]);
+  }
+  free(zones->top_labels);
+  free(zones->top_label_lengths);
+  free(zones);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "message.h"
+
+typedef struct LocalZones LocalZones;
+typedef struct LocalName LocalName;
+
+/*
+ * Creates a table of local names holding the built-in zones which are never forwarded: lan,
+ * local, internal, home.arpa and the reverse zones of private and link-local IPv4 addresses
+ */
+LocalZones *local_zones_new(void);
+
+/*
+ * - Loads local records and zones from a file
+ * - Each line has the form "<name> <A|AAAA|CNAME|PTR> <value>" for a record, or
+ *   "<name> local" for a zone whose names are never forwarded
+ * - Returns true on success, false on failure
+ */
+bool local_zones_load(LocalZones *zones, const char *path);
+
+/*
+ * - Builds the wire-format answers of all names, after which the table is read-only and can
+ *   be searched by any number of threads
+ * - Returns true on success, false if a name has conflicting or too many records
+ */
+bool local_zones_finish(LocalZones *zones);
+
+/*
+ * Returns the local name a domain is answered with, or NULL if it's not in a local zone and
+ * has no local records
+ */
+const LocalName *local_zones_lookup(const LocalZones *zones, const char *domain);
+
+/*
+ * - Turns a query into the answer of a local name in place: its records of the queried type,
+ *   no records if it has none of that type, or NXDOMAIN if it only lies in a local zone
+ * - Returns false if the message isn't a query with a single valid question
+ */
+bool local_zones_apply(const LocalName *name, Message *message);
+
+/*
+ * Frees memory allocated for the local zones
+ */
+void local_zones_free(LocalZones *zones);
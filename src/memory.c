@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include "memory.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+#define HUGE_PAGE_SIZE (2ul * 1024 * 1024)
+// Number of bits in the node masks passed to the kernel
+#define MAX_NODES 64
+
+PageMode page_mode = PAGES_DEFAULT;
+bool explicit_pages_available = true;
+// NUMA node of the CPU the calling thread is pinned to, -1 if it isn't pinned
+_Thread_local int pinned_node = -1;
+
+void memory_configure(PageMode mode) {
+  page_mode = mode;
+}
+
+size_t round_to_huge_pages(size_t size) {
+  return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Maps anonymous memory aligned to a hugepage boundary, so that the kernel can back
+ * it with transparent hugepages
+ */
+void *map_aligned(size_t length) {
+  const size_t padded = length + HUGE_PAGE_SIZE;
+  uint8_t *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    fatal_error("Failed to map %zu bytes of memory with error: %d", padded, errno);
+  }
+
+  uint8_t *aligned = (uint8_t *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  const size_t head = aligned - raw;
+  const size_t tail = padded - head - length;
+  if (head) {
+    munmap(raw, head);
+  }
+  if (tail) {
+    munmap(aligned + length, tail);
+  }
+  return aligned;
+}
+
+void *memory_alloc(size_t size, int node) {
+  if (size < HUGE_PAGE_SIZE) {
+    void *ptr = calloc(1, size ? size : 1);
+    CHECK_ALLOC(ptr);
+    return ptr;
+  }
+
+  const size_t length = round_to_huge_pages(size);
+  void *ptr = MAP_FAILED;
+  if (page_mode == PAGES_EXPLICIT && explicit_pages_available) {
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      fprintf(stderr, "[Memory] Failed to map explicit hugepages with error: %d, "
+          "falling back to transparent hugepages!\n", errno);
+      explicit_pages_available = false;
+    }
+  }
+
+  if (ptr == MAP_FAILED) {
+    ptr = map_aligned(length);
+    if (page_mode != PAGES_DEFAULT && madvise(ptr, length, MADV_HUGEPAGE) == -1) {
+      fprintf(stderr, "[Memory] Failed to request transparent hugepages with error: %d\n", errno);
+    }
+  }
+
+  // Bind the pages to the node before they are first touched
+  if (node >= 0 && node < MAX_NODES) {
+    const unsigned long mask = 1ul << node;
+    if (syscall(SYS_mbind, ptr, length, MPOL_BIND, &mask, MAX_NODES + 1, 0) == -1) {
+      fprintf(stderr, "[Memory] Failed to bind memory to node %d with error: %d\n", node, errno);
+    }
+  }
+  return ptr;
+}
+
+void memory_free(void *ptr, size_t size) {
+  if (size < HUGE_PAGE_SIZE) {
+    free(ptr);
+  } else {
+    munmap(ptr, round_to_huge_pages(size));
+  }
+}
+
+size_t shared_mapping_length(size_t size) {
+  if (size >= HUGE_PAGE_SIZE) {
+    return round_to_huge_pages(size);
+  }
+  const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+void *memory_alloc_shared(size_t size) {
+  const size_t length = shared_mapping_length(size ? size : 1);
+  void *ptr = MAP_FAILED;
+  if (page_mode == PAGES_EXPLICIT && explicit_pages_available && size >= HUGE_PAGE_SIZE) {
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      fprintf(stderr, "[Memory] Failed to map explicit hugepages with error: %d, "
+          "falling back to transparent hugepages!\n", errno);
+      explicit_pages_available = false;
+    }
+  }
+
+  if (ptr == MAP_FAILED) {
+    // Shared memory is aligned to hugepages by the kernel when they are enabled for it
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      fatal_error("Failed to map %zu bytes of shared memory with error: %d", length, errno);
+    }
+    if (page_mode != PAGES_DEFAULT && size >= HUGE_PAGE_SIZE
+        && madvise(ptr, length, MADV_HUGEPAGE) == -1) {
+      fprintf(stderr, "[Memory] Failed to request transparent hugepages with error: %d\n", errno);
+    }
+  }
+  return ptr;
+}
+
+void memory_free_shared(void *ptr, size_t size) {
+  munmap(ptr, shared_mapping_length(size ? size : 1));
+}
+
+void memory_report(const char *name, const void *ptr, size_t size) {
+  // Find the mapping of the memory and its page sizes
+  unsigned long page_size = (unsigned long) sysconf(_SC_PAGESIZE) / 1024;
+  unsigned long huge_pages = 0;
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps) {
+    char line[256];
+    bool in_mapping = false;
+    while (fgets(line, sizeof(line), smaps)) {
+      unsigned long start, end, value;
+      if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+        if (in_mapping) {
+          break;
+        }
+        in_mapping = start <= (uintptr_t) ptr && (uintptr_t) ptr < end;
+      } else if (in_mapping && sscanf(line, "KernelPageSize: %lu kB", &value) == 1) {
+        page_size = value;
+      } else if (in_mapping && sscanf(line, "AnonHugePages: %lu kB", &value) == 1) {
+        huge_pages = value;
+      }
+    }
+    fclose(smaps);
+  }
+
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, ptr, MPOL_F_NODE | MPOL_F_ADDR) == -1) {
+    node = -1;
+  }
+
+  printf("[Memory] %s: %zu kB on node %d, %lu kB pages, %lu kB in transparent hugepages\n",
+      name, size / 1024, node, page_size, huge_pages);
+}
+
+size_t memory_nodes(int *nodes, size_t max_nodes) {
+  size_t count = 0;
+  FILE *file = fopen("/sys/devices/system/node/online", "r");
+  if (file) {
+    // The file holds comma separated ranges, such as "0-1,3"
+    int first, last;
+    char separator;
+    while (count < max_nodes && fscanf(file, "%d", &first) == 1) {
+      last = first;
+      if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+        if (fscanf(file, "%d", &last) != 1) {
+          break;
+        }
+        fscanf(file, "%c", &separator);
+      }
+      for (int node = first; node <= last && count < max_nodes; node++) {
+        nodes[count++] = node;
+      }
+    }
+    fclose(file);
+  }
+
+  if (count == 0 && max_nodes > 0) {
+    // Kernels without NUMA support have a single node
+    nodes[count++] = 0;
+  }
+  return count;
+}
+
+void memory_pin_thread(void) {
+  pinned_node = -1;
+  pinned_node = memory_current_node();
+}
+
+int memory_current_node(void) {
+  if (pinned_node >= 0) {
+    return pinned_node;
+  }
+  // The scheduler may have moved the thread since its last call
+  unsigned int cpu, node;
+  return syscall(SYS_getcpu, &cpu, &node, NULL) == -1 ? 0 : (int) node;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  // Regular pages
+  PAGES_DEFAULT,
+  // Transparent hugepages, requested with madvise
+  PAGES_TRANSPARENT,
+  // Hugepages reserved in the hugetlbfs pool, falling back to transparent hugepages
+  PAGES_EXPLICIT
+} PageMode;
+
+/*
+ * Sets the kind of pages used for large allocations, which should be done before any
+ * lookup tables are allocated
+ */
+void memory_configure(PageMode mode);
+
+/*
+ * - Allocates zeroed memory for a large lookup structure, backed by hugepages if configured
+ * - If node is not negative, the memory is bound to that NUMA node
+ * - Small allocations always come from the heap
+ */
+void *memory_alloc(size_t size, int node);
+
+/*
+ * Frees memory allocated with memory_alloc, size being the size it was allocated with
+ */
+void memory_free(void *ptr, size_t size);
+
+/*
+ * - Allocates zeroed memory shared with the processes forked afterwards, backed by hugepages
+ *   if configured and the size is at least a hugepage
+ * - Unlike memory_alloc, small allocations are mapped as well
+ */
+void *memory_alloc_shared(size_t size);
+
+/*
+ * Frees memory allocated with memory_alloc_shared, size being the size it was allocated with
+ */
+void memory_free_shared(void *ptr, size_t size);
+
+/*
+ * Prints the size, page size and NUMA node of memory allocated with memory_alloc
+ */
+void memory_report(const char *name, const void *ptr, size_t size);
+
+/*
+ * Stores the ids of the online NUMA nodes to nodes, returning their count
+ */
+size_t memory_nodes(int *nodes, size_t max_nodes);
+
+/*
+ * Caches the NUMA node of the calling thread, once it's pinned to a CPU, for memory_current_node
+ */
+void memory_pin_thread(void);
+
+/*
+ * Returns the NUMA node of the CPU the calling thread runs on, which is only cached for
+ * threads pinned with memory_pin_thread
+ */
+int memory_current_node(void);
@@ -29,10 +29,17 @@ uint16_t get_qtype_code(Message *message) {
 char *parse_dns_domain(const Message *message, size_t *length) {
   char *domain = NULL;
   const uint8_t *cur = &message->data[QUESTION_START_BYTE];
+  const uint8_t *end = &message->data[message->length];
 
   *length = 0;
 
-  while (*cur) {
+  // Names running past the end of the message or using compression are malformed
+  while (cur < end && *cur) {
+    if (*cur > 63 || cur + 1 + *cur >= end) {
+      free(domain);
+      return NULL;
+    }
+
     if (domain) {
       // Allocate space for (current label) + (.) + (next label) + (\0)
       domain = realloc(domain, *length + 1 + *cur + 1);
@@ -49,6 +56,210 @@ char *parse_dns_domain(const Message *message, size_t *length) {
     cur += *cur + 1;
   }
 
+  if (cur >= end) {
+    free(domain);
+    return NULL;
+  }
+
   *length += 2;
   return domain;
 }
+
+bool message_truncate(Message *message) {
+  // Skip over the labels of the question name
+  size_t offset = QUESTION_START_BYTE;
+  while (offset < message->length && message->data[offset]) {
+    offset += message->data[offset] + 1;
+  }
+
+  // Question name terminator, QTYPE and QCLASS
+  offset += 5;
+  if (offset > message->length) {
+    return false;
+  }
+
+  message->length = offset;
+  message->data[2] |= 0x02; // TC flag
+  memset(message->data + 6, 0, 6); // No answer, authority or additional records
+  return true;
+}
+
+#define QTYPE_A 1
+#define QTYPE_AAAA 28
+#define QTYPE_OPT 41
+#define RCODE_NXDOMAIN 3
+#define RCODE_REFUSED 5
+
+void block_template_init(ResponseTemplate *template, BlockMode mode, uint16_t qtype, uint32_t ttl) {
+  *template = (ResponseTemplate) {0};
+  uint8_t *header = template->header;
+  header[0] = 0x80; // Response, the RD flag is copied from the query
+  header[1] = 0x80; // Recursion available
+  header[3] = 0x01; // One question
+
+  if (mode == BLOCK_MODE_NXDOMAIN) {
+    header[1] |= RCODE_NXDOMAIN;
+  } else if (mode == BLOCK_MODE_REFUSED) {
+    header[1] |= RCODE_REFUSED;
+  }
+  if (mode != BLOCK_MODE_ZERO || (qtype != QTYPE_A && qtype != QTYPE_AAAA)) {
+    return;
+  }
+
+  // A single unroutable address record, with a pointer to the question name
+  const uint16_t address_length = qtype == QTYPE_A ? 4 : 16;
+  header[5] = 0x01; // One answer
+  uint8_t *answer = template->answer;
+  answer[0] = 0xc0;
+  answer[1] = QUESTION_START_BYTE;
+  answer[3] = (uint8_t) qtype;
+  answer[5] = 0x01; // IN class
+  answer[6] = ttl >> 24;
+  answer[7] = ttl >> 16;
+  answer[8] = ttl >> 8;
+  answer[9] = ttl;
+  answer[11] = (uint8_t) address_length;
+  // The address bytes are left as 0.0.0.0 or ::
+  template->answer_length = 12 + address_length;
+}
+
+void block_templates_init(BlockTemplates *templates, BlockMode mode, uint32_t ttl) {
+  block_template_init(&templates->types[0], mode, QTYPE_A, ttl);
+  block_template_init(&templates->types[1], mode, QTYPE_AAAA, ttl);
+  block_template_init(&templates->types[2], mode, 0, ttl);
+}
+
+size_t message_question_end(const Message *message) {
+  const uint8_t *data = message->data;
+  if (message->length < QUESTION_START_BYTE || data[4] || data[5] != 1) {
+    return 0;
+  }
+
+  // Find the end of the question, whose name can't be compressed
+  size_t offset = QUESTION_START_BYTE;
+  while (offset < message->length && data[offset]) {
+    if (data[offset] > 63) {
+      return 0;
+    }
+    offset += data[offset] + 1;
+  }
+  offset += 5;
+  return offset > message->length ? 0 : offset;
+}
+
+bool message_respond(Message *message, size_t question_end, const uint8_t *header,
+    const uint8_t *answer, size_t answer_length) {
+  if (question_end + answer_length > MAX_MESSAGE_LENGTH) {
+    return false;
+  }
+
+  uint8_t *data = message->data;
+  const uint8_t recursion_desired = data[2] & 0x01;
+  memcpy(data + 2, header, RESPONSE_HEADER_LENGTH);
+  data[2] |= recursion_desired;
+  memcpy(data + question_end, answer, answer_length);
+  message->length = question_end + answer_length;
+  return true;
+}
+
+bool block_templates_apply(const BlockTemplates *templates, Message *message) {
+  const size_t offset = message_question_end(message);
+  if (!offset) {
+    return false;
+  }
+
+  const uint16_t qtype = (message->data[offset - 4] << 8) | message->data[offset - 3];
+  const ResponseTemplate *template = &templates->types[2];
+  if (qtype == QTYPE_A) {
+    template = &templates->types[0];
+  } else if (qtype == QTYPE_AAAA) {
+    template = &templates->types[1];
+  }
+  return message_respond(message, offset, template->header, template->answer,
+      template->answer_length);
+}
+
+/*
+ * Returns the offset following a possibly compressed name, or 0 if it's out of bounds
+ */
+size_t message_skip_name(const Message *message, size_t offset) {
+  while (offset < message->length) {
+    const uint8_t length = message->data[offset];
+    if ((length & 0xc0) == 0xc0) {
+      return offset + 2;
+    }
+    if (length == 0) {
+      return offset + 1;
+    }
+    offset += length + 1;
+  }
+  return 0;
+}
+
+/*
+ * Walks the TTLs of the records of a response, finding the smallest one and subtracting
+ * elapsed seconds from them in writable, the data of the message, if it isn't NULL
+ */
+bool message_walk_ttls(const Message *message, uint8_t *writable, uint32_t elapsed,
+    uint32_t *min_ttl) {
+  const uint8_t *data = message->data;
+  *min_ttl = UINT32_MAX;
+  if (message->length < QUESTION_START_BYTE) {
+    return false;
+  }
+
+  const uint16_t questions = (data[4] << 8) | data[5];
+  const uint32_t records = ((data[6] << 8) | data[7]) + ((data[8] << 8) | data[9])
+      + ((data[10] << 8) | data[11]);
+
+  size_t offset = QUESTION_START_BYTE;
+  for (uint16_t i = 0; i < questions; i++) {
+    offset = message_skip_name(message, offset);
+    if (!offset || offset + 4 > message->length) {
+      return false;
+    }
+    offset += 4;
+  }
+
+  for (uint32_t i = 0; i < records; i++) {
+    // Name followed by the type, class, TTL and data length
+    offset = message_skip_name(message, offset);
+    if (!offset || offset + 10 > message->length) {
+      return false;
+    }
+    const uint8_t *record = data + offset;
+    const size_t ttl_offset = offset + 4;
+    const uint16_t type = (record[0] << 8) | record[1];
+    const uint16_t data_length = (record[8] << 8) | record[9];
+    offset += 10 + data_length;
+    if (offset > message->length) {
+      return false;
+    }
+    if (type == QTYPE_OPT) {
+      continue;
+    }
+
+    uint32_t ttl = ((uint32_t) record[4] << 24) | ((uint32_t) record[5] << 16)
+        | ((uint32_t) record[6] << 8) | record[7];
+    if (writable && elapsed) {
+      ttl = ttl > elapsed ? ttl - elapsed : 0;
+      writable[ttl_offset] = ttl >> 24;
+      writable[ttl_offset + 1] = ttl >> 16;
+      writable[ttl_offset + 2] = ttl >> 8;
+      writable[ttl_offset + 3] = ttl;
+    }
+    if (ttl < *min_ttl) {
+      *min_ttl = ttl;
+    }
+  }
+  return true;
+}
+
+bool message_min_ttl(const Message *message, uint32_t *min_ttl) {
+  return message_walk_ttls(message, NULL, 0, min_ttl);
+}
+
+bool message_adjust_ttls(Message *message, uint32_t elapsed) {
+  uint32_t min_ttl;
+  return message_walk_ttls(message, message->data, elapsed, &min_ttl);
+}
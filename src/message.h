@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -7,6 +8,10 @@
 
 #define MAX_MESSAGE_LENGTH 512
 #define QUESTION_START_BYTE 12
+#define BLOCK_TEMPLATE_TYPES 3
+#define MAX_TEMPLATE_ANSWER 28
+// Header bytes following the ID, from the flags to the additional record count
+#define RESPONSE_HEADER_LENGTH 10
 
 typedef struct {
   uint16_t port;
@@ -22,6 +27,31 @@ typedef struct {
   size_t length;
 } Message;
 
+typedef enum {
+  // Answers A queries with 0.0.0.0, AAAA queries with :: and other queries with no records
+  BLOCK_MODE_ZERO,
+  // Answers with no records
+  BLOCK_MODE_NODATA,
+  // Answers that the name doesn't exist
+  BLOCK_MODE_NXDOMAIN,
+  // Refuses to answer
+  BLOCK_MODE_REFUSED
+} BlockMode;
+
+typedef struct {
+  uint8_t header[RESPONSE_HEADER_LENGTH];
+  // Records following the question
+  uint8_t answer[MAX_TEMPLATE_ANSWER];
+  size_t answer_length;
+} ResponseTemplate;
+
+/*
+ * Responses to blocked queries, built once for the A, AAAA and other query types
+ */
+typedef struct {
+  ResponseTemplate types[BLOCK_TEMPLATE_TYPES];
+} BlockTemplates;
+
 /*
  * Sets the address and port in an Address structure. The values should
  * be passed in the host byte order and will be set in network byte order.
@@ -41,6 +71,53 @@ void set_message_address_str(Address *result, uint16_t port, const char* address
 uint16_t get_qtype_code(Message *message);
 
 /*
- * Parses the domain name from a DNS request.
+ * Parses the domain name from a DNS request, returning NULL for the root domain or if the
+ * name is malformed.
  */
 char *parse_dns_domain(const Message *message, size_t *length);
+
+/*
+ * - Strips every record following the question section from a response and sets its
+ *   TC flag, telling the client to retry the query over TCP
+ * - Returns false if the message has no valid question section
+ */
+bool message_truncate(Message *message);
+
+/*
+ * Builds the responses to blocked queries for a block mode, with answers living for ttl seconds
+ */
+void block_templates_init(BlockTemplates *templates, BlockMode mode, uint32_t ttl);
+
+/*
+ * Returns the offset following the single question of a query, or 0 if the message doesn't
+ * have a single valid question
+ */
+size_t message_question_end(const Message *message);
+
+/*
+ * - Turns a query into a response in place, replacing the header after the ID with header,
+ *   keeping the RD flag, and everything after the question with the answer records
+ * - Returns false if the response doesn't fit in a message
+ */
+bool message_respond(Message *message, size_t question_end, const uint8_t *header,
+    const uint8_t *answer, size_t answer_length);
+
+/*
+ * - Turns a query into the response to it from the templates in place, keeping the ID and
+ *   question and replacing everything after the question
+ * - Returns false if the message isn't a query with a single valid question
+ */
+bool block_templates_apply(const BlockTemplates *templates, Message *message);
+
+/*
+ * - Finds the smallest TTL of the records of a response, skipping OPT records, as their
+ *   TTL field holds flags. min_ttl is set to UINT32_MAX if the response has no records.
+ * - Returns false if the response is malformed
+ */
+bool message_min_ttl(const Message *message, uint32_t *min_ttl);
+
+/*
+ * - Subtracts elapsed seconds from the TTLs of the records of a response, down to 0
+ * - Returns false if the response is malformed
+ */
+bool message_adjust_ttls(Message *message, uint32_t elapsed);
@@ -0,0 +1,451 @@
+#include "perfect_set.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "utils.h"
+
+// Average number of items sharing a pilot, trading index size against build time
+#define AVERAGE_BUCKET_SIZE 5
+// Percentage of the positions the pilots map items to that are filled, the positions past
+// the item count being remapped to the free ones below it
+#define LOAD_PERCENT 98
+// Number of seeds tried before giving up on finding a perfect hash function
+#define MAX_SEEDS 8
+// Items whose cache misses are overlapped by batched lookups
+#define LOOKUP_BATCH 32
+
+/*
+ * The hash of an item picks its bucket and the pilot of the bucket picks its position among
+ * position_count positions, the pilots being chosen so that no two items share a position.
+ * Positions past the item count are remapped to the positions left free below it, so that
+ * there is exactly one slot per item. The set is stored in a single allocation laid out as the
+ * arrays below:
+ * - masks: distinct list masks of the items, referenced by index from data
+ * - slots: fingerprint and name offset of the item at every position
+ * - remap: slot of every position past the item count
+ * - pilots: pilot of every bucket
+ * - data: name of every item, preceded by its mask index as an LEB128 varint and followed
+ *   by a null byte
+ * The hit counters of the items are allocated separately, indexed by slot.
+ */
+typedef struct {
+  uint32_t fingerprint;
+  uint32_t offset;
+} PerfectSlot;
+
+struct PerfectSet {
+  uint8_t *blob;
+  size_t blob_size;
+  size_t item_count;
+  size_t position_count;
+  size_t bucket_count;
+  size_t mask_count;
+  uint64_t seed;
+  ListMask *masks;
+  PerfectSlot *slots;
+  uint32_t *remap;
+  uint16_t *pilots;
+  uint8_t *data;
+  HitCounter *hits;
+};
+
+typedef struct {
+  const char *value;
+  uint64_t hash;
+  ListMask lists;
+  uint32_t bucket;
+  uint32_t position;
+} PerfectItem;
+
+typedef struct {
+  PerfectItem *items;
+  size_t count;
+} PerfectItems;
+
+/*
+ * Maps a 32-bit value to [0, range) with a multiplication instead of a division
+ */
+uint32_t perfect_reduce(uint32_t value, size_t range) {
+  return (uint32_t) (((uint64_t) value * range) >> 32);
+}
+
+uint32_t perfect_bucket(uint64_t hash, size_t bucket_count) {
+  return perfect_reduce((uint32_t) (hash >> 32), bucket_count);
+}
+
+uint32_t perfect_position(uint64_t hash, uint64_t seed, uint16_t pilot, size_t position_count) {
+  uint64_t x = hash ^ seed ^ (pilot * 0x9e3779b97f4a7c15ull);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return perfect_reduce((uint32_t) (x >> 32), position_count);
+}
+
+const uint8_t *perfect_read_varint(const uint8_t *data, size_t *value) {
+  *value = 0;
+  for (unsigned int shift = 0; ; shift += 7) {
+    const uint8_t byte = *data++;
+    *value |= (size_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return data;
+    }
+  }
+}
+
+size_t perfect_varint_size(size_t value) {
+  size_t size = 1;
+  while (value >>= 7) {
+    size++;
+  }
+  return size;
+}
+
+size_t perfect_write_varint(uint8_t *data, size_t value) {
+  size_t size = 0;
+  do {
+    const uint8_t byte = value & 0x7f;
+    value >>= 7;
+    data[size++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return size;
+}
+
+int perfect_compare_masks(const void *first, const void *second) {
+  const ListMask a = *(const ListMask *) first;
+  const ListMask b = *(const ListMask *) second;
+  return (a > b) - (a < b);
+}
+
+size_t perfect_find_mask(const ListMask *masks, size_t mask_count, ListMask lists) {
+  size_t low = 0;
+  size_t high = mask_count;
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (masks[middle] < lists) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+void perfect_collect_item(const char *value, ListMask lists, const HitCounter *hits,
+    void *context) {
+  PerfectItems *items = context;
+  PerfectItem *item = items->items + items->count++;
+  item->value = value;
+  item->hash = hash(value);
+  item->lists = lists;
+}
+
+/*
+ * - Searches for the pilots of all buckets with a seed, placing the largest buckets first while
+ *   most positions are still free
+ * - Items are sorted by bucket, bucket_starts holding the index of the first item of every
+ *   bucket and bucket_order the buckets sorted by decreasing size
+ * - Returns true iff every bucket got a pilot mapping its items to free positions
+ */
+bool perfect_place(PerfectItem *items, const uint32_t *bucket_starts, const uint32_t *bucket_order,
+    size_t bucket_count, uint64_t seed, size_t position_count, uint16_t *pilots, uint8_t *taken) {
+  memset(taken, 0, position_count);
+  memset(pilots, 0, bucket_count * sizeof(uint16_t));
+  for (size_t i = 0; i < bucket_count; i++) {
+    const uint32_t bucket = bucket_order[i];
+    const uint32_t start = bucket_starts[bucket];
+    const uint32_t end = bucket_starts[bucket + 1];
+    if (start == end) {
+      break;
+    }
+
+    bool placed = false;
+    for (uint32_t pilot = 0; pilot <= UINT16_MAX && !placed; pilot++) {
+      uint32_t j = start;
+      for (; j < end; j++) {
+        const uint32_t position = perfect_position(items[j].hash, seed, (uint16_t) pilot,
+            position_count);
+        if (taken[position]) {
+          break;
+        }
+        taken[position] = 1;
+        items[j].position = position;
+      }
+      placed = j == end;
+      if (!placed) {
+        // Free the positions taken by the items placed before the collision
+        while (j-- > start) {
+          taken[items[j].position] = 0;
+        }
+      } else {
+        pilots[bucket] = (uint16_t) pilot;
+      }
+    }
+    if (!placed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Points the arrays of a perfect set into its blob
+ */
+void perfect_set_attach(PerfectSet *set, uint8_t *blob) {
+  set->blob = blob;
+  set->masks = (ListMask *) blob;
+  set->slots = (PerfectSlot *) (set->masks + set->mask_count);
+  set->remap = (uint32_t *) (set->slots + set->item_count);
+  set->pilots = (uint16_t *) (set->remap + (set->position_count - set->item_count));
+  set->data = (uint8_t *) (set->pilots + set->bucket_count);
+}
+
+PerfectSet *perfect_set_build(const Set *set) {
+  PerfectItems items = { malloc((set_size(set) + 1) * sizeof(PerfectItem)), 0 };
+  CHECK_ALLOC(items.items);
+  set_foreach(set, perfect_collect_item, &items);
+  const size_t count = items.count;
+  if (count > UINT32_MAX / 2) {
+    free(items.items);
+    return NULL;
+  }
+
+  const size_t bucket_count = count / AVERAGE_BUCKET_SIZE + 1;
+  const size_t position_count = count + count * (100 - LOAD_PERCENT) / LOAD_PERCENT;
+
+  // Sort the items by bucket and the buckets by decreasing size, with counting sorts
+  uint32_t *bucket_starts = calloc(bucket_count + 1, sizeof(uint32_t));
+  uint32_t *bucket_order = malloc(bucket_count * sizeof(uint32_t));
+  PerfectItem *sorted = malloc((count + 1) * sizeof(PerfectItem));
+  CHECK_ALLOC(bucket_starts);
+  CHECK_ALLOC(bucket_order);
+  CHECK_ALLOC(sorted);
+  size_t max_bucket_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    items.items[i].bucket = perfect_bucket(items.items[i].hash, bucket_count);
+    const uint32_t size = ++bucket_starts[items.items[i].bucket + 1];
+    if (size > max_bucket_size) {
+      max_bucket_size = size;
+    }
+  }
+  size_t *size_starts = calloc(max_bucket_size + 2, sizeof(size_t));
+  CHECK_ALLOC(size_starts);
+  for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+    size_starts[max_bucket_size - bucket_starts[bucket + 1] + 1]++;
+  }
+  for (size_t size = 1; size <= max_bucket_size + 1; size++) {
+    size_starts[size] += size_starts[size - 1];
+  }
+  for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+    bucket_order[size_starts[max_bucket_size - bucket_starts[bucket + 1]]++] = (uint32_t) bucket;
+  }
+  for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+    bucket_starts[bucket + 1] += bucket_starts[bucket];
+  }
+  uint32_t *next = malloc((bucket_count + 1) * sizeof(uint32_t));
+  CHECK_ALLOC(next);
+  memcpy(next, bucket_starts, bucket_count * sizeof(uint32_t));
+  for (size_t i = 0; i < count; i++) {
+    sorted[next[items.items[i].bucket]++] = items.items[i];
+  }
+  free(next);
+  free(size_starts);
+  free(items.items);
+
+  // Collect the distinct masks, most sets only having a handful of them
+  ListMask *masks = malloc((count + 1) * sizeof(ListMask));
+  CHECK_ALLOC(masks);
+  for (size_t i = 0; i < count; i++) {
+    masks[i] = sorted[i].lists;
+  }
+  qsort(masks, count, sizeof(ListMask), perfect_compare_masks);
+  size_t mask_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (mask_count == 0 || masks[mask_count - 1] != masks[i]) {
+      masks[mask_count++] = masks[i];
+    }
+  }
+
+  size_t data_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    data_size += perfect_varint_size(perfect_find_mask(masks, mask_count, sorted[i].lists))
+        + strlen(sorted[i].value) + 1;
+  }
+
+  // Search for pilots, retrying with another seed in the unlikely case a bucket has none
+  uint16_t *pilots = malloc(bucket_count * sizeof(uint16_t));
+  uint8_t *taken = malloc(position_count + 1);
+  CHECK_ALLOC(pilots);
+  CHECK_ALLOC(taken);
+  uint64_t seed = 0;
+  bool placed = false;
+  for (uint32_t attempt = 0; attempt < MAX_SEEDS && !placed && data_size <= UINT32_MAX; attempt++) {
+    seed = hash_bytes(&attempt, sizeof(attempt));
+    placed = perfect_place(sorted, bucket_starts, bucket_order, bucket_count, seed,
+        position_count, pilots, taken);
+  }
+  free(bucket_starts);
+  free(bucket_order);
+
+  PerfectSet *perfect = NULL;
+  if (placed) {
+    perfect = malloc(sizeof(PerfectSet));
+    CHECK_ALLOC(perfect);
+    perfect->item_count = count;
+    perfect->position_count = position_count;
+    perfect->bucket_count = bucket_count;
+    perfect->mask_count = mask_count;
+    perfect->seed = seed;
+    perfect->blob_size = mask_count * sizeof(ListMask) + count * sizeof(PerfectSlot)
+        + (position_count - count) * sizeof(uint32_t) + bucket_count * sizeof(uint16_t)
+        + data_size;
+    perfect_set_attach(perfect, memory_alloc(perfect->blob_size, -1));
+    perfect->hits = calloc(count + 1, sizeof(HitCounter));
+    CHECK_ALLOC(perfect->hits);
+    memcpy(perfect->masks, masks, mask_count * sizeof(ListMask));
+    memcpy(perfect->pilots, pilots, bucket_count * sizeof(uint16_t));
+
+    // Remap the taken positions past the item count to the free ones below it
+    size_t free_position = 0;
+    for (size_t position = count; position < position_count; position++) {
+      if (taken[position]) {
+        while (taken[free_position]) {
+          free_position++;
+        }
+        perfect->remap[position - count] = (uint32_t) free_position++;
+      }
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+      const PerfectItem *item = sorted + i;
+      const size_t position = item->position < count
+          ? item->position
+          : perfect->remap[item->position - count];
+      perfect->slots[position] = (PerfectSlot) { (uint32_t) item->hash, (uint32_t) offset };
+      offset += perfect_write_varint(perfect->data + offset,
+          perfect_find_mask(masks, mask_count, item->lists));
+      const size_t length = strlen(item->value) + 1;
+      memcpy(perfect->data + offset, item->value, length);
+      offset += length;
+    }
+  }
+
+  free(sorted);
+  free(masks);
+  free(pilots);
+  free(taken);
+  return perfect;
+}
+
+/*
+ * Returns the slot of an item given the hash of its name and the pilot of its bucket
+ */
+size_t perfect_slot(const PerfectSet *set, uint64_t value_hash, uint16_t pilot) {
+  const size_t position = perfect_position(value_hash, set->seed, pilot, set->position_count);
+  return position < set->item_count ? position : set->remap[position - set->item_count];
+}
+
+/*
+ * Compares an item to the one in its slot, returning the mask of the lists it belongs to
+ */
+ListMask perfect_match(const PerfectSet *set, size_t position, uint64_t value_hash,
+    const char *value, HitCounter **hits) {
+  // Only names whose fingerprint matches the one of the item at their position are compared
+  const PerfectSlot slot = set->slots[position];
+  if (slot.fingerprint != (uint32_t) value_hash) {
+    return 0;
+  }
+  size_t mask_index;
+  const char *name = (const char *) perfect_read_varint(set->data + slot.offset, &mask_index);
+  if (strcmp(name, value)) {
+    return 0;
+  }
+  if (hits) {
+    *hits = set->hits + position;
+  }
+  return set->masks[mask_index];
+}
+
+ListMask perfect_set_lookup(const PerfectSet *set, const char *value, HitCounter **hits) {
+  if (set->item_count == 0) {
+    return 0;
+  }
+
+  const uint64_t value_hash = hash(value);
+  const uint16_t pilot = set->pilots[perfect_bucket(value_hash, set->bucket_count)];
+  return perfect_match(set, perfect_slot(set, value_hash, pilot), value_hash, value, hits);
+}
+
+void perfect_set_lookup_batch(const PerfectSet *set, const char *const *values, size_t count,
+    ListMask *results, HitCounter **hits) {
+  if (set->item_count == 0) {
+    memset(results, 0, count * sizeof(ListMask));
+    return;
+  }
+
+  uint64_t hashes[LOOKUP_BATCH];
+  const uint16_t *pilots[LOOKUP_BATCH];
+  size_t positions[LOOKUP_BATCH];
+  for (size_t first = 0; first < count; first += LOOKUP_BATCH) {
+    const size_t batch = count - first < LOOKUP_BATCH ? count - first : LOOKUP_BATCH;
+    const char *const *batch_values = values + first;
+
+    for (size_t i = 0; i < batch; i++) {
+      hashes[i] = hash(batch_values[i]);
+      pilots[i] = set->pilots + perfect_bucket(hashes[i], set->bucket_count);
+      __builtin_prefetch(pilots[i]);
+    }
+    for (size_t i = 0; i < batch; i++) {
+      positions[i] = perfect_slot(set, hashes[i], *pilots[i]);
+      __builtin_prefetch(set->slots + positions[i]);
+    }
+    // Names are only fetched for the slots whose fingerprint matches
+    for (size_t i = 0; i < batch; i++) {
+      const PerfectSlot *slot = set->slots + positions[i];
+      if (slot->fingerprint == (uint32_t) hashes[i]) {
+        __builtin_prefetch(set->data + slot->offset);
+      }
+    }
+    for (size_t i = 0; i < batch; i++) {
+      results[first + i] = perfect_match(set, positions[i], hashes[i], batch_values[i],
+          hits ? hits + first + i : NULL);
+    }
+  }
+}
+
+void perfect_set_foreach(const PerfectSet *set, SetItemCallback callback, void *context) {
+  for (size_t position = 0; position < set->item_count; position++) {
+    size_t mask_index;
+    const char *name = (const char *) perfect_read_varint(set->data + set->slots[position].offset,
+        &mask_index);
+    callback(name, set->masks[mask_index], set->hits + position, context);
+  }
+}
+
+size_t perfect_set_size(const PerfectSet *set) {
+  return set->item_count;
+}
+
+size_t perfect_set_memory(const PerfectSet *set) {
+  return sizeof(PerfectSet) + set->blob_size + set->item_count * sizeof(HitCounter);
+}
+
+size_t perfect_set_index_memory(const PerfectSet *set) {
+  return (set->position_count - set->item_count) * sizeof(uint32_t)
+      + set->bucket_count * sizeof(uint16_t);
+}
+
+void perfect_set_report_memory(const PerfectSet *set, const char *name) {
+  memory_report(name, set->blob, set->blob_size);
+}
+
+void perfect_set_free(PerfectSet *set) {
+  free(set->hits);
+  memory_free(set->blob, set->blob_size);
+  free(set);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "set.h"
+
+typedef struct PerfectSet PerfectSet;
+
+/*
+ * - Builds a read-only copy of a set indexed by a minimal perfect hash function, mapping each
+ *   item to its own slot holding a fingerprint of the item and the offset of its name
+ * - Returns NULL if no perfect hash function was found for the items
+ */
+PerfectSet *perfect_set_build(const Set *set);
+
+/*
+ * - Searches for an item in a perfect set and returns the mask of lists it belongs to, or 0
+ *   if it's not in the set
+ * - If hits is not NULL, it's set to the hit counter of the item when it's found
+ */
+ListMask perfect_set_lookup(const PerfectSet *set, const char *value, HitCounter **hits);
+
+/*
+ * - Searches for count items in a perfect set like perfect_set_lookup, writing their masks to
+ *   results and, if hits is not NULL, their hit counters to hits
+ * - Lookups are staged over the items, prefetching the pilots of all of them, then their
+ *   slots, then the names whose fingerprints match, before comparing any
+ */
+void perfect_set_lookup_batch(const PerfectSet *set, const char *const *values, size_t count,
+    ListMask *results, HitCounter **hits);
+
+/*
+ * Calls callback with every item in the perfect set, in the order of their slots
+ */
+void perfect_set_foreach(const PerfectSet *set, SetItemCallback callback, void *context);
+
+/*
+ * Returns the number of items in the perfect set
+ */
+size_t perfect_set_size(const PerfectSet *set);
+
+/*
+ * Returns the number of bytes used by the perfect set
+ */
+size_t perfect_set_memory(const PerfectSet *set);
+
+/*
+ * Returns the number of bytes used by the hash function of the perfect set, without the
+ * slots and names it indexes
+ */
+size_t perfect_set_index_memory(const PerfectSet *set);
+
+/*
+ * Prints the page sizes and NUMA node of the memory holding the perfect set
+ */
+void perfect_set_report_memory(const PerfectSet *set, const char *name);
+
+/*
+ * Frees memory allocated for the perfect set
+ */
+void perfect_set_free(PerfectSet *set);
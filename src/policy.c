@@ -0,0 +1,179 @@
+#include "policy.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+
+#define MAX_PREFIX_LENGTH 32
+
+typedef struct Node Node;
+
+/*
+ * Node of a binary trie indexed by the bits of the subnet address, most significant first.
+ * Nodes are only ever added, and are published to concurrent lookups with release stores.
+ */
+struct Node {
+  _Atomic(Node *) children[2];
+  _Atomic bool has_policy;
+  _Atomic ListMask mask;
+};
+
+struct PolicyTable {
+  Node *root;
+  ListMask default_mask;
+};
+
+Node *node_new(void) {
+  Node *node = calloc(1, sizeof(Node));
+  CHECK_ALLOC(node);
+  return node;
+}
+
+void node_free(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+  node_free(node->children[0]);
+  node_free(node->children[1]);
+  free(node);
+}
+
+PolicyTable *policy_table_new(ListMask default_mask) {
+  PolicyTable *table = malloc(sizeof(PolicyTable));
+  CHECK_ALLOC(table);
+  table->root = node_new();
+  table->default_mask = default_mask;
+  return table;
+}
+
+void policy_table_add(PolicyTable *table, uint32_t address, uint8_t prefix_length, ListMask mask) {
+  Node *node = table->root;
+  for (uint8_t depth = 0; depth < prefix_length; depth++) {
+    const uint32_t bit = (address >> (MAX_PREFIX_LENGTH - 1 - depth)) & 1u;
+    Node *child = atomic_load_explicit(&node->children[bit], memory_order_relaxed);
+    if (child == NULL) {
+      child = node_new();
+      atomic_store_explicit(&node->children[bit], child, memory_order_release);
+    }
+    node = child;
+  }
+  atomic_store_explicit(&node->mask, mask, memory_order_relaxed);
+  atomic_store_explicit(&node->has_policy, true, memory_order_release);
+}
+
+ListMask policy_table_lookup(const PolicyTable *table, uint32_t address) {
+  ListMask mask = table->default_mask;
+  const Node *node = table->root;
+  // Walk down the trie remembering the deepest (longest) subnet which has a policy
+  for (uint8_t depth = 0; node != NULL; depth++) {
+    if (atomic_load_explicit(&node->has_policy, memory_order_acquire)) {
+      mask = atomic_load_explicit(&node->mask, memory_order_relaxed);
+    }
+    if (depth == MAX_PREFIX_LENGTH) {
+      break;
+    }
+    node = atomic_load_explicit(&node->children[(address >> (MAX_PREFIX_LENGTH - 1 - depth)) & 1u],
+        memory_order_acquire);
+  }
+  return mask;
+}
+
+/*
+ * Parses a comma separated list of list names into a mask
+ * Returns true on success, false on failure
+ */
+bool parse_policy_lists(char *names, const AdListsInfo *ad_lists, ListMask *mask) {
+  *mask = 0;
+  if (!strcmp(names, "*")) {
+    *mask = adlists_block_mask(ad_lists);
+    return true;
+  }
+  if (!strcmp(names, "-")) {
+    return true;
+  }
+
+  for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+    uint32_t id;
+    if (!map_get(ad_lists->lists_map, name, &id)) {
+      fprintf(stderr, "[Policy] Unknown filter name %s!\n", name);
+      return false;
+    }
+    if (ad_lists->lists[id]->allow) {
+      fprintf(stderr, "[Policy] Filter %s is a whitelist and can't be selected by a policy!\n", name);
+      return false;
+    }
+    if (!ad_lists->lists[id]->active) {
+      fprintf(stderr, "[Policy] Filter %s is not active and will not block anything until it is enabled!\n", name);
+    }
+    *mask |= LIST_BIT(id);
+  }
+  return true;
+}
+
+bool policy_table_set(PolicyTable *table, char *subnet, char *names, const AdListsInfo *ad_lists) {
+  // Split the subnet into address and prefix length, a bare address being a /32 subnet
+  unsigned int prefix_length = MAX_PREFIX_LENGTH;
+  char *slash = strchr(subnet, '/');
+  if (slash) {
+    *slash = '\0';
+    char *end;
+    prefix_length = (unsigned int) strtoul(slash + 1, &end, 10);
+    if (*end || end == slash + 1 || prefix_length > MAX_PREFIX_LENGTH) {
+      fprintf(stderr, "[Policy] Invalid prefix length %s!\n", slash + 1);
+      return false;
+    }
+  }
+
+  struct in_addr addr;
+  if (inet_pton(AF_INET, subnet, &addr) != 1) {
+    fprintf(stderr, "[Policy] Invalid subnet address %s!\n", subnet);
+    return false;
+  }
+
+  ListMask mask;
+  if (!parse_policy_lists(names, ad_lists, &mask)) {
+    return false;
+  }
+
+  policy_table_add(table, ntohl(addr.s_addr), (uint8_t) prefix_length, mask);
+  return true;
+}
+
+bool policy_table_load(PolicyTable *table, const char *path, const AdListsInfo *ad_lists) {
+  FILE *file = fopen(path, "r");
+
+  if (!file) {
+    fprintf(stderr, "[Policy] Failed to open policy file %s!\n", path);
+    return false;
+  }
+
+  char buffer[1024];
+  char subnet[32];
+  char names[1024];
+  uint32_t line = 0;
+  bool success = true;
+  while (fgets(buffer, sizeof(buffer), file)) {
+    line++;
+    if (buffer[0] == '#' || sscanf(buffer, "%31s %1023s", subnet, names) != 2) {
+      // Skip comments and blank lines
+      continue;
+    }
+
+    if (!policy_table_set(table, subnet, names, ad_lists)) {
+      fprintf(stderr, "[Policy] Skipping invalid policy on line %" PRIu32 " of %s!\n", line, path);
+      success = false;
+    }
+  }
+
+  fclose(file);
+  return success;
+}
+
+void policy_table_free(PolicyTable *table) {
+  node_free(table->root);
+  free(table);
+}
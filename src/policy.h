@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ad_list.h"
+
+typedef struct PolicyTable PolicyTable;
+
+/*
+ * Creates a new policy table, which can be searched by any number of threads while a single
+ * thread at a time adds policies. Clients that don't match any of the subnets added to
+ * the table are filtered using the lists in default_mask.
+ */
+PolicyTable *policy_table_new(ListMask default_mask);
+
+/*
+ * - Maps the subnet address/prefix_length to the lists in mask
+ * - The address should be passed in the host byte order
+ * - Adding the same subnet twice replaces its mask
+ */
+void policy_table_add(PolicyTable *table, uint32_t address, uint8_t prefix_length, ListMask mask);
+
+/*
+ * - Maps a subnet of the form "<address>[/<prefix length>]" to the comma separated list
+ *   names, as on a line of a policy file
+ * - Returns true on success, false on failure
+ */
+bool policy_table_set(PolicyTable *table, char *subnet, char *names, const AdListsInfo *ad_lists);
+
+/*
+ * - Loads client policies from a file and adds them to the table
+ * - Each line has the form "<address>[/<prefix length>] <list name>,<list name>,...",
+ *   with "*" selecting all block lists and "-" selecting none
+ * - Returns true on success, false on failure
+ */
+bool policy_table_load(PolicyTable *table, const char *path, const AdListsInfo *ad_lists);
+
+/*
+ * Returns the mask of lists that apply to the client with the given address, using the
+ * longest matching subnet. The address should be passed in the host byte order.
+ */
+ListMask policy_table_lookup(const PolicyTable *table, uint32_t address);
+
+/*
+ * Frees memory allocated for the policy table
+ */
+void policy_table_free(PolicyTable *table);
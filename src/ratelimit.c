@@ -0,0 +1,133 @@
+#include "ratelimit.h"
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+
+// Number of buckets in the table, each key can be stored in one of BUCKET_WAYS buckets
+#define TABLE_SIZE 65536
+#define BUCKET_WAYS 4
+// Tokens are stored in millionths to refill buckets smoothly
+#define TOKEN_SCALE 1000000ull
+// Longest idle time credited to a bucket, bounding the refill arithmetic
+#define MAX_REFILL_NS 60000000000ull
+
+typedef struct {
+  uint64_t key;
+  // Time of the last access, 0 for unused buckets
+  uint64_t last_ns;
+  uint64_t tokens;
+  uint64_t limited;
+} Bucket;
+
+struct RateLimiter {
+  RateLimitConfig config;
+  uint32_t prefix_mask;
+  uint64_t max_tokens;
+  Bucket *buckets;
+};
+
+/*
+ * Mixes the bits of a key so that similar keys land in different bucket sets
+ */
+uint64_t mix_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key;
+}
+
+RateLimiter *ratelimit_new(const RateLimitConfig *config) {
+  if (config->rate == 0) {
+    return NULL;
+  }
+
+  RateLimiter *limiter = malloc(sizeof(RateLimiter));
+  CHECK_ALLOC(limiter);
+  limiter->buckets = calloc(TABLE_SIZE, sizeof(Bucket));
+  CHECK_ALLOC(limiter->buckets);
+
+  limiter->config = *config;
+  if (limiter->config.burst == 0) {
+    limiter->config.burst = config->rate;
+  }
+  limiter->prefix_mask = config->prefix_length ? UINT32_MAX << (32 - config->prefix_length) : 0;
+  limiter->max_tokens = limiter->config.burst * TOKEN_SCALE;
+  return limiter;
+}
+
+uint64_t ratelimit_client_key(const RateLimiter *limiter, uint32_t address) {
+  return ntohl(address) & limiter->prefix_mask;
+}
+
+uint64_t ratelimit_response_key(const RateLimiter *limiter, uint32_t address, const Message *response) {
+  // FNV-1a over the case folded question name, bounded by the message length
+  uint64_t name_hash = 0xcbf29ce484222325ull;
+  for (size_t i = QUESTION_START_BYTE; i < response->length && response->data[i]; i++) {
+    uint8_t c = response->data[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    name_hash = (name_hash ^ c) * 0x100000001b3ull;
+  }
+
+  const uint8_t rcode = response->length > 3 ? response->data[3] & 0x0f : 0;
+  return name_hash ^ ((ratelimit_client_key(limiter, address) << 4) | rcode);
+}
+
+RateLimitVerdict ratelimit_check(RateLimiter *limiter, uint64_t key, uint64_t now_ns) {
+  Bucket *set = limiter->buckets + (mix_key(key) % (TABLE_SIZE / BUCKET_WAYS)) * BUCKET_WAYS;
+
+  // Find the bucket of the key, falling back to the least recently used one in the set
+  Bucket *bucket = NULL;
+  Bucket *oldest = set;
+  for (int way = 0; way < BUCKET_WAYS; way++) {
+    if (set[way].last_ns && set[way].key == key) {
+      bucket = set + way;
+      break;
+    }
+    if (set[way].last_ns < oldest->last_ns) {
+      oldest = set + way;
+    }
+  }
+
+  if (bucket == NULL) {
+    // Evict the oldest bucket, the new client starts with a full bucket
+    bucket = oldest;
+    bucket->key = key;
+    bucket->tokens = limiter->max_tokens;
+    bucket->limited = 0;
+  } else {
+    uint64_t elapsed = now_ns - bucket->last_ns;
+    if (elapsed > MAX_REFILL_NS) {
+      elapsed = MAX_REFILL_NS;
+    }
+    bucket->tokens += elapsed * limiter->config.rate / (1000000000ull / TOKEN_SCALE);
+    if (bucket->tokens > limiter->max_tokens) {
+      bucket->tokens = limiter->max_tokens;
+    }
+  }
+  bucket->last_ns = now_ns;
+
+  if (bucket->tokens >= TOKEN_SCALE) {
+    bucket->tokens -= TOKEN_SCALE;
+    return RATELIMIT_PASS;
+  }
+
+  bucket->limited++;
+  if (limiter->config.slip && bucket->limited % limiter->config.slip == 0) {
+    return RATELIMIT_SLIP;
+  }
+  return RATELIMIT_DROP;
+}
+
+void ratelimit_free(RateLimiter *limiter) {
+  if (limiter == NULL) {
+    return;
+  }
+  free(limiter->buckets);
+  free(limiter);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "message.h"
+
+typedef struct RateLimiter RateLimiter;
+
+typedef struct {
+  // Tokens added to a bucket per second, 0 disables limiting
+  uint32_t rate;
+  // Maximum number of tokens a bucket can hold
+  uint32_t burst;
+  // Length of the client address prefix that shares a bucket
+  uint8_t prefix_length;
+  // Every slip-th limited message is let through truncated, 0 never lets one through
+  uint32_t slip;
+} RateLimitConfig;
+
+typedef enum {
+  RATELIMIT_PASS,
+  RATELIMIT_DROP,
+  RATELIMIT_SLIP
+} RateLimitVerdict;
+
+/*
+ * - Creates a new rate limiter using a fixed-size table of token buckets
+ * - Buckets are evicted in approximately least recently used order when the table is full
+ * - Returns NULL if the config disables limiting
+ */
+RateLimiter *ratelimit_new(const RateLimitConfig *config);
+
+/*
+ * Returns the bucket key of a client address, passed in network byte order
+ */
+uint64_t ratelimit_client_key(const RateLimiter *limiter, uint32_t address);
+
+/*
+ * Returns the bucket key of a response, combining the client address passed in network
+ * byte order with the question and response code of the message
+ */
+uint64_t ratelimit_response_key(const RateLimiter *limiter, uint32_t address, const Message *response);
+
+/*
+ * Takes a token from the bucket with the given key, returning whether the message
+ * should be passed, dropped or sent truncated. now_ns is a monotonic timestamp.
+ */
+RateLimitVerdict ratelimit_check(RateLimiter *limiter, uint64_t key, uint64_t now_ns);
+
+/*
+ * Frees memory allocated for the rate limiter
+ */
+void ratelimit_free(RateLimiter *limiter);
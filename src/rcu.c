@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rcu.h"
+
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "thread_slots.h"
+
+/*
+ * Epoch a reader entered its critical section in, 0 while it's outside of one. Each reader
+ * has its own cache line so that readers never write to shared lines.
+ */
+typedef struct {
+  alignas(64) _Atomic uint64_t epoch;
+} Reader;
+
+_Atomic uint64_t rcu_epoch = 1;
+Reader readers[MAX_THREAD_SLOTS];
+ThreadSlots reader_slots = THREAD_SLOTS_INIT("read RCU protected structures");
+_Thread_local Reader *current_reader = NULL;
+// Number of read-side critical sections the calling thread is in, nested in each other
+_Thread_local uint32_t read_depth = 0;
+
+void rcu_read_lock(void) {
+  if (current_reader == NULL) {
+    current_reader = readers + thread_slots_acquire(&reader_slots);
+  }
+  // Nested sections are part of the outermost one
+  if (read_depth++) {
+    return;
+  }
+
+  // The store has to be visible before any protected pointer is loaded
+  atomic_store(&current_reader->epoch, atomic_load_explicit(&rcu_epoch, memory_order_relaxed));
+}
+
+void rcu_read_unlock(void) {
+  if (--read_depth) {
+    return;
+  }
+  atomic_store_explicit(&current_reader->epoch, 0, memory_order_release);
+}
+
+void rcu_synchronize(void) {
+  // Readers that entered before the increment might still hold the old version, readers
+  // entering after it are guaranteed to see the new one
+  const uint64_t epoch = atomic_fetch_add(&rcu_epoch, 1) + 1;
+  atomic_thread_fence(memory_order_seq_cst);
+
+  // The slots of exited threads were left outside of any critical section
+  const size_t count = thread_slots_count(&reader_slots);
+  for (size_t i = 0; i < count; i++) {
+    for (;;) {
+      const uint64_t reader_epoch = atomic_load(&readers[i].epoch);
+      if (reader_epoch == 0 || reader_epoch >= epoch) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * Read-copy-update synchronization between threads looking up shared structures and the
+ * single thread changing them at a time:
+ * - Readers enclose their accesses in rcu_read_lock and rcu_read_unlock, which never block.
+ *   Sections may be nested, the outermost one protecting the accesses of the inner ones.
+ * - The writer publishes a new version with an atomic store and waits in rcu_synchronize
+ *   for the readers that might still see the old version before freeing it
+ */
+
+/*
+ * Marks the start of a read-side critical section of the calling thread
+ */
+void rcu_read_lock(void);
+
+/*
+ * Marks the end of a read-side critical section of the calling thread
+ */
+void rcu_read_unlock(void);
+
+/*
+ * Waits until every read-side critical section that started before the call has ended.
+ * Must not be called inside a read-side critical section.
+ */
+void rcu_synchronize(void);
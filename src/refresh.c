@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "refresh.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utils.h"
+
+// Longest time the thread sleeps before checking again for lists enabled in the meantime
+#define MAX_SLEEP_SECONDS 60
+
+struct Refresher {
+  AdListsInfo *ad_lists;
+  Filter *filter;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  bool stopping;
+  // Monotonic time in seconds at which each list is next refreshed, 0 if it's not scheduled
+  time_t due[MAX_LISTS];
+};
+
+time_t monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/*
+ * Schedules the active lists and collects the ones that are due into due_lists, returning
+ * the time at which the next list will be due
+ */
+time_t refresher_schedule(Refresher *refresher, time_t now, ListMask *due_lists) {
+  AdListsInfo *ad_lists = refresher->ad_lists;
+  time_t wake_at = now + MAX_SLEEP_SECONDS;
+  *due_lists = 0;
+
+  pthread_mutex_lock(&ad_lists->lock);
+  // The filter is made read-only once the lists are loaded, which may happen after the start
+  if (!refresher->filter->domains) {
+    fprintf(stderr, "[Refresh] Lists are not refreshed once the filter is read-only!\n");
+    refresher->stopping = true;
+    pthread_mutex_unlock(&ad_lists->lock);
+    return now;
+  }
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    const AdListInfo *ad_list_info = ad_lists->lists[id];
+    if (!ad_list_info->active || ad_list_info->refresh_interval == 0) {
+      refresher->due[id] = 0;
+      continue;
+    }
+
+    // Lists are loaded when they are activated, so the first refresh is a full interval later
+    if (refresher->due[id] == 0) {
+      refresher->due[id] = now + ad_list_info->refresh_interval;
+    }
+    if (refresher->due[id] <= now) {
+      *due_lists |= LIST_BIT(id);
+      refresher->due[id] = now + ad_list_info->refresh_interval;
+    }
+    if (refresher->due[id] < wake_at) {
+      wake_at = refresher->due[id];
+    }
+  }
+  pthread_mutex_unlock(&ad_lists->lock);
+  return wake_at;
+}
+
+void refresher_refresh(Refresher *refresher, uint32_t id) {
+  AdListsInfo *ad_lists = refresher->ad_lists;
+  AdListInfo *ad_list_info = ad_lists->lists[id];
+  // Lists are downloaded without holding the lock, so the domains are only applied once the
+  // whole list has arrived
+  ParsedList *parsed;
+  if (!download_list(ad_list_info, &parsed)) {
+    return;
+  }
+
+  pthread_mutex_lock(&ad_lists->lock);
+  // The list might have been disabled while it was downloading
+  if (!ad_list_info->active) {
+    free_parsed_list(parsed);
+  } else if (!apply_list_by_id(id, ad_lists, refresher->filter, parsed)) {
+    fprintf(stderr, "[Refresh] Failed to refresh list %s!\n", ad_list_info->name);
+  }
+  pthread_mutex_unlock(&ad_lists->lock);
+}
+
+void *refresher_thread(void *argument) {
+  Refresher *refresher = argument;
+  pthread_mutex_lock(&refresher->mutex);
+  while (!refresher->stopping) {
+    ListMask due_lists;
+    const time_t wake_at = refresher_schedule(refresher, monotonic_seconds(), &due_lists);
+
+    // Refresh the due lists without blocking refresher_stop
+    pthread_mutex_unlock(&refresher->mutex);
+    for (uint32_t id = 0; id < refresher->ad_lists->num_lists; id++) {
+      if (due_lists & LIST_BIT(id)) {
+        refresher_refresh(refresher, id);
+      }
+    }
+    pthread_mutex_lock(&refresher->mutex);
+
+    struct timespec deadline = { .tv_sec = wake_at, .tv_nsec = 0 };
+    while (!refresher->stopping && monotonic_seconds() < wake_at) {
+      pthread_cond_timedwait(&refresher->wake, &refresher->mutex, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&refresher->mutex);
+  return NULL;
+}
+
+Refresher *refresher_start(AdListsInfo *ad_lists, Filter *filter) {
+  bool refreshed = false;
+  for (uint32_t id = 0; id < ad_lists->num_lists; id++) {
+    refreshed = refreshed || ad_lists->lists[id]->refresh_interval > 0;
+  }
+  if (!refreshed) {
+    return NULL;
+  }
+  Refresher *refresher = calloc(1, sizeof(Refresher));
+  CHECK_ALLOC(refresher);
+  refresher->ad_lists = ad_lists;
+  refresher->filter = filter;
+  refresher->stopping = false;
+  pthread_mutex_init(&refresher->mutex, NULL);
+
+  // Deadlines are monotonic so that changes of the wall clock don't affect the schedule
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&refresher->wake, &attributes);
+  pthread_condattr_destroy(&attributes);
+
+  if (!start_thread(&refresher->thread, refresher_thread, refresher)) {
+    fprintf(stderr, "[Refresh] Failed to start refresh thread!\n");
+    pthread_cond_destroy(&refresher->wake);
+    pthread_mutex_destroy(&refresher->mutex);
+    free(refresher);
+    return NULL;
+  }
+  return refresher;
+}
+
+void refresher_stop(Refresher *refresher) {
+  pthread_mutex_lock(&refresher->mutex);
+  refresher->stopping = true;
+  pthread_cond_signal(&refresher->wake);
+  pthread_mutex_unlock(&refresher->mutex);
+  pthread_join(refresher->thread, NULL);
+
+  pthread_cond_destroy(&refresher->wake);
+  pthread_mutex_destroy(&refresher->mutex);
+  free(refresher);
+}
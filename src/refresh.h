@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ad_list.h"
+#include "filter.h"
+
+typedef struct Refresher Refresher;
+
+/*
+ * - Starts a thread refreshing the active lists that have a refresh interval, each list on
+ *   its own schedule. Lists are downloaded without holding the lists lock, which is only taken
+ *   to apply the changes to the filter. The thread stops once the filter is read-only.
+ * - Returns NULL if no list is ever refreshed or the thread can't be started
+ */
+Refresher *refresher_start(AdListsInfo *ad_lists, Filter *filter);
+
+/*
+ * Stops the refresh thread, waiting for a refresh in progress to finish
+ */
+void refresher_stop(Refresher *refresher);
@@ -0,0 +1,289 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "replay.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stages.h"
+#include "stats.h"
+#include "utils.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NANOSECONDS 0xa1b23c4d
+#define PCAP_HEADER_LENGTH 24
+#define PCAP_RECORD_HEADER_LENGTH 16
+#define MAX_PACKET_LENGTH 262144
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define PROTOCOL_UDP 17
+#define DNS_PORT 53
+
+typedef struct {
+  Message *items;
+  size_t count;
+  size_t capacity;
+} Queries;
+
+uint16_t replay_read16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+uint32_t replay_header_field(const uint8_t *header, size_t offset, bool swapped) {
+  uint32_t value;
+  memcpy(&value, header + offset, sizeof(value));
+  return swapped ? __builtin_bswap32(value) : value;
+}
+
+/*
+ * Returns the offset of the IP header of a packet, or SIZE_MAX if it doesn't hold an IP packet
+ */
+size_t replay_network_offset(const uint8_t *packet, size_t length, uint32_t linktype) {
+  size_t offset;
+  uint16_t ethertype;
+  switch (linktype) {
+    case LINKTYPE_ETHERNET:
+      if (length < 14) {
+        return SIZE_MAX;
+      }
+      offset = 14;
+      ethertype = replay_read16(packet + 12);
+      while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) && offset + 4 <= length) {
+        ethertype = replay_read16(packet + offset + 2);
+        offset += 4;
+      }
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (length < 16) {
+        return SIZE_MAX;
+      }
+      offset = 16;
+      ethertype = replay_read16(packet + 14);
+      break;
+    case LINKTYPE_LINUX_SLL2:
+      if (length < 20) {
+        return SIZE_MAX;
+      }
+      offset = 20;
+      ethertype = replay_read16(packet);
+      break;
+    case LINKTYPE_NULL:
+      // The address family is in the byte order of the capturing host, use the IP version
+      return length > 4 ? 4 : SIZE_MAX;
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+      return length > 0 ? 0 : SIZE_MAX;
+    default:
+      return SIZE_MAX;
+  }
+  return ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6 ? offset : SIZE_MAX;
+}
+
+/*
+ * - Extracts the DNS query of a captured packet sent over UDP to port 53
+ * - Returns false if the packet isn't such a query
+ */
+bool replay_extract(const uint8_t *packet, size_t length, uint32_t linktype, Message *query) {
+  const size_t offset = replay_network_offset(packet, length, linktype);
+  if (offset == SIZE_MAX || offset >= length) {
+    return false;
+  }
+  const uint8_t *ip = packet + offset;
+  const size_t ip_length = length - offset;
+
+  // Only unfragmented IPv4 packets and IPv6 packets without extension headers
+  const uint8_t *udp;
+  uint32_t source = 0;
+  if ((ip[0] >> 4) == 4) {
+    const size_t header_length = (ip[0] & 0x0f) * 4;
+    if (ip_length < 20 || header_length < 20 || ip_length < header_length + 8
+        || ip[9] != PROTOCOL_UDP || (replay_read16(ip + 6) & 0x3fff)) {
+      return false;
+    }
+    memcpy(&source, ip + 12, sizeof(source));
+    udp = ip + header_length;
+  } else if ((ip[0] >> 4) == 6) {
+    if (ip_length < 48 || ip[6] != PROTOCOL_UDP) {
+      return false;
+    }
+    udp = ip + 40;
+  } else {
+    return false;
+  }
+
+  const size_t udp_available = ip_length - (udp - ip);
+  size_t payload_length = replay_read16(udp + 4);
+  if (replay_read16(udp + 2) != DNS_PORT || payload_length < 8) {
+    return false;
+  }
+  payload_length -= 8;
+  if (payload_length > udp_available - 8) {
+    payload_length = udp_available - 8;
+  }
+  const uint8_t *payload = udp + 8;
+  if (payload_length < QUESTION_START_BYTE || (payload[2] & 0x80)) {
+    // Too short or a response
+    return false;
+  }
+
+  if (payload_length > MAX_MESSAGE_LENGTH) {
+    payload_length = MAX_MESSAGE_LENGTH;
+  }
+  memcpy(query->data, payload, payload_length);
+  query->length = payload_length;
+  query->sender.address = source;
+  memcpy(&query->sender.port, udp, sizeof(query->sender.port));
+  return true;
+}
+
+/*
+ * - Reads the queries of a pcap capture into memory, so that reading the file isn't timed
+ * - Returns false if the file isn't a pcap capture
+ */
+bool replay_load(const char *path, Queries *queries) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "[Replay] Failed to open %s with error: %d\n", path, errno);
+    return false;
+  }
+
+  uint8_t header[PCAP_HEADER_LENGTH];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+    fprintf(stderr, "[Replay] %s is too short to be a capture!\n", path);
+    fclose(file);
+    return false;
+  }
+  uint32_t magic;
+  memcpy(&magic, header, sizeof(magic));
+  const bool swapped = magic == __builtin_bswap32(PCAP_MAGIC)
+      || magic == __builtin_bswap32(PCAP_MAGIC_NANOSECONDS);
+  if (!swapped && magic != PCAP_MAGIC && magic != PCAP_MAGIC_NANOSECONDS) {
+    fprintf(stderr, "[Replay] %s is not a pcap capture, pcapng captures have to be converted!\n", path);
+    fclose(file);
+    return false;
+  }
+  const uint32_t linktype = replay_header_field(header, 20, swapped) & 0xffff;
+
+  uint8_t *packet = malloc(MAX_PACKET_LENGTH);
+  CHECK_ALLOC(packet);
+  uint8_t record[PCAP_RECORD_HEADER_LENGTH];
+  size_t packets = 0;
+  while (fread(record, 1, sizeof(record), file) == sizeof(record)) {
+    const uint32_t captured_length = replay_header_field(record, 8, swapped);
+    if (captured_length > MAX_PACKET_LENGTH
+        || fread(packet, 1, captured_length, file) != captured_length) {
+      // Captures cut short when the capture was stopped still replay up to the last packet
+      fprintf(stderr, "[Replay] %s is truncated or corrupt after %zu packets, ignoring the rest\n",
+          path, packets);
+      break;
+    }
+    packets++;
+
+    if (queries->count == queries->capacity) {
+      queries->capacity = queries->capacity ? queries->capacity * 2 : 1024;
+      queries->items = realloc(queries->items, queries->capacity * sizeof(Message));
+      CHECK_ALLOC(queries->items);
+    }
+    if (replay_extract(packet, captured_length, linktype, &queries->items[queries->count])) {
+      queries->count++;
+    }
+  }
+  free(packet);
+  fclose(file);
+
+  printf("[Replay] Read %zu DNS queries out of %zu packets from %s\n", queries->count, packets, path);
+  return true;
+}
+
+bool replay_run(const char *path, uint32_t passes, RequestHandler handler,
+    BatchHandler batch_handler, void *context) {
+  Queries queries = {0};
+  if (!replay_load(path, &queries) || queries.count == 0) {
+    free(queries.items);
+    return false;
+  }
+
+  // The digest covers the response code, answer count and length of every response, which
+  // stay the same for the same verdicts while TTLs can differ between runs
+  uint64_t digest = 0xcbf29ce484222325ull;
+  uint64_t responses = 0;
+  uint64_t response_bytes = 0;
+  Message *batch = malloc(MAX_BATCH * sizeof(Message));
+  CHECK_ALLOC(batch);
+
+  // Queries are handled in batches of the size a server receives at once
+  const uint64_t start = stage_clock();
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    for (size_t first = 0; first < queries.count; first += MAX_BATCH) {
+      const size_t count = queries.count - first < MAX_BATCH ? queries.count - first : MAX_BATCH;
+      memcpy(batch, queries.items + first, count * sizeof(Message));
+      stage_request_start();
+      if (batch_handler) {
+        batch_handler(NULL, batch, count, context);
+      }
+      for (size_t i = 0; i < count; i++) {
+        Message *message = batch + i;
+        if (i) {
+          stage_request_start();
+        }
+        const bool responded = handler(NULL, message, context);
+        stage_request_finish(message);
+        if (!responded) {
+          digest = (digest ^ 0xff) * 0x100000001b3ull;
+          continue;
+        }
+        responses++;
+        response_bytes += message->length;
+        const uint8_t summary[] = {
+          message->data[3] & 0x0f, message->data[6], message->data[7],
+          (uint8_t) (message->length >> 8), (uint8_t) message->length
+        };
+        for (size_t j = 0; j < sizeof(summary); j++) {
+          digest = (digest ^ summary[j]) * 0x100000001b3ull;
+        }
+      }
+    }
+  }
+  const uint64_t elapsed_ns = stage_clock() - start;
+
+  const uint64_t total = (uint64_t) queries.count * passes;
+  uint64_t stats[STAT_COUNT];
+  stats_collect(stats);
+  printf("[Replay] %" PRIu64 " queries in %.3f s, %.0f queries/s\n", total, elapsed_ns / 1e9,
+      total / (elapsed_ns / 1e9));
+  printf("[Replay] %" PRIu64 " responses, %" PRIu64 " bytes, digest %016" PRIx64 "\n", responses,
+      response_bytes, digest);
+  printf("[Replay] %" PRIu64 " blocked, %" PRIu64 " forwarded, %" PRIu64 " cached, %" PRIu64
+      " local\n", stats[STAT_BLOCKED], stats[STAT_FORWARDED], stats[STAT_CACHED], stats[STAT_LOCAL]);
+
+  StageTimes times;
+  stages_collect(&times);
+  printf("[Replay] %-8s %12s %10s %10s %10s %6s\n", "stage", "calls", "avg ns", "max ns", "total ms",
+      "share");
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    const uint64_t count = times.count[stage];
+    printf("[Replay] %-8s %12" PRIu64 " %10.1f %10" PRIu64 " %10.2f %5.1f%%\n", stage_name(stage),
+        count, count ? (double) times.total_ns[stage] / count : 0.0, times.max_ns[stage],
+        times.total_ns[stage] / 1e6, 100.0 * times.total_ns[stage] / elapsed_ns);
+  }
+
+  free(batch);
+  free(queries.items);
+  return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "udp_server.h"
+
+/*
+ * - Reads the DNS queries sent over UDP in a pcap capture and feeds them to a request handler
+ *   passes times in a row, in capture order, as fast as possible on the calling thread.
+ *   The handlers are invoked with a NULL server, the batch handler, if not NULL, with
+ *   batches of up to MAX_BATCH queries like a server receiving them at once.
+ * - Prints the throughput, the time spent in each stage timed by the handler and a digest of
+ *   the responses, which is the same for runs with the same lists and capture
+ * - Returns false if the capture can't be read
+ */
+bool replay_run(const char *path, uint32_t passes, RequestHandler handler,
+    BatchHandler batch_handler, void *context);
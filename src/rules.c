@@ -0,0 +1,775 @@
+#include "rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Largest automaton we are willing to build, with one transition per state and byte class
+#define MAX_DFA_STATES 65536
+// Largest count accepted in a {m,n} repetition
+#define MAX_REPEAT 64
+#define NO_STATE -1
+
+// Markers fed to the automaton around each domain, turning the anchors into plain characters
+#define BEGIN_MARKER 0x02
+#define END_MARKER 0x03
+
+// State of the automaton from which no rule can match anymore
+#define DEAD_STATE 0
+#define START_STATE 1
+
+typedef struct {
+  uint64_t bits[4];
+} CharSet;
+
+typedef enum {
+  NFA_EPSILON,
+  NFA_CHAR,
+  NFA_MATCH
+} NfaStateType;
+
+/*
+ * State of the Thompson automaton built from the rules. Epsilon states have up to two
+ * outgoing edges, char states have a single edge taken on any character in chars.
+ */
+typedef struct {
+  NfaStateType type;
+  int32_t out;
+  int32_t out1;
+  CharSet chars;
+  ListMask lists;
+} NfaState;
+
+/*
+ * Part of the automaton with a single entry state and a single epsilon exit state
+ * whose out edge is not connected yet
+ */
+typedef struct {
+  int32_t start;
+  int32_t end;
+} Fragment;
+
+typedef struct {
+  RuleSet *rules;
+  const char *pattern;
+  size_t pos;
+} RegexParser;
+
+struct RuleSet {
+  NfaState *nfa;
+  size_t nfa_count;
+  size_t nfa_capacity;
+  // Start states of the automatons of the individual rules
+  int32_t *starts;
+  size_t rule_count;
+  size_t rule_capacity;
+  // Lists that have at least one rule
+  ListMask lists;
+
+  // Compiled automaton, where bytes which no rule tells apart share a class
+  uint8_t classes[256];
+  uint32_t class_count;
+  uint32_t state_count;
+  uint32_t *transitions;
+  ListMask *accept;
+};
+
+/*
+ * Subsets of NFA states making up the DFA states while the DFA is being built
+ */
+typedef struct {
+  int32_t *states;
+  size_t states_count;
+  size_t states_capacity;
+  size_t *offsets;
+  size_t *sizes;
+  // Open addressing table from subset hashes to DFA states
+  uint32_t *table;
+  size_t table_capacity;
+} SubsetIndex;
+
+void charset_add(CharSet *set, uint8_t c) {
+  set->bits[c >> 6] |= 1ull << (c & 63);
+}
+
+bool charset_has(const CharSet *set, uint8_t c) {
+  return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+void charset_add_range(CharSet *set, uint8_t from, uint8_t to) {
+  for (unsigned int c = from; c <= to; c++) {
+    charset_add(set, (uint8_t) c);
+  }
+}
+
+/*
+ * Adds the other case of every letter in the set
+ */
+void charset_fold(CharSet *set) {
+  for (uint8_t c = 'a'; c <= 'z'; c++) {
+    const uint8_t upper = c - 'a' + 'A';
+    if (charset_has(set, c) || charset_has(set, upper)) {
+      charset_add(set, c);
+      charset_add(set, upper);
+    }
+  }
+}
+
+/*
+ * Set matched by "." - any character of a domain, but not the anchor markers
+ */
+CharSet charset_any(void) {
+  CharSet set = {{0}};
+  charset_add_range(&set, 1, 255);
+  set.bits[0] &= ~((1ull << BEGIN_MARKER) | (1ull << END_MARKER));
+  return set;
+}
+
+/*
+ * Adds the characters of a "\d", "\w" or "\s" class, returning false for other escapes
+ */
+bool charset_add_escape_class(CharSet *set, char escape) {
+  switch (escape) {
+    case 'd':
+      charset_add_range(set, '0', '9');
+      return true;
+    case 'w':
+      charset_add_range(set, '0', '9');
+      charset_add_range(set, 'a', 'z');
+      charset_add_range(set, 'A', 'Z');
+      charset_add(set, '_');
+      return true;
+    case 's':
+      charset_add(set, ' ');
+      charset_add_range(set, '\t', '\r');
+      return true;
+    default:
+      return false;
+  }
+}
+
+int32_t nfa_add(RuleSet *rules, NfaStateType type) {
+  if (rules->nfa_count == rules->nfa_capacity) {
+    rules->nfa_capacity *= 2;
+    rules->nfa = realloc(rules->nfa, rules->nfa_capacity * sizeof(NfaState));
+    CHECK_ALLOC(rules->nfa);
+  }
+  NfaState *state = rules->nfa + rules->nfa_count;
+  memset(state, 0, sizeof(NfaState));
+  state->type = type;
+  state->out = NO_STATE;
+  state->out1 = NO_STATE;
+  return (int32_t) rules->nfa_count++;
+}
+
+Fragment fragment_empty(RuleSet *rules) {
+  const int32_t state = nfa_add(rules, NFA_EPSILON);
+  return (Fragment) { state, state };
+}
+
+Fragment fragment_chars(RuleSet *rules, const CharSet *chars) {
+  const int32_t start = nfa_add(rules, NFA_CHAR);
+  const int32_t end = nfa_add(rules, NFA_EPSILON);
+  rules->nfa[start].chars = *chars;
+  rules->nfa[start].out = end;
+  return (Fragment) { start, end };
+}
+
+Fragment fragment_concat(RuleSet *rules, Fragment first, Fragment second) {
+  rules->nfa[first.end].out = second.start;
+  return (Fragment) { first.start, second.end };
+}
+
+Fragment fragment_alternate(RuleSet *rules, Fragment first, Fragment second) {
+  const int32_t start = nfa_add(rules, NFA_EPSILON);
+  const int32_t end = nfa_add(rules, NFA_EPSILON);
+  rules->nfa[start].out = first.start;
+  rules->nfa[start].out1 = second.start;
+  rules->nfa[first.end].out = end;
+  rules->nfa[second.end].out = end;
+  return (Fragment) { start, end };
+}
+
+Fragment fragment_star(RuleSet *rules, Fragment fragment) {
+  const int32_t start = nfa_add(rules, NFA_EPSILON);
+  const int32_t end = nfa_add(rules, NFA_EPSILON);
+  rules->nfa[start].out = fragment.start;
+  rules->nfa[start].out1 = end;
+  rules->nfa[fragment.end].out = start;
+  return (Fragment) { start, end };
+}
+
+Fragment fragment_plus(RuleSet *rules, Fragment fragment) {
+  const int32_t loop = nfa_add(rules, NFA_EPSILON);
+  const int32_t end = nfa_add(rules, NFA_EPSILON);
+  rules->nfa[loop].out = fragment.start;
+  rules->nfa[loop].out1 = end;
+  rules->nfa[fragment.end].out = loop;
+  return (Fragment) { fragment.start, end };
+}
+
+Fragment fragment_optional(RuleSet *rules, Fragment fragment) {
+  const int32_t start = nfa_add(rules, NFA_EPSILON);
+  const int32_t end = nfa_add(rules, NFA_EPSILON);
+  rules->nfa[start].out = fragment.start;
+  rules->nfa[start].out1 = end;
+  rules->nfa[fragment.end].out = end;
+  return (Fragment) { start, end };
+}
+
+bool regex_parse_alternation(RegexParser *parser, Fragment *result);
+
+/*
+ * Parses a bracket expression following the opening "["
+ */
+bool regex_parse_class(RegexParser *parser, CharSet *set) {
+  const char *pattern = parser->pattern;
+  bool negate = false;
+  if (pattern[parser->pos] == '^') {
+    negate = true;
+    parser->pos++;
+  }
+
+  bool first = true;
+  while (pattern[parser->pos] != ']' || first) {
+    first = false;
+    char c = pattern[parser->pos++];
+    if (c == '\0') {
+      return false;
+    }
+    if (c == '\\') {
+      c = pattern[parser->pos++];
+      if (c == '\0') {
+        return false;
+      }
+      if (charset_add_escape_class(set, c)) {
+        continue;
+      }
+    }
+
+    // Character range, unless the dash is the last character of the expression
+    if (pattern[parser->pos] == '-' && pattern[parser->pos + 1] != ']' && pattern[parser->pos + 1]) {
+      const char to = pattern[parser->pos + 1];
+      if ((uint8_t) to < (uint8_t) c) {
+        return false;
+      }
+      charset_add_range(set, (uint8_t) c, (uint8_t) to);
+      parser->pos += 2;
+    } else {
+      charset_add(set, (uint8_t) c);
+    }
+  }
+  parser->pos++;
+
+  charset_fold(set);
+  if (negate) {
+    const CharSet any = charset_any();
+    for (int i = 0; i < 4; i++) {
+      set->bits[i] = ~set->bits[i] & any.bits[i];
+    }
+  }
+  return true;
+}
+
+bool regex_parse_atom(RegexParser *parser, Fragment *result) {
+  RuleSet *rules = parser->rules;
+  CharSet set = {{0}};
+  const char c = parser->pattern[parser->pos++];
+  switch (c) {
+    case '(':
+      // Groups don't capture anything, so non-capturing groups are the same
+      if (!strncmp(parser->pattern + parser->pos, "?:", 2)) {
+        parser->pos += 2;
+      }
+      if (!regex_parse_alternation(parser, result) || parser->pattern[parser->pos] != ')') {
+        return false;
+      }
+      parser->pos++;
+      return true;
+    case '[':
+      if (!regex_parse_class(parser, &set)) {
+        return false;
+      }
+      break;
+    case '.':
+      set = charset_any();
+      break;
+    case '^':
+      charset_add(&set, BEGIN_MARKER);
+      break;
+    case '$':
+      charset_add(&set, END_MARKER);
+      break;
+    case '\\': {
+      const char escaped = parser->pattern[parser->pos++];
+      if (escaped == '\0') {
+        return false;
+      }
+      if (!charset_add_escape_class(&set, escaped)) {
+        charset_add(&set, (uint8_t) escaped);
+      }
+      charset_fold(&set);
+      break;
+    }
+    case '\0':
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case ')':
+    case '|':
+      return false;
+    default:
+      charset_add(&set, (uint8_t) c);
+      charset_fold(&set);
+      break;
+  }
+
+  *result = fragment_chars(rules, &set);
+  return true;
+}
+
+/*
+ * Parses the bounds of a "{m}", "{m,}" or "{m,n}" repetition following the opening "{",
+ * setting max to -1 for unbounded repetitions
+ */
+bool regex_parse_bounds(RegexParser *parser, int *min, int *max) {
+  const char *start = parser->pattern + parser->pos;
+  char *end;
+  long value = strtol(start, &end, 10);
+  if (end == start || value < 0 || value > MAX_REPEAT) {
+    return false;
+  }
+  *min = *max = (int) value;
+
+  if (*end == ',') {
+    start = end + 1;
+    value = strtol(start, &end, 10);
+    if (end == start) {
+      *max = -1;
+    } else if (value < *min || value > MAX_REPEAT) {
+      return false;
+    } else {
+      *max = (int) value;
+    }
+  }
+
+  if (*end != '}') {
+    return false;
+  }
+  parser->pos = end + 1 - parser->pattern;
+  return true;
+}
+
+bool regex_parse_repetition(RegexParser *parser, Fragment *result) {
+  const size_t atom_pos = parser->pos;
+  if (!regex_parse_atom(parser, result)) {
+    return false;
+  }
+
+  // Counted repetitions are expanded into copies of the atom, parsed again from its source
+  if (parser->pattern[parser->pos] == '{') {
+    parser->pos++;
+    int min, max;
+    if (!regex_parse_bounds(parser, &min, &max)) {
+      return false;
+    }
+    const size_t bounds_end = parser->pos;
+
+    Fragment first = *result;
+    Fragment repeated = fragment_empty(parser->rules);
+    const int copies = max == -1 ? (min > 0 ? min : 1) : max;
+    for (int i = 0; i < copies; i++) {
+      Fragment copy = first;
+      if (i > 0) {
+        parser->pos = atom_pos;
+        if (!regex_parse_atom(parser, &copy)) {
+          return false;
+        }
+      }
+      if (max == -1 && i == copies - 1) {
+        copy = min > 0 ? fragment_plus(parser->rules, copy) : fragment_star(parser->rules, copy);
+      } else if (i >= min) {
+        copy = fragment_optional(parser->rules, copy);
+      }
+      repeated = fragment_concat(parser->rules, repeated, copy);
+    }
+
+    // A {0,0} repetition never uses the parsed atom, it's left unreachable
+    parser->pos = bounds_end;
+    *result = repeated;
+  }
+
+  while (true) {
+    switch (parser->pattern[parser->pos]) {
+      case '*':
+        *result = fragment_star(parser->rules, *result);
+        break;
+      case '+':
+        *result = fragment_plus(parser->rules, *result);
+        break;
+      case '?':
+        *result = fragment_optional(parser->rules, *result);
+        break;
+      default:
+        return true;
+    }
+    parser->pos++;
+  }
+}
+
+bool regex_parse_concatenation(RegexParser *parser, Fragment *result) {
+  *result = fragment_empty(parser->rules);
+  while (true) {
+    const char c = parser->pattern[parser->pos];
+    if (c == '\0' || c == '|' || c == ')') {
+      return true;
+    }
+    Fragment next;
+    if (!regex_parse_repetition(parser, &next)) {
+      return false;
+    }
+    *result = fragment_concat(parser->rules, *result, next);
+  }
+}
+
+bool regex_parse_alternation(RegexParser *parser, Fragment *result) {
+  if (!regex_parse_concatenation(parser, result)) {
+    return false;
+  }
+  while (parser->pattern[parser->pos] == '|') {
+    parser->pos++;
+    Fragment next;
+    if (!regex_parse_concatenation(parser, &next)) {
+      return false;
+    }
+    *result = fragment_alternate(parser->rules, *result, next);
+  }
+  return true;
+}
+
+RuleSet *rules_new(void) {
+  RuleSet *rules = calloc(1, sizeof(RuleSet));
+  CHECK_ALLOC(rules);
+  rules->nfa_capacity = 64;
+  rules->nfa = malloc(rules->nfa_capacity * sizeof(NfaState));
+  CHECK_ALLOC(rules->nfa);
+  rules->rule_capacity = 16;
+  rules->starts = malloc(rules->rule_capacity * sizeof(int32_t));
+  CHECK_ALLOC(rules->starts);
+  return rules;
+}
+
+bool rules_add_regex(RuleSet *rules, const char *regex, ListMask lists) {
+  const size_t nfa_count = rules->nfa_count;
+  RegexParser parser = { rules, regex, 0 };
+  Fragment fragment;
+  if (!regex_parse_alternation(&parser, &fragment) || regex[parser.pos] != '\0') {
+    // Drop the states of the partially parsed rule
+    rules->nfa_count = nfa_count;
+    return false;
+  }
+
+  // The rule matches anywhere in the marked domain unless it uses anchors
+  CharSet all = {{0}};
+  charset_add_range(&all, 1, 255);
+  Fragment prefix = fragment_star(rules, fragment_chars(rules, &all));
+  Fragment suffix = fragment_star(rules, fragment_chars(rules, &all));
+  fragment = fragment_concat(rules, fragment_concat(rules, prefix, fragment), suffix);
+
+  const int32_t match = nfa_add(rules, NFA_MATCH);
+  rules->nfa[match].lists = lists;
+  rules->nfa[fragment.end].out = match;
+
+  if (rules->rule_count == rules->rule_capacity) {
+    rules->rule_capacity *= 2;
+    rules->starts = realloc(rules->starts, rules->rule_capacity * sizeof(int32_t));
+    CHECK_ALLOC(rules->starts);
+  }
+  rules->starts[rules->rule_count++] = fragment.start;
+  rules->lists |= lists;
+  return true;
+}
+
+bool rules_add_wildcard(RuleSet *rules, const char *pattern, bool match_subdomains, ListMask lists) {
+  // Every character may be escaped or expanded, plus the anchors
+  char *regex = malloc(2 * strlen(pattern) + 8);
+  CHECK_ALLOC(regex);
+  char *out = regex;
+  out += sprintf(out, match_subdomains ? "(^|\\.)" : "^");
+  for (const char *c = pattern; *c; c++) {
+    if (*c == '*') {
+      *out++ = '.';
+      *out++ = '*';
+    } else if (strchr(".+?()[]{}|^$\\", *c)) {
+      *out++ = '\\';
+      *out++ = *c;
+    } else {
+      *out++ = *c;
+    }
+  }
+  *out++ = '$';
+  *out = '\0';
+
+  bool success = rules_add_regex(rules, regex, lists);
+  free(regex);
+  return success;
+}
+
+/*
+ * Collects the char and match states reachable through epsilon edges from the states
+ * on the stack into subset, sorted by state index
+ */
+void nfa_closure(const RuleSet *rules, int32_t *stack, size_t stack_count, uint32_t *marks,
+    uint32_t generation, int32_t *subset, size_t *subset_count) {
+  *subset_count = 0;
+  while (stack_count) {
+    const int32_t index = stack[--stack_count];
+    if (index == NO_STATE || marks[index] == generation) {
+      continue;
+    }
+    marks[index] = generation;
+
+    const NfaState *state = rules->nfa + index;
+    if (state->type == NFA_EPSILON) {
+      stack[stack_count++] = state->out;
+      stack[stack_count++] = state->out1;
+    } else {
+      subset[(*subset_count)++] = index;
+    }
+  }
+
+  // Insertion sort, the subsets are small and often nearly sorted
+  for (size_t i = 1; i < *subset_count; i++) {
+    const int32_t value = subset[i];
+    size_t j = i;
+    while (j > 0 && subset[j - 1] > value) {
+      subset[j] = subset[j - 1];
+      j--;
+    }
+    subset[j] = value;
+  }
+}
+
+uint64_t subset_hash(const int32_t *subset, size_t count) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ (uint32_t) subset[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+/*
+ * Looks up the DFA state made of the subset, adding a new state if there is none.
+ * Returns the state and sets created to true if the state is new.
+ */
+uint32_t subset_index_get(SubsetIndex *index, uint32_t *state_count, const int32_t *subset,
+    size_t count, bool *created) {
+  size_t slot = subset_hash(subset, count) & (index->table_capacity - 1);
+  while (index->table[slot] != UINT32_MAX) {
+    const uint32_t state = index->table[slot];
+    if (index->sizes[state] == count
+        && !memcmp(index->states + index->offsets[state], subset, count * sizeof(int32_t))) {
+      *created = false;
+      return state;
+    }
+    slot = (slot + 1) & (index->table_capacity - 1);
+  }
+
+  const uint32_t state = (*state_count)++;
+  if (index->states_count + count > index->states_capacity) {
+    while (index->states_count + count > index->states_capacity) {
+      index->states_capacity *= 2;
+    }
+    index->states = realloc(index->states, index->states_capacity * sizeof(int32_t));
+    CHECK_ALLOC(index->states);
+  }
+  memcpy(index->states + index->states_count, subset, count * sizeof(int32_t));
+  index->offsets[state] = index->states_count;
+  index->sizes[state] = count;
+  index->states_count += count;
+  index->table[slot] = state;
+  *created = true;
+  return state;
+}
+
+/*
+ * Splits the bytes into the fewest classes such that no char state tells apart two
+ * bytes of the same class
+ */
+void rules_compute_classes(RuleSet *rules) {
+  memset(rules->classes, 0, sizeof(rules->classes));
+  rules->class_count = 1;
+  for (size_t i = 0; i < rules->nfa_count; i++) {
+    const NfaState *state = rules->nfa + i;
+    if (state->type != NFA_CHAR) {
+      continue;
+    }
+
+    uint16_t split[256][2];
+    memset(split, 0xff, sizeof(split));
+    uint32_t class_count = 0;
+    for (unsigned int c = 0; c < 256; c++) {
+      uint16_t *class = &split[rules->classes[c]][charset_has(&state->chars, (uint8_t) c)];
+      if (*class == UINT16_MAX) {
+        *class = (uint16_t) class_count++;
+      }
+      rules->classes[c] = (uint8_t) *class;
+    }
+    rules->class_count = class_count;
+  }
+}
+
+bool rules_compile(RuleSet *rules) {
+  free(rules->transitions);
+  free(rules->accept);
+  rules->transitions = NULL;
+  rules->accept = NULL;
+  rules->state_count = 0;
+
+  if (rules->rule_count == 0) {
+    return true;
+  }
+
+  rules_compute_classes(rules);
+  const uint32_t class_count = rules->class_count;
+  uint8_t representatives[256];
+  for (int c = 255; c >= 0; c--) {
+    representatives[rules->classes[c]] = (uint8_t) c;
+  }
+
+  SubsetIndex index = {0};
+  index.states_capacity = 1024;
+  index.states = malloc(index.states_capacity * sizeof(int32_t));
+  index.offsets = malloc(MAX_DFA_STATES * sizeof(size_t));
+  index.sizes = malloc(MAX_DFA_STATES * sizeof(size_t));
+  index.table_capacity = 2 * MAX_DFA_STATES;
+  index.table = malloc(index.table_capacity * sizeof(uint32_t));
+  CHECK_ALLOC(index.states);
+  CHECK_ALLOC(index.offsets);
+  CHECK_ALLOC(index.sizes);
+  CHECK_ALLOC(index.table);
+  memset(index.table, 0xff, index.table_capacity * sizeof(uint32_t));
+
+  size_t state_capacity = 64;
+  uint32_t *transitions = malloc(state_capacity * class_count * sizeof(uint32_t));
+  ListMask *accept = malloc(state_capacity * sizeof(ListMask));
+  CHECK_ALLOC(transitions);
+  CHECK_ALLOC(accept);
+
+  // Scratch space for the closures, each epsilon state pushes its two edges at most once
+  int32_t *stack = malloc((3 * rules->nfa_count + rules->rule_count + 1) * sizeof(int32_t));
+  int32_t *subset = malloc(rules->nfa_count * sizeof(int32_t));
+  uint32_t *marks = calloc(rules->nfa_count, sizeof(uint32_t));
+  CHECK_ALLOC(stack);
+  CHECK_ALLOC(subset);
+  CHECK_ALLOC(marks);
+  uint32_t generation = 0;
+
+  bool created;
+  uint32_t state_count = 0;
+  size_t subset_count;
+  // The dead state is the empty subset, the start state the closure of all rule starts
+  subset_index_get(&index, &state_count, subset, 0, &created);
+  memcpy(stack, rules->starts, rules->rule_count * sizeof(int32_t));
+  nfa_closure(rules, stack, rules->rule_count, marks, ++generation, subset, &subset_count);
+  subset_index_get(&index, &state_count, subset, subset_count, &created);
+
+  bool success = true;
+  // States are numbered in the order they are discovered, so the loop visits each one once
+  for (uint32_t state = 0; state < state_count && success; state++) {
+    if (state == state_capacity) {
+      state_capacity *= 2;
+      transitions = realloc(transitions, state_capacity * class_count * sizeof(uint32_t));
+      accept = realloc(accept, state_capacity * sizeof(ListMask));
+      CHECK_ALLOC(transitions);
+      CHECK_ALLOC(accept);
+    }
+
+    const int32_t *states = index.states + index.offsets[state];
+    const size_t size = index.sizes[state];
+    accept[state] = 0;
+    for (size_t i = 0; i < size; i++) {
+      if (rules->nfa[states[i]].type == NFA_MATCH) {
+        accept[state] |= rules->nfa[states[i]].lists;
+      }
+    }
+
+    for (uint32_t class = 0; class < class_count; class++) {
+      size_t stack_count = 0;
+      // The subset may move when new states are added, so it's looked up on every class
+      states = index.states + index.offsets[state];
+      for (size_t i = 0; i < size; i++) {
+        const NfaState *nfa_state = rules->nfa + states[i];
+        if (nfa_state->type == NFA_CHAR && charset_has(&nfa_state->chars, representatives[class])) {
+          stack[stack_count++] = nfa_state->out;
+        }
+      }
+
+      nfa_closure(rules, stack, stack_count, marks, ++generation, subset, &subset_count);
+      const uint32_t next = subset_index_get(&index, &state_count, subset, subset_count, &created);
+      transitions[state * class_count + class] = next;
+      if (state_count == MAX_DFA_STATES) {
+        success = false;
+        break;
+      }
+    }
+  }
+
+  free(stack);
+  free(subset);
+  free(marks);
+  free(index.states);
+  free(index.offsets);
+  free(index.sizes);
+  free(index.table);
+
+  if (!success) {
+    fprintf(stderr, "[Rules] The automaton for %zu rules exceeds %d states, rules are disabled!\n",
+        rules->rule_count, MAX_DFA_STATES);
+    free(transitions);
+    free(accept);
+    return false;
+  }
+
+  rules->state_count = state_count;
+  rules->transitions = transitions;
+  rules->accept = accept;
+  return true;
+}
+
+ListMask rules_match(const RuleSet *rules, const char *domain) {
+  if (rules->state_count == 0) {
+    return 0;
+  }
+
+  const uint32_t *transitions = rules->transitions;
+  const uint32_t class_count = rules->class_count;
+  uint32_t state = transitions[START_STATE * class_count + rules->classes[BEGIN_MARKER]];
+  for (const uint8_t *c = (const uint8_t *) domain; *c; c++) {
+    state = transitions[state * class_count + rules->classes[*c]];
+    if (state == DEAD_STATE) {
+      return 0;
+    }
+  }
+  state = transitions[state * class_count + rules->classes[END_MARKER]];
+  return rules->accept[state];
+}
+
+ListMask rules_lists(const RuleSet *rules) {
+  return rules->lists;
+}
+
+size_t rules_count(const RuleSet *rules) {
+  return rules->rule_count;
+}
+
+void rules_free(RuleSet *rules) {
+  free(rules->nfa);
+  free(rules->starts);
+  free(rules->transitions);
+  free(rules->accept);
+  free(rules);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "set.h"
+
+typedef struct RuleSet RuleSet;
+
+/*
+ * Creates a new, empty rule set
+ */
+RuleSet *rules_new(void);
+
+/*
+ * - Adds an extended regular expression matched against domain names
+ * - Supports literals, ".", bracket expressions, grouping, "|", "*", "+", "?", "{m,n}",
+ *   the "\d", "\w" and "\s" classes and the "^" and "$" anchors; matching is case insensitive
+ * - Returns false if the expression is not supported
+ */
+bool rules_add_regex(RuleSet *rules, const char *regex, ListMask lists);
+
+/*
+ * - Adds a host pattern where "*" matches any sequence of characters
+ * - If match_subdomains is true, the pattern also matches all subdomains of the names
+ *   it matches, as adblock "||" rules do
+ * - Returns false if the pattern is not supported
+ */
+bool rules_add_wildcard(RuleSet *rules, const char *pattern, bool match_subdomains, ListMask lists);
+
+/*
+ * - Compiles all added rules into a single automaton, replacing the previously compiled one
+ * - Rules added after compilation take effect once the rule set is compiled again
+ * - Returns false if the automaton grows too large, in which case no rules are matched
+ */
+bool rules_compile(RuleSet *rules);
+
+/*
+ * Returns the mask of lists whose rules match the domain, or 0 if none do. Runs in time
+ * linear in the length of the domain regardless of the number of rules.
+ */
+ListMask rules_match(const RuleSet *rules, const char *domain);
+
+/*
+ * Returns the mask of lists that have at least one rule in the rule set
+ */
+ListMask rules_lists(const RuleSet *rules);
+
+/*
+ * Returns the number of rules added to the rule set
+ */
+size_t rules_count(const RuleSet *rules);
+
+/*
+ * Frees memory allocated for the rule set
+ */
+void rules_free(RuleSet *rules);
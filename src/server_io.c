@@ -0,0 +1,104 @@
+#include "server_io.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+#include "utils.h"
+
+struct ServerIO {
+  int socket;
+  // NULL when using the blocking backend
+  Uring *uring;
+};
+
+ServerIO *io_create(int socket, IOBackend backend) {
+  ServerIO *io = malloc(sizeof(ServerIO));
+  CHECK_ALLOC(io);
+  io->socket = socket;
+  io->uring = NULL;
+
+  if (backend == IO_BACKEND_URING) {
+    io->uring = uring_create(socket);
+    if (!io->uring) {
+      fprintf(stderr, "[UDPServer] io_uring is not available, falling back to blocking sockets.\n");
+    }
+  }
+  return io;
+}
+
+size_t io_receive_blocking(ServerIO *io, Message *request) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+
+  const ssize_t length = recvfrom(io->socket, &request->data, MAX_MESSAGE_LENGTH, 0,
+      (struct sockaddr *) &addr, &addrlen);
+
+  if (length == -1) {
+    return 0;
+  }
+
+  request->length = length;
+  request->sender.address = addr.sin_addr.s_addr;
+  request->sender.port = addr.sin_port;
+  return 1;
+}
+
+size_t io_receive(ServerIO *io, Message *requests, size_t max) {
+  if (io->uring) {
+    const ssize_t count = uring_receive(io->uring, requests, max);
+    if (count >= 0) {
+      return count;
+    }
+
+    fprintf(stderr, "[UDPServer] io_uring stopped receiving, falling back to blocking sockets.\n");
+    uring_destroy(io->uring);
+    io->uring = NULL;
+  }
+  return io_receive_blocking(io, requests);
+}
+
+bool io_send(ServerIO *io, const Message *response) {
+  if (io->uring && uring_send(io->uring, response)) {
+    return true;
+  }
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = response->recipient.port,
+    .sin_addr = { response->recipient.address }
+  };
+
+  ssize_t sent = sendto(io->socket, response->data, response->length, 0,
+      (struct sockaddr *) &addr, sizeof(addr));
+
+  if (sent == -1) {
+    fprintf(stderr, "[UDPServer] Failed to send response to %s:%d with error: %d.\n",
+        inet_ntoa(addr.sin_addr), htons(addr.sin_port), errno);
+    return false;
+  }
+
+  if (sent != response->length) {
+    fprintf(stderr, "[UDPServer] Failed to send response to %s:%d. %ld bytes were sent.\n",
+        inet_ntoa(addr.sin_addr), htons(addr.sin_port), sent);
+    return false;
+  }
+
+  return true;
+}
+
+void io_flush(ServerIO *io) {
+  if (io->uring) {
+    uring_flush(io->uring);
+  }
+}
+
+void io_destroy(ServerIO *io) {
+  if (io->uring) {
+    uring_destroy(io->uring);
+  }
+  free(io);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "message.h"
+
+typedef struct ServerIO ServerIO;
+
+typedef enum {
+  // One blocking recvfrom and sendto system call per message
+  IO_BACKEND_BLOCKING,
+  // Multishot receives into a registered buffer ring, sends submitted in batches
+  IO_BACKEND_URING
+} IOBackend;
+
+/*
+ * - Creates the I/O backend of a bound server socket
+ * - Falls back to the blocking backend if io_uring is not available
+ */
+ServerIO *io_create(int socket, IOBackend backend);
+
+/*
+ * - Waits for at least one request and receives up to max requests into requests
+ * - Returns the number of received requests, 0 if the wait was interrupted by a signal
+ */
+size_t io_receive(ServerIO *io, Message *requests, size_t max);
+
+/*
+ * - Sends a response to response->recipient, possibly queuing it until io_flush
+ * - Returns true on success, false on failure
+ */
+bool io_send(ServerIO *io, const Message *response);
+
+/*
+ * Submits the queued responses
+ */
+void io_flush(ServerIO *io);
+
+/*
+ * Destroys the I/O backend, leaving the socket open
+ */
+void io_destroy(ServerIO *io);
@@ -1,82 +1,220 @@
 #include "set.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
+#include "memory.h"
+#include "rcu.h"
 #include "utils.h"
 
 #define INCREASE_FACTOR 2
 #define START_SIZE 6
 #define LOAD_FACTOR 0.75
+// Entries are allocated in slabs growing up to the size of a hugepage
+#define FIRST_SLAB_ENTRIES 64
+#define MAX_SLAB_SIZE (2 * 1024 * 1024)
+// Items whose cache misses are overlapped by batched lookups
+#define LOOKUP_BATCH 32
 
 typedef struct Entry Entry;
+typedef struct Slab Slab;
 
+/*
+ * Lookups may run concurrently with a single thread changing the set. Entries are published
+ * with release stores once initialized, their values never change and unlinked entries are
+ * only reused after an RCU grace period.
+ */
 struct Entry {
   char *value;
-  Entry *next;
+  _Atomic ListMask lists;
+  _Atomic(Entry *) next;
+  HitCounter hits;
+};
+
+struct Slab {
+  Slab *next;
+  size_t size;
+  size_t capacity;
+  size_t used;
+  Entry entries[];
 };
 
+typedef struct {
+  size_t bucket_count;
+  _Atomic(Entry *) buckets[];
+} Table;
+
+typedef enum {
+  RETIRED_ENTRY,
+  RETIRED_VALUE
+} RetiredKind;
+
+typedef struct {
+  void *ptr;
+  RetiredKind kind;
+} Retired;
+
 struct Set {
-  Entry **entries;
+  _Atomic(Table *) table;
   size_t entries_count;
-  size_t bucket_count;
+  Slab *slabs;
+  // Entries of removed items, linked through their next pointers
+  Entry *free_entries;
+  // Entries and values unlinked from the set that lookups might still be reading
+  Retired *retired;
+  size_t retired_count;
+  size_t retired_capacity;
 };
 
+size_t table_size(size_t bucket_count) {
+  return sizeof(Table) + bucket_count * sizeof(_Atomic(Entry *));
+}
+
+Table *table_new(size_t bucket_count) {
+  Table *table = memory_alloc(table_size(bucket_count), -1);
+  table->bucket_count = bucket_count;
+  return table;
+}
+
+void table_free(Table *table) {
+  memory_free(table, table_size(table->bucket_count));
+}
+
+/*
+ * Takes an entry from the free list or the current slab, allocating a new slab if it's full
+ */
+Entry *set_alloc_entry(Set *set) {
+  if (set->free_entries) {
+    Entry *entry = set->free_entries;
+    set->free_entries = atomic_load_explicit(&entry->next, memory_order_relaxed);
+    return entry;
+  }
+
+  Slab *slab = set->slabs;
+  if (slab == NULL || slab->used == slab->capacity) {
+    size_t size = slab ? slab->size * 2 : sizeof(Slab) + FIRST_SLAB_ENTRIES * sizeof(Entry);
+    if (size > MAX_SLAB_SIZE) {
+      size = MAX_SLAB_SIZE;
+    }
+    Slab *new_slab = memory_alloc(size, -1);
+    new_slab->next = slab;
+    new_slab->size = size;
+    new_slab->capacity = (size - sizeof(Slab)) / sizeof(Entry);
+    new_slab->used = 0;
+    set->slabs = slab = new_slab;
+  }
+  return slab->entries + slab->used++;
+}
+
+void set_free_entry(Set *set, Entry *entry) {
+  atomic_store_explicit(&entry->next, set->free_entries, memory_order_relaxed);
+  set->free_entries = entry;
+}
+
 /*
- * Increase the size of the hash map by factor of INCREASE_FACTOR
+ * Defers freeing memory unlinked from the set until set_reclaim
+ */
+void set_retire(Set *set, void *ptr, RetiredKind kind) {
+  if (set->retired_count == set->retired_capacity) {
+    set->retired_capacity = set->retired_capacity ? set->retired_capacity * 2 : 64;
+    set->retired = realloc(set->retired, set->retired_capacity * sizeof(Retired));
+    CHECK_ALLOC(set->retired);
+  }
+  set->retired[set->retired_count++] = (Retired) { ptr, kind };
+}
+
+void set_free_retired(Set *set) {
+  for (size_t i = 0; i < set->retired_count; i++) {
+    if (set->retired[i].kind == RETIRED_ENTRY) {
+      set_free_entry(set, set->retired[i].ptr);
+    } else {
+      free(set->retired[i].ptr);
+    }
+  }
+  set->retired_count = 0;
+}
+
+void set_reclaim(Set *set) {
+  if (set->retired_count) {
+    rcu_synchronize();
+    set_free_retired(set);
+  }
+}
+
+/*
+ * Increase the size of the hash map by factor of INCREASE_FACTOR. Lookups might still be
+ * walking the old buckets, so the entries are copied into the new table instead of being
+ * relinked, and the old ones are freed after a grace period.
  */
 void set_increase(Set *set) {
-  const size_t bucket_count = set->bucket_count;
+  Table *old_table = atomic_load_explicit(&set->table, memory_order_relaxed);
+  const size_t bucket_count = old_table->bucket_count;
+  const size_t new_bucket_count = bucket_count * INCREASE_FACTOR;
   // Create a new entries array with double the previous size
-  Entry **new_entries = calloc(bucket_count * 2, sizeof(Entry *));
-  CHECK_ALLOC(new_entries);
-  Entry **old_entries = set->entries;
+  Table *new_table = table_new(new_bucket_count);
 
-  set->entries = new_entries;
-  set->entries_count = 0;
-  set->bucket_count = bucket_count * INCREASE_FACTOR;
-
-  // Recurse through the old entries and put them all into the map
+  // Copy the old entries into the new buckets, preserving their list masks and hits. Hits
+  // counted into the old entries during the grace period are lost.
   for (size_t i = 0; i < bucket_count; i++) {
-    Entry *entry = old_entries[i];
+    Entry *entry = atomic_load_explicit(&old_table->buckets[i], memory_order_relaxed);
     while (entry != NULL) {
-      set_add(set, entry->value);
-      Entry *old_entry = entry;
-      entry = old_entry->next;
-      free(old_entry);
+      const size_t bucket = hash(entry->value) % new_bucket_count;
+      Entry *copy = set_alloc_entry(set);
+      copy->value = entry->value;
+      atomic_init(&copy->lists, atomic_load_explicit(&entry->lists, memory_order_relaxed));
+      atomic_init(&copy->hits.count, atomic_load_explicit(&entry->hits.count, memory_order_relaxed));
+      atomic_init(&copy->hits.last, atomic_load_explicit(&entry->hits.last, memory_order_relaxed));
+      atomic_init(&copy->next, atomic_load_explicit(&new_table->buckets[bucket], memory_order_relaxed));
+      atomic_init(&new_table->buckets[bucket], copy);
+      set_retire(set, entry, RETIRED_ENTRY);
+      entry = atomic_load_explicit(&entry->next, memory_order_relaxed);
     }
   }
 
-  free(old_entries);
+  atomic_store_explicit(&set->table, new_table, memory_order_release);
+  rcu_synchronize();
+  table_free(old_table);
+  set_free_retired(set);
 }
 
 Set *set_new(void) {
-  Entry **entries = calloc(START_SIZE, sizeof(Entry *));
-  CHECK_ALLOC(entries);
   Set *set = malloc(sizeof(Set));
   CHECK_ALLOC(set);
 
-  set->entries = entries;
+  atomic_init(&set->table, table_new(START_SIZE));
   set->entries_count = 0;
-  set->bucket_count = START_SIZE;
+  set->slabs = NULL;
+  set->free_entries = NULL;
+  set->retired = NULL;
+  set->retired_count = 0;
+  set->retired_capacity = 0;
   return set;
 }
 
 void set_free_opts(Set *set, bool free_vals) {
-  for (int i = 0; i < set->bucket_count; i++) {
-    Entry *entry = set->entries[i];
-    while (entry != NULL) {
-      Entry *old_entry = entry;
-      entry = old_entry->next;
-      if (free_vals) {
-        free((char*) old_entry->value);
+  Table *table = atomic_load(&set->table);
+  if (free_vals) {
+    for (size_t i = 0; i < table->bucket_count; i++) {
+      for (Entry *entry = table->buckets[i]; entry != NULL; entry = entry->next) {
+        free(entry->value);
       }
-      free(old_entry);
     }
   }
 
-  free(set->entries);
+  set_free_retired(set);
+  free(set->retired);
+
+  Slab *slab = set->slabs;
+  while (slab != NULL) {
+    Slab *next = slab->next;
+    memory_free(slab, slab->size);
+    slab = next;
+  }
+
+  table_free(table);
   free(set);
 }
 
@@ -88,70 +226,181 @@ void set_free_vals(Set *set) {
     set_free_opts(set, true);
 }
 
-
-
 bool set_contains(const Set *set, const char *value) {
-  const size_t bucket = hash(value) % (set->bucket_count);
-  // Pulls the entry from the bucket we expect the symbol to be in
-  Entry *entry = set->entries[bucket];
+  return set_lookup(set, value, NULL) != 0;
+}
+
+/*
+ * Searches for an item in the chain of entries starting at entry
+ */
+ListMask set_find(const Entry *entry, const char *value, HitCounter **hits) {
   while (entry != NULL) {
     // Check if the value matches
     if (!strcmp(entry->value, value)) {
-      return true;
+      if (hits) {
+        *hits = (HitCounter *) &entry->hits;
+      }
+      return atomic_load_explicit(&entry->lists, memory_order_relaxed);
     } else {
       // If the value doesn't match move along the linked list
-      entry = entry->next;
+      entry = atomic_load_explicit(&entry->next, memory_order_acquire);
     }
   }
 
   // No entry with searched value exists
-  return false;
+  return 0;
 }
 
-void set_add(Set *set, char *value) {
+ListMask set_lookup(const Set *set, const char *value, HitCounter **hits) {
+  const Table *table = atomic_load_explicit(&set->table, memory_order_acquire);
+  const size_t bucket = hash(value) % (table->bucket_count);
+  // Pulls the entry from the bucket we expect the symbol to be in
+  return set_find(atomic_load_explicit(&table->buckets[bucket], memory_order_acquire), value, hits);
+}
+
+void set_lookup_batch(const Set *set, const char *const *values, size_t count, ListMask *results,
+    HitCounter **hits) {
+  const Table *table = atomic_load_explicit(&set->table, memory_order_acquire);
+  _Atomic(Entry *) const *buckets[LOOKUP_BATCH];
+  const Entry *entries[LOOKUP_BATCH];
+  for (size_t first = 0; first < count; first += LOOKUP_BATCH) {
+    const size_t batch = count - first < LOOKUP_BATCH ? count - first : LOOKUP_BATCH;
+    const char *const *batch_values = values + first;
+
+    for (size_t i = 0; i < batch; i++) {
+      buckets[i] = table->buckets + hash(batch_values[i]) % table->bucket_count;
+      __builtin_prefetch(buckets[i]);
+    }
+    for (size_t i = 0; i < batch; i++) {
+      entries[i] = atomic_load_explicit(buckets[i], memory_order_acquire);
+      if (entries[i]) {
+        __builtin_prefetch(entries[i]);
+      }
+    }
+    for (size_t i = 0; i < batch; i++) {
+      if (entries[i]) {
+        __builtin_prefetch(entries[i]->value);
+      }
+    }
+    for (size_t i = 0; i < batch; i++) {
+      results[first + i] = set_find(entries[i], batch_values[i], hits ? hits + first + i : NULL);
+    }
+  }
+}
+
+char *set_acquire(Set *set, char *value, ListMask lists) {
   // If we have too many entries for our map, increase the size
-  if ((((float)set->entries_count+1) / (float)set->bucket_count) > LOAD_FACTOR) {
+  Table *table = atomic_load_explicit(&set->table, memory_order_relaxed);
+  if ((((float)set->entries_count+1) / (float)table->bucket_count) > LOAD_FACTOR) {
     set_increase(set);
+    table = atomic_load_explicit(&set->table, memory_order_relaxed);
   }
 
-  const size_t bucket = hash(value) % (set -> bucket_count);
+  const size_t bucket = hash(value) % (table->bucket_count);
   // Initialize new_entry_ptr with the address of a pointer to the first entry of the bucket
-  Entry **new_entry_ptr = (set->entries) + bucket;
-  // Initialize entry with pointer to the first entry of the bucket
-  Entry *entry = (set->entries)[bucket];
+  _Atomic(Entry *) *new_entry_ptr = table->buckets + bucket;
+  Entry *entry = atomic_load_explicit(new_entry_ptr, memory_order_relaxed);
   while (entry != NULL) {
     if (!strcmp(entry->value, value)) {
-      // Entry with inserted value already exists - update
-      entry->value = value;
-      return;
+      // Entry with inserted value already exists - merge the list masks
+      atomic_store_explicit(&entry->lists,
+          atomic_load_explicit(&entry->lists, memory_order_relaxed) | lists, memory_order_relaxed);
+      return entry->value;
     }
 
-    // Get pointer to the next entry
-    Entry *next = entry->next;
-    if (next == NULL) {
-      // Current entry does not have a next entry set - save pointer to the next field
-      new_entry_ptr = &(entry->next);
-      break;
-    }
-    // Move to next entry
-    entry = next;
+    // Move to the next entry, remembering the field that will point to the new entry
+    new_entry_ptr = &entry->next;
+    entry = atomic_load_explicit(new_entry_ptr, memory_order_relaxed);
   }
 
-  // Set pointer to the newly created entry
-  *new_entry_ptr = malloc(sizeof(Entry));
-  CHECK_ALLOC(*new_entry_ptr);
-  // Initialize the newly created entry
-  Entry *new_entry = *new_entry_ptr;
+  // Initialize the new entry before publishing it to lookups
+  Entry *new_entry = set_alloc_entry(set);
   new_entry->value = value;
-  new_entry->next = NULL;
+  atomic_init(&new_entry->lists, lists);
+  atomic_init(&new_entry->next, NULL);
+  atomic_init(&new_entry->hits.count, 0);
+  atomic_init(&new_entry->hits.last, 0);
+  atomic_store_explicit(new_entry_ptr, new_entry, memory_order_release);
   set->entries_count++;
+  return value;
+}
+
+bool set_add(Set *set, char *value, ListMask lists) {
+  return set_acquire(set, value, lists) == value;
+}
+
+bool set_release(Set *set, const char *value, ListMask lists) {
+  Table *table = atomic_load_explicit(&set->table, memory_order_relaxed);
+  _Atomic(Entry *) *entry_ptr = table->buckets + hash(value) % table->bucket_count;
+  Entry *curr = atomic_load_explicit(entry_ptr, memory_order_relaxed);
+  while (curr != NULL && strcmp(curr->value, value)) {
+    entry_ptr = &curr->next;
+    curr = atomic_load_explicit(entry_ptr, memory_order_relaxed);
+  }
+
+  if (curr == NULL) {
+    return false;
+  }
+  const ListMask remaining = atomic_load_explicit(&curr->lists, memory_order_relaxed) & ~lists;
+  atomic_store_explicit(&curr->lists, remaining, memory_order_relaxed);
+  if (remaining) {
+    // Entry is still referenced by other lists
+    return false;
+  }
+
+  // Lookups walking the bucket might still be at the entry, so its next pointer is kept
+  atomic_store_explicit(entry_ptr, atomic_load_explicit(&curr->next, memory_order_relaxed),
+      memory_order_release);
+  set_retire(set, curr->value, RETIRED_VALUE);
+  set_retire(set, curr, RETIRED_ENTRY);
+  set->entries_count--;
+  return true;
+}
+
+size_t set_size(const Set *set) {
+  return set->entries_count;
+}
+
+size_t set_longest_chain(const Set *set) {
+  const Table *table = atomic_load(&set->table);
+  size_t longest = 0;
+  for (size_t i = 0; i < table->bucket_count; i++) {
+    size_t length = 0;
+    for (const Entry *entry = table->buckets[i]; entry != NULL; entry = entry->next) {
+      length++;
+    }
+    if (length > longest) {
+      longest = length;
+    }
+  }
+  return longest;
+}
+
+void set_foreach(const Set *set, SetItemCallback callback, void *context) {
+  const Table *table = atomic_load(&set->table);
+  for (size_t i = 0; i < table->bucket_count; i++) {
+    for (const Entry *entry = table->buckets[i]; entry != NULL; entry = entry->next) {
+      callback(entry->value, entry->lists, &entry->hits, context);
+    }
+  }
+}
+
+void set_report_memory(const Set *set, const char *name) {
+  char region[128];
+  snprintf(region, sizeof(region), "%s buckets", name);
+  const Table *table = atomic_load(&set->table);
+  memory_report(region, table, table_size(table->bucket_count));
+  if (set->slabs) {
+    snprintf(region, sizeof(region), "%s entries", name);
+    memory_report(region, set->slabs, set->slabs->size);
+  }
 }
 
 void set_remove(Set *set, char *value, bool free_val) {
-  const size_t bucket = hash(value) % (set -> bucket_count);
+  Table *table = atomic_load_explicit(&set->table, memory_order_relaxed);
   // Initialize pointers required for removal
-  Entry *pred = NULL;
-  Entry *curr = (set->entries)[bucket];
+  _Atomic(Entry *) *entry_ptr = table->buckets + hash(value) % table->bucket_count;
+  Entry *curr = atomic_load_explicit(entry_ptr, memory_order_relaxed);
   // Locate removed entry
   while (curr != NULL) {
     if (!strcmp(curr->value, value)) {
@@ -159,8 +408,8 @@ void set_remove(Set *set, char *value, bool free_val) {
       break;
     }
 
-    pred = curr;
-    curr = curr->next;
+    entry_ptr = &curr->next;
+    curr = atomic_load_explicit(entry_ptr, memory_order_relaxed);
   }
 
   if (curr == NULL) {
@@ -168,15 +417,12 @@ void set_remove(Set *set, char *value, bool free_val) {
     return;
   }
 
-  if (pred == NULL) {
-    // Removed entry is at the beginning of the bucket list
-    set->entries[bucket] = curr->next;
-  } else {
-    // Removed entry has a predecessor - update pointers to exclude curr from the list
-    pred->next = curr->next;
-  }
+  // Update the pointer to curr to exclude it from the list
+  atomic_store_explicit(entry_ptr, atomic_load_explicit(&curr->next, memory_order_relaxed),
+      memory_order_release);
   if (free_val) {
-    free(curr->value);
+    set_retire(set, curr->value, RETIRED_VALUE);
   }
-  free(curr);
+  set_retire(set, curr, RETIRED_ENTRY);
+  set->entries_count--;
 }
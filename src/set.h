@@ -1,9 +1,46 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct Set Set;
 
+/*
+ * Bitmask of the lists an entry belongs to, bit n being set iff the entry was loaded
+ * from the list with id n
+ */
+typedef uint64_t ListMask;
+
+// Each list is identified by a bit in the ListMask of the set entries it contributes to
+#define MAX_LISTS 64
+
+#define LIST_BIT(id) (((ListMask) 1) << (id))
+
+/*
+ * Number of lookups that found an item and the time of the latest one in seconds since the
+ * epoch, 0 if it was never found. Lookups update it with relaxed loads and stores, so the
+ * number undercounts lookups racing with each other.
+ */
+typedef struct {
+  _Atomic uint32_t count;
+  _Atomic uint32_t last;
+} HitCounter;
+
+/*
+ * Function called with an item of a set, the mask of lists it belongs to, its hit counter and
+ * the context passed to the iteration
+ */
+typedef void (*SetItemCallback)(const char *value, ListMask lists, const HitCounter *hits,
+    void *context);
+
+/*
+ * A set of strings, which can be searched by any number of threads while a single thread
+ * at a time adds and removes items. Memory of removed items is only freed by set_reclaim,
+ * once no search can still be reading it.
+ */
+
 /*
  * Creates a new set on a heap
  */
@@ -15,15 +52,74 @@ Set *set_new(void);
 bool set_contains(const Set *set, const char *value);
 
 /*
- * Adds an item to the set
+ * - Searches for an item in a set and returns the mask of lists it belongs to, or 0 if
+ *   it's not in the set
+ * - If hits is not NULL, it's set to the hit counter of the item when it's found
+ */
+ListMask set_lookup(const Set *set, const char *value, HitCounter **hits);
+
+/*
+ * - Searches for count items in a set like set_lookup, writing their masks to results and,
+ *   if hits is not NULL, their hit counters to hits, left unchanged for missing items
+ * - Lookups are staged over the items, prefetching the buckets of all of them before reading
+ *   any, then their first entries, then the names of the entries, so that the cache misses
+ *   of the items overlap
  */
-void set_add(Set *set, char *value);
+void set_lookup_batch(const Set *set, const char *const *values, size_t count, ListMask *results,
+    HitCounter **hits);
+
+/*
+ * - Adds an item to the set, marking it as a member of the lists in mask
+ * - If the item is already in the set, the mask is merged into the existing entry
+ * - Returns true iff the value was inserted and is now owned by the set
+ */
+bool set_add(Set *set, char *value, ListMask lists);
+
+/*
+ * - Adds an item to the set like set_add, the mask bits acting as references held by lists
+ * - Returns the value stored in the set, which is value itself iff it was inserted
+ */
+char *set_acquire(Set *set, char *value, ListMask lists);
+
+/*
+ * - Drops the references of the lists in mask to an item, removing the item and freeing
+ *   its value once no list references it
+ * - Returns true iff the item was removed
+ */
+bool set_release(Set *set, const char *value, ListMask lists);
+
+/*
+ * Returns the number of items in the set
+ */
+size_t set_size(const Set *set);
+
+/*
+ * Returns the number of items in the longest bucket chain of the set, which lookups of
+ * colliding names have to walk
+ */
+size_t set_longest_chain(const Set *set);
+
+/*
+ * Calls callback with every item in the set, the mask of lists it belongs to, its hit counter
+ * and the context
+ */
+void set_foreach(const Set *set, SetItemCallback callback, void *context);
+
+/*
+ * Prints the page sizes and NUMA nodes of the bucket array and the latest entry slab
+ */
+void set_report_memory(const Set *set, const char *name);
 
 /*
  * Removes an item from the set, freeing entry and optionally value stored in the entry
  */
 void set_remove(Set *set, char *value, bool free_val);
 
+/*
+ * Waits for the searches that might still be reading removed items and frees their memory
+ */
+void set_reclaim(Set *set);
+
 /*
   * Deletes the map, preserving the elements allocated within it
  */
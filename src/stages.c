@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stages.h"
+
+#include <inttypes.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "thread_slots.h"
+#include "utils.h"
+
+// Time over which the tick counter is calibrated
+#define CALIBRATION_NS 20000000
+
+typedef struct {
+  alignas(64) _Atomic uint64_t ticks[STAGE_COUNT];
+  _Atomic uint64_t max_ticks[STAGE_COUNT];
+  _Atomic uint64_t count[STAGE_COUNT];
+} ThreadStageTimes;
+
+ThreadStageTimes thread_stage_times[MAX_THREAD_SLOTS];
+ThreadSlots stage_slots = THREAD_SLOTS_INIT("time request stages");
+_Thread_local ThreadStageTimes *current_stage_times = NULL;
+
+/*
+ * Times the stages of the request being served by a thread
+ */
+typedef struct {
+  // Tick count when the request started, 0 if stage timing is disabled
+  uint64_t start;
+  uint64_t last;
+  uint64_t ticks[STAGE_COUNT];
+  // Bit of every stage the request went through
+  uint32_t stages;
+} StageTimer;
+
+_Thread_local StageTimer current_timer;
+
+bool stage_timing = false;
+uint64_t slow_threshold_ticks = 0;
+double ns_per_tick = 1.0;
+
+const char *stage_names[STAGE_COUNT] = {
+  [STAGE_PARSE]   = "parse",
+  [STAGE_LOOKUP]  = "lookup",
+  [STAGE_RESPOND] = "respond",
+  [STAGE_FORWARD] = "forward",
+  [STAGE_LOG]     = "log",
+  [STAGE_SEND]    = "send"
+};
+
+uint64_t stage_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Reads the time stamp counter, which ticks at a constant rate on the CPUs the server runs on
+ * and is read without entering the kernel
+ */
+uint64_t stage_ticks(void) {
+  uint32_t low, high;
+  __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+  return ((uint64_t) high << 32) | low;
+}
+#else
+uint64_t stage_ticks(void) {
+  return stage_clock();
+}
+#endif
+
+uint64_t stage_ticks_to_ns(uint64_t ticks) {
+  return (uint64_t) (ticks * ns_per_tick);
+}
+
+void stages_enable(uint64_t slow_threshold_ns) {
+#if defined(__x86_64__) || defined(__i386__)
+  const uint64_t start_ns = stage_clock();
+  const uint64_t start_ticks = stage_ticks();
+  nanosleep(&(struct timespec) { .tv_nsec = CALIBRATION_NS }, NULL);
+  const uint64_t elapsed_ticks = stage_ticks() - start_ticks;
+  const uint64_t elapsed_ns = stage_clock() - start_ns;
+  if (elapsed_ticks) {
+    ns_per_tick = (double) elapsed_ns / elapsed_ticks;
+  }
+#endif
+
+  slow_threshold_ticks = (uint64_t) (slow_threshold_ns / ns_per_tick);
+  stage_timing = true;
+  printf("[Stages] Timing request stages at %.3f ns per tick", ns_per_tick);
+  if (slow_threshold_ns) {
+    printf(", logging requests slower than %" PRIu64 " us", slow_threshold_ns / 1000);
+  }
+  printf("\n");
+}
+
+bool stages_enabled(void) {
+  return stage_timing;
+}
+
+void stage_request_start(void) {
+  if (!stage_timing) {
+    return;
+  }
+  StageTimer *timer = &current_timer;
+  timer->start = timer->last = stage_ticks();
+  timer->stages = 0;
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    timer->ticks[stage] = 0;
+  }
+}
+
+void stage_end(Stage stage) {
+  StageTimer *timer = &current_timer;
+  if (!timer->start) {
+    return;
+  }
+  const uint64_t now = stage_ticks();
+  STAGE_PROBE2(stage, stage, now - timer->last);
+  timer->ticks[stage] += now - timer->last;
+  timer->stages |= 1u << stage;
+  timer->last = now;
+}
+
+/*
+ * Prints the stage breakdown of a slow request to the slow query log
+ */
+void stage_report_slow(const StageTimer *timer, const Message *message) {
+  size_t name_length;
+  char *domain = parse_dns_domain(message, &name_length);
+  printf("[SlowQuery] %s took %" PRIu64 " us:", domain ? domain : ".",
+      stage_ticks_to_ns(timer->last - timer->start) / 1000);
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    if (timer->stages & (1u << stage)) {
+      printf(" %s %" PRIu64 " ns", stage_names[stage], stage_ticks_to_ns(timer->ticks[stage]));
+    }
+  }
+  printf("\n");
+  free(domain);
+}
+
+void stage_request_finish(const Message *message) {
+  StageTimer *timer = &current_timer;
+  if (!timer->start) {
+    return;
+  }
+  if (current_stage_times == NULL) {
+    current_stage_times = thread_stage_times + thread_slots_acquire(&stage_slots);
+  }
+
+  // Only the owning thread writes its times, which needs no atomic read-modify-write
+  ThreadStageTimes *times = current_stage_times;
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    if (!(timer->stages & (1u << stage))) {
+      continue;
+    }
+    const uint64_t ticks = timer->ticks[stage];
+    atomic_store_explicit(&times->ticks[stage],
+        atomic_load_explicit(&times->ticks[stage], memory_order_relaxed) + ticks,
+        memory_order_relaxed);
+    atomic_store_explicit(&times->count[stage],
+        atomic_load_explicit(&times->count[stage], memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    if (ticks > atomic_load_explicit(&times->max_ticks[stage], memory_order_relaxed)) {
+      atomic_store_explicit(&times->max_ticks[stage], ticks, memory_order_relaxed);
+    }
+  }
+
+  if (slow_threshold_ticks && timer->last - timer->start > slow_threshold_ticks) {
+    stage_report_slow(timer, message);
+  }
+  timer->start = 0;
+}
+
+void stages_collect(StageTimes *totals) {
+  for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+    totals->total_ns[stage] = totals->max_ns[stage] = totals->count[stage] = 0;
+  }
+
+  const size_t count = thread_slots_count(&stage_slots);
+  for (size_t i = 0; i < count; i++) {
+    ThreadStageTimes *times = thread_stage_times + i;
+    for (Stage stage = 0; stage < STAGE_COUNT; stage++) {
+      totals->total_ns[stage] += stage_ticks_to_ns(
+          atomic_load_explicit(&times->ticks[stage], memory_order_relaxed));
+      totals->count[stage] += atomic_load_explicit(&times->count[stage], memory_order_relaxed);
+      const uint64_t max_ns = stage_ticks_to_ns(
+          atomic_load_explicit(&times->max_ticks[stage], memory_order_relaxed));
+      if (max_ns > totals->max_ns[stage]) {
+        totals->max_ns[stage] = max_ns;
+      }
+    }
+  }
+}
+
+const char *stage_name(Stage stage) {
+  return stage_names[stage];
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "message.h"
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+/*
+ * Fire USDT probes of the dnsblocker provider, which are no-op instructions until a tracer
+ * attaches to them
+ */
+#define STAGE_PROBE2(name, a, b) STAP_PROBE2(dnsblocker, name, a, b)
+#define STAGE_PROBE3(name, a, b, c) STAP_PROBE3(dnsblocker, name, a, b, c)
+#else
+#define STAGE_PROBE2(name, a, b) do { } while (0)
+#define STAGE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+typedef enum {
+  // Rate limiting the query and parsing the question name
+  STAGE_PARSE,
+  // Matching the name against the lists of the client's policy
+  STAGE_LOOKUP,
+  // Answering from the block templates or the response cache
+  STAGE_RESPOND,
+  // Forwarding to the upstream provider and caching its response
+  STAGE_FORWARD,
+  // Logging the request
+  STAGE_LOG,
+  // Rate limiting and sending the response
+  STAGE_SEND,
+  STAGE_COUNT
+} Stage;
+
+/*
+ * Time spent in each stage by all threads
+ */
+typedef struct {
+  uint64_t total_ns[STAGE_COUNT];
+  uint64_t max_ns[STAGE_COUNT];
+  uint64_t count[STAGE_COUNT];
+} StageTimes;
+
+/*
+ * - Turns on stage timing, calibrating the tick counter against the monotonic clock
+ * - Requests taking longer than slow_threshold_ns are logged with their stage breakdown,
+ *   0 disabling the slow query log
+ * - Has to be called before the server starts
+ */
+void stages_enable(uint64_t slow_threshold_ns);
+
+/*
+ * Returns whether stage timing is enabled
+ */
+bool stages_enabled(void);
+
+/*
+ * Returns a monotonic timestamp in nanoseconds
+ */
+uint64_t stage_clock(void);
+
+/*
+ * Starts timing the stages of a request served by the calling thread, which costs a single
+ * branch if stage timing is disabled
+ */
+void stage_request_start(void);
+
+/*
+ * Adds the time since the previous stage of the current request, or since it started, to a
+ * stage
+ */
+void stage_end(Stage stage);
+
+/*
+ * - Adds the stages of the current request to the totals of the calling thread
+ * - Logs the stage breakdown of the request if it's slower than the slow query threshold
+ */
+void stage_request_finish(const Message *message);
+
+/*
+ * Sums the stage times of all threads into totals
+ */
+void stages_collect(StageTimes *totals);
+
+/*
+ * Returns the name of a stage
+ */
+const char *stage_name(Stage stage);
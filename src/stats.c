@@ -0,0 +1,54 @@
+#include "stats.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "thread_slots.h"
+
+typedef struct {
+  alignas(64) _Atomic uint64_t counters[STAT_COUNT];
+} ThreadStats;
+
+ThreadStats thread_stats[MAX_THREAD_SLOTS];
+ThreadSlots stats_slots = THREAD_SLOTS_INIT("update statistics");
+_Thread_local ThreadStats *current_stats = NULL;
+
+const char *stat_names[STAT_COUNT] = {
+  [STAT_QUERIES]      = "queries",
+  [STAT_BLOCKED]      = "blocked",
+  [STAT_FORWARDED]    = "forwarded",
+  [STAT_CACHED]       = "cached",
+  [STAT_LOCAL]        = "local",
+  [STAT_RATE_LIMITED] = "rate_limited",
+  [STAT_TRUNCATED]    = "truncated"
+};
+
+void stats_increment(Stat stat) {
+  if (current_stats == NULL) {
+    current_stats = thread_stats + thread_slots_acquire(&stats_slots);
+  }
+
+  // Only the owning thread writes the counter, which needs no atomic read-modify-write
+  _Atomic uint64_t *counter = current_stats->counters + stat;
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+void stats_collect(uint64_t totals[STAT_COUNT]) {
+  for (size_t stat = 0; stat < STAT_COUNT; stat++) {
+    totals[stat] = 0;
+  }
+
+  // Slots of exited threads keep their counts, which the next thread adds to
+  const size_t count = thread_slots_count(&stats_slots);
+  for (size_t i = 0; i < count; i++) {
+    for (size_t stat = 0; stat < STAT_COUNT; stat++) {
+      totals[stat] += atomic_load_explicit(&thread_stats[i].counters[stat], memory_order_relaxed);
+    }
+  }
+}
+
+const char *stats_name(Stat stat) {
+  return stat_names[stat];
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef enum {
+  STAT_QUERIES,
+  STAT_BLOCKED,
+  STAT_FORWARDED,
+  STAT_CACHED,
+  STAT_LOCAL,
+  STAT_RATE_LIMITED,
+  STAT_TRUNCATED,
+  STAT_COUNT
+} Stat;
+
+/*
+ * Increments a counter of the calling thread. Every thread counts into its own cache line,
+ * so counting never contends with other threads.
+ */
+void stats_increment(Stat stat);
+
+/*
+ * Sums the counters of all threads into totals
+ */
+void stats_collect(uint64_t totals[STAT_COUNT]);
+
+/*
+ * Returns the name of a counter
+ */
+const char *stats_name(Stat stat);
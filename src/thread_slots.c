@@ -0,0 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "thread_slots.h"
+
+#include "utils.h"
+
+/*
+ * Gives the slot of an exiting thread back, called with the value of its key
+ */
+void thread_slots_release(void *value) {
+  ThreadSlotOwner *owner = value;
+  ThreadSlots *slots = owner->slots;
+  pthread_mutex_lock(&slots->lock);
+  slots->used &= ~(UINT64_C(1) << (owner - slots->owners));
+  pthread_mutex_unlock(&slots->lock);
+}
+
+size_t thread_slots_acquire(ThreadSlots *slots) {
+  pthread_mutex_lock(&slots->lock);
+  if (!slots->key_created) {
+    const int error = pthread_key_create(&slots->key, thread_slots_release);
+    if (error) {
+      fatal_error("Failed to create the key of the threads that %s with error: %d",
+          slots->purpose, error);
+    }
+    slots->key_created = true;
+  }
+  if (slots->used == UINT64_MAX) {
+    fatal_error("More than %d threads %s", MAX_THREAD_SLOTS, slots->purpose);
+  }
+
+  const size_t index = (size_t) __builtin_ctzll(~slots->used);
+  slots->used |= UINT64_C(1) << index;
+  if (index >= atomic_load_explicit(&slots->count, memory_order_relaxed)) {
+    atomic_store(&slots->count, index + 1);
+  }
+  ThreadSlotOwner *owner = &slots->owners[index];
+  owner->slots = slots;
+  pthread_setspecific(slots->key, owner);
+  pthread_mutex_unlock(&slots->lock);
+  return index;
+}
+
+size_t thread_slots_count(ThreadSlots *slots) {
+  return atomic_load(&slots->count);
+}
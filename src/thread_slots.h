@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest number of threads holding a slot of the same array at once
+#define MAX_THREAD_SLOTS 64
+
+typedef struct ThreadSlots ThreadSlots;
+
+/*
+ * Entry of a slot, which the key of the thread holding it points to
+ */
+typedef struct {
+  ThreadSlots *slots;
+} ThreadSlotOwner;
+
+/*
+ * - Hands out the indexes of an array with an element per thread, such as per-thread counters
+ *   that a single thread writes and any thread sums
+ * - A thread takes the lowest free slot when it first needs one, and gives it back when it
+ *   exits. The element is kept as it is, so that the next thread carries on from its values.
+ */
+struct ThreadSlots {
+  // What the threads use the slots for, reported when all of them are taken
+  const char *purpose;
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  bool key_created;
+  // Slots held by running threads
+  uint64_t used;
+  // Number of slots ever taken, the elements past it were never written
+  _Atomic size_t count;
+  ThreadSlotOwner owners[MAX_THREAD_SLOTS];
+};
+
+#define THREAD_SLOTS_INIT(what) { .purpose = (what), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * Takes a free slot for the calling thread, which has to keep its index for as long as it
+ * runs, and exits with a fatal error if MAX_THREAD_SLOTS running threads hold one already
+ */
+size_t thread_slots_acquire(ThreadSlots *slots);
+
+/*
+ * Returns the number of slots ever taken, which readers of the elements iterate over
+ */
+size_t thread_slots_count(ThreadSlots *slots);
@@ -0,0 +1,442 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "top.h"
+
+#include <inttypes.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "thread_slots.h"
+#include "utils.h"
+// Longest key, which fits any domain name
+#define MAX_TOP_KEY 256
+// Rows of the count-min sketches, which estimate counts with the smallest of a counter per row
+#define TOP_SKETCH_DEPTH 4
+// Cache lines of the sketches. Each key only uses the counters of one line, one from each
+// quarter of it, so that counting a key misses the cache once.
+#define TOP_SKETCH_LINES 512
+#define TOP_LINE_COUNTERS 16
+
+/*
+ * A candidate for the most frequent keys, which only the owning thread writes
+ */
+typedef struct {
+  // Odd while the key is being replaced, so that readers skip the entry
+  _Atomic uint32_t version;
+  _Atomic uint32_t length;
+  _Atomic uint64_t hash;
+  // Estimated count of the key when it was last seen, which picks the entry to replace
+  uint64_t count;
+  // Position of the entry in the heap
+  uint32_t position;
+  _Atomic uint64_t key[MAX_TOP_KEY / 8];
+} TopEntry;
+
+/*
+ * - Counts the keys of a stream seen by a thread in a count-min sketch, and keeps the keys
+ *   with the highest estimates in a table of candidates, replacing the smallest one
+ * - The table is indexed by an open addressing hash table of entry indexes, and ordered by
+ *   a min-heap of the entry counts
+ */
+typedef struct {
+  alignas(64) _Atomic uint32_t counters[TOP_SKETCH_LINES][TOP_LINE_COUNTERS];
+  TopEntry *entries;
+  _Atomic uint32_t size;
+  // Entry indexes, the entry with the smallest count first
+  uint16_t *heap;
+  // Index of each entry plus one, 0 for empty slots
+  uint16_t *slots;
+  uint32_t slot_mask;
+} TopSketch;
+
+typedef struct {
+  alignas(64) TopSketch streams[TOP_COUNT];
+} ThreadTop;
+
+_Atomic(ThreadTop *) thread_tops[MAX_THREAD_SLOTS];
+ThreadSlots top_slots = THREAD_SLOTS_INIT("track the most frequent keys");
+_Thread_local ThreadTop *current_top = NULL;
+
+uint32_t top_capacity = 0;
+
+const char *top_stream_names[TOP_COUNT] = {
+  [TOP_CLIENTS]   = "clients",
+  [TOP_BLOCKED]   = "blocked",
+  [TOP_FORWARDED] = "forwarded",
+  [TOP_CACHED]    = "cached",
+  [TOP_LOCAL]     = "local"
+};
+
+void top_enable(uint32_t capacity) {
+  top_capacity = capacity;
+  printf("[Top] Tracking the %" PRIu32 " most frequent clients and names of every thread\n",
+      capacity);
+}
+
+bool top_enabled(void) {
+  return top_capacity != 0;
+}
+
+/*
+ * Allocates the streams of the calling thread and publishes them to the readers, or carries on
+ * with the streams of the exited thread whose slot it takes
+ */
+ThreadTop *top_register_thread(void) {
+  const size_t index = thread_slots_acquire(&top_slots);
+  ThreadTop *previous = atomic_load_explicit(&thread_tops[index], memory_order_acquire);
+  if (previous) {
+    return previous;
+  }
+
+  uint32_t slot_count = 1;
+  while (slot_count < top_capacity * 2) {
+    slot_count <<= 1;
+  }
+
+  ThreadTop *top = calloc(1, sizeof(ThreadTop));
+  CHECK_ALLOC(top);
+  for (TopStream stream = 0; stream < TOP_COUNT; stream++) {
+    TopSketch *sketch = &top->streams[stream];
+    sketch->entries = calloc(top_capacity, sizeof(TopEntry));
+    CHECK_ALLOC(sketch->entries);
+    sketch->heap = calloc(top_capacity, sizeof(uint16_t));
+    CHECK_ALLOC(sketch->heap);
+    sketch->slots = calloc(slot_count, sizeof(uint16_t));
+    CHECK_ALLOC(sketch->slots);
+    sketch->slot_mask = slot_count - 1;
+  }
+  atomic_store_explicit(&thread_tops[index], top, memory_order_release);
+  return top;
+}
+
+uint32_t top_home_slot(const TopSketch *sketch, uint64_t hash) {
+  // The low bits of the hash pick the sketch counters
+  return (uint32_t) (hash >> 40) & sketch->slot_mask;
+}
+
+/*
+ * Returns the counter of a key's hash in a row of the sketch
+ */
+_Atomic uint32_t *top_counter(TopSketch *sketch, uint64_t hash, uint32_t row) {
+  const uint32_t line = (uint32_t) (hash >> 24) % TOP_SKETCH_LINES;
+  const uint32_t column = (hash >> (row * 2)) & (TOP_LINE_COUNTERS / TOP_SKETCH_DEPTH - 1);
+  return &sketch->counters[line][row * (TOP_LINE_COUNTERS / TOP_SKETCH_DEPTH) + column];
+}
+
+/*
+ * Removes an entry from the index, shifting back the entries probed past it
+ */
+void top_index_remove(TopSketch *sketch, uint32_t entry) {
+  uint32_t slot = top_home_slot(sketch, atomic_load_explicit(&sketch->entries[entry].hash,
+      memory_order_relaxed));
+  while (sketch->slots[slot] != entry + 1) {
+    slot = (slot + 1) & sketch->slot_mask;
+  }
+
+  uint32_t next = slot;
+  while (true) {
+    next = (next + 1) & sketch->slot_mask;
+    if (!sketch->slots[next]) {
+      break;
+    }
+    const uint32_t home = top_home_slot(sketch, atomic_load_explicit(
+        &sketch->entries[sketch->slots[next] - 1].hash, memory_order_relaxed));
+    // Entries whose home lies cyclically after the hole and up to their slot stay in place
+    const bool stays = slot <= next ? slot < home && home <= next : slot < home || home <= next;
+    if (!stays) {
+      sketch->slots[slot] = sketch->slots[next];
+      slot = next;
+    }
+  }
+  sketch->slots[slot] = 0;
+}
+
+/*
+ * Moves the entry at a position of the heap towards the root while its count is smaller
+ * than its parent's
+ */
+void top_heap_up(TopSketch *sketch, uint32_t position) {
+  const uint16_t entry = sketch->heap[position];
+  const uint64_t count = sketch->entries[entry].count;
+  while (position > 0) {
+    const uint32_t parent = (position - 1) / 2;
+    if (sketch->entries[sketch->heap[parent]].count <= count) {
+      break;
+    }
+    sketch->heap[position] = sketch->heap[parent];
+    sketch->entries[sketch->heap[position]].position = position;
+    position = parent;
+  }
+  sketch->heap[position] = entry;
+  sketch->entries[entry].position = position;
+}
+
+/*
+ * Moves the entry at a position of the heap towards the leaves while its count is larger
+ * than one of its children's
+ */
+void top_heap_down(TopSketch *sketch, uint32_t position, uint32_t size) {
+  const uint16_t entry = sketch->heap[position];
+  const uint64_t count = sketch->entries[entry].count;
+  while (true) {
+    uint32_t child = position * 2 + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size
+        && sketch->entries[sketch->heap[child + 1]].count < sketch->entries[sketch->heap[child]].count) {
+      child++;
+    }
+    if (count <= sketch->entries[sketch->heap[child]].count) {
+      break;
+    }
+    sketch->heap[position] = sketch->heap[child];
+    sketch->entries[sketch->heap[position]].position = position;
+    position = child;
+  }
+  sketch->heap[position] = entry;
+  sketch->entries[entry].position = position;
+}
+
+/*
+ * Writes a key over an entry, which readers skip until it's complete
+ */
+void top_write_entry(TopEntry *entry, uint64_t hash, const uint8_t *key, uint32_t length,
+    uint64_t count) {
+  const uint32_t version = atomic_load_explicit(&entry->version, memory_order_relaxed);
+  atomic_store_explicit(&entry->version, version + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  atomic_store_explicit(&entry->hash, hash, memory_order_relaxed);
+  atomic_store_explicit(&entry->length, length, memory_order_relaxed);
+  for (uint32_t i = 0; i < (length + 7) / 8; i++) {
+    uint64_t word = 0;
+    memcpy(&word, key + i * 8, length - i * 8 < 8 ? length - i * 8 : 8);
+    atomic_store_explicit(&entry->key[i], word, memory_order_relaxed);
+  }
+  entry->count = count;
+
+  atomic_store_explicit(&entry->version, version + 2, memory_order_release);
+}
+
+/*
+ * Copies the key of an entry, returning false if it was being replaced
+ */
+bool top_read_entry(const TopEntry *entry, uint8_t *key, uint32_t *length, uint64_t *hash) {
+  const uint32_t version = atomic_load_explicit(&entry->version, memory_order_acquire);
+  if (version & 1) {
+    return false;
+  }
+
+  *hash = atomic_load_explicit(&entry->hash, memory_order_relaxed);
+  *length = atomic_load_explicit(&entry->length, memory_order_relaxed);
+  for (uint32_t i = 0; i < (*length + 7) / 8; i++) {
+    const uint64_t word = atomic_load_explicit(&entry->key[i], memory_order_relaxed);
+    memcpy(key + i * 8, &word, *length - i * 8 < 8 ? *length - i * 8 : 8);
+  }
+
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&entry->version, memory_order_relaxed) == version;
+}
+
+/*
+ * Counts a key into a stream of the calling thread
+ */
+void top_count(TopSketch *sketch, const uint8_t *key, uint32_t length) {
+  const uint64_t hash = hash_bytes(key, length);
+
+  // Only the counters below the new estimate are raised, which overcounts less than raising
+  // them all. Counters saturate instead of wrapping around.
+  _Atomic uint32_t *counters[TOP_SKETCH_DEPTH];
+  uint32_t estimate = UINT32_MAX;
+  for (uint32_t row = 0; row < TOP_SKETCH_DEPTH; row++) {
+    counters[row] = top_counter(sketch, hash, row);
+    const uint32_t count = atomic_load_explicit(counters[row], memory_order_relaxed);
+    if (count < estimate) {
+      estimate = count;
+    }
+  }
+  if (estimate < UINT32_MAX) {
+    estimate++;
+  }
+  for (uint32_t row = 0; row < TOP_SKETCH_DEPTH; row++) {
+    // Only the owning thread writes the counters, which needs no atomic read-modify-write
+    if (atomic_load_explicit(counters[row], memory_order_relaxed) < estimate) {
+      atomic_store_explicit(counters[row], estimate, memory_order_relaxed);
+    }
+  }
+
+  uint32_t slot = top_home_slot(sketch, hash);
+  while (sketch->slots[slot]) {
+    TopEntry *entry = &sketch->entries[sketch->slots[slot] - 1];
+    if (atomic_load_explicit(&entry->hash, memory_order_relaxed) == hash) {
+      entry->count = estimate;
+      top_heap_down(sketch, entry->position, atomic_load_explicit(&sketch->size,
+          memory_order_relaxed));
+      return;
+    }
+    slot = (slot + 1) & sketch->slot_mask;
+  }
+
+  const uint32_t size = atomic_load_explicit(&sketch->size, memory_order_relaxed);
+  if (size < top_capacity) {
+    top_write_entry(&sketch->entries[size], hash, key, length, estimate);
+    sketch->slots[slot] = size + 1;
+    sketch->heap[size] = size;
+    top_heap_up(sketch, size);
+    atomic_store_explicit(&sketch->size, size + 1, memory_order_release);
+    return;
+  }
+
+  // Keys seen less often than every candidate are only counted by the sketch
+  const uint16_t smallest = sketch->heap[0];
+  if (estimate <= sketch->entries[smallest].count) {
+    return;
+  }
+
+  top_index_remove(sketch, smallest);
+  top_write_entry(&sketch->entries[smallest], hash, key, length, estimate);
+  top_heap_down(sketch, 0, size);
+  slot = top_home_slot(sketch, hash);
+  while (sketch->slots[slot]) {
+    slot = (slot + 1) & sketch->slot_mask;
+  }
+  sketch->slots[slot] = smallest + 1;
+}
+
+void top_record(uint32_t client, Stat verdict, const char *domain) {
+  if (!top_capacity) {
+    return;
+  }
+  if (current_top == NULL) {
+    current_top = top_register_thread();
+  }
+
+  const uint32_t address = htonl(client);
+  top_count(&current_top->streams[TOP_CLIENTS], (const uint8_t *) &address, sizeof(address));
+
+  TopStream stream;
+  switch (verdict) {
+    case STAT_BLOCKED:   stream = TOP_BLOCKED;   break;
+    case STAT_FORWARDED: stream = TOP_FORWARDED; break;
+    case STAT_CACHED:    stream = TOP_CACHED;    break;
+    case STAT_LOCAL:     stream = TOP_LOCAL;     break;
+    default:             return;
+  }
+
+  // Names are counted case insensitively, so that randomized case doesn't split them
+  uint8_t key[MAX_TOP_KEY];
+  uint32_t length = 0;
+  if (!domain) {
+    key[length++] = '.';
+  }
+  for (const char *c = domain; c && *c && length < MAX_TOP_KEY; c++) {
+    key[length++] = *c >= 'A' && *c <= 'Z' ? *c + 'a' - 'A' : *c;
+  }
+  top_count(&current_top->streams[stream], key, length);
+}
+
+/*
+ * A key of the merged streams
+ */
+typedef struct {
+  uint64_t hash;
+  uint64_t count;
+  uint32_t length;
+  uint8_t key[MAX_TOP_KEY];
+} TopCandidate;
+
+int top_compare_hashes(const void *a, const void *b) {
+  const uint64_t first = ((const TopCandidate *) a)->hash;
+  const uint64_t second = ((const TopCandidate *) b)->hash;
+  return first < second ? -1 : first > second;
+}
+
+int top_compare_counts(const void *a, const void *b) {
+  const uint64_t first = ((const TopCandidate *) a)->count;
+  const uint64_t second = ((const TopCandidate *) b)->count;
+  return first > second ? -1 : first < second;
+}
+
+void top_report(TopStream stream, uint32_t limit, FILE *out) {
+  const size_t thread_count = thread_slots_count(&top_slots);
+  ThreadTop *tops[MAX_THREAD_SLOTS];
+  size_t count = 0;
+  for (size_t i = 0; i < thread_count; i++) {
+    ThreadTop *top = atomic_load_explicit(&thread_tops[i], memory_order_acquire);
+    if (top) {
+      tops[count++] = top;
+    }
+  }
+
+  // The candidates of every thread, each counted once
+  TopCandidate *candidates = malloc((count * top_capacity + 1) * sizeof(TopCandidate));
+  CHECK_ALLOC(candidates);
+  size_t candidate_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    const TopSketch *sketch = &tops[i]->streams[stream];
+    const uint32_t size = atomic_load_explicit(&sketch->size, memory_order_acquire);
+    for (uint32_t entry = 0; entry < size; entry++) {
+      TopCandidate *candidate = &candidates[candidate_count];
+      if (top_read_entry(&sketch->entries[entry], candidate->key, &candidate->length,
+          &candidate->hash)) {
+        candidate_count++;
+      }
+    }
+  }
+  if (candidate_count) {
+    qsort(candidates, candidate_count, sizeof(TopCandidate), top_compare_hashes);
+  }
+  size_t unique = 0;
+  for (size_t i = 0; i < candidate_count; i++) {
+    if (unique == 0 || candidates[i].hash != candidates[unique - 1].hash) {
+      candidates[unique++] = candidates[i];
+    }
+  }
+
+  // The sketches of all threads use the same hash functions, so that adding their counters
+  // gives the sketch of the merged stream
+  for (size_t i = 0; i < unique; i++) {
+    TopCandidate *candidate = &candidates[i];
+    candidate->count = UINT64_MAX;
+    for (uint32_t row = 0; row < TOP_SKETCH_DEPTH; row++) {
+      uint64_t sum = 0;
+      for (size_t thread = 0; thread < count; thread++) {
+        sum += atomic_load_explicit(top_counter(&tops[thread]->streams[stream], candidate->hash,
+            row), memory_order_relaxed);
+      }
+      if (sum < candidate->count) {
+        candidate->count = sum;
+      }
+    }
+  }
+  if (unique) {
+    qsort(candidates, unique, sizeof(TopCandidate), top_compare_counts);
+  }
+
+  for (size_t i = 0; i < unique && i < limit; i++) {
+    const TopCandidate *candidate = &candidates[i];
+    if (stream == TOP_CLIENTS) {
+      char address[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, candidate->key, address, sizeof(address));
+      fprintf(out, "%s %" PRIu64 "\n", address, candidate->count);
+    } else {
+      fprintf(out, "%.*s %" PRIu64 "\n", (int) candidate->length, candidate->key,
+          candidate->count);
+    }
+  }
+  free(candidates);
+}
+
+bool top_find_stream(const char *name, TopStream *stream) {
+  for (TopStream i = 0; i < TOP_COUNT; i++) {
+    if (!strcmp(top_stream_names[i], name)) {
+      *stream = i;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+// Most entries tracked per stream and thread
+#define MAX_TOP_CAPACITY 1024
+
+typedef enum {
+  // Client addresses of all queries
+  TOP_CLIENTS,
+  // Question names by verdict
+  TOP_BLOCKED,
+  TOP_FORWARDED,
+  TOP_CACHED,
+  TOP_LOCAL,
+  TOP_COUNT
+} TopStream;
+
+/*
+ * - Turns on tracking the most frequent clients and names, keeping up to capacity candidates
+ *   per stream in every thread, in memory that doesn't grow with the number of queries
+ * - Has to be called before the server starts
+ */
+void top_enable(uint32_t capacity);
+
+/*
+ * Returns whether the most frequent clients and names are tracked
+ */
+bool top_enabled(void);
+
+/*
+ * - Counts a query of a client for a name (NULL for the root) into the streams of the
+ *   calling thread, the client stream and the stream of the verdict
+ * - Costs a single branch if tracking is disabled
+ */
+void top_record(uint32_t client, Stat verdict, const char *domain);
+
+/*
+ * - Merges the streams of all threads and prints up to limit of the most frequent keys of
+ *   a stream with their estimated counts, one per line
+ * - Counts are estimated by count-min sketches, which never undercount
+ */
+void top_report(TopStream stream, uint32_t limit, FILE *out);
+
+/*
+ * Finds a stream by name, returning false if there is none
+ */
+bool top_find_stream(const char *name, TopStream *stream);
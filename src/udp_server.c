@@ -1,39 +1,123 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include "udp_server.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 
+#include "memory.h"
+#include "stages.h"
+#include "stats.h"
 #include "utils.h"
 
-struct UDPServer {
+#define CACHE_LINE_SIZE 64
+// Seconds a worker process has to run for before it's restarted right away if it exits
+#define MIN_WORKER_UPTIME 1
+
+typedef struct {
+  // Workers own whole cache lines, so that they never write to a line shared with another
+  alignas(CACHE_LINE_SIZE) atomic_bool stopping;
+  atomic_bool stopped;
+  uint32_t id;
+  // UDP socket requests are received on, -1 for the DNS over HTTPS worker
   int socket;
+  DoHListener *doh;
+  // CPU the worker is pinned to, -1 if it isn't pinned
+  int cpu;
+  pthread_t thread;
+  // Process running the worker and the monotonic time it was started at, if workers are
+  // processes, -1 while it isn't running
+  pid_t pid;
+  time_t started_at;
+  UDPServer *server;
+  ServerIO *io;
   UDPClient *client;
+  RateLimiter *query_limiter;
+  RateLimiter *response_limiter;
+} Worker;
+
+struct UDPServer {
+  UDPServerConfig config;
+  Worker *workers;
+  uint32_t worker_count;
+  // Workers receiving requests on UDP sockets, followed by the DNS over HTTPS worker, if any
+  uint32_t socket_count;
+  // Thread that created the server and waits for the termination signals in server_run
+  pthread_t thread;
+  RequestHandler handler;
+  BatchHandler batch_handler;
+  void *context;
 };
 
 sig_atomic_t terminate = 0;
+_Thread_local Worker *current_worker = NULL;
 
 void handle_signal(int signal) {
   terminate = 1;
 }
 
-UDPServer *server_create(const UDPServerConfig *config) {
-  assert(config != NULL);
+// Only interrupts the blocking calls of a worker, so that it notices it has to stop
+void handle_wakeup(int signal) {
+}
 
+/*
+ * Returns the CPUs the process may run on, in ascending order
+ */
+uint32_t server_available_cpus(int *cpus, uint32_t max) {
+  cpu_set_t set;
+  uint32_t count = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus[count++] = cpu;
+      }
+    }
+  }
+  return count;
+}
+
+/*
+ * - Steers each query to the socket at index source address modulo the number of sockets,
+ *   so that every client is served by a single worker, which rate limits it on its own
+ * - The program runs on the UDP payload, the source address is read relative to the IP header
+ */
+bool server_steer_by_client(int socket, uint32_t socket_count) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, socket_count),
+    BPF_STMT(BPF_RET | BPF_A, 0)
+  };
+  struct sock_fprog program = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+  return setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+}
+
+/*
+ * - Creates a socket bound to the server address, shared with the other workers through
+ *   SO_REUSEPORT if there is more than one
+ * - Returns -1 on failure
+ */
+int server_bind_socket(const UDPServerConfig *config, int cpu) {
   int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
   if (s == -1) {
     fprintf(stderr, "[UDPServer] Failed to create socket with error: %d\n", errno);
-    return NULL;
+    return -1;
   }
 
   struct sockaddr_in addr = {
@@ -47,113 +131,485 @@ UDPServer *server_create(const UDPServerConfig *config) {
     addr.sin_addr.s_addr = inet_addr(config->address);
   }
 
+  const int enable = 1;
+  if (config->workers > 1 && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+    fprintf(stderr, "[UDPServer] Failed to enable port reuse with error: %d\n", errno);
+    close(s);
+    return -1;
+  }
+
+  // Prefer the socket of the worker on the CPU that received the packet
+  if (cpu >= 0) {
+    setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+  }
+
   if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
     fprintf(stderr, "[UDPServer] Failed to bind socket to port %d with error: %d\n", config->port, errno);
-    return NULL;
+    close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+UDPServer *server_create(const UDPServerConfig *config) {
+  assert(config != NULL);
+
+  int cpus[MAX_WORKERS];
+  const uint32_t cpu_count = server_available_cpus(cpus, MAX_WORKERS);
+  uint32_t socket_count = config->sockets ? config->socket_count : config->workers;
+  if (socket_count == 0) {
+    socket_count = cpu_count ? cpu_count : 1;
   }
+  if (socket_count > MAX_WORKERS) {
+    socket_count = MAX_WORKERS;
+  }
+  const uint32_t worker_count = socket_count + (config->doh.port ? 1 : 0);
 
   UDPServer *server = malloc(sizeof(UDPServer));
   CHECK_ALLOC(server);
+  server->config = *config;
+  server->config.workers = socket_count;
+  server->worker_count = worker_count;
+  server->socket_count = socket_count;
+  server->thread = pthread_self();
+  server->workers = aligned_alloc(CACHE_LINE_SIZE, worker_count * sizeof(Worker));
+  CHECK_ALLOC(server->workers);
+
+  for (uint32_t i = 0; i < worker_count; i++) {
+    Worker *worker = &server->workers[i];
+    *worker = (Worker) {
+      .id = i,
+      // The DNS over HTTPS worker isn't pinned, it runs wherever there is time left
+      .cpu = socket_count > 1 && cpu_count && i < socket_count ? cpus[i % cpu_count] : -1,
+      .pid = -1,
+      .server = server
+    };
+    atomic_init(&worker->stopping, false);
+    atomic_init(&worker->stopped, false);
+    if (i == socket_count) {
+      worker->socket = -1;
+      worker->doh = doh_listen(&config->doh);
+      if (worker->doh) {
+        continue;
+      }
+    } else if (config->sockets) {
+      worker->socket = config->sockets[i];
+      if (worker->cpu >= 0) {
+        setsockopt(worker->socket, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(worker->cpu));
+      }
+    } else {
+      worker->socket = server_bind_socket(&server->config, worker->cpu);
+    }
+
+    if (worker->socket == -1) {
+      while (i-- > 0) {
+        close(server->workers[i].socket);
+      }
+      free(server->workers);
+      free(server);
+      return NULL;
+    }
+  }
+
+  // Without rate limits, packets stay on the CPU that received them through SO_INCOMING_CPU
+  const bool limited = config->query_limit.rate || config->response_limit.rate;
+  if (socket_count > 1 && limited && !server_steer_by_client(server->workers[0].socket, socket_count)) {
+    fprintf(stderr, "[UDPServer] Failed to steer clients to workers with error: %d, "
+        "rate limits apply per worker.\n", errno);
+  }
 
-  server->socket = s;
-  server->client = client_create();
+  // Termination signals received from here on stop server_run
+  struct sigaction sa = {
+    .sa_handler  = handle_signal,
+    .sa_flags    = 0
+  };
 
-  printf("[UDPServer] Server listening on port %d...\n", config->port);
+  sigemptyset(&sa.sa_mask);
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  sa.sa_handler = handle_wakeup;
+  sigaction(SIGUSR1, &sa, NULL);
+  if (config->processes) {
+    // Worker processes exiting wake up server_run to restart them
+    sigaction(SIGCHLD, &sa, NULL);
+  }
+
+  if (config->sockets) {
+    printf("[UDPServer] Server listening on %" PRIu32 " inherited sockets...\n", socket_count);
+  } else {
+    printf("[UDPServer] Server listening on port %d...\n", config->port);
+  }
+  if (config->processes) {
+    printf("[UDPServer] Serving with %" PRIu32 " worker processes.\n", worker_count);
+  } else if (socket_count > 1) {
+    printf("[UDPServer] Serving with %" PRIu32 " workers pinned to CPUs.\n", socket_count);
+  }
 
   return server;
 }
 
-Message *server_receive(UDPServer* server) {
-  Message *request = malloc(sizeof(Message));
-  CHECK_ALLOC(request);
+/*
+ * Returns the monotonic time rates are limited at
+ */
+uint64_t server_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-  struct sockaddr_in addr;
-  socklen_t addrlen = sizeof(addr);
+/*
+ * Drops the requests of clients over their rate, moving the accepted ones to the front of
+ * the batch, and returns their number
+ */
+size_t server_admit(Worker *worker, Message *requests, size_t count) {
+  const uint64_t now_ns = worker->query_limiter ? server_clock() : 0;
+
+  size_t accepted = 0;
+  for (size_t i = 0; i < count; i++) {
+    stats_increment(STAT_QUERIES);
+
+    // Drop queries from clients over their rate before doing any work on them
+    if (worker->query_limiter) {
+      uint64_t key = ratelimit_client_key(worker->query_limiter, requests[i].sender.address);
+      if (ratelimit_check(worker->query_limiter, key, now_ns) != RATELIMIT_PASS) {
+        stats_increment(STAT_RATE_LIMITED);
+        continue;
+      }
+    }
+    if (accepted != i) {
+      requests[accepted] = requests[i];
+    }
+    accepted++;
+  }
+  return accepted;
+}
+
+/*
+ * Writes the response from the handler over an accepted request, returning false if none
+ * is sent, because the handler has none or the response is over its rate
+ */
+bool server_respond(Worker *worker, Message *message) {
+  // The response replaces the request in its buffer
+  UDPServer *server = worker->server;
+  if (!server->handler(server, message, server->context)) {
+    return false;
+  }
+
+  if (worker->response_limiter) {
+    const uint64_t now_ns = server_clock();
+    uint64_t key = ratelimit_response_key(worker->response_limiter, message->recipient.address, message);
+    switch (ratelimit_check(worker->response_limiter, key, now_ns)) {
+      case RATELIMIT_PASS:
+        break;
+      case RATELIMIT_SLIP:
+        stats_increment(STAT_TRUNCATED);
+        if (!message_truncate(message)) {
+          return false;
+        }
+        break;
+      case RATELIMIT_DROP:
+        stats_increment(STAT_RATE_LIMITED);
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Sends the response from the handler to an accepted request, if any
+ */
+void server_process(Worker *worker, Message *message) {
+  if (server_respond(worker, message)) {
+    io_send(worker->io, message);
+    stage_end(STAGE_SEND);
+  }
+}
 
-  request->length = recvfrom(server->socket, &request->data, MAX_MESSAGE_LENGTH, 0,
-      (struct sockaddr *) &addr, &addrlen);
+/*
+ * - Answers a query received over HTTPS by the worker, like a batch of a single request
+ * - Responses are written once all the queries read together are answered, outside of the
+ *   request's stages
+ */
+bool server_serve_doh(Message *message, void *context) {
+  Worker *worker = context;
+  stage_request_start();
+  const bool respond = server_admit(worker, message, 1) && server_respond(worker, message);
+  stage_request_finish(message);
+  return respond;
+}
 
-  if (request->length == -1) {
-    free(request);
+void *server_worker(void *argument) {
+  Worker *worker = argument;
+  current_worker = worker;
+
+  if (worker->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error) {
+      fprintf(stderr, "[UDPServer] Failed to pin worker to CPU %d with error: %d\n", worker->cpu, error);
+    } else {
+      memory_pin_thread();
+    }
+  }
+
+  // The worker state is allocated once pinned, so that it's local to the worker's CPU
+  UDPServer *server = worker->server;
+  const UDPServerConfig *config = &server->config;
+  worker->client = client_create();
+  worker->query_limiter = ratelimit_new(&config->query_limit);
+  // Responses over TCP can't be reflected to a spoofed address, nor truncated to make the
+  // client retry over TCP, so only UDP responses are rate limited
+  worker->response_limiter = worker->doh ? NULL : ratelimit_new(&config->response_limit);
+  if (worker->doh) {
+    doh_serve(worker->doh, &worker->stopping, server_serve_doh, worker);
+    atomic_store(&worker->stopped, true);
     return NULL;
   }
 
-  request->sender.address = addr.sin_addr.s_addr;
-  request->sender.port = addr.sin_port;
+  worker->io = io_create(worker->socket, config->io_backend);
+  Message *requests = malloc(MAX_BATCH * sizeof(Message));
+  CHECK_ALLOC(requests);
+
+  while (!atomic_load_explicit(&worker->stopping, memory_order_relaxed)) {
+    const size_t count = io_receive(worker->io, requests, MAX_BATCH);
+    stage_request_start();
+    const size_t accepted = server_admit(worker, requests, count);
+    if (accepted && server->batch_handler) {
+      server->batch_handler(server, requests, accepted, server->context);
+    }
+    for (size_t i = 0; i < accepted; i++) {
+      // The first request is timed from the start of the batch, including the batch handler
+      if (i) {
+        stage_request_start();
+      }
+      server_process(worker, &requests[i]);
+      stage_request_finish(&requests[i]);
+    }
+    io_flush(worker->io);
+  }
 
-  return request;
+  free(requests);
+  atomic_store(&worker->stopped, true);
+  return NULL;
 }
 
-bool server_respond(UDPServer *server, const Message *response) {
-  struct sockaddr_in addr = {
-    .sin_family = AF_INET,
-    .sin_port = response->recipient.port,
-    .sin_addr = { response->recipient.address }
-  };
+/*
+ * Stops a worker, interrupting it until it notices, and waits for it to exit
+ */
+void server_stop_worker(Worker *worker) {
+  atomic_store(&worker->stopping, true);
+  while (!atomic_load(&worker->stopped)) {
+    pthread_kill(worker->thread, SIGUSR1);
+    nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+  }
+  pthread_join(worker->thread, NULL);
+}
 
-  ssize_t sent = sendto(server->socket, response->data, response->length, 0,
-      (struct sockaddr *) &addr, sizeof(addr));
+/*
+ * - Starts count workers from the one at index first as threads and waits for a termination
+ *   signal to stop them
+ * - The termination signals have to be blocked, old_signals being the mask to wait with
+ */
+void server_run_threads(UDPServer *server, uint32_t first, uint32_t count,
+    const sigset_t *old_signals) {
+  uint32_t started = 0;
+  while (started < count) {
+    Worker *worker = &server->workers[first + started];
+    if (!start_thread(&worker->thread, server_worker, worker)) {
+      terminate = 1;
+      break;
+    }
+    started++;
+  }
 
-  if (sent == -1) {
-    fprintf(stderr, "[UDPServer] Failed to send response to %s:%d with error: %d.\n",
-        inet_ntoa(addr.sin_addr), htons(addr.sin_port), errno);
-    return false;
+  while (!terminate) {
+    sigsuspend(old_signals);
+  }
+
+  for (uint32_t i = 0; i < started; i++) {
+    server_stop_worker(&server->workers[first + i]);
   }
+}
 
-  if (sent != response->length) {
-    fprintf(stderr, "[UDPServer] Failed to send response to %s:%d. %ld bytes were sent.\n",
-        inet_ntoa(addr.sin_addr), htons(addr.sin_port), sent);
+time_t server_uptime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/*
+ * - Forks a process running a worker as a single thread until it receives a termination
+ *   signal, or until the server stops
+ * - Returns false on failure
+ */
+bool server_fork_worker(UDPServer *server, Worker *worker, const sigset_t *old_signals) {
+  // Output buffered before the fork would be written by both processes
+  fflush(stdout);
+  fflush(stderr);
+  const pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "[UDPServer] Failed to fork worker %" PRIu32 " with error: %d\n", worker->id,
+        errno);
     return false;
   }
+  if (pid == 0) {
+    server_run_threads(server, worker->id, 1, old_signals);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
 
+  worker->pid = pid;
+  worker->started_at = server_uptime();
   return true;
 }
 
-void server_run(UDPServer *server, RequestHandler handler, void *context) {
-  assert(server != NULL);
-  assert(handler != NULL);
+/*
+ * Reaps the worker processes that exited and restarts them, unless the server is stopping
+ */
+void server_restart_workers(UDPServer *server, const sigset_t *old_signals) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    Worker *worker = NULL;
+    for (uint32_t i = 0; i < server->worker_count && !worker; i++) {
+      if (server->workers[i].pid == pid) {
+        worker = &server->workers[i];
+      }
+    }
+    if (!worker) {
+      continue;
+    }
+    worker->pid = -1;
 
-  struct sigaction sa = {
-    .sa_handler  = handle_signal,
-    .sa_flags    = 0,
-    .sa_restorer = NULL
-  };
+    // Termination signals sent to the whole process group also stop the workers
+    sigset_t pending;
+    sigpending(&pending);
+    if (terminate || sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM)) {
+      continue;
+    }
 
-  sigemptyset(&sa.sa_mask);
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "[UDPServer] Worker process %d was killed by signal %d, restarting it.\n",
+          (int) pid, WTERMSIG(status));
+    } else {
+      fprintf(stderr, "[UDPServer] Worker process %d exited with status %d, restarting it.\n",
+          (int) pid, WEXITSTATUS(status));
+    }
+    // Workers crashing on startup are restarted at most once a second
+    if (server_uptime() - worker->started_at < MIN_WORKER_UPTIME) {
+      nanosleep(&(struct timespec) { .tv_sec = MIN_WORKER_UPTIME }, NULL);
+    }
+    server_fork_worker(server, worker, old_signals);
+  }
+}
 
-  sigaction(SIGINT, &sa, NULL);
-  sigaction(SIGTERM, &sa, NULL);
+/*
+ * Runs every worker in its own process, restarting the ones that exit, until a termination
+ * signal stops them
+ */
+void server_run_processes(UDPServer *server, const sigset_t *old_signals) {
+  for (uint32_t i = 0; i < server->worker_count && !terminate; i++) {
+    if (!server_fork_worker(server, &server->workers[i], old_signals)) {
+      terminate = 1;
+    }
+  }
 
   while (!terminate) {
-    Message *request = server_receive(server);
+    sigsuspend(old_signals);
+    server_restart_workers(server, old_signals);
+  }
 
-    if (request == NULL) {
-      continue;
+  for (uint32_t i = 0; i < server->worker_count; i++) {
+    if (server->workers[i].pid > 0) {
+      kill(server->workers[i].pid, SIGTERM);
     }
+  }
+  for (uint32_t i = 0; i < server->worker_count; i++) {
+    if (server->workers[i].pid > 0) {
+      waitpid(server->workers[i].pid, NULL, 0);
+      server->workers[i].pid = -1;
+    }
+  }
+}
 
-    Message *response = calloc(1, sizeof(Message));
-    CHECK_ALLOC(response);
+void server_run(UDPServer *server, RequestHandler handler, BatchHandler batch_handler,
+    void *context) {
+  assert(server != NULL);
+  assert(handler != NULL);
 
-    if (handler(server, request, response, context)) {
-      response->recipient = request->sender;
-      server_respond(server, response);
-    }
+  server->handler = handler;
+  server->batch_handler = batch_handler;
+  server->context = context;
+
+  // Block the termination signals until waiting for them, so that none is missed
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
 
-    free(request);
-    free(response);
+  if (server->config.processes) {
+    server_run_processes(server, &old_signals);
+  } else {
+    server_run_threads(server, 0, server->worker_count, &old_signals);
   }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+void server_stop(UDPServer *server) {
+  terminate = 1;
+  // Wakes up server_run, or stays pending until it waits for the signal
+  pthread_kill(server->thread, SIGTERM);
+}
+
+uint32_t server_worker_count(const UDPServer *server) {
+  return server->worker_count;
+}
+
+uint32_t server_socket_count(const UDPServer *server) {
+  return server->socket_count;
+}
+
+uint32_t server_worker_id(const UDPServer *server) {
+  // Requests replayed outside of the server's workers use the first worker's state
+  return current_worker ? current_worker->id : 0;
+}
+
+int server_worker_socket(const UDPServer *server, uint32_t id) {
+  return server->workers[id].socket;
 }
 
 UDPClient *server_getclient(UDPServer *server) {
-  return server->client;
+  return current_worker->client;
 }
 
 void server_returnclient(UDPServer *server, UDPClient *client) {
-  // Do nothing. This will probably be used if we implement multithreading.
+  // Do nothing, each worker keeps its own client.
 }
 
 void server_destroy(UDPServer *server) {
-  client_destroy(server->client, true);
-  close(server->socket);
+  for (uint32_t i = 0; i < server->worker_count; i++) {
+    Worker *worker = &server->workers[i];
+    if (worker->io) {
+      io_destroy(worker->io);
+    }
+    if (worker->client) {
+      ratelimit_free(worker->query_limiter);
+      ratelimit_free(worker->response_limiter);
+      client_destroy(worker->client, true);
+    }
+    if (worker->doh) {
+      doh_free(worker->doh);
+    } else {
+      close(worker->socket);
+    }
+  }
+  free(server->workers);
   free(server);
 }
@@ -1,41 +1,112 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "doh.h"
 #include "udp_client.h"
 #include "message.h"
+#include "ratelimit.h"
+#include "server_io.h"
+
+#define MAX_WORKERS 32
+// Maximum number of requests received at once, before their responses are flushed
+#define MAX_BATCH 32
 
 typedef struct UDPServer UDPServer;
 
 typedef struct {
   uint16_t port;
   const char *address;
+  // Backend receiving requests and sending responses
+  IOBackend io_backend;
+  // Number of worker threads, 0 for one per available CPU. Multiple workers are pinned to
+  // CPUs and each has its own socket, upstream client and rate limiters.
+  uint32_t workers;
+  // Whether workers are forked processes rather than threads, so that a worker crashing
+  // doesn't stop the others. Workers that exit before the server stops are restarted.
+  bool processes;
+  // Limits the rate of queries accepted from each client
+  RateLimitConfig query_limit;
+  // Limits the rate of identical responses sent to each client over UDP
+  RateLimitConfig response_limit;
+  // Bound sockets inherited from another process, which replace binding new ones and set the
+  // number of workers, one per socket. NULL to bind new sockets.
+  const int *sockets;
+  uint32_t socket_count;
+  // DNS over HTTPS listener, served by one more worker with its own upstream client and rate
+  // limiters, if its port isn't 0
+  DoHConfig doh;
 } UDPServerConfig;
 
 /*
  * Function pointer type that is invoked by a server on receiving a request.
- * The response should be written to response->data, and response->length should
- * be set to the number of bytes written. The maximum size of the response is
- * given by MAX_MESSAGE_LENGTH.
+ * The request is given in message, and the response should be written over it
+ * in place, with message->length set to the number of bytes written. The maximum
+ * size of the response is given by MAX_MESSAGE_LENGTH. The response is sent to
+ * message->recipient, which shares its storage with the sender of the request.
  * If the handler returns false, no response is sent.
  */
-typedef bool (*RequestHandler)(UDPServer *server, const Message *request, Message *response, void *context);
+typedef bool (*RequestHandler)(UDPServer *server, Message *message, void *context);
+
+/*
+ * Function pointer type that is invoked by a server with every batch of requests
+ * it received at once and accepted, before the request handler is invoked for each
+ * of them in order. It lets the work shared by the requests be done over the whole
+ * batch, so that their memory accesses overlap. The time it takes is counted towards
+ * the first request of the batch.
+ */
+typedef void (*BatchHandler)(UDPServer *server, Message *messages, size_t count, void *context);
 
 /*
  * Creates a new server, binding it to the host and port
- * specified by config.
+ * specified by config, or serving on the sockets it passes.
+ * The termination signals stop the server from then on.
  */
 UDPServer *server_create(const UDPServerConfig *config);
 
 /*
  * Runs the server until the process receives a SIGINT or SIGTERM signal.
  * The request handler is invoked whenever a request is received,
- * with the context pointer passed on as an argument.
+ * with the context pointer passed on as an argument. Requests are served
+ * by worker threads, which may invoke the handler concurrently, or by worker
+ * processes, which only share the memory the context mapped as shared.
+ * The batch handler, if not NULL, is invoked first with the requests received at once.
+ */
+void server_run(UDPServer *server, RequestHandler handler, BatchHandler batch_handler,
+    void *context);
+
+/*
+ * Makes server_run return as if the process received a SIGTERM signal.
+ * May be called from any thread.
+ */
+void server_stop(UDPServer *server);
+
+/*
+ * Returns the number of workers serving requests
+ */
+uint32_t server_worker_count(const UDPServer *server);
+
+/*
+ * Returns the number of workers receiving requests on UDP sockets, which come before the
+ * DNS over HTTPS worker, if any
+ */
+uint32_t server_socket_count(const UDPServer *server);
+
+/*
+ * Returns the index of the worker serving the current request, below server_worker_count,
+ * which can be used to pick state owned by the worker, or 0 outside of the workers
+ */
+uint32_t server_worker_id(const UDPServer *server);
+
+/*
+ * Returns the socket the worker at index id receives requests on, below server_socket_count
  */
-void server_run(UDPServer *server, RequestHandler handler, void *context);
+int server_worker_socket(const UDPServer *server, uint32_t id);
 
 /*
- * Returns a client for making separate udp requests.
+ * Returns a client for making separate udp requests, owned by the
+ * worker serving the current request.
  */
 UDPClient *server_getclient(UDPServer *server);
 
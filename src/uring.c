@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+// Multishot receives and buffer rings are needed, which first appeared in Linux 6.0
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SINGLE_ISSUER)
+
+#define URING_ENTRIES 256
+// Buffer rings need a power of two entries
+#define BUFFER_COUNT 256
+// Receive buffers hold a struct io_uring_recvmsg_out and the sender address before the payload
+#define BUFFER_SIZE 2048
+#define BUFFER_GROUP 0
+#define SEND_SLOTS 256
+#define RECEIVE_TAG UINT64_MAX
+// Consecutive failed multishot receives after which the ring is given up on
+#define MAX_RECEIVE_FAILURES 8
+
+typedef struct {
+  struct msghdr header;
+  struct iovec iov;
+  struct sockaddr_in addr;
+  uint8_t data[MAX_MESSAGE_LENGTH];
+} SendSlot;
+
+struct Uring {
+  int fd;
+  int socket;
+
+  // Rings shared with the kernel
+  void *rings;
+  size_t rings_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  // Entries added to the submission queue since the last submission
+  unsigned sq_queued;
+
+  // Buffers registered with the kernel, which picks one for every received request
+  struct io_uring_buf_ring *buffer_ring;
+  size_t buffer_ring_size;
+  uint8_t *buffers;
+  struct msghdr receive_header;
+  uint32_t receive_failures;
+
+  // Responses being sent and the indices of the free send slots
+  SendSlot *slots;
+  uint32_t *free_slots;
+  uint32_t free_count;
+};
+
+int uring_sys_setup(unsigned entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Ring indices are shared with the kernel, which reads and writes them concurrently
+unsigned uring_load_acquire(const unsigned *index) {
+  return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+void uring_store_release(unsigned *index, unsigned value) {
+  __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+/*
+ * - Submits the queued entries, waiting for at least min_complete completions
+ * - Returns -1 and sets errno on failure
+ */
+int uring_submit(Uring *uring, unsigned min_complete) {
+  const int submitted = uring_sys_enter(uring->fd, uring->sq_queued, min_complete,
+      min_complete ? IORING_ENTER_GETEVENTS : 0);
+  if (submitted > 0) {
+    uring->sq_queued -= submitted;
+  }
+  return submitted;
+}
+
+/*
+ * Returns a cleared submission queue entry, to be queued with uring_push, or NULL if the
+ * queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *uring) {
+  const unsigned tail = *uring->sq_tail;
+  if (tail - uring_load_acquire(uring->sq_head) == uring->sq_entries) {
+    // Make room by having the kernel consume the queue
+    uring_submit(uring, 0);
+    if (tail - uring_load_acquire(uring->sq_head) == uring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  const unsigned index = tail & *uring->sq_mask;
+  struct io_uring_sqe *sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring->sq_array[index] = index;
+  return sqe;
+}
+
+void uring_push(Uring *uring) {
+  uring_store_release(uring->sq_tail, *uring->sq_tail + 1);
+  uring->sq_queued++;
+}
+
+/*
+ * Gives a receive buffer back to the kernel
+ */
+void uring_recycle_buffer(Uring *uring, uint16_t id) {
+  struct io_uring_buf_ring *ring = uring->buffer_ring;
+  const uint16_t tail = ring->tail;
+  struct io_uring_buf *buffer = &ring->bufs[tail & (BUFFER_COUNT - 1)];
+  buffer->addr = (uintptr_t) (uring->buffers + (size_t) id * BUFFER_SIZE);
+  buffer->len = BUFFER_SIZE;
+  buffer->bid = id;
+  __atomic_store_n(&ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * Queues a multishot receive, which keeps completing with a request in a buffer of the ring
+ * until it runs out of buffers or fails
+ */
+bool uring_arm_receive(Uring *uring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = uring->socket;
+  sqe->addr = (uintptr_t) &uring->receive_header;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->user_data = RECEIVE_TAG;
+  uring_push(uring);
+  return true;
+}
+
+/*
+ * Copies the request received into a buffer, returning false if it's malformed
+ */
+bool uring_read_request(Uring *uring, const uint8_t *buffer, size_t length, Message *request) {
+  const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *) buffer;
+  const size_t payload_offset = sizeof(*out) + uring->receive_header.msg_namelen;
+  if (length < payload_offset || out->namelen < sizeof(struct sockaddr_in)) {
+    return false;
+  }
+
+  struct sockaddr_in addr;
+  memcpy(&addr, buffer + sizeof(*out), sizeof(addr));
+  request->sender.address = addr.sin_addr.s_addr;
+  request->sender.port = addr.sin_port;
+
+  // Like recvfrom, keep only the start of requests that are too long
+  size_t payload_length = length - payload_offset;
+  if (payload_length > out->payloadlen) {
+    payload_length = out->payloadlen;
+  }
+  if (payload_length > MAX_MESSAGE_LENGTH) {
+    payload_length = MAX_MESSAGE_LENGTH;
+  }
+  memcpy(request->data, buffer + payload_offset, payload_length);
+  request->length = payload_length;
+  return true;
+}
+
+/*
+ * - Consumes completions, copying up to max received requests into requests and freeing
+ *   the slots of completed sends
+ * - Returns the number of requests, or -1 if receiving keeps failing
+ */
+ssize_t uring_reap(Uring *uring, Message *requests, size_t max) {
+  unsigned head = *uring->cq_head;
+  const unsigned tail = uring_load_acquire(uring->cq_tail);
+  size_t count = 0;
+  bool rearm = false;
+
+  while (head != tail && count < max) {
+    const struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+    head++;
+
+    if (cqe->user_data != RECEIVE_TAG) {
+      if (cqe->res < 0) {
+        fprintf(stderr, "[UDPServer] Failed to send response with error: %d.\n", -cqe->res);
+      }
+      uring->free_slots[uring->free_count++] = (uint32_t) cqe->user_data;
+      continue;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      const uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      const uint8_t *buffer = uring->buffers + (size_t) id * BUFFER_SIZE;
+      if (cqe->res >= 0 && uring_read_request(uring, buffer, cqe->res, &requests[count])) {
+        count++;
+        uring->receive_failures = 0;
+      }
+      uring_recycle_buffer(uring, id);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      // The multishot receive ended, usually because every buffer was in use
+      if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        fprintf(stderr, "[UDPServer] Failed to receive requests with error: %d.\n", -cqe->res);
+        uring->receive_failures++;
+      }
+      rearm = true;
+    }
+  }
+  uring_store_release(uring->cq_head, head);
+
+  if (rearm && (uring->receive_failures >= MAX_RECEIVE_FAILURES || !uring_arm_receive(uring))) {
+    return -1;
+  }
+  return count;
+}
+
+void uring_destroy(Uring *uring) {
+  if (uring->buffer_ring) {
+    struct io_uring_buf_reg reg = { .bgid = BUFFER_GROUP };
+    uring_sys_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(uring->buffer_ring, uring->buffer_ring_size);
+  }
+  if (uring->sqes) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->rings) {
+    munmap(uring->rings, uring->rings_size);
+  }
+  close(uring->fd);
+  free(uring->buffers);
+  free(uring->slots);
+  free(uring->free_slots);
+  free(uring);
+}
+
+Uring *uring_create(int socket) {
+  // Only the serving thread submits, so the kernel can run completion work when it enters
+  struct io_uring_params params = {
+    .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN
+  };
+  const int fd = uring_sys_setup(URING_ENTRIES, &params);
+  if (fd < 0) {
+    fprintf(stderr, "[UDPServer] Failed to set up io_uring with error: %d\n", errno);
+    return NULL;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    return NULL;
+  }
+
+  Uring *uring = calloc(1, sizeof(Uring));
+  CHECK_ALLOC(uring);
+  uring->fd = fd;
+  uring->socket = socket;
+
+  // Map the submission and completion rings, which share a single mapping
+  const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQ_RING);
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQES);
+  if (uring->rings == MAP_FAILED || uring->sqes == MAP_FAILED) {
+    fprintf(stderr, "[UDPServer] Failed to map io_uring with error: %d\n", errno);
+    uring->rings = uring->rings == MAP_FAILED ? NULL : uring->rings;
+    uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+    uring_destroy(uring);
+    return NULL;
+  }
+
+  uint8_t *rings = uring->rings;
+  uring->sq_head = (unsigned *) (rings + params.sq_off.head);
+  uring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+  uring->sq_mask = (unsigned *) (rings + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned *) (rings + params.sq_off.array);
+  uring->sq_entries = params.sq_entries;
+  uring->cq_head = (unsigned *) (rings + params.cq_off.head);
+  uring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+  uring->cq_mask = (unsigned *) (rings + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+  // Register the ring of receive buffers, which has to be page aligned
+  uring->buffer_ring_size = BUFFER_COUNT * sizeof(struct io_uring_buf);
+  void *buffer_ring = mmap(NULL, uring->buffer_ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring == MAP_FAILED) {
+    uring_destroy(uring);
+    return NULL;
+  }
+  uring->buffer_ring = buffer_ring;
+
+  struct io_uring_buf_reg reg = {
+    .ring_addr = (uintptr_t) buffer_ring,
+    .ring_entries = BUFFER_COUNT,
+    .bgid = BUFFER_GROUP
+  };
+  if (uring_sys_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    fprintf(stderr, "[UDPServer] Failed to register io_uring buffers with error: %d\n", errno);
+    munmap(uring->buffer_ring, uring->buffer_ring_size);
+    uring->buffer_ring = NULL;
+    uring_destroy(uring);
+    return NULL;
+  }
+
+  uring->buffers = malloc((size_t) BUFFER_COUNT * BUFFER_SIZE);
+  CHECK_ALLOC(uring->buffers);
+  for (uint16_t id = 0; id < BUFFER_COUNT; id++) {
+    uring_recycle_buffer(uring, id);
+  }
+  uring->receive_header.msg_namelen = sizeof(struct sockaddr_in);
+
+  uring->slots = malloc(SEND_SLOTS * sizeof(SendSlot));
+  CHECK_ALLOC(uring->slots);
+  uring->free_slots = malloc(SEND_SLOTS * sizeof(uint32_t));
+  CHECK_ALLOC(uring->free_slots);
+  for (uint32_t i = 0; i < SEND_SLOTS; i++) {
+    uring->free_slots[i] = i;
+  }
+  uring->free_count = SEND_SLOTS;
+
+  if (!uring_arm_receive(uring) || uring_submit(uring, 0) < 0) {
+    fprintf(stderr, "[UDPServer] Failed to start receiving with io_uring with error: %d\n", errno);
+    uring_destroy(uring);
+    return NULL;
+  }
+
+  printf("[UDPServer] Receiving requests with io_uring.\n");
+  return uring;
+}
+
+ssize_t uring_receive(Uring *uring, Message *requests, size_t max) {
+  for (;;) {
+    const ssize_t count = uring_reap(uring, requests, max);
+    if (count != 0) {
+      return count;
+    }
+
+    // Submit the queued sends along with waiting for requests
+    if (uring_submit(uring, 1) < 0) {
+      if (errno == EINTR) {
+        return 0;
+      }
+      if (errno != EAGAIN && errno != EBUSY) {
+        fprintf(stderr, "[UDPServer] Failed to wait for io_uring with error: %d\n", errno);
+        return -1;
+      }
+    }
+  }
+}
+
+bool uring_send(Uring *uring, const Message *response) {
+  if (!uring->free_count) {
+    return false;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+  if (!sqe) {
+    return false;
+  }
+
+  const uint32_t index = uring->free_slots[--uring->free_count];
+  SendSlot *slot = &uring->slots[index];
+  memcpy(slot->data, response->data, response->length);
+  slot->addr = (struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_port = response->recipient.port,
+    .sin_addr = { response->recipient.address }
+  };
+  slot->iov = (struct iovec) { .iov_base = slot->data, .iov_len = response->length };
+  slot->header = (struct msghdr) {
+    .msg_name = &slot->addr,
+    .msg_namelen = sizeof(slot->addr),
+    .msg_iov = &slot->iov,
+    .msg_iovlen = 1
+  };
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = uring->socket;
+  sqe->addr = (uintptr_t) &slot->header;
+  sqe->len = 1;
+  sqe->user_data = index;
+  uring_push(uring);
+  return true;
+}
+
+void uring_flush(Uring *uring) {
+  if (uring->sq_queued && uring_submit(uring, 0) < 0 && errno != EINTR) {
+    fprintf(stderr, "[UDPServer] Failed to submit responses with error: %d\n", errno);
+  }
+}
+
+#else
+
+Uring *uring_create(int socket) {
+  fprintf(stderr, "[UDPServer] Built without io_uring multishot receive support.\n");
+  return NULL;
+}
+
+ssize_t uring_receive(Uring *uring, Message *requests, size_t max) {
+  return -1;
+}
+
+bool uring_send(Uring *uring, const Message *response) {
+  return false;
+}
+
+void uring_flush(Uring *uring) {
+}
+
+void uring_destroy(Uring *uring) {
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "message.h"
+
+typedef struct Uring Uring;
+
+/*
+ * - Sets up an io_uring instance serving a UDP socket, with a multishot receive reading
+ *   requests into a ring of buffers registered with the kernel
+ * - Returns NULL if the kernel doesn't support the required io_uring features
+ */
+Uring *uring_create(int socket);
+
+/*
+ * - Submits the queued sends, waits for at least one request and copies up to max
+ *   received requests into requests
+ * - Returns the number of received requests, 0 if the wait was interrupted by a signal
+ *   or -1 if the ring can't receive any more requests
+ */
+ssize_t uring_receive(Uring *uring, Message *requests, size_t max);
+
+/*
+ * - Queues a response for sending, which is submitted by the next uring_flush or
+ *   uring_receive
+ * - Returns false if all send buffers are in flight, leaving the response to be sent
+ *   some other way
+ */
+bool uring_send(Uring *uring, const Message *response);
+
+/*
+ * Submits the queued sends without waiting for their completion
+ */
+void uring_flush(Uring *uring);
+
+/*
+ * Destroys the io_uring instance, leaving the socket open
+ */
+void uring_destroy(Uring *uring);
@@ -1,20 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "utils.h"
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/random.h>
 
-uint64_t hash(const char *str) {
-  unsigned char *to_hash = (unsigned char *)(str);
-  uint32_t hash = 5381;
-  int32_t c;
+#include "top.h"
+#include "udp_server.h"
+
+// Secret of wyhash, mixed with the per-process seed
+const uint64_t hash_secret[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+uint64_t hash_seed = 0xa0761d6478bd642full;
+
+__extension__ typedef unsigned __int128 HashProduct;
+
+/*
+ * Multiplies two words into 128 bits, returning the low half in a and the high half in b
+ */
+void hash_multiply(uint64_t *a, uint64_t *b) {
+  const HashProduct product = (HashProduct) *a * *b;
+  *a = (uint64_t) product;
+  *b = (uint64_t) (product >> 64);
+}
+
+uint64_t hash_mix(uint64_t a, uint64_t b) {
+  hash_multiply(&a, &b);
+  return a ^ b;
+}
+
+uint64_t hash_read8(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t hash_read4(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
 
-  while ( (c = *to_hash++) ) {
-    hash = ((hash << 5u) + hash) + c;
+void hash_init(void) {
+  uint64_t seed;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    fprintf(stderr, "Failed to get a random hash seed, hashes are predictable.\n");
+    return;
   }
+  hash_seed = seed;
+}
+
+uint64_t hash_bytes(const void *data, size_t length) {
+  const uint8_t *p = data;
+  uint64_t seed = hash_seed ^ hash_mix(hash_seed ^ hash_secret[0], hash_secret[1]);
+  uint64_t a, b;
+
+  if (length <= 16) {
+    if (length >= 4) {
+      a = (hash_read4(p) << 32) | hash_read4(p + ((length >> 3) << 2));
+      b = (hash_read4(p + length - 4) << 32) | hash_read4(p + length - 4 - ((length >> 3) << 2));
+    } else if (length > 0) {
+      a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t remaining = length;
+    if (remaining > 48) {
+      // Three independent lanes of 16 bytes each
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = hash_mix(hash_read8(p) ^ hash_secret[1], hash_read8(p + 8) ^ seed);
+        seed1 = hash_mix(hash_read8(p + 16) ^ hash_secret[2], hash_read8(p + 24) ^ seed1);
+        seed2 = hash_mix(hash_read8(p + 32) ^ hash_secret[3], hash_read8(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (remaining > 16) {
+      seed = hash_mix(hash_read8(p) ^ hash_secret[1], hash_read8(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    // The last 16 bytes, overlapping already hashed ones if needed
+    a = hash_read8(p + remaining - 16);
+    b = hash_read8(p + remaining - 8);
+  }
+
+  a ^= hash_secret[1];
+  b ^= seed;
+  hash_multiply(&a, &b);
+  return hash_mix(a ^ hash_secret[0] ^ length, b ^ hash_secret[1]);
+}
 
-  return hash;
+uint64_t hash(const char *str) {
+  return hash_bytes(str, strlen(str));
 }
 
 void fatal_error(const char *fmt, ...) {
@@ -26,6 +113,22 @@ void fatal_error(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+bool start_thread(pthread_t *thread, void *(*routine)(void *), void *argument) {
+  // Leave the termination signals to the serving thread, so that they interrupt it
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  const int error = pthread_create(thread, NULL, routine, argument);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (error) {
+    fprintf(stderr, "Failed to create thread with error: %d\n", error);
+    return false;
+  }
+  return true;
+}
+
 bool validate_ip4_address(const char *address, uint32_t *result) {
   struct in_addr addr;
   bool success = inet_pton(AF_INET, address, &addr) == 1;
@@ -33,14 +136,63 @@ bool validate_ip4_address(const char *address, uint32_t *result) {
   return success;
 }
 
+/*
+ * Parses the numeric value of the option at argv[i], returning false if it's missing or
+ * larger than max
+ */
+bool parse_uint_option(int argc, char **argv, int i, uint32_t max, uint32_t *result) {
+  if (argc <= i + 1) {
+    fprintf(stderr, "Missing value for %s option.\n", argv[i]);
+    return false;
+  }
+
+  char *end;
+  unsigned long value = strtoul(argv[i + 1], &end, 10);
+  if (*end || end == argv[i + 1] || value > max) {
+    fprintf(stderr, "Invalid value specified for %s option.\n", argv[i]);
+    return false;
+  }
+
+  *result = (uint32_t) value;
+  return true;
+}
+
 bool parse_options(int argc, char **argv, ProgramOptions *options) {
   // Set default options
   options->server_port = DEFAULT_DNS_PORT;
   options->server_address = NULL;
+  options->doh_port = 0;
+  options->doh_certificate = NULL;
+  options->doh_key = NULL;
   options->provider_address = ntohl(inet_addr("1.1.1.1")); // Cloudflare DNS provider
   options->disable_defaults = false;
   options->blocklist = NULL;
   options->whitelist = NULL;
+  options->policies = NULL;
+  options->local_zones = NULL;
+  options->catalog = NULL;
+  options->control_socket = NULL;
+  options->handoff_socket = NULL;
+  options->startup = STARTUP_FORWARD;
+  options->lists_snapshot = NULL;
+  bool startup_given = false;
+  options->compact = false;
+  options->perfect_hash = false;
+  options->page_mode = PAGES_DEFAULT;
+  options->numa_replicas = false;
+  options->io_backend = IO_BACKEND_BLOCKING;
+  options->workers = 1;
+  options->prefork = false;
+  options->block_mode = BLOCK_MODE_ZERO;
+  options->cache_size = DEFAULT_CACHE_SIZE;
+  options->cache_snapshot = NULL;
+  options->replay = NULL;
+  options->replay_passes = 1;
+  options->stage_timing = false;
+  options->slow_query_us = 0;
+  options->top_capacity = 0;
+  options->query_limit = (RateLimitConfig) { .rate = 0, .burst = 0, .prefix_length = 32, .slip = 0 };
+  options->response_limit = (RateLimitConfig) { .rate = 0, .burst = 0, .prefix_length = 24, .slip = 2 };
 
   for (int i = 0; i < argc; i++) {
     // Parse port number argument
@@ -73,6 +225,39 @@ bool parse_options(int argc, char **argv, ProgramOptions *options) {
       options->server_address = argv[i + 1];
     }
 
+    // Parse DNS over HTTPS arguments
+    if (!strcmp(argv[i], "--doh-port")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for DNS over HTTPS port option.\n");
+        return false;
+      }
+
+      options->doh_port = atoi(argv[i + 1]);
+
+      if (!options->doh_port) {
+        fprintf(stderr, "Invalid DNS over HTTPS port specified.\n");
+        return false;
+      }
+    }
+
+    if (!strcmp(argv[i], "--doh-cert")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for DNS over HTTPS certificate option.\n");
+        return false;
+      }
+
+      options->doh_certificate = argv[i + 1];
+    }
+
+    if (!strcmp(argv[i], "--doh-key")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for DNS over HTTPS key option.\n");
+        return false;
+      }
+
+      options->doh_key = argv[i + 1];
+    }
+
     // Parse DNS provider argument
     if (!strcmp(argv[i], "--provider")) {
       if (argc <= i + 1) {
@@ -109,6 +294,298 @@ bool parse_options(int argc, char **argv, ProgramOptions *options) {
 
       options->whitelist = argv[i + 1];
     }
+
+    // Parse client policies path argument
+    if (!strcmp(argv[i], "--policies")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for policies path option.\n");
+        return false;
+      }
+
+      options->policies = argv[i + 1];
+    }
+
+    // Parse local zones path argument
+    if (!strcmp(argv[i], "--local-zones")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for local zones path option.\n");
+        return false;
+      }
+
+      options->local_zones = argv[i + 1];
+    }
+
+    // Parse list catalog path argument
+    if (!strcmp(argv[i], "--catalog")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for catalog path option.\n");
+        return false;
+      }
+
+      options->catalog = argv[i + 1];
+    }
+
+    // Parse control socket path argument
+    if (!strcmp(argv[i], "--control")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for control socket path option.\n");
+        return false;
+      }
+
+      options->control_socket = argv[i + 1];
+    }
+
+    // Parse handoff socket path argument, which upgrades take the server's sockets over through
+    if (!strcmp(argv[i], "--handoff")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for handoff socket path option.\n");
+        return false;
+      }
+
+      options->handoff_socket = argv[i + 1];
+    }
+
+    // Parse startup arguments, which decide what is served while the lists load
+    if (!strcmp(argv[i], "--startup")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for startup policy option.\n");
+        return false;
+      }
+
+      if (!strcmp(argv[i + 1], "wait")) {
+        options->startup = STARTUP_WAIT;
+      } else if (!strcmp(argv[i + 1], "forward")) {
+        options->startup = STARTUP_FORWARD;
+      } else if (!strcmp(argv[i + 1], "snapshot")) {
+        options->startup = STARTUP_SNAPSHOT;
+      } else {
+        fprintf(stderr, "Invalid startup policy specified, expected wait, forward or snapshot.\n");
+        return false;
+      }
+      startup_given = true;
+    }
+
+    // Parse lists snapshot path argument, which the lists are saved to on exit
+    if (!strcmp(argv[i], "--lists-snapshot")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for lists snapshot path option.\n");
+        return false;
+      }
+
+      options->lists_snapshot = argv[i + 1];
+    }
+
+    // Parse compact domain storage argument
+    if (!strcmp(argv[i], "--compact")) {
+      options->compact = true;
+    }
+
+    // Parse perfect hash domain index argument
+    if (!strcmp(argv[i], "--perfect-hash")) {
+      options->perfect_hash = true;
+    }
+
+    // Parse hugepages argument
+    if (!strcmp(argv[i], "--hugepages")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for hugepages option.\n");
+        return false;
+      }
+
+      if (!strcmp(argv[i + 1], "transparent")) {
+        options->page_mode = PAGES_TRANSPARENT;
+      } else if (!strcmp(argv[i + 1], "explicit")) {
+        options->page_mode = PAGES_EXPLICIT;
+      } else {
+        fprintf(stderr, "Invalid hugepages mode specified, expected transparent or explicit.\n");
+        return false;
+      }
+    }
+
+    // Parse NUMA replicas argument
+    if (!strcmp(argv[i], "--numa-replicas")) {
+      options->numa_replicas = true;
+    }
+
+    // Parse the answer to blocked queries argument
+    if (!strcmp(argv[i], "--block-mode")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for block mode option.\n");
+        return false;
+      }
+
+      if (!strcmp(argv[i + 1], "zero")) {
+        options->block_mode = BLOCK_MODE_ZERO;
+      } else if (!strcmp(argv[i + 1], "nodata")) {
+        options->block_mode = BLOCK_MODE_NODATA;
+      } else if (!strcmp(argv[i + 1], "nxdomain")) {
+        options->block_mode = BLOCK_MODE_NXDOMAIN;
+      } else if (!strcmp(argv[i + 1], "refused")) {
+        options->block_mode = BLOCK_MODE_REFUSED;
+      } else {
+        fprintf(stderr, "Invalid block mode specified, expected zero, nodata, nxdomain or refused.\n");
+        return false;
+      }
+    }
+
+    // Parse response cache arguments, a size of 0 disabling the cache
+    if (!strcmp(argv[i], "--cache-size")
+        && !parse_uint_option(argc, argv, i, MAX_CACHE_SIZE, &options->cache_size)) {
+      return false;
+    }
+
+    if (!strcmp(argv[i], "--cache-snapshot")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for cache snapshot path option.\n");
+        return false;
+      }
+
+      options->cache_snapshot = argv[i + 1];
+    }
+
+    // Parse replay arguments, which benchmark the request handler with a capture
+    if (!strcmp(argv[i], "--replay")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for replay capture path option.\n");
+        return false;
+      }
+
+      options->replay = argv[i + 1];
+    }
+
+    if (!strcmp(argv[i], "--replay-passes")
+        && !parse_uint_option(argc, argv, i, MAX_REPLAY_PASSES, &options->replay_passes)) {
+      return false;
+    }
+
+    // Parse stage timing arguments, logging slow queries turning on stage timing
+    if (!strcmp(argv[i], "--stage-timing")) {
+      options->stage_timing = true;
+    }
+
+    if (!strcmp(argv[i], "--slow-query-us")
+        && !parse_uint_option(argc, argv, i, MAX_SLOW_QUERY_US, &options->slow_query_us)) {
+      return false;
+    }
+
+    // Parse the number of most frequent clients and names tracked per stream, 0 disabling it
+    if (!strcmp(argv[i], "--top-k")
+        && !parse_uint_option(argc, argv, i, MAX_TOP_CAPACITY, &options->top_capacity)) {
+      return false;
+    }
+
+    // Parse I/O backend argument
+    if (!strcmp(argv[i], "--io")) {
+      if (argc <= i + 1) {
+        fprintf(stderr, "Missing value for I/O backend option.\n");
+        return false;
+      }
+
+      if (!strcmp(argv[i + 1], "blocking")) {
+        options->io_backend = IO_BACKEND_BLOCKING;
+      } else if (!strcmp(argv[i + 1], "uring")) {
+        options->io_backend = IO_BACKEND_URING;
+      } else {
+        fprintf(stderr, "Invalid I/O backend specified, expected blocking or uring.\n");
+        return false;
+      }
+    }
+
+    // Parse worker count argument, 0 meaning one worker per CPU
+    if (!strcmp(argv[i], "--workers")
+        && !parse_uint_option(argc, argv, i, MAX_WORKERS, &options->workers)) {
+      return false;
+    }
+
+    // Parse prefork argument, which runs the workers as processes
+    if (!strcmp(argv[i], "--prefork")) {
+      options->prefork = true;
+    }
+
+    // Parse query rate limiting arguments
+    uint32_t prefix_length;
+    if (!strcmp(argv[i], "--rate-limit")
+        && !parse_uint_option(argc, argv, i, MAX_RATE_LIMIT, &options->query_limit.rate)) {
+      return false;
+    }
+
+    if (!strcmp(argv[i], "--rate-burst")
+        && !parse_uint_option(argc, argv, i, MAX_RATE_LIMIT, &options->query_limit.burst)) {
+      return false;
+    }
+
+    if (!strcmp(argv[i], "--rate-prefix")) {
+      if (!parse_uint_option(argc, argv, i, 32, &prefix_length)) {
+        return false;
+      }
+      options->query_limit.prefix_length = (uint8_t) prefix_length;
+    }
+
+    // Parse response rate limiting arguments
+    if (!strcmp(argv[i], "--rrl")
+        && !parse_uint_option(argc, argv, i, MAX_RATE_LIMIT, &options->response_limit.rate)) {
+      return false;
+    }
+
+    if (!strcmp(argv[i], "--rrl-slip")
+        && !parse_uint_option(argc, argv, i, MAX_RATE_LIMIT, &options->response_limit.slip)) {
+      return false;
+    }
+
+    if (!strcmp(argv[i], "--rrl-prefix")) {
+      if (!parse_uint_option(argc, argv, i, 32, &prefix_length)) {
+        return false;
+      }
+      options->response_limit.prefix_length = (uint8_t) prefix_length;
+    }
+  }
+
+  if (options->numa_replicas && !options->compact) {
+    fprintf(stderr, "NUMA replicas require the compact domain storage.\n");
+    return false;
+  }
+
+  if (options->perfect_hash && options->compact) {
+    fprintf(stderr, "The perfect hash index and the compact domain storage are exclusive.\n");
+    return false;
+  }
+
+  // Worker processes only share memory that is never written after they are forked
+  if (options->prefork && !options->compact && !options->perfect_hash) {
+    fprintf(stderr, "Worker processes require the compact domain storage or the perfect hash "
+        "index.\n");
+    return false;
+  }
+
+  if (options->prefork && options->control_socket) {
+    fprintf(stderr, "The control socket can't change or report the state of worker "
+        "processes.\n");
+    return false;
+  }
+
+  if (options->doh_port && !doh_supported()) {
+    fprintf(stderr, "DNS over HTTPS requires building with DOH=1.\n");
+    return false;
+  }
+
+  if (options->doh_port && (!options->doh_certificate || !options->doh_key)) {
+    fprintf(stderr, "DNS over HTTPS requires a certificate and its key.\n");
+    return false;
+  }
+
+  if (options->startup == STARTUP_SNAPSHOT && !options->lists_snapshot) {
+    fprintf(stderr, "Starting with the last snapshot of the lists requires a lists snapshot "
+        "path.\n");
+    return false;
+  }
+
+  // Worker processes don't see the lists their parent loads after forking them
+  if (options->prefork && startup_given && options->startup != STARTUP_WAIT) {
+    fprintf(stderr, "Worker processes can only start once the lists are loaded.\n");
+    return false;
+  }
+  if (options->prefork) {
+    options->startup = STARTUP_WAIT;
   }
 
   return true;
@@ -1,21 +1,83 @@
+#pragma once
+
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdnoreturn.h>
 
+#include "memory.h"
+#include "ratelimit.h"
+#include "server_io.h"
+
 #define DEFAULT_DNS_PORT 53
+#define MAX_RATE_LIMIT 1000000
+#define DEFAULT_CACHE_SIZE 4096
+#define MAX_CACHE_SIZE 16777216
+#define MAX_REPLAY_PASSES 1000000
+#define MAX_SLOW_QUERY_US 60000000
+
+typedef enum {
+  // Load the lists before serving
+  STARTUP_WAIT,
+  // Serve right away, forwarding every query until the lists are loaded
+  STARTUP_FORWARD,
+  // Serve right away with the lists of the last snapshot until the lists are loaded
+  STARTUP_SNAPSHOT
+} StartupPolicy;
 
 typedef struct {
   uint16_t server_port;
   const char *server_address;
+  // DNS over HTTPS port, 0 if it isn't served, with the PEM files of its certificate and key
+  uint16_t doh_port;
+  char *doh_certificate;
+  char *doh_key;
   uint32_t provider_address;
   bool disable_defaults;
   char *blocklist;
   char *whitelist;
+  char *policies;
+  char *local_zones;
+  char *catalog;
+  char *control_socket;
+  char *handoff_socket;
+  StartupPolicy startup;
+  char *lists_snapshot;
+  bool compact;
+  bool perfect_hash;
+  PageMode page_mode;
+  bool numa_replicas;
+  IOBackend io_backend;
+  uint32_t workers;
+  bool prefork;
+  BlockMode block_mode;
+  uint32_t cache_size;
+  char *cache_snapshot;
+  char *replay;
+  uint32_t replay_passes;
+  bool stage_timing;
+  uint32_t slow_query_us;
+  uint32_t top_capacity;
+  RateLimitConfig query_limit;
+  RateLimitConfig response_limit;
 } ProgramOptions;
 
 /*
- * Compute hash using djb2 algorithm created by Daniel J. Bernstein
+ * Seeds the hash functions with random bytes, so that their collisions can't be predicted.
+ * Has to be called before any hash is computed, hashes use a fixed seed otherwise.
+ */
+void hash_init(void);
+
+/*
+ * Computes a 64-bit hash of a byte string with the seeded wyhash algorithm, which reads
+ * the input a word at a time
+ */
+uint64_t hash_bytes(const void *data, size_t length);
+
+/*
+ * Computes the seeded hash of a null terminated string
  */
 uint64_t hash(const char *str);
 
@@ -34,6 +96,13 @@ noreturn void fatal_error(const char *fmt, ...);
     } \
   } while (0)
 
+/*
+ * - Starts a thread with the termination signals blocked, so that they are delivered to the
+ *   serving thread
+ * - Returns true on success, false on failure
+ */
+bool start_thread(pthread_t *thread, void *(*routine)(void *), void *argument);
+
 /*
  * Parses options passed on the command line, returning false on failure.
  */
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# - Checks the DNS over HTTPS listener of a server built with DOH=1 (./dnsblocker by default)
+#   end to end with curl: GET and POST queries, curl's own resolver and multiplexed streams
+# - A self-signed certificate is made for the run, the queries are for names of a block list
+#   so that no upstream is needed
+#
+set -u
+
+server=${1:-./dnsblocker}
+port=5392
+doh_port=8453
+url="https://127.0.0.1:$doh_port/dns-query"
+dir=$(mktemp -d)
+pid=
+
+cleanup() {
+  [ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "doh_test: failed: $*" >&2
+  exit 1
+}
+
+# Checks that a response in a file answers ads.test with 0.0.0.0
+check_answer() {
+  [ "$(od -An -tu1 -j6 -N2 "$1" | tr -s ' ')" = " 0 1" ] || fail "$2 has no answer"
+  [ "$(tail -c 4 "$1" | od -An -tu1 | tr -s ' ')" = " 0 0 0 0" ] || fail "$2 isn't blocked"
+}
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 \
+  -subj /CN=localhost -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null \
+  || fail "the certificate wasn't created"
+echo ads.test > "$dir/block.txt"
+i=0
+while [ $i -lt 100 ]; do
+  echo "ads$i.test" >> "$dir/block.txt"
+  i=$((i + 1))
+done
+
+"$server" --disable-defaults --blocklist "$dir/block.txt" --startup wait -a 127.0.0.1 \
+  -p $port --doh-port $doh_port --doh-cert "$dir/cert.pem" --doh-key "$dir/key.pem" \
+  > "$dir/server.log" 2>&1 &
+pid=$!
+i=0
+until curl -sk -o /dev/null "$url"; do
+  i=$((i + 1))
+  [ $i -lt 50 ] && kill -0 $pid 2>/dev/null || { cat "$dir/server.log" >&2; fail "no listener"; }
+  sleep 0.1
+done
+
+# A query for ads.test A, with id 0 as RFC 8484 recommends
+printf '\0\0\1\0\0\1\0\0\0\0\0\0\3ads\4test\0\0\1\0\1' > "$dir/query.bin"
+query=$(base64 < "$dir/query.bin" | tr '+/' '-_' | tr -d '=\n')
+
+result=$(curl -sk --http2 -o "$dir/get.bin" -w '%{http_code} %{content_type} %{http_version}' \
+  "$url?dns=$query")
+[ "$result" = "200 application/dns-message 2" ] || fail "GET returned $result"
+check_answer "$dir/get.bin" GET
+
+result=$(curl -sk --http2 -o "$dir/post.bin" -w '%{http_code}' \
+  -H 'content-type: application/dns-message' --data-binary "@$dir/query.bin" "$url")
+[ "$result" = 200 ] || fail "POST returned $result"
+check_answer "$dir/post.bin" POST
+
+result=$(curl -sk -o /dev/null -w '%{http_code}' "$url?dns=%%%")
+[ "$result" = 400 ] || fail "a malformed query returned $result"
+result=$(curl -sk -o /dev/null -w '%{http_code}' "https://127.0.0.1:$doh_port/other?dns=$query")
+[ "$result" = 404 ] || fail "another path returned $result"
+
+# curl resolving a name through the listener connects to the blocked address
+curl -sk --doh-insecure --doh-url "$url" --connect-timeout 1 -v http://ads.test:9/ 2>&1 \
+  | grep -q 'Trying 0\.0\.0\.0' || fail "curl's resolver didn't get the blocked address"
+
+# Parallel queries share a single connection as streams
+i=0
+while [ $i -lt 100 ]; do
+  label=ads$i
+  query=$(printf '\0\0\1\0\0\1\0\0\0\0\0\0\'"${#label}$label"'\4test\0\0\1\0\1' \
+    | base64 | tr '+/' '-_' | tr -d '=\n')
+  printf 'url = "%s?dns=%s"\noutput = "/dev/null"\n' "$url" "$query" >> "$dir/urls.txt"
+  i=$((i + 1))
+done
+curl -sk --http2 -Z --parallel-max 100 -K "$dir/urls.txt" \
+  -w '%{http_code} %{num_connects}\n' > "$dir/parallel.txt" 2>/dev/null
+[ "$(grep -c '^200 ' "$dir/parallel.txt")" = 100 ] || fail "parallel queries failed"
+connections=$(awk '{ sum += $2 } END { print sum }' "$dir/parallel.txt")
+[ "$connections" = 1 ] || fail "parallel queries used $connections connections"
+
+echo "doh_test: passed"
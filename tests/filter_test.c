@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "test.h"
+
+/*
+ * Adds a name to a list of the filter
+ */
+void filter_test_add_name(Filter *filter, const char *name, uint32_t list) {
+  const size_t size = strlen(name) + 1;
+  char *copy = malloc(size);
+  CHECK_ALLOC(copy);
+  memcpy(copy, name, size);
+  set_acquire(filter->domains, copy, LIST_BIT(list));
+}
+
+/*
+ * Replaces the rules of the filter with a single wildcard rule of a list
+ */
+void filter_test_set_rule(Filter *filter, const char *pattern, uint32_t list) {
+  RuleSet *rules = rules_new();
+  CHECK(rules_add_wildcard(rules, pattern, false, LIST_BIT(list)));
+  CHECK(rules_compile(rules));
+  filter_swap_rules(filter, rules);
+}
+
+/*
+ * Looks a domain up against the given lists, in every lookup variant
+ */
+ListMask filter_test_lookup(const Filter *filter, const char *domain, ListMask lists) {
+  ListMask batch_result;
+  filter_lookup_batch(filter, &domain, &lists, 1, false, &batch_result);
+  const ListMask result = filter_lookup(filter, domain, lists, false);
+  CHECK(result == batch_result);
+  return result;
+}
+
+void test_allow_rule_overrides_lower_name(void) {
+  // Block list 0 has the name, allow list 1 a rule matching it
+  Filter *filter = filter_new();
+  filter->allow_lists = LIST_BIT(1);
+  filter_test_add_name(filter, "ads.example.com", 0);
+  filter_test_set_rule(filter, "*.example.com", 1);
+  CHECK(!filter_test_lookup(filter, "ads.example.com", LIST_BIT(0)));
+  filter_test_set_rule(filter, "*.other.com", 1);
+  CHECK(filter_test_lookup(filter, "ads.example.com", LIST_BIT(0)) == LIST_BIT(0));
+  filter_free(filter);
+}
+
+void test_block_rule_overrides_lower_name(void) {
+  // Allow list 0 has the name, block list 1 a rule matching it
+  Filter *filter = filter_new();
+  filter->allow_lists = LIST_BIT(0);
+  filter_test_add_name(filter, "tracker.net", 0);
+  filter_test_set_rule(filter, "*.net", 1);
+  CHECK(filter_test_lookup(filter, "tracker.net", LIST_BIT(1)) == LIST_BIT(1));
+  // The rule only applies to clients using its list
+  CHECK(!filter_test_lookup(filter, "tracker.net", LIST_BIT(2)));
+  filter_free(filter);
+}
+
+void test_name_overrides_lower_rule(void) {
+  // Block list 0 has a rule, allow list 1 the name
+  Filter *filter = filter_new();
+  filter->allow_lists = LIST_BIT(1);
+  filter_test_add_name(filter, "cdn.example.com", 1);
+  filter_test_set_rule(filter, "*.example.com", 0);
+  CHECK(!filter_test_lookup(filter, "cdn.example.com", LIST_BIT(0)));
+  CHECK(filter_test_lookup(filter, "ads.example.com", LIST_BIT(0)) == LIST_BIT(0));
+
+  // Block list 2 has the name above both
+  filter_test_add_name(filter, "cdn.example.com", 2);
+  CHECK(filter_test_lookup(filter, "cdn.example.com", LIST_BIT(0) | LIST_BIT(2)) == LIST_BIT(2));
+  filter_free(filter);
+}
+
+int main(void) {
+  test_allow_rule_overrides_lower_name();
+  test_block_rule_overrides_lower_name();
+  test_name_overrides_lower_rule();
+  printf("filter_test: passed\n");
+  return 0;
+}
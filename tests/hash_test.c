@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "set.h"
+#include "test.h"
+
+// Blocks of two characters with the same djb2 hash, "ab" and "bA"
+#define COLLIDING_BLOCKS 14
+#define COLLIDING_NAMES (1 << COLLIDING_BLOCKS)
+// Longest bucket chain allowed for the colliding names, which a random hash keeps below 10
+#define MAX_CHAIN 16
+
+/*
+ * The djb2 hash names used to be hashed with, which the colliding names are made for
+ */
+uint32_t hash_test_djb2(const char *value) {
+  uint32_t hash = 5381;
+  for (const char *c = value; *c; c++) {
+    hash = hash * 33 + (uint8_t) *c;
+  }
+  return hash;
+}
+
+/*
+ * Makes the colliding name number index, picking "ab" or "bA" by each of its bits
+ */
+char *hash_test_name(uint32_t index) {
+  char *name = malloc(2 * COLLIDING_BLOCKS + sizeof(".com"));
+  CHECK_ALLOC(name);
+  for (int block = 0; block < COLLIDING_BLOCKS; block++) {
+    memcpy(name + 2 * block, index & (1u << block) ? "bA" : "ab", 2);
+  }
+  strcpy(name + 2 * COLLIDING_BLOCKS, ".com");
+  return name;
+}
+
+/*
+ * Loads the colliding names into a set and checks they spread over its buckets
+ */
+void test_colliding_names_spread(void) {
+  Set *set = set_new();
+  for (uint32_t i = 0; i < COLLIDING_NAMES; i++) {
+    CHECK(set_add(set, hash_test_name(i), LIST_BIT(0)));
+  }
+  CHECK(set_size(set) == COLLIDING_NAMES);
+  printf("hash_test: longest chain of %d colliding names: %zu\n", COLLIDING_NAMES,
+      set_longest_chain(set));
+  CHECK(set_longest_chain(set) <= MAX_CHAIN);
+
+  for (uint32_t i = 0; i < COLLIDING_NAMES; i++) {
+    char *name = hash_test_name(i);
+    CHECK(set_lookup(set, name, NULL) == LIST_BIT(0));
+    free(name);
+  }
+  set_free_vals(set);
+}
+
+int main(void) {
+  // The names are adversarial to the old hash
+  char *first = hash_test_name(0);
+  char *last = hash_test_name(COLLIDING_NAMES - 1);
+  CHECK(hash_test_djb2(first) == hash_test_djb2(last));
+
+  // With the default seed, then with a random seed, which changes every hash
+  test_colliding_names_spread();
+  const uint64_t fixed = hash(first);
+  hash_init();
+  CHECK(hash(first) != fixed);
+  test_colliding_names_spread();
+
+  free(first);
+  free(last);
+  printf("hash_test: passed\n");
+  return 0;
+}
@@ -0,0 +1,80 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rcu.h"
+#include "stats.h"
+#include "test.h"
+#include "thread_slots.h"
+
+// Threads started one after the other, more than there are slots
+#define THREADS (4 * MAX_THREAD_SLOTS)
+
+_Atomic bool synchronized = false;
+
+void *rcu_test_synchronize(void *arg) {
+  (void) arg;
+  rcu_synchronize();
+  atomic_store(&synchronized, true);
+  return NULL;
+}
+
+/*
+ * Enters a read-side critical section and a nested one, and checks that leaving the nested
+ * one doesn't end the outer one
+ */
+void *rcu_test_nested(void *arg) {
+  (void) arg;
+  rcu_read_lock();
+  rcu_read_lock();
+  rcu_read_unlock();
+
+  pthread_t writer;
+  CHECK(pthread_create(&writer, NULL, rcu_test_synchronize, NULL) == 0);
+  const struct timespec delay = {.tv_nsec = 50000000};
+  nanosleep(&delay, NULL);
+  CHECK(!atomic_load(&synchronized));
+
+  rcu_read_unlock();
+  CHECK(pthread_join(writer, NULL) == 0);
+  CHECK(atomic_load(&synchronized));
+  return NULL;
+}
+
+void *rcu_test_read(void *arg) {
+  (void) arg;
+  rcu_read_lock();
+  rcu_read_unlock();
+  stats_increment(STAT_QUERIES);
+  return NULL;
+}
+
+/*
+ * Starts more threads than there are slots, one after the other, so that each one takes the
+ * slot of a thread that exited
+ */
+void rcu_test_exited_threads(void) {
+  for (int i = 0; i < THREADS; i++) {
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, rcu_test_read, NULL) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+  }
+  rcu_synchronize();
+
+  uint64_t totals[STAT_COUNT];
+  stats_collect(totals);
+  CHECK(totals[STAT_QUERIES] == THREADS);
+}
+
+int main(void) {
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, rcu_test_nested, NULL) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  rcu_test_exited_threads();
+  printf("rcu_test: passed\n");
+  return 0;
+}
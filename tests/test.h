@@ -0,0 +1,13 @@
+#pragma once
+
+#include "utils.h"
+
+/*
+ * Fails the test program with the location of the check if the condition doesn't hold
+ */
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fatal_error("Check failed at %s:%d: %s", __FILE__, __LINE__, #condition); \
+    } \
+  } while (0)